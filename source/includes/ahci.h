@@ -13,6 +13,7 @@
 
 #include <basics.h>
 #include <graphics.h>
+#include <multitasking.h>
 
 #define AHCI_PORT_DET_PRESENT 3
 #define AHCI_PORT_IPM_ACTIVE 1
@@ -25,12 +26,31 @@
 
 #define ATA_CMD_WRITE_DMA_EXT 0x35
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+#define AHCI_CAP_SNCQ          (1U << 30)
+#define AHCI_CAP_S64A          (1U << 31)
+#define AHCI_GHC_IE            (1U << 1)
+
+#define AHCI_PORT_IS_DHRS      (1U << 0)   /* D2H register FIS received */
+#define AHCI_PORT_IS_SDBS      (1U << 3)   /* Set Device Bits FIS (NCQ completions) */
+#define AHCI_PORT_IS_IFS       (1U << 27)
+#define AHCI_PORT_IS_HBDS      (1U << 28)
+#define AHCI_PORT_IS_HBFS      (1U << 29)
+#define AHCI_PORT_IS_TFES      (1U << 30)
+#define AHCI_PORT_IS_ERRORS    (AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES)
+
+#define AHCI_MSI_VECTOR        0x50
+#define AHCI_REQ_MAX_SECTORS   8192        /* 4 MiB per command */
+#define AHCI_BOUNCE_MAX_SECTORS 128        /* 64 KiB */
+#define AHCI_REQ_PENDING       1
 
 #define MAX_PARTITIONS 128
 #define MAX_BLOCK_DEVICES 64
 
 #define AHCI_MAX_PRDT 16  // 8,16 OR 32
-#define PRDT_MAX_BYTES (4 * 1024 * 1024) // 4 KiB
+#define PRDT_MAX_BYTES (4 * 1024 * 1024) // 4 MiB
 
 
 /**
@@ -144,6 +164,30 @@ typedef struct {
     int logical_device;
 } ahci_disk_info_t;
 
+/**
+ * @brief One read or write queued on a SATA port with ahci_submit().
+ * The caller fills in the first block of fields; the rest is the driver's.
+ */
+typedef struct ahci_request {
+    uint64_t lba;
+    uint32_t count;             /* sectors, 1..AHCI_REQ_MAX_SECTORS */
+    void* buffer;
+    bool write;
+    /* Called in interrupt context when done; NULL to use ahci_wait(). */
+    void (*complete)(struct ahci_request* req);
+    void* private_data;
+
+    volatile int status;        /* AHCI_REQ_PENDING, then 0 or an error */
+    task_completion_t done;
+    void* dma;                  /* bounce buffer, NULL when DMA goes to buffer */
+    prdt_entry_t prd[AHCI_MAX_PRDT];
+    uint32_t nprd;
+    uint64_t issued_ns;
+    uint8_t slot;
+    uint8_t retries;
+    struct ahci_request* next;  /* waiting for a command slot */
+} ahci_request_t;
+
 typedef enum {
     BLOCK_DEVICE_AHCI = 0,
     BLOCK_DEVICE_NVME
@@ -158,6 +202,19 @@ typedef struct {
     char name[32];
 } block_device_info_t;
 
+typedef struct {
+    uint64_t hits;          // block lookups served from memory
+    uint64_t misses;        // block lookups that went to the disk
+    uint64_t bypassed;      // large transfers that skipped the cache
+    uint64_t writebacks;    // dirty sectors written to the disk
+    uint64_t evictions;
+    uint64_t prefetched;    // sectors read ahead of their first use
+    uint32_t buffers;
+    uint32_t max_buffers;
+    uint32_t buffer_bytes;
+    uint32_t dirty;
+} block_cache_stats_t;
+
 /// GENERAL PARITION LAYOUT BEGIN
 
 typedef enum {
@@ -250,8 +307,56 @@ void handle_satapi_disk(int portno);
 void ahci_init_port(int portno);
 int ahci_read_sector(int portno, uint64_t lba, void* buffer, uint32_t count);
 int ahci_write_sector(int portno, uint64_t lba, void* buffer, uint32_t count);
+
+/**
+ * @brief Read-ahead counterpart of ahci_read_sector(): queues the range
+ * into the block cache and returns at once. See block_prefetch().
+ */
+int ahci_prefetch_sectors(int portno, uint64_t lba, uint32_t count);
 int ahci_identify(int portno, void* buffer);
 
+/**
+ * @brief Queues @p req on a SATA port. It is issued as soon as a command slot
+ * is free: several at once with NCQ, one at a time otherwise. The HBA moves
+ * the data straight to or from @p req->buffer when its pages fit in the PRD
+ * table and are within reach of the HBA; otherwise it goes through a bounce
+ * buffer, which takes at most AHCI_BOUNCE_MAX_SECTORS.
+ *
+ * @return 0 if queued; -1 on bad arguments, -10 if out of memory.
+ */
+int ahci_submit(int portno, ahci_request_t* req);
+
+/**
+ * @brief Sleeps until @p req finishes. The port interrupt wakes the caller;
+ * before interrupts work the port is polled instead.
+ *
+ * @return 0 on success, -2 on a device error, -3 on a timeout.
+ */
+int ahci_wait(int portno, ahci_request_t* req);
+
+/**
+ * @brief Routes the controller's interrupt through MSI to the boot CPU.
+ * Without MSI, requests keep being completed by polling.
+ */
+void ahci_enable_interrupts(uint8_t bus, uint8_t slot, uint8_t func);
+
+/**
+ * @brief Reaps finished commands of a port and looks for stuck ones, for
+ * callers that cannot rely on the interrupt.
+ */
+void ahci_poll(int portno);
+
+/**
+ * @brief Whether completions arrive by interrupt, so a waiter may sleep.
+ */
+bool ahci_interrupts_enabled(void);
+
+/**
+ * @brief Sectors from @p buffer on that one command can move without a
+ * bounce buffer, at most @p count; 0 if the start is not DMA-safe.
+ */
+uint32_t ahci_dma_sectors(const void* buffer, uint32_t count);
+
 int block_register_device(
     block_device_type_t type,
     int backend_index,
@@ -264,6 +369,28 @@ const char* block_get_device_name(int device_id);
 int block_read_sector(int device_id, uint64_t lba, void* buffer, uint32_t count);
 int block_write_sector(int device_id, uint64_t lba, void* buffer, uint32_t count);
 
+/**
+ * @brief Starts reading [lba, lba + count) into the block cache without
+ * waiting for it. Blocks already cached are skipped, and at most 256 KiB
+ * is claimed per call. A later block_read_sector() of the range waits for
+ * the read in flight rather than issuing its own.
+ *
+ * @return 0 if queued, -1 if the device has no cache or request queue.
+ */
+int block_prefetch(int device_id, uint64_t lba, uint32_t count);
+
+/**
+ * @brief Writes every dirty buffer of the block cache back to its device.
+ *
+ * @return 0 on success, -1 if a write-back failed (the buffer stays dirty).
+ */
+int block_sync_all(void);
+
+/**
+ * @brief Snapshot of the block cache counters, for /proc/bcache.
+ */
+void block_get_cache_stats(block_cache_stats_t* out);
+
 general_partition_t* add_general_partition(
     partition_table_type_t table_type,
     uint64 lba_start,
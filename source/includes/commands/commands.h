@@ -40,5 +40,7 @@ int cmd_umount(int argc, char** argv);
 int cmd_exec(int argc, char** argv);
 int cmd_tasks(int argc, char** argv);
 int cmd_probepci(int argc, char** argv);
+int cmd_heapbench(int argc, char** argv);
+int cmd_membench(int argc, char** argv);
 
 #endif
\ No newline at end of file
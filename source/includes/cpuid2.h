@@ -47,6 +47,54 @@ cstring cpu_string(void);
  */
 void cpuid(uint32 reg, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx);
 
+/**
+ * @brief Executes the CPUID instruction for a leaf that takes a sub-leaf in ECX.
+ *
+ * @param leaf The leaf to query (EAX).
+ * @param subleaf The sub-leaf to query (ECX).
+ * @param eax Pointer to store the value of EAX register.
+ * @param ebx Pointer to store the value of EBX register.
+ * @param ecx Pointer to store the value of ECX register.
+ * @param edx Pointer to store the value of EDX register.
+ */
+void cpuid_count(uint32 leaf, uint32 subleaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx);
+
+/**
+ * @brief Checks for SSE2 (CPUID.1:EDX bit 26).
+ */
+bool cpu_has_sse2(void);
+
+/**
+ * @brief Checks for Enhanced REP MOVSB/STOSB (CPUID.7.0:EBX bit 9).
+ */
+bool cpu_has_erms(void);
+
+/**
+ * @brief Checks for Fast Short REP MOV (CPUID.7.0:EDX bit 4).
+ */
+bool cpu_has_fsrm(void);
+
+/**
+ * @brief Checks that AVX is both supported and enabled in XCR0 by the OS.
+ */
+bool cpu_has_avx(void);
+
+/**
+ * @brief Checks for the LAPIC TSC-deadline timer mode (CPUID.1:ECX bit 24).
+ */
+bool cpu_has_tsc_deadline(void);
+
+/**
+ * @brief Checks for process-context identifiers (CPUID.1:ECX bit 17).
+ */
+bool cpu_has_pcid(void);
+
+/**
+ * @brief Checks for a TSC that runs at a constant rate in every P/C-state
+ * (CPUID.80000007H:EDX bit 8).
+ */
+bool cpu_has_invariant_tsc(void);
+
 /**
  * @brief Retrieve the CPU vendor string.
  * 
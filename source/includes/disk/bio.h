@@ -0,0 +1,129 @@
+/**
+ * @file bio.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Block I/O requests: a queue per disk with a merge stage and a
+ * pluggable scheduler in front of the AHCI and NVMe drivers.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef BIO_H
+#define BIO_H
+
+#include <basics.h>
+#include <stdbool.h>
+#include <multitasking.h>
+
+#define BIO_PENDING             1
+#define BIO_MERGE_MAX_SECTORS   128     /* 64 KiB, what a driver can always bounce */
+#define BIO_MAX_INFLIGHT        32      /* commands per disk handed to the driver */
+
+/**
+ * @brief One read or write of a run of sectors, queued with bio_submit().
+ * The caller fills in the first block of fields; the rest is the queue's.
+ */
+typedef struct bio {
+    int device;                 /* block device ID */
+    uint64_t lba;
+    uint32_t count;             /* sectors */
+    void* buffer;               /* kernel memory: it is used from interrupt context */
+    bool write;
+    /* Called in interrupt context when done; NULL to use bio_wait(). */
+    void (*end_io)(struct bio* bio);
+    void* private_data;
+
+    volatile int status;        /* BIO_PENDING, then 0 or an error */
+    task_completion_t done;
+    uint64_t submit_ns;
+    uint64_t deadline_ns;
+    struct bio* next;           /* next bio of the same request, in LBA order */
+} bio_t;
+
+typedef struct {
+    uint64_t reads;             /* bios */
+    uint64_t writes;
+    uint64_t read_sectors;
+    uint64_t write_sectors;
+    uint64_t read_ns;           /* summed submit-to-completion latency */
+    uint64_t write_ns;
+    uint64_t max_ns;
+    uint64_t merges;            /* bios that joined a queued request */
+    uint64_t requests;          /* commands handed to the driver */
+    uint64_t errors;
+    uint64_t busy_ns;           /* time with at least one command in flight */
+    uint32_t queued;
+    uint32_t inflight;
+    const char* scheduler;
+} bio_stats_t;
+
+/**
+ * @brief Whether @p device goes through a request queue: SATA disks,
+ * optical drives (reads only) and NVMe namespaces with 512 byte sectors.
+ */
+bool bio_queueable(int device);
+
+/**
+ * @brief Queues @p bio. It joins a queued request it is adjacent to, in the
+ * same direction, when the result stays within BIO_MERGE_MAX_SECTORS;
+ * otherwise it becomes a request of its own. The disk's scheduler decides
+ * when requests go to the driver.
+ *
+ * @return 0 if queued; -1 on bad arguments, -10 if out of memory.
+ */
+int bio_submit(bio_t* bio);
+
+/**
+ * @brief Sleeps until @p bio finishes, polling the driver when it has no
+ * completion interrupt.
+ *
+ * @return 0 on success, else the driver's error.
+ */
+int bio_wait(bio_t* bio);
+
+/**
+ * @brief Reaps what the driver of @p device has finished and dispatches
+ * what the queue holds. For code that waits on bios it does not own, such
+ * as a cache buffer being read ahead, while completions are polled.
+ */
+void bio_kick(int device);
+
+/**
+ * @brief Reads or writes @p count sectors through the queue and waits for
+ * them. Large transfers are split per what one command can map and queued
+ * together; buffers outside kernel memory are staged through the heap.
+ *
+ * @return 0 on success, negative on error.
+ */
+int bio_transfer(int device, uint64_t lba, void* buffer, uint32_t count, bool write);
+
+/**
+ * @brief Holds back dispatch on @p device while a batch is submitted, so
+ * the whole batch can be merged and sorted. Nests; every bio_plug() needs
+ * a bio_unplug() before its bios are waited for.
+ */
+void bio_plug(int device);
+void bio_unplug(int device);
+
+/**
+ * @brief Switches the scheduler of @p device: "noop" (arrival order) or
+ * "deadline" (LBA order, with reads due after 500 ms and writes after 5 s).
+ *
+ * @return 0 on success, -1 for an unknown device or scheduler.
+ */
+int bio_set_scheduler(int device, const char* name);
+
+/**
+ * @brief Names the schedulers bio_set_scheduler() accepts, NULL past the end.
+ */
+const char* bio_scheduler_name(int index);
+
+/**
+ * @brief Copies the counters of @p device.
+ *
+ * @return false if the device has no request queue.
+ */
+bool bio_get_stats(int device, bio_stats_t* out);
+
+#endif
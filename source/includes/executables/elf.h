@@ -196,8 +196,57 @@ typedef struct {
     void* tls_template;
 } elf_image_info_t;
 
+/**
+ * @brief An executable opened for loading: the header is checked and the
+ * program headers are read, nothing is mapped yet.
+ */
+typedef struct {
+    vfs_file_t file;
+    uint64_t size;
+    Elf64_Ehdr header;
+    Elf64_Phdr* phdrs;
+} elf_image_t;
+
 void* elf_load_from_memory(void* file_base_address, uint64_t file_size);
 void* elf_load_from_vfs(const char* path);
 void* elf_load_from_memory_ex(void* file_base_address, uint64_t file_size, elf_image_info_t* info);
 void* elf_load_from_vfs_ex(const char* path, elf_image_info_t* info);
+
+/**
+ * @brief Opens @p path and checks that it can be loaded, without touching
+ * the address space; exec can still fail back to the caller after this.
+ *
+ * @return 0 on success, -1 if the file is missing or not a valid ELF.
+ */
+int elf_open_image(const char* path, elf_image_t* image);
+
+/**
+ * @brief Maps @p image into the current address space. PT_LOAD segments
+ * are only registered with the pager and read from the file when a page is
+ * first touched; the file stays open for that and is owned by the task.
+ *
+ * @return The entry point, NULL on failure. @p image is closed either way.
+ */
+void* elf_map_image(elf_image_t* image, elf_image_info_t* info);
+
+/**
+ * @brief Releases an image that was opened but not mapped.
+ */
+void elf_close_image(elf_image_t* image);
+
+/**
+ * @brief Reads @p size bytes at @p offset of an executable, through the
+ * page cache.
+ *
+ * @return 0 on success, -1 on a short read.
+ */
+int elf_read_image(vfs_file_t* file, uint64_t offset, void* buf, uint32_t size);
+
+/**
+ * @brief The page cache frame of page @p index of an executable, for the
+ * pager to map as it is.
+ *
+ * @return Physical address with a reference for the caller, 0 on error.
+ */
+uintptr_t elf_image_page(vfs_file_t* file, uint64_t index);
 #endif
@@ -0,0 +1,89 @@
+/**
+ * @file dcache.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Path lookup cache of the VFS, shared by the disk filesystems.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <basics.h>
+#include <stdbool.h>
+#include <ahci.h>
+
+#define VFS_DCACHE_BUCKETS      256
+#define VFS_DCACHE_MAX          1024    // entries before the oldest leaves go
+#define VFS_DCACHE_NAME_MAX     64      // longer names are looked up uncached
+
+#define VFS_LOOKUP_NOENT        -2
+
+/* What a lookup tells about a path */
+typedef struct {
+    bool is_dir;
+    uint32_t size;
+    uint64_t ino;               // inode, first cluster or extent, per filesystem
+} vfs_lookup_t;
+
+/*
+ * One component of a path on a mount, found under its parent's entry by
+ * the hash of (filesystem, parent, name). Negative entries remember that
+ * a name does not exist. On FAT and ISO 9660 mounts names compare without
+ * case, like the filesystems do.
+ */
+typedef struct vfs_dentry {
+    void* fs;                   // mounted filesystem it belongs to
+    struct vfs_dentry* parent;  // NULL directly under the mount point
+    uint32_t hash;
+    uint32_t children;          // cached entries below it; only leaves are dropped
+    bool negative;
+    vfs_lookup_t info;
+    char name[VFS_DCACHE_NAME_MAX];
+
+    struct vfs_dentry* hash_next;
+    struct vfs_dentry* lru_prev;
+    struct vfs_dentry* lru_next;
+} vfs_dentry_t;
+
+/**
+ * @brief Asks the filesystem about @p rel, a path relative to the root of
+ * @p mnt.
+ *
+ * @return 0 if found, VFS_LOOKUP_NOENT if not, -1 on error (not cached).
+ */
+typedef int (*vfs_dcache_fill_t)(mount_entry_t* mnt, const char* rel, vfs_lookup_t* out);
+
+/**
+ * @brief Looks up @p rel one component at a time, asking @p fill only
+ * for components not cached yet.
+ *
+ * @return 0 with @p out filled in, VFS_LOOKUP_NOENT, or -1 on error.
+ */
+int vfs_dcache_lookup(mount_entry_t* mnt, const char* rel, vfs_dcache_fill_t fill, vfs_lookup_t* out);
+
+/**
+ * @brief Hash under which @p rel is cached, for vfs_dcache_drop_hash().
+ */
+uint32_t vfs_dcache_hash(mount_entry_t* mnt, const char* rel);
+
+/**
+ * @brief Forgets @p rel, what is below it and its siblings (which may be
+ * other spellings of the same name). For creates, removes and renames.
+ */
+void vfs_dcache_invalidate(mount_entry_t* mnt, const char* rel);
+
+/**
+ * @brief Forgets the leaf entries with hash @p hash, e.g. a file whose
+ * size changed.
+ */
+void vfs_dcache_drop_hash(void* fs, uint32_t hash);
+
+/**
+ * @brief Forgets everything cached for filesystem @p fs, at unmount.
+ */
+void vfs_dcache_drop_fs(void* fs);
+
+#endif
@@ -19,6 +19,7 @@
 #include <graphics.h>
 #include <ahci.h>
 #include <filesystems/fat.h> /* for partition_fs_type_t, FAT_OK/FAT_ERR_* style codes */
+#include <multitasking.h>
 
 /* ===================== On-disk constants ===================== */
 
@@ -70,9 +71,17 @@
 #define EXT2_FT_SYMLINK  7
 
 /* feature flags we understand */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX    0x0020
 #define EXT2_FEATURE_INCOMPAT_FILETYPE   0x0002
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 
+/* s_flags */
+#define EXT2_FLAGS_SIGNED_HASH    0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH  0x0002
+
+/* i_flags */
+#define EXT2_INDEX_FL             0x00001000 /* directory has an HTree index */
+
 /* error codes (kept consistent with FAT driver's style) */
 #define EXT2_OK               0
 #define EXT2_ERR_NOT_FOUND   -1
@@ -141,10 +150,21 @@ typedef struct {
     uint16_t s_reserved_word_pad;
     uint32_t s_default_mount_opts;
     uint32_t s_first_meta_bg;
-
-    uint8_t  s_unused[760];
+    uint32_t s_mkfs_time;
+    uint32_t s_jnl_blocks[17];
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
+
+    uint8_t  s_unused[668];
 } __attribute__((packed)) ext2_superblock_t;
 
+_Static_assert(__builtin_offsetof(ext2_superblock_t, s_flags) == 0x160, "ext2 s_flags offset mismatch");
+_Static_assert(sizeof(ext2_superblock_t) == 1024, "ext2 superblock size mismatch");
+
 typedef struct {
     uint32_t bg_block_bitmap;
     uint32_t bg_inode_bitmap;
@@ -189,6 +209,26 @@ typedef struct {
 
 /* ===================== Runtime structures ===================== */
 
+#define EXT2_ICACHE_BUCKETS     64
+#define EXT2_ICACHE_MAX         128     /* cached inodes before unused ones are dropped */
+
+/* Indirect blocks ext2_bmap() last read for an inode, one per level (0 = leaf) */
+typedef struct {
+    uint32_t  block[3];
+    uint32_t* tbl[3];           /* heap copy of the block, NULL until used */
+} ext2_bmap_memo_t;
+
+typedef struct ext2_icache_entry {
+    uint32_t ino;
+    ext2_inode_t inode;
+    uint32_t refs;              /* open files holding it; 0 = may be dropped */
+    int      dirty;             /* inode not yet written back */
+    ext2_bmap_memo_t memo;
+    struct ext2_icache_entry* hash_next;
+    struct ext2_icache_entry* lru_prev;
+    struct ext2_icache_entry* lru_next;
+} ext2_icache_entry_t;
+
 typedef struct {
     int      portno;
     uint32_t partition_lba;     /* LBA of start of partition, sector units */
@@ -203,11 +243,21 @@ typedef struct {
     uint32_t groups_count;
     uint32_t gdt_block;         /* block number where group desc table starts */
     int      has_filetype;
+    int      has_dir_index;
+    uint8_t  dx_hash_unsigned;  /* added to the root's hash version, 0 or 3 */
 
     uint32_t cwd_ino;           /* 0 = not set -> root */
     char     cwd_path[128];
 
     int      sb_dirty;
+
+    uint32_t* inode_tables;     /* bg_inode_table of every group, NULL if not loaded */
+
+    ext2_icache_entry_t* icache[EXT2_ICACHE_BUCKETS];
+    ext2_icache_entry_t* icache_lru;    /* least recently used */
+    ext2_icache_entry_t* icache_mru;
+    uint32_t icache_count;
+    task_mutex_t icache_lock;
 } ext2_fs_t;
 
 typedef struct {
@@ -216,6 +266,7 @@ typedef struct {
     ext2_inode_t inode;
     uint32_t   pos;
     uint16_t   is_dir;
+    ext2_icache_entry_t* ic;    /* referenced cache entry, NULL if none */
 } ext2_file_t;
 
 /* ===================== API ===================== */
@@ -232,6 +283,7 @@ int ext2_open(ext2_fs_t* fs, const char* path, ext2_file_t* f);
 int ext2_create(ext2_fs_t* fs, const char* path, uint16_t mode, ext2_file_t* f);
 int ext2_read(ext2_file_t* f, uint8_t* out, uint32_t size);
 int ext2_write(ext2_file_t* f, const uint8_t* data, uint32_t size);
+int ext2_readahead(ext2_file_t* f, uint32_t offset, uint32_t bytes);
 void ext2_close(ext2_file_t* f);
 
 int ext2_mkdir(ext2_fs_t* fs, const char* path);
@@ -246,12 +298,9 @@ int ext2_find_in_dir(ext2_fs_t* fs, uint32_t dir_ino, const char* name, uint32_t
 /**
  * @brief Flush all pending EXT2 filesystem writes.
  *
- * FrostWing's EXT2 implementation performs synchronous writes for
- * all metadata and file data, so there are currently no dirty buffers
- * to flush.
- *
- * Future implementations with block caches or delayed allocation
- * should flush those here before returning.
+ * File data, bitmaps and directories are written synchronously; inodes
+ * are kept in the inode cache and written back here (or when dropped
+ * from the cache, or at unmount).
  *
  * @param fs Mounted EXT2 filesystem.
  * @return EXT2_OK on success.
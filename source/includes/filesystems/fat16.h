@@ -16,6 +16,7 @@
 #include <graphics.h>
 #include <ahci.h>
 #include <filesystems/fat.h>
+#include <filesystems/fat_table.h>
 
 #define FAT16_EOC 0xFFF8
 #define FAT16_ROOT_CLUSTER 0
@@ -71,6 +72,8 @@ typedef struct {
 
     uint16_t cwd_cluster;    // 0 = root, otherwise cluster number
     char cwd_path[128];
+
+    fat_table_t fat;
 } fat16_fs_t;
 
 typedef struct {
@@ -78,7 +81,8 @@ typedef struct {
     fat16_dir_entry_t entry;
     uint16_t parent_cluster;
     uint32_t pos;
-    uint16_t cluster;
+    uint16_t cluster;           // last cluster used, 0 if unknown
+    fat_extent_map_t map;       // where its clusters are, filled in on use
 } fat16_file_t;
 
 typedef int (*fat16_cluster_cb)(
@@ -90,6 +94,7 @@ typedef int (*fat16_cluster_cb)(
 
 partition_fs_type_t detect_fat_type_enum(const uint8* buf);
 int fat16_mount(int portno, uint32_t partition_lba, fat16_fs_t* fs) ;
+void fat16_unmount(fat16_fs_t* fs);
 uint16_t fat16_read_fat_fs(fat16_fs_t* fs, uint16_t cluster);
 int fat16_list_root(fat16_fs_t* fs);
 int fat16_find_path(fat16_fs_t* fs, const char* path, fat16_dir_entry_t* out);
@@ -102,11 +107,13 @@ int fat16_find_file(fat16_fs_t* fs, const char* name, fat16_dir_entry_t* out);
 int fat16_open(fat16_fs_t* fs, const char* path, fat16_file_t* f);
 int fat16_read(fat16_file_t* f, uint8_t* out, uint32_t size);
 int fat16_write(fat16_file_t* f, const uint8_t* data, uint32_t size);
+int fat16_readahead(fat16_file_t* f, uint32_t offset, uint32_t bytes);
 void fat16_close(fat16_file_t* f);
 
 uint16_t fat16_find_free_cluster(fat16_fs_t* fs);
 void fat16_write_fat_entry(fat16_fs_t* fs, uint16_t cluster, uint16_t value);
 uint16_t fat16_allocate_cluster(fat16_fs_t* fs);
+uint16_t fat16_allocate_run(fat16_fs_t* fs, uint16_t prev, uint32_t count, uint32_t* got);
 uint16_t fat16_append_cluster(fat16_fs_t* fs, uint16_t last_cluster);
 void fat16_update_root_entry(fat16_fs_t* fs, fat16_dir_entry_t* entry);
 int fat16_update_dir_entry(fat16_fs_t* fs, uint16_t dir_cluster, fat16_dir_entry_t* entry);
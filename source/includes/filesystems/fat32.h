@@ -12,6 +12,7 @@
 #define FAT32_H
 #include <basics.h>
 #include <filesystems/fat.h>
+#include <filesystems/fat_table.h>
 
 /* ============================= */
 /*   FAT32 CONSTANTS & MACROS    */
@@ -72,6 +73,29 @@ typedef struct __attribute__((packed)) {
     uint8_t  fs_type[8];
 } fat32_bpb_t;
 
+/* ext_flags: bit 7 turns FAT mirroring off, bits 0-3 then pick the FAT */
+#define FAT32_EXT_NO_MIRROR      0x0080
+#define FAT32_EXT_ACTIVE_FAT     0x000F
+
+/* ============================= */
+/*   FSINFO SECTOR               */
+/* ============================= */
+
+#define FAT32_FSINFO_LEAD_SIG    0x41615252
+#define FAT32_FSINFO_STRUCT_SIG  0x61417272
+#define FAT32_FSINFO_TRAIL_SIG   0xAA550000
+#define FAT32_FSINFO_UNKNOWN     0xFFFFFFFF
+
+typedef struct __attribute__((packed)) {
+    uint32_t lead_sig;
+    uint8_t  reserved1[480];
+    uint32_t struct_sig;
+    uint32_t free_count;  /* FAT32_FSINFO_UNKNOWN if not known */
+    uint32_t next_free;   /* hint: where to look for a free cluster */
+    uint8_t  reserved2[12];
+    uint32_t trail_sig;
+} fat32_fsinfo_t;
+
 /* ============================= */
 /*   FAT32 DIRECTORY ENTRY       */
 /* ============================= */
@@ -123,7 +147,12 @@ typedef struct {
     uint32_t total_clusters;
     uint32_t root_cluster;
 
-    uint32_t last_alloc;
+    fat_table_t fat;
+
+    /* FSInfo sector, 0 if the volume has none; and what it last said */
+    uint32_t fsinfo_lba;
+    uint32_t fsinfo_free;
+    uint32_t fsinfo_next;
 } fat32_fs_t;
 
 /* ============================= */
@@ -135,6 +164,7 @@ typedef struct {
     fat32_dir_entry_t entry;
     uint32_t start_cluster;
     uint32_t current_cluster;
+    fat_extent_map_t map;       // where its clusters are, filled in on use
     uint32_t pos;
     uint32_t size;
 
@@ -152,6 +182,7 @@ int fat32_create_path(fat32_fs_t* fs, const char* path, uint8_t attr);
 int fat32_truncate(fat32_file_t* file, uint32_t new_size);
 
 uint32_t fat32_alloc_cluster(fat32_fs_t* fs);
+uint32_t fat32_alloc_run(fat32_fs_t* fs, uint32_t prev, uint32_t count, uint32_t* got);
 const char* fat_next_path_component(const char* path, char* out);
 
 void fat32_free_chain_from(
@@ -186,4 +217,8 @@ int fat32_delete_entry(fat32_fs_t* fs, uint32_t dir_cluster, const char* name);
 int fat32_rmdir(fat32_fs_t* fs, uint32_t dir_cluster);
 
 int fat32_sync(fat32_file_t* f);
+int fat32_fs_sync(fat32_fs_t* fs);
+void fat32_unmount(fat32_fs_t* fs);
+
+int fat32_readahead(fat32_file_t* f, uint32_t offset, uint32_t bytes);
 #endif
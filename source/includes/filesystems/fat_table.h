@@ -0,0 +1,142 @@
+/**
+ * @file fat_table.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief In-memory copy of a FAT with a free-cluster bitmap, shared by the
+ * FAT16 and FAT32 drivers.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef FAT_TABLE_H
+#define FAT_TABLE_H
+
+#include <basics.h>
+#include <stdbool.h>
+#include <multitasking.h>
+
+#define FAT_TABLE_SECTOR_SIZE    512
+#define FAT_TABLE_CHUNK_SECTORS  64     // 32 KiB: loads skip the block cache
+#define FAT_TABLE_MAX_CHUNKS     256    // at most 8 MiB of FAT held at once
+
+typedef struct {
+    uint8_t* data;              // NULL until first used
+    uint64_t dirty;             // one bit per sector
+} fat_chunk_t;
+
+/*
+ * The first FAT of a volume, read in 32 KiB chunks as they are used and
+ * written back, to every FAT copy, only by fat_table_flush(). A bitmap of
+ * free clusters is built at mount, so allocating never reads the disk.
+ */
+typedef struct {
+    int portno;
+    uint32_t fat_lba;           // first sector of the first FAT
+    uint32_t fat_sectors;       // sectors per FAT copy
+    uint8_t fat_count;          // copies written on flush
+    uint8_t entry_bytes;        // 2 for FAT16, 4 for FAT32
+    uint32_t clusters;          // data clusters, numbered from 2
+    uint32_t eoc;               // written to end a chain
+
+    fat_chunk_t* chunks;
+    uint32_t nchunks;
+    uint32_t loaded;
+    uint32_t clock;             // next chunk considered for eviction
+
+    uint32_t* free_map;         // bit per cluster number, set if free
+    uint32_t free_count;
+    uint32_t next_free;         // where allocation looks first
+    task_mutex_t lock;
+} fat_table_t;
+
+/*
+ * Where the clusters of one file are, as runs of consecutive cluster
+ * numbers. Built lazily from the FAT as far as a lookup needs and kept with
+ * the open file, so a seek is a binary search instead of a chain walk.
+ */
+typedef struct {
+    uint32_t index;             // first cluster of the file it covers
+    uint32_t cluster;           // where that one is on disk
+    uint32_t count;
+} fat_extent_t;
+
+typedef struct {
+    fat_extent_t* ext;
+    uint32_t n;
+    uint32_t cap;
+} fat_extent_map_t;
+
+/**
+ * @brief Sets up @p t for a FAT at @p fat_lba and scans it once to build
+ * the free bitmap.
+ *
+ * @return 0 on success, -1 on a read error or if out of memory.
+ */
+int fat_table_init(fat_table_t* t, int portno, uint32_t fat_lba, uint32_t fat_sectors,
+                   uint8_t fat_count, uint8_t entry_bytes, uint32_t clusters, uint32_t eoc);
+
+/**
+ * @brief Writes back what is dirty and frees the table.
+ */
+void fat_table_release(fat_table_t* t);
+
+/**
+ * @brief FAT entry of @p cluster; the end-of-chain value if it cannot be read.
+ */
+uint32_t fat_table_get(fat_table_t* t, uint32_t cluster);
+
+/**
+ * @brief Changes the FAT entry of @p cluster in memory and keeps the free
+ * bitmap in step.
+ */
+int fat_table_set(fat_table_t* t, uint32_t cluster, uint32_t value);
+
+/**
+ * @brief First cluster of a free run of @p want clusters, searching from
+ * @p from and wrapping around. If no run is that long, the first free
+ * cluster found; 0 if the volume is full.
+ */
+uint32_t fat_table_find_run(fat_table_t* t, uint32_t from, uint32_t want);
+
+/**
+ * @brief Allocates up to @p count clusters as one contiguous run, chained
+ * and ended with the end-of-chain value. With @p prev (0 for none) the run
+ * is linked behind it and looked for right after it first.
+ *
+ * @param got Receives how many clusters the run holds.
+ * @return First cluster of the run, 0 if the volume is full.
+ */
+uint32_t fat_table_alloc(fat_table_t* t, uint32_t prev, uint32_t count, uint32_t* got);
+
+/**
+ * @brief Writes the dirty FAT sectors to every FAT copy, one request per
+ * run of sectors.
+ *
+ * @return 0 on success, -1 if a write failed (those sectors stay dirty).
+ */
+int fat_table_flush(fat_table_t* t);
+
+/**
+ * @brief Cluster number @p index of the chain that starts at @p first,
+ * extending @p m from the FAT as needed.
+ *
+ * @param run If not NULL, receives how many clusters from there on are
+ * consecutive on disk.
+ * @return The cluster, 0 if the chain is shorter.
+ */
+uint32_t fat_extent_map(fat_table_t* t, fat_extent_map_t* m, uint32_t first,
+                        uint32_t index, uint32_t* run);
+
+/**
+ * @brief How many clusters @p m has mapped, and the last of them. After a
+ * lookup past the end, that is the whole chain.
+ */
+uint32_t fat_extent_count(const fat_extent_map_t* m, uint32_t* last);
+
+/**
+ * @brief Forgets @p m, e.g. after the chain was cut short.
+ */
+void fat_extent_reset(fat_extent_map_t* m);
+
+#endif
@@ -32,6 +32,7 @@ int iso9660_mount(int portno, uint32_t partition_lba, iso9660_fs_t* fs);
 int iso9660_find_path(iso9660_fs_t* fs, const char* path, iso9660_dirent_t* out);
 int iso9660_open(iso9660_fs_t* fs, const char* path, iso9660_file_t* out);
 int iso9660_read(iso9660_file_t* f, uint8_t* out, uint32_t size);
+int iso9660_readahead(iso9660_file_t* f, uint32_t offset, uint32_t bytes);
 void iso9660_close(iso9660_file_t* f);
 int iso9660_list_root(iso9660_fs_t* fs);
 int iso9660_list_dir(iso9660_fs_t* fs, const iso9660_dirent_t* dir);
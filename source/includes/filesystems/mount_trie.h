@@ -0,0 +1,62 @@
+/**
+ * @file mount_trie.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Mount points kept in a trie of path components.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef MOUNT_TRIE_H
+#define MOUNT_TRIE_H
+
+#include <basics.h>
+#include <ahci.h>
+
+/*
+ * One path component below its parent. A node exists for every component
+ * of every mount point; the ones a filesystem is mounted on have mnt set.
+ */
+typedef struct mount_node {
+    char* name;                 // "" for the root
+    mount_entry_t* mnt;         // mounted here, NULL if only on the way
+    struct mount_node* child;   // first child
+    struct mount_node* sibling;
+} mount_node_t;
+
+/**
+ * @brief Adds @p m under its mount point.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int mount_trie_insert(mount_entry_t* m);
+
+/**
+ * @brief Rebuilds the trie from mounted_partitions, after entries moved.
+ */
+void mount_trie_rebuild(void);
+
+/**
+ * @brief Deepest mount that @p path (absolute, normalized) lies on, found
+ * in one walk down its components.
+ *
+ * @param rel If not NULL, receives the rest of @p path below the mount
+ * point, without a leading '/'.
+ * @return The mount, NULL if none covers the path.
+ */
+mount_entry_t* mount_trie_resolve(const char* path, const char** rel);
+
+/**
+ * @brief The mount whose mount point is exactly @p mount_point, or NULL.
+ */
+mount_entry_t* mount_trie_find(const char* mount_point);
+
+/**
+ * @brief Mounts one component below @p path, e.g. /mnt/usb for /mnt.
+ *
+ * @return How many there are; at most @p max are stored in @p out.
+ */
+int mount_trie_children(const char* path, mount_entry_t** out, int max);
+
+#endif
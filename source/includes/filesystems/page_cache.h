@@ -0,0 +1,86 @@
+/**
+ * @file page_cache.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Pages of files kept resident, so executables can be mapped from
+ * memory instead of read again.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <basics.h>
+#include <stdbool.h>
+#include <filesystems/vfs.h>
+
+#define PAGE_CACHE_BUCKETS      512
+#define PAGE_CACHE_MAX          4096    // pages before the oldest unmapped ones go
+
+/*
+ * One page of a file, found by (filesystem, inode, page index). The cache
+ * holds one reference on the frame; every mapping of it holds another,
+ * so a page dropped from the cache stays alive where it is mapped.
+ */
+typedef struct page_cache_page {
+    void* fs;
+    uint64_t ino;
+    uint64_t index;
+    uintptr_t phys;
+
+    struct page_cache_page* hash_next;
+    struct page_cache_page* lru_prev;
+    struct page_cache_page* lru_next;
+} page_cache_page_t;
+
+/**
+ * @brief Fills @p page (a whole page) with the file's bytes at @p offset,
+ * zeros past the end of the file.
+ *
+ * @return 0 on success, -1 on a read error.
+ */
+typedef int (*page_cache_fill_t)(vfs_file_t* file, uint64_t offset, void* page);
+
+/**
+ * @brief The frame holding page @p index of @p file, read with @p fill if
+ * it is not cached yet. Files without a stable identity get a private
+ * frame.
+ *
+ * @return Physical address with a reference for the caller (dropped with
+ * free_page()), 0 on error.
+ */
+uintptr_t page_cache_get(vfs_file_t* file, uint64_t index, page_cache_fill_t fill);
+
+/**
+ * @brief Copies @p size bytes at @p offset of @p file out of the cache.
+ *
+ * @return 0 on success, -1 on a read error.
+ */
+int page_cache_read(vfs_file_t* file, uint64_t offset, void* buf, uint32_t size, page_cache_fill_t fill);
+
+/**
+ * @brief Copies @p size bytes just written at @p offset of @p file into
+ * the pages cached for it, so reads and shared mappings of those pages see
+ * the write. Pages not cached are read from the file when next needed.
+ */
+void page_cache_write(vfs_file_t* file, uint64_t offset, const void* buf, uint32_t size);
+
+/**
+ * @brief Forgets the cached pages of inode @p ino, before the file is
+ * overwritten as a whole or removed.
+ */
+void page_cache_invalidate(void* fs, uint64_t ino);
+
+/**
+ * @brief page_cache_invalidate() for the inode behind an open file.
+ */
+void page_cache_invalidate_file(vfs_file_t* file);
+
+/**
+ * @brief Forgets everything cached for filesystem @p fs, at unmount.
+ */
+void page_cache_drop_fs(void* fs);
+
+#endif
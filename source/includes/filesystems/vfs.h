@@ -16,6 +16,21 @@
 #include <filesystems/fat16.h>
 #include <filesystems/fat32.h>
 #include <filesystems/iso9660.h>
+#include <filesystems/dcache.h>
+
+/*
+ * Read-ahead of an open file. A read that starts where the previous one
+ * ended is sequential and doubles the window, up to VFS_RA_MAX_WINDOW;
+ * any other read closes it.
+ */
+#define VFS_RA_MIN_WINDOW   (16 * 1024)
+#define VFS_RA_MAX_WINDOW   (128 * 1024)
+
+typedef struct {
+    uint32_t next_pos;  // where a sequential read would start
+    uint32_t window;    // bytes to keep queued past the reader, 0 if random
+    uint32_t ahead;     // end of what has been queued so far
+} vfs_readahead_t;
 
 typedef struct vfs_file {
     mount_entry_t* mnt;
@@ -27,6 +42,8 @@ typedef struct vfs_file {
     } f;
     uint32_t pos; // for virtual files only, must not be used for real fs
     int flags;
+    vfs_readahead_t ra;
+    uint32_t dhash; // dentry cache hash of its path, 0 if not on disk
 
     char rel_path[64]; // for virtual files only, must not be used for real fs
 } vfs_file_t;
@@ -84,6 +101,34 @@ int vfs_write(vfs_file_t* file, const uint8_t* buf, uint32_t size);
  */
 void vfs_close(vfs_file_t* file);
 
+/**
+ * @brief Size of an open disk file
+ *
+ * @param file Pointer to open file
+ * @return Size in bytes, 0 for device and proc files
+ */
+uint64_t vfs_file_size(vfs_file_t* file);
+
+/**
+ * @brief Read from an open disk file at a given offset
+ * @param file Pointer to open file
+ * @param offset Where to start; the file position ends up after the bytes read
+ * @param buf Buffer to store read data
+ * @param size Number of bytes to read
+ * @return Number of bytes read or negative on error
+ */
+int vfs_pread(vfs_file_t* file, uint64_t offset, uint8_t* buf, uint32_t size);
+
+/**
+ * @brief Write to an open disk file at a given offset
+ * @param file Pointer to open file
+ * @param offset Where to start; the file position ends up after the bytes written
+ * @param buf Buffer containing data
+ * @param size Number of bytes to write
+ * @return Number of bytes written or negative on error
+ */
+int vfs_pwrite(vfs_file_t* file, uint64_t offset, const uint8_t* buf, uint32_t size);
+
 /**
  * @brief Checks whether a given path exists and is a directory,
  *        without changing the current working directory.
@@ -153,6 +198,17 @@ int vfs_normalize_path(const char* in, char* out, size_t out_sz);
 
 int vfs_resolve_mount(const char* path, vfs_mount_res_t* out);
 
+/**
+ * @brief Finds a path on a disk filesystem through the dentry cache, so
+ * repeated lookups of it do not read the disk.
+ *
+ * @param res Mount and relative path, from vfs_resolve_mount().
+ * @param out Receives whether it is a directory, its size and number.
+ * @return 0 if found, VFS_LOOKUP_NOENT if not, -1 on error or for
+ *         proc and dev mounts.
+ */
+int vfs_lookup(const vfs_mount_res_t* res, vfs_lookup_t* out);
+
 int vfs_sync(void);
 
 #endif // VFS_H
@@ -11,6 +11,16 @@
 #ifndef GDT_H
 #define GDT_H
 #include <basics.h>
+#include <smp.h>
+
+/**
+ * @brief Entries 0-4 are the flat segments, then one 16-byte TSS descriptor
+ * per CPU: a TSS that has been loaded with ltr is marked busy, so the CPUs
+ * cannot share one.
+ */
+#define GDT_TSS_INDEX          5
+#define GDT_ENTRIES            (GDT_TSS_INDEX + 2 * SMP_MAX_CPUS)
+#define GDT_TSS_SELECTOR(cpu)  ((uint16_t)((GDT_TSS_INDEX + 2 * (cpu)) * 8))
 
 /**
  * @brief The GDT Table.
@@ -34,7 +44,7 @@ struct gdt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
-extern struct gdt_entry gdt[7];
+extern struct gdt_entry gdt[GDT_ENTRIES];
 extern struct gdt_ptr gdtp;
 
 /**
@@ -42,4 +52,10 @@ extern struct gdt_ptr gdtp;
  * 
  */
 void setup_gdt(void);
+
+/**
+ * @brief Loads the GDT on the calling CPU and reloads the segment registers.
+ * setup_gdt() does this for the BSP, the APs call it on their own.
+ */
+void gdt_load(void);
 #endif
\ No newline at end of file
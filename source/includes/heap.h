@@ -11,8 +11,27 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <basics.h>
 
+/**
+ * @brief Number of slab size classes (16 bytes up to 2 KiB).
+ */
+#define HEAP_SIZE_CLASSES 8
+
+/**
+ * @brief Occupancy snapshot of one slab size class.
+ */
+typedef struct {
+    uint32_t object_size;
+    uint64_t slabs;
+    uint64_t objects_in_use;
+    uint64_t objects_cached;   // free objects parked in per-CPU magazines/depot
+    uint64_t objects_total;
+    uint64_t total_allocs;
+    uint64_t total_frees;
+} heap_class_stats_t;
+
 extern uint64_t heap_begin;
 extern uint64_t heap_end;
 extern uint64_t last_alloc;
@@ -47,6 +66,22 @@ extern void mm_constrict(uint64_t removal_size);
  */
 extern void mm_print_out(void);
 
+/**
+ * @brief Returns the amount of heap memory that can still be handed out.
+ * 
+ * @return uint64_t Free bytes (unreserved space, free blocks and empty slabs).
+ */
+extern uint64_t mm_free_memory(void);
+
+/**
+ * @brief Reads the occupancy statistics of a slab size class.
+ * 
+ * @param class_index Index of the class, 0 to HEAP_SIZE_CLASSES - 1.
+ * @param out Where the statistics are written.
+ * @return true if class_index is valid.
+ */
+extern bool heap_get_class_stats(int class_index, heap_class_stats_t* out);
+
 /**
  * @brief The main memory alloc function.
  * 
@@ -57,6 +57,11 @@ void init_syscall(void);
 
 void remap_pic(void);
 void initIdt(void);
+
+/**
+ * @brief Loads the (shared) IDT on the calling CPU, for APs coming online.
+ */
+void idt_load(void);
 void setIdtEntry(IDTEntry *target, uint64_t offset, uint16_t selector, uint8_t ist, uint8_t type_attributes);
 
 #endif
\ No newline at end of file
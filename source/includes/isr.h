@@ -28,6 +28,11 @@ typedef struct InterruptFrame
  */
 typedef void(*irq_handler)(InterruptFrame*);
 
+/* Vectors handed out to MSI and MSI-X devices; the LAPIC's sit below */
+#define IRQ_DYNAMIC_FIRST 0x60
+#define IRQ_DYNAMIC_LAST  0xEF
+#define IRQ_SYSCALL       0x80
+
 void exceptionHandler(InterruptFrame* frame);
 void irqHandler(InterruptFrame* frame); 
 
@@ -39,6 +44,20 @@ void irqHandler(InterruptFrame* frame);
  */
 void registerInterruptHandler(uint8_t irq, irq_handler handler);
 
+/**
+ * @brief Takes a free vector for a device interrupt (MSI, MSI-X) and
+ * registers @p handler on it. Vectors that already have a handler and the
+ * int 0x80 syscall gate are never handed out.
+ *
+ * @return The vector, 0 if none is left.
+ */
+uint8_t allocateInterruptVector(irq_handler handler);
+
+/**
+ * @brief Gives back a vector from allocateInterruptVector().
+ */
+void freeInterruptVector(uint8_t irq);
+
 void rtl8139_handler(InterruptFrame* frame);
 
 #endif
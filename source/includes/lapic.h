@@ -0,0 +1,72 @@
+/**
+ * @file lapic.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Local APIC: enable, EOI, IPIs and the per-CPU timer.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <basics.h>
+#include <stdbool.h>
+
+#define LAPIC_TIMER_VECTOR     0x40
+#define LAPIC_RESCHED_VECTOR   0x41
+#define LAPIC_SPURIOUS_VECTOR  0xFF
+
+/**
+ * @brief Software-enables the local APIC of the calling CPU. Works in xAPIC
+ * (MMIO) and x2APIC (MSR) mode, whichever the firmware left on.
+ */
+void lapic_init(void);
+
+/**
+ * @brief APIC ID of the calling CPU.
+ */
+uint32_t lapic_id(void);
+
+/**
+ * @brief Signals end of interrupt to the local APIC.
+ */
+void lapic_eoi(void);
+
+/**
+ * @brief Sends a fixed interrupt to another CPU.
+ *
+ * @param apic_id Destination APIC ID.
+ * @param vector Vector, e.g. LAPIC_RESCHED_VECTOR.
+ */
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/**
+ * @brief Lets the timer count down from 0xFFFFFFFF without interrupting,
+ * for calibration. The divider is 16 in every timer mode.
+ */
+void lapic_timer_count_start(void);
+
+/**
+ * @brief Counts elapsed since lapic_timer_count_start().
+ */
+uint32_t lapic_timer_count_elapsed(void);
+
+/**
+ * @brief Fires LAPIC_TIMER_VECTOR once after @p count timer counts.
+ */
+void lapic_timer_oneshot(uint32_t count);
+
+/**
+ * @brief Fires LAPIC_TIMER_VECTOR once the TSC reaches @p tsc. Only valid
+ * if cpu_has_tsc_deadline().
+ */
+void lapic_timer_tsc_deadline(uint64_t tsc);
+
+/**
+ * @brief Cancels a pending one-shot or TSC-deadline event.
+ */
+void lapic_timer_stop(void);
+
+#endif
@@ -27,6 +27,47 @@ struct memory_context {
     uint64 unknown;                // This value must be always 0.
 };
 
+/**
+ * @brief Copies at or above this many bytes go through `rep movs`/`rep stos`
+ * (or always, when the CPU reports FSRM).
+ */
+#define MEMORY_REP_THRESHOLD    64
+
+/**
+ * @brief Copies and fills at or above this many bytes use non-temporal SIMD stores.
+ */
+#define MEMORY_STREAM_THRESHOLD (512 * 1024)
+
+typedef enum {
+    MEMORY_STREAM_NONE = 0,
+    MEMORY_STREAM_SSE2,
+    MEMORY_STREAM_AVX
+} memory_stream_t;
+
+/**
+ * @brief Picks the memcpy/memset strategy from CPUID (ERMS, FSRM, SSE2, AVX).
+ *
+ * Call once SSE is enabled; until then the word-wide fallbacks are used.
+ */
+void memory_probe_features(void);
+
+/**
+ * @brief Returns the SIMD path used for large copies.
+ */
+memory_stream_t memory_stream_kind(void);
+
+/**
+ * @brief Overrides the SIMD path for large copies (clamped to what the CPU supports).
+ *
+ * @param kind The path to use.
+ */
+void memory_set_stream_kind(memory_stream_t kind);
+
+/**
+ * @brief Human readable name of a large copy path.
+ */
+cstring memory_stream_name(memory_stream_t kind);
+
 /**
  * @brief Copies a block of memory from a source location to a destination location.
  *
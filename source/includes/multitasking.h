@@ -4,6 +4,7 @@
 #include <basics.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <spinlock.h>
 
 typedef enum {
     TASK_TYPE_KERNEL = 0,
@@ -13,7 +14,8 @@ typedef enum {
 typedef enum {
     TASK_STATE_READY = 0,
     TASK_STATE_RUNNING = 1,
-    TASK_STATE_EXITED = 2
+    TASK_STATE_EXITED = 2,
+    TASK_STATE_BLOCKED = 3
 } task_state_t;
 
 typedef struct task_info {
@@ -21,7 +23,8 @@ typedef struct task_info {
     task_type_t type;
     task_state_t state;
     int exit_code;
-    uint64_t runtime_ticks;
+    uint64_t runtime_ms;
+    uint32_t cpu;
     const char* name;
 } task_info_t;
 
@@ -32,15 +35,112 @@ typedef struct user_task_spec {
 } user_task_spec_t;
 
 typedef bool (*task_iter_cb_t)(const task_info_t* info, void* ctx);
-typedef bool (*kernel_task_fn_t)(uint32_t pid, uint64_t now_ticks, void* ctx, int* exit_code);
+typedef bool (*kernel_task_fn_t)(uint32_t pid, uint64_t now_ms, void* ctx, int* exit_code);
 
+struct userland_state;
+struct syscall_frame;
+
+#define TASK_KSTACK_SIZE      (16 * 1024)
+#define TASK_TIMESLICE_NS     (50ULL * 1000000ULL)
+
+/**
+ * @brief Run queue priorities, lower runs first. Kernel tasks sleep most of
+ * the time, so putting them above userland keeps the shell responsive without
+ * starving programs.
+ */
+#define TASK_PRIO_KERNEL      0
+#define TASK_PRIO_USER        1
+#define TASK_PRIORITIES       2
+
+/**
+ * @brief Turns the running boot context into a task and starts the idle task.
+ * Timer preemption begins once this returns.
+ */
 void multitasking_init(void);
-void multitasking_on_pit_tick(uint64_t now_ticks);
+
+/**
+ * @brief Makes the calling AP a scheduler CPU with its own run queue and
+ * idle task. Called by smp_ap_loop() once the AP's GDT, TSS, IDT and LAPIC
+ * timer are set up.
+ *
+ * @param cpu Dense index of the AP.
+ */
+void multitasking_ap_enter(uint32_t cpu) __attribute__((noreturn));
+
+/**
+ * @brief Timer event hook of the calling CPU, called after the EOI from the
+ * LAPIC timer, a reschedule IPI or, without a usable LAPIC timer, the PIT.
+ * Wakes due sleepers and programs the next one-shot event, which is none at
+ * all when the CPU goes idle with nobody sleeping.
+ *
+ * @param from_user The interrupt arrived while the CPU was in ring 3; only
+ * then is the interrupted task switched out (the kernel is not preemptible).
+ */
+void multitasking_on_timer_tick(bool from_user);
+
+/**
+ * @brief Exit hook of a device interrupt that may have signalled a
+ * completion, called after the EOI. Switches to the woken task right away
+ * if it preempts the interrupted one, without the timer's accounting.
+ *
+ * @param from_user As for multitasking_on_timer_tick().
+ */
+void multitasking_on_device_irq(bool from_user);
+
+/**
+ * @brief Makes another CPU look at its run queue: wakes it from the idle
+ * halt or gets a pending kill or reschedule handled.
+ *
+ * @param cpu Dense index of the CPU.
+ */
+void multitasking_kick_cpu(uint32_t cpu);
+
+/**
+ * @brief Switches away if the timer asked for it while the task was in the
+ * kernel. Called on the way back to ring 3 from a syscall.
+ */
+void multitasking_preempt_point(void);
+
+/**
+ * @brief Takes the kernel lock, which serializes kernel code across CPUs.
+ * Nests; a task that sleeps gives it up and gets it back on wakeup.
+ * Syscalls take it on entry, kernel tasks hold it while they run.
+ */
+void multitasking_lock_kernel(void);
+
+/**
+ * @brief Releases one level of the kernel lock.
+ */
+void multitasking_unlock_kernel(void);
+
+/**
+ * @brief Frees the resources of tasks that have exited.
+ */
 void multitasking_pump(void);
 
-uint32_t multitasking_spawn_kernel(const char* name, kernel_task_fn_t fn, void* ctx);
+/**
+ * @brief Starts a kernel task that calls @p fn every @p period_ms until it
+ * returns true.
+ */
+uint32_t multitasking_spawn_kernel(const char* name, kernel_task_fn_t fn, void* ctx, uint32_t period_ms);
 uint32_t multitasking_spawn_userland(const char* name, const user_task_spec_t* spec);
 
+/**
+ * @brief Starts a copy of the calling userland task that shares its pages
+ * copy-on-write and returns to ring 3 through @p frame with 0 in RAX.
+ *
+ * @param frame Registers of the caller's fork() syscall.
+ * @return The child's pid, 0 if the caller is not a userland task with its
+ * own address space or out of memory.
+ */
+uint32_t multitasking_fork_userland(const struct syscall_frame* frame);
+
+/**
+ * @brief Kills task @p pid, which exits with @p exit_code the next time it
+ * runs, through the same path as exit().
+ *
+ * @return false if there is no such task.
+ */
 bool multitasking_exit_task(uint32_t pid, int exit_code);
 bool multitasking_get_task(uint32_t pid, task_info_t* out_info);
 uint32_t multitasking_current_pid(void);
@@ -52,4 +152,106 @@ bool multitasking_for_each_task(task_iter_cb_t cb, void* ctx);
 
 void multitasking_start_cursor_blink_task(void);
 
+/**
+ * @brief Gives up the CPU to the next ready task, if any.
+ */
+void multitasking_yield(void);
+
+/**
+ * @brief Blocks the calling task for at least @p ns nanoseconds.
+ * Falls back to spinning on the clock before the scheduler is running.
+ */
+void multitasking_sleep_ns(uint64_t ns);
+
+static inline void multitasking_sleep_ms(uint64_t ms) {
+    multitasking_sleep_ns(ms * 1000000ULL);
+}
+
+/**
+ * @brief One-shot event a task can sleep on until another task or an
+ * interrupt handler signals it.
+ */
+typedef struct task_completion {
+    volatile bool done;
+    void* volatile waiter;      // task blocked in multitasking_completion_wait()
+} task_completion_t;
+
+static inline void multitasking_completion_init(task_completion_t* c) {
+    c->done = false;
+    c->waiter = NULL;
+}
+
+/**
+ * @brief Sleeps until @p c is signalled or @p timeout_ns (TIMER_NEVER for no
+ * limit) passes, without the kernel lock. Returns right away before the
+ * scheduler runs or on the idle task; callers poll their device then.
+ *
+ * @return Whether @p c has been signalled.
+ */
+bool multitasking_completion_wait(task_completion_t* c, uint64_t timeout_ns);
+
+/**
+ * @brief Marks @p c done and wakes its waiter. Safe in interrupt handlers.
+ */
+void multitasking_completion_signal(task_completion_t* c);
+
+/**
+ * @brief Lock that may be held across sleeping, e.g. while waiting for a
+ * disk. Recursive for its holder; contenders yield the CPU.
+ */
+typedef struct task_mutex {
+    spinlock_t lock;
+    const void* owner;
+    uint32_t depth;
+} task_mutex_t;
+
+#define TASK_MUTEX_INIT { SPINLOCK_INIT, NULL, 0 }
+
+void multitasking_mutex_lock(task_mutex_t* m);
+void multitasking_mutex_unlock(task_mutex_t* m);
+
+/**
+ * @brief Terminates the calling task. Its stack and address space are
+ * released later by multitasking_pump().
+ */
+void multitasking_exit_current(int exit_code) __attribute__((noreturn));
+
+/**
+ * @brief Arms (or disarms) the calling task to be woken by the next task
+ * exit. Arm first, then look for exited tasks, then multitasking_exit_wait():
+ * an exit in between is not missed.
+ */
+void multitasking_exit_watch(bool on);
+
+/**
+ * @brief Sleeps until some task exits after multitasking_exit_watch(true),
+ * then disarms. Returns at once if not armed.
+ */
+void multitasking_exit_wait(void);
+
+/**
+ * @brief Sleeps until the task exits.
+ *
+ * @param pid Task to wait for.
+ * @param exit_code Receives the exit code, may be NULL.
+ * @param load_failed Set if a userland task ended because its image could
+ * not be loaded, rather than with a status of its own; may be NULL.
+ * @return false if no such task exists.
+ */
+bool multitasking_wait_task(uint32_t pid, int* exit_code, bool* load_failed);
+
+/**
+ * @brief Per-process userland bookkeeping (heap break, mmap cursor) of the
+ * running task, NULL for kernel tasks.
+ */
+struct userland_state* multitasking_current_userland(void);
+
+/**
+ * @brief Gives the running userland task empty user page tables and frees
+ * its old ones with everything mapped in them, e.g. for exec.
+ *
+ * @return false if the task runs on the kernel's tables instead.
+ */
+bool multitasking_new_address_space(void);
+
 #endif
@@ -2,11 +2,18 @@
 #define NVME_H
 
 #include <basics.h>
+#include <stdbool.h>
+#include <multitasking.h>
 
 #define NVME_MAX_CONTROLLERS 8
 #define NVME_MAX_NAMESPACES 16
 #define NVME_ADMIN_QUEUE_DEPTH 16
-#define NVME_IO_QUEUE_DEPTH 64
+#define NVME_IO_QUEUE_DEPTH 64      /* at most 64: command IDs are a 64-bit mask */
+#define NVME_MAX_IO_QUEUES 8        /* one per CPU, shared round-robin beyond that */
+
+#define NVME_REQ_MAX_SECTORS 2048   /* 1 MiB per command, one PRP list page */
+#define NVME_BOUNCE_MAX_SECTORS 256 /* 128 KiB */
+#define NVME_REQ_PENDING 1
 
 typedef volatile struct {
     uint64_t cap;
@@ -48,6 +55,30 @@ typedef struct __attribute__((packed)) {
     uint16_t status;
 } nvme_completion_t;
 
+/**
+ * @brief One read or write queued on a namespace with nvme_submit().
+ * The caller fills in the first block of fields; the rest is the driver's.
+ */
+typedef struct nvme_request {
+    uint64_t lba;
+    uint32_t count;             /* sectors, 1..NVME_REQ_MAX_SECTORS */
+    void* buffer;
+    bool write;
+    /* Called in interrupt context when done; NULL to use nvme_wait(). */
+    void (*complete)(struct nvme_request* req);
+    void* private_data;
+
+    volatile int status;        /* NVME_REQ_PENDING, then 0 or an error */
+    task_completion_t done;
+    void* dma;                  /* bounce buffer, NULL when DMA goes to buffer */
+    uint64_t* prp_list;         /* PRP list page for more than two pages */
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t nsid;
+    uint16_t queue;             /* index into the controller's I/O queues */
+    struct nvme_request* next;  /* waiting for a command ID */
+} nvme_request_t;
+
 typedef struct {
     nvme_command_t* sq;
     nvme_completion_t* cq;
@@ -56,6 +87,14 @@ typedef struct {
     uint16_t sq_tail;
     uint16_t cq_head;
     uint8_t phase;
+
+    /* I/O queues only */
+    spinlock_t lock;
+    uint8_t vector;             /* MSI-X vector, 0 when polled */
+    uint64_t cid_busy;
+    nvme_request_t* cid_req[NVME_IO_QUEUE_DEPTH];
+    nvme_request_t* pending_head;
+    nvme_request_t* pending_tail;
 } nvme_queue_t;
 
 typedef struct {
@@ -64,8 +103,10 @@ typedef struct {
     uint32_t controller_id;
     uint32_t nn;
     nvme_queue_t adminq;
-    nvme_queue_t ioq;
-    void* bounce_buffer;
+    nvme_queue_t ioq[NVME_MAX_IO_QUEUES];
+    uint16_t nr_ioq;
+    uint32_t max_sectors;       /* per command, from MDTS */
+    bool msix;
     int present;
 } nvme_controller_t;
 
@@ -87,4 +128,43 @@ void probe_nvme(uint8_t bus, uint8_t slot, uint8_t function);
 int nvme_read_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count);
 int nvme_write_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count);
 
+/**
+ * @brief Queues @p req on the calling CPU's I/O queue of a namespace's
+ * controller. Up to the queue depth is in flight per queue; the rest waits
+ * for a command ID. The controller moves the data straight to or from
+ * @p req->buffer through PRP entries when every page is mapped; otherwise
+ * it goes through a bounce buffer, which takes at most
+ * NVME_BOUNCE_MAX_SECTORS.
+ *
+ * @return 0 if queued; -1 on bad arguments, -2 if the controller failed,
+ * -10 if out of memory.
+ */
+int nvme_submit(int namespace_index, nvme_request_t* req);
+
+/**
+ * @brief Sleeps until @p req finishes. The queue's MSI-X interrupt wakes the
+ * caller; before interrupts work the queue is polled instead.
+ *
+ * @return 0 on success, -2 on a command or controller error.
+ */
+int nvme_wait(int namespace_index, nvme_request_t* req);
+
+/**
+ * @brief Reaps every I/O queue of a namespace's controller, for callers
+ * that cannot rely on the interrupts.
+ */
+void nvme_poll(int namespace_index);
+
+/**
+ * @brief Whether the namespace's controller completes by MSI-X, so a
+ * waiter may sleep.
+ */
+bool nvme_interrupts_enabled(int namespace_index);
+
+/**
+ * @brief Sectors from @p buffer on that one command can move without a
+ * bounce buffer, at most @p count; 0 if the start is not DMA-safe.
+ */
+uint32_t nvme_dma_sectors(int namespace_index, const void* buffer, uint32_t count);
+
 #endif
@@ -20,21 +20,52 @@
 #define PAGE_PRESENT  0x1
 #define PAGE_RW       0x2
 #define PAGE_USER     0x4
+#define PAGE_DIRTY    0x40          /* set by the CPU on a write */
+#define PAGE_HUGE     0x80          /* PS: 2 MiB in a PD, 1 GiB in a PDPT */
+#define PAGE_COW      (1ULL << 9)   /* software: read-only until a write copies it */
+#define PAGE_SHARED   (1ULL << 10)  /* software: stays shared, writable, across fork */
 #define PAGE_NX       (1ULL << 63)
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
 
 #define USER_CODE_FLAGS (PAGE_PRESENT | PAGE_USER | PAGE_RW )
 #define USER_DATA_FLAGS (PAGE_PRESENT | PAGE_USER | PAGE_RW | PAGE_NX)
 
 extern struct limine_memmap_response *memmap;
 
+/**
+ * @brief Physical memory zones, split by what devices can address.
+ */
+typedef enum {
+    PMM_ZONE_DMA,     // below 16 MiB (ISA DMA)
+    PMM_ZONE_DMA32,   // below 4 GiB (32-bit DMA engines)
+    PMM_ZONE_NORMAL,  // everything above
+    PMM_ZONE_COUNT
+} pmm_zone_t;
+
+typedef struct {
+    const char* name;
+    uint64_t total_frames;
+    uint64_t free_frames;
+} pmm_zone_stats_t;
+
+typedef struct {
+    uint64_t total_frames;
+    uint64_t free_frames;      // includes cached_frames
+    uint64_t used_frames;
+    uint64_t cached_frames;    // free frames held in per-CPU stacks
+    pmm_zone_stats_t zones[PMM_ZONE_COUNT];
+} pmm_stats_t;
+
 /**
  * @brief Function to map userland pages
  * 
  * @param virt Virtual memory address of user
  * @param phys Physical memory address of kernel's user code.
  * @param flags Permissions
+ * @return false if a page table could not be allocated; nothing is mapped
+ * then and @p phys stays with the caller.
  */
-void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags);
+bool map_user_page(uint64_t virt, uint64_t phys, uint64_t flags);
 void unmap_user_page(uint64_t virt);
 
 /**
@@ -44,10 +75,146 @@ void unmap_user_page(uint64_t virt);
  */
 void paging_set_hhdm_offset(uint64_t offset);
 
+/**
+ * @brief Keeps a physical range away from the frame allocator.
+ *
+ * @param base Physical base address.
+ * @param length Length of the range in bytes.
+ */
+void pmm_reserve_range(uint64_t base, uint64_t length);
+
+/**
+ * @brief Builds the page frame bitmap from every USABLE Limine memmap entry.
+ */
+void pmm_init(void);
+
+/**
+ * @brief Allocates one physical page frame.
+ *
+ * @return uintptr_t Physical address of the frame.
+ */
 uintptr_t allocate_page(void);
+
+/**
+ * @brief Allocates physically contiguous page frames.
+ *
+ * @param count Number of frames.
+ * @return uintptr_t Physical address of the first frame.
+ */
 uintptr_t allocate_pages(size_t count);
+
+/**
+ * @brief Allocates physically contiguous page frames below 4 GiB for DMA.
+ *
+ * @param count Number of frames.
+ * @return uintptr_t Physical address of the first frame.
+ */
+uintptr_t allocate_dma_pages(size_t count);
+
+/**
+ * @brief Returns a page frame to the allocator.
+ *
+ * @param phys Physical address of the frame.
+ */
+void free_page(uintptr_t phys);
+void free_pages(uintptr_t phys, size_t count);
+
+/**
+ * @brief Takes one more reference on a frame, e.g. to map it a second
+ * time. Each reference is dropped with free_page().
+ *
+ * @param phys Physical address of the frame.
+ */
+void page_get(uintptr_t phys);
+
+/**
+ * @brief How many holders a frame has, 1 for an unshared one.
+ *
+ * @param phys Physical address of the frame.
+ */
+uint32_t page_ref_count(uintptr_t phys);
+
+/**
+ * @brief Reads the frame allocator counters.
+ *
+ * @param out Where the statistics are written.
+ */
+void pmm_get_stats(pmm_stats_t* out);
+
+/**
+ * @brief Translates an address through the page tables of the running
+ * address space. Handles 2 MiB and 1 GiB pages.
+ *
+ * @param virt Virtual address.
+ * @return uint64_t Physical address, 0 if @p virt is not mapped.
+ */
 uint64_t virtual_to_physical(uint64_t virt);
 uint64_t fast_virt_to_phys(void* v);
+
+/**
+ * @brief The page table entry of a 4 KiB user page in the running address
+ * space, flags included.
+ *
+ * @param virt Virtual address.
+ * @return uint64_t The entry, 0 if there is none.
+ */
+uint64_t user_page_entry(uint64_t virt);
 uint64_t virt_to_phys(void* v);
 
+/**
+ * @brief Returns the HHDM address of a physical address.
+ *
+ * @param phys Physical address.
+ * @return The higher-half direct mapped pointer.
+ */
+void* phys_to_virt(uint64_t phys);
+
+/**
+ * @brief Returns the page tables the kernel booted with.
+ */
+uint64_t paging_kernel_cr3(void);
+
+/**
+ * @brief Turns on PCIDs on this CPU if the processor has them. Called by
+ * the BSP first, then by every AP.
+ */
+void paging_enable_pcid(void);
+
+/**
+ * @brief Loads @p cr3.
+ *
+ * @param tlb_current The TLB of this CPU still holds valid entries for the
+ * address space, because it has not run anywhere else since it last ran
+ * here. They are then kept instead of flushed.
+ */
+void paging_switch_address_space(uint64_t cr3, bool tlb_current);
+
+/**
+ * @brief Creates a PML4 sharing all kernel mappings and no user mappings.
+ *
+ * @return Physical address of the new PML4, tagged with a PCID if those
+ * are on, suitable for CR3; 0 if out of memory.
+ */
+uint64_t paging_create_address_space(void);
+
+/**
+ * @brief Creates an address space with the same user mappings as @p cr3,
+ * for fork(). The pages themselves are shared copy-on-write, so both sides
+ * lose write access to them until they write and get their own copy;
+ * PAGE_SHARED pages stay shared as they are.
+ *
+ * @param cr3 Address space to copy, may be the active one.
+ * @return The new address space, as from paging_create_address_space(),
+ * 0 if out of memory.
+ */
+uint64_t paging_clone_address_space(uint64_t cr3);
+
+/**
+ * @brief Frees every user page and page table of an address space, then the PML4.
+ * Must not be the active CR3.
+ *
+ * @param cr3 Address space from paging_create_address_space().
+ */
+void paging_destroy_address_space(uint64_t cr3);
+
 #endif
@@ -116,6 +116,48 @@ void print_lspci(void);
 uint32 pci_config_read_dword(uint8 bus, uint8 slot, uint8 func, uint8 offset);
 void pci_config_write_dword(uint8 bus, uint8 slot, uint8 func, uint8 offset, uint32_t value);
 
+#define PCI_CAP_ID_MSI     0x05
+#define PCI_CAP_ID_MSIX    0x11
+
+/**
+ * @brief Walks the capability list of a function.
+ *
+ * @param bus The PCI bus number.
+ * @param slot The PCI slot number.
+ * @param func The PCI function number.
+ * @param cap_id Capability ID, e.g. PCI_CAP_ID_MSI.
+ * @return uint8 Config space offset of the capability, 0 if it has none.
+ */
+uint8 pci_find_capability(uint8 bus, uint8 slot, uint8 func, uint8 cap_id);
+
+/**
+ * @brief Points the MSI capability of a function at a local APIC, enables it
+ * and turns off legacy INTx. Also enables bus mastering.
+ *
+ * @param bus The PCI bus number.
+ * @param slot The PCI slot number.
+ * @param func The PCI function number.
+ * @param vector Interrupt vector raised by the device.
+ * @param apic_id Destination local APIC ID.
+ * @return true if the function has MSI and it is now on.
+ */
+bool pci_enable_msi(uint8 bus, uint8 slot, uint8 func, uint8 vector, uint32_t apic_id);
+
+/**
+ * @brief Points one MSI-X table entry of a function at a local APIC and
+ * unmasks it, then enables MSI-X and turns off legacy INTx. Entries never
+ * programmed stay masked. Also enables bus mastering.
+ *
+ * @param bus The PCI bus number.
+ * @param slot The PCI slot number.
+ * @param func The PCI function number.
+ * @param entry Index into the MSI-X table.
+ * @param vector Interrupt vector raised for this entry.
+ * @param apic_id Destination local APIC ID.
+ * @return true if the function has MSI-X and a table entry @p entry.
+ */
+bool pci_enable_msix(uint8 bus, uint8 slot, uint8 func, uint16 entry, uint8 vector, uint32_t apic_id);
+
 /**
  * @brief Gets the AHCI bar address
  * 
@@ -0,0 +1,98 @@
+/**
+ * @file smp.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Application processor bookkeeping and per-CPU indexing.
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) Pradosh 2026
+ * 
+ */
+#ifndef SMP_H
+#define SMP_H
+
+#include <basics.h>
+#include <stdbool.h>
+#include <limine.h>
+
+#define SMP_MAX_CPUS 32
+
+typedef void (*smp_work_fn_t)(void* arg);
+
+/**
+ * @brief Assigns dense CPU indices (BSP = 0) from the Limine SMP response.
+ * 
+ * @param response Limine SMP response.
+ */
+void smp_init(struct limine_smp_response* response);
+
+/**
+ * @brief Called by an AP once it is up, before it enters smp_ap_loop().
+ * 
+ * @param info Limine info of the AP.
+ */
+void smp_ap_online(struct limine_smp_info* info);
+
+/**
+ * @brief Parking loop of an AP: runs whatever smp_run_on() posts to it until
+ * smp_start_scheduler() lets it load the kernel GDT, TSS and IDT and become
+ * a scheduler CPU.
+ */
+void smp_ap_loop(void) __attribute__((noreturn));
+
+/**
+ * @brief Moves the parked APs into the scheduler. Needs timer_init() to
+ * have switched to LAPIC timer events. Call on the BSP after
+ * multitasking_init().
+ *
+ * @return true if at least one AP joined.
+ */
+bool smp_start_scheduler(void);
+
+/**
+ * @brief Runs the work smp_run_on() posted to the calling CPU, if any.
+ * The scheduler's idle loop calls this on the APs.
+ *
+ * @return true if something ran.
+ */
+bool smp_run_posted_work(void);
+
+/**
+ * @brief Number of CPUs known to the kernel (BSP included).
+ */
+uint32_t smp_cpu_count(void);
+
+/**
+ * @brief Local APIC ID of the CPU with this dense index.
+ */
+uint32_t smp_cpu_lapic_id(uint32_t cpu);
+
+/**
+ * @brief Dense index of the CPU executing the call, always < SMP_MAX_CPUS.
+ */
+uint32_t smp_current_cpu(void);
+
+/**
+ * @brief Whether the CPU with this index has reached smp_ap_loop().
+ */
+bool smp_cpu_online(uint32_t cpu);
+
+/**
+ * @brief Posts a function to an AP. Once the scheduler runs there, the work
+ * is picked up by that CPU's idle task, i.e. when it has nothing else to do.
+ * 
+ * @param cpu Index of the AP (not the BSP).
+ * @param fn Function to run.
+ * @param arg Argument for fn.
+ * @return true if the work was posted.
+ */
+bool smp_run_on(uint32_t cpu, smp_work_fn_t fn, void* arg);
+
+/**
+ * @brief Waits until the AP has finished the work posted by smp_run_on().
+ * 
+ * @param cpu Index of the AP.
+ */
+void smp_wait(uint32_t cpu);
+
+#endif
@@ -0,0 +1,76 @@
+/**
+ * @file spinlock.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Busy-wait locks shared by the BSP and the APs.
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) Pradosh 2026
+ * 
+ */
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <basics.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+/**
+ * @brief Disables interrupts on the current CPU.
+ * 
+ * @return uint64_t RFLAGS before the call, to be passed to irq_restore().
+ */
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/**
+ * @brief Re-enables interrupts if they were enabled at irq_save() time.
+ * 
+ * @param flags Value returned by irq_save().
+ */
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1ULL << 9))
+        asm volatile("sti" : : : "memory");
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked)
+            asm volatile("pause");
+    }
+}
+
+static inline bool spin_trylock(spinlock_t* lock) {
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __sync_lock_release(&lock->locked);
+}
+
+/**
+ * @brief Takes a lock with interrupts disabled, so an IRQ handler on the
+ * same CPU can never spin on a lock its own CPU is holding.
+ * 
+ * @param lock The lock.
+ * @return uint64_t Saved RFLAGS for spin_unlock_irqrestore().
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
@@ -16,6 +16,7 @@
 #include <stdint.h>
 
 typedef struct vfs_file vfs_file_t;
+typedef struct fd_table fd_table_t;
 
 typedef enum {
     STDIN  = 0,
@@ -45,6 +46,19 @@ void stream_write(stream_t s, const char* buf, size_t len);
 void stream_putc(stream_t s, char c);
 
 void fd_table_init(void);
+
+/**
+ * @brief Copies the calling task's descriptors for a new process; both
+ * sides keep sharing the open files and their positions.
+ *
+ * @return The copy, NULL if out of memory.
+ */
+fd_table_t* fd_table_fork(void);
+
+/**
+ * @brief Closes every descriptor of @p table and frees it.
+ */
+void fd_table_release(fd_table_t* table);
 bool fd_valid(int fd);
 vfs_file_t* fd_get_file(int fd);
 int fd_open(const char* path, int flags);
@@ -103,6 +103,7 @@
 #define LINUX_ENOMEM     12
 #define LINUX_ERANGE     34
 #define LINUX_ENOTDIR    20
+#define LINUX_ENODEV     19
 #define LINUX_ESRCH      3
 #define LINUX_EPERM      1
 #define LINUX_EINTR      4
@@ -200,6 +201,12 @@ typedef struct syscall_frame {
     uint64_t rsi;
     uint64_t rdi;
     uint64_t rax;
+    uint64_t rbx;     // kept per syscall, a sleeping syscall must not lose it
+    uint64_t rbp;     // callee-saved ones, for a forked child
+    uint64_t r12;
+    uint64_t r13;
+    uint64_t r14;
+    uint64_t r15;
 
     uint64_t rip;     // rcx
     uint64_t cs;      // 0x1B
@@ -227,6 +234,13 @@ void int80_handler(InterruptFrame* frame);
  */
 void syscall_handler(syscall_frame_t* f);
 
+/**
+ * @brief Returns to ring 3 with the registers in @p f, as if the syscall
+ * that saved them just finished. @p f must be on the running task's kernel
+ * stack.
+ */
+void syscall_resume(syscall_frame_t* f) __attribute__((noreturn));
+
 /**
  * @brief Dispatches syscall based on the syscall number.
  * 
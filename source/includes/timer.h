@@ -0,0 +1,74 @@
+/**
+ * @file timer.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Clock and timer events: TSC time keeping, LAPIC one-shot or
+ * TSC-deadline events, calibrated against the HPET or the PIT.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <basics.h>
+#include <stdbool.h>
+
+#define TIMER_NS_PER_US   1000ULL
+#define TIMER_NS_PER_MS   1000000ULL
+#define TIMER_NS_PER_SEC  1000000000ULL
+
+/**
+ * @brief Deadline meaning "no event", stops the calling CPU's timer.
+ */
+#define TIMER_NEVER       (~0ULL)
+
+typedef enum {
+    TIMER_EVENT_PIT = 0,        // periodic 100 Hz PIT on the BSP only
+    TIMER_EVENT_LAPIC_ONESHOT,  // LAPIC timer, one-shot mode
+    TIMER_EVENT_TSC_DEADLINE    // LAPIC timer, TSC-deadline mode
+} timer_event_t;
+
+/**
+ * @brief Calibrates the TSC and the LAPIC timer against the HPET (from the
+ * ACPI tables) or, without one, the PIT, then takes over from the periodic
+ * PIT. Call on the BSP once the PIT interrupt is running.
+ */
+void timer_init(void);
+
+/**
+ * @brief Monotonic time in nanoseconds. Runs off the TSC once calibrated,
+ * before that (or without a usable TSC) off the HPET or the PIT tick.
+ */
+uint64_t timer_now_ns(void);
+
+/**
+ * @brief Wall-clock time in nanoseconds since the Unix epoch: the RTC read
+ * at boot plus the monotonic clock.
+ */
+uint64_t timer_realtime_ns(void);
+
+/**
+ * @brief Calibrated TSC frequency in Hz, 0 if calibration failed.
+ */
+uint64_t timer_tsc_hz(void);
+
+/**
+ * @brief How the per-CPU timer events are generated.
+ */
+timer_event_t timer_event_kind(void);
+
+/**
+ * @brief Human readable name of timer_event_kind().
+ */
+const char* timer_event_name(void);
+
+/**
+ * @brief Arms the calling CPU's one-shot timer for an absolute
+ * timer_now_ns() deadline; TIMER_NEVER stops it. The interrupt goes to
+ * multitasking_on_timer_tick(). Does nothing in TIMER_EVENT_PIT mode.
+ */
+void timer_arm(uint64_t deadline_ns);
+
+#endif
@@ -48,29 +48,49 @@ struct __attribute__((packed)) tss_descriptor {
     uint32_t reserved;
 };
 
-extern struct tss_entry tss;
 /**
- * @brief 16 KB kernel stack
- * 
+ * @brief What syscall_entry needs before it has a stack, one per CPU and
+ * reached through IA32_KERNEL_GS_BASE. The offsets are hard-coded in
+ * syscalls-x86_64.asm.
  */
-extern uint8_t kernel_stack[0x4000];
+typedef struct cpu_syscall_area {
+    uint64_t kernel_stack_top;  // gs:0, kernel stack of the running task
+    uint64_t user_rsp;          // gs:8, user RSP while the stacks are swapped
+} cpu_syscall_area_t;
+
+#define IA32_KERNEL_GS_BASE_MSR 0xC0000102
+
+extern struct tss_entry cpu_tss[SMP_MAX_CPUS];
+extern cpu_syscall_area_t cpu_syscall_area[SMP_MAX_CPUS];
 
 /**
- * @brief The starting address of kernel's stack.
- * 
+ * @brief Boot kernel stack, used by the BSP until the scheduler installs
+ * per-task stacks.
  */
-extern uint64_t kernel_stack_top;
+extern uint8_t kernel_stack[0x4000];
 
 /**
- * @brief Initialize TSS.
- * 
+ * @brief Fills in the TSS descriptors of every CPU.
  */
 void kernel_tss_init(void);
 
 /**
- * @brief Load the TSS.
- * 
+ * @brief Loads the BSP's TSS.
  */
 void tss_load(void);
 
+/**
+ * @brief Loads the TSS of @p cpu and points IA32_KERNEL_GS_BASE at its
+ * syscall area. Must run on that CPU.
+ */
+void tss_load_cpu(uint32_t cpu);
+
+/**
+ * @brief Sets the stack ring 3 traps and syscalls land on for @p cpu.
+ */
+static inline void tss_set_kernel_stack(uint32_t cpu, uint64_t top) {
+    cpu_tss[cpu].rsp0 = top;
+    cpu_syscall_area[cpu].kernel_stack_top = top;
+}
+
 #endif
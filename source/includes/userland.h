@@ -13,10 +13,11 @@
 
 #include <basics.h>
 #include <syscalls.h>
+#include <vma.h>
 
 #define USER_STACK_SIZE  (16 * 1024)
 #define USER_HEAP_SIZE   (1 * 1024 * 1024)
-#define USER_MMAP_SIZE   (4 * 1024 * 1024)
+#define USER_MMAP_SIZE   (256 * 1024 * 1024)  // address space only, paged in on touch
 
 #define USER_CODE_VADDR  0x0000400000000000ULL // canonical user space, isolated PML4 slot
 #define USER_HEAP_VADDR  0x0000400010000000ULL // user heap right above code region
@@ -94,12 +95,164 @@ typedef struct {
     uint64_t value;
 } auxv_pair_t;
 
+#define USER_REGIONS_MAX 16
+#define USER_CHILDREN_MAX 64
+
+/**
+ * @brief Part of the program image that is mapped on first touch: bytes in
+ * [start, file_end) come from the executable, the rest up to end is zero.
+ */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;         // page flags once present
+    uint64_t file_end;
+    uint64_t file_offset;   // where start is in the executable
+} user_region_t;
+
+/**
+ * @brief Per-process userland layout, owned by the task running the program.
+ */
+typedef struct userland_state {
+    uint64_t heap_break;
+    uint64_t heap_mapped_end;   // heap pages up to here are zero-filled on demand
+    vma_t* vmas;                // mmap()ed areas
+
+    user_region_t regions[USER_REGIONS_MAX];
+    uint32_t region_count;
+    user_file_t* image;         // executable the regions are read from
+    bool user_access;           // the kernel is touching our memory for us
+    bool entered;               // an image got as far as ring 3
+
+    // Process state that lives on across execve(), unlike the layout above.
+    struct fd_table* fds;       // NULL: the kernel's table
+    uint64_t* clear_child_tid;  // set_tid_address(), zeroed on exit
+    uint32_t umask;
+    uint32_t children[USER_CHILDREN_MAX]; // forked and not waited for yet
+    uint32_t child_count;
+} userland_state_t;
+
 void enter_userland_at(uint64_t entry_point);
+
+/**
+ * @brief State of the program on this task, or the legacy boot state when
+ * enter_userland_at() is used outside of the scheduler.
+ */
+userland_state_t* userland_state(void);
+
+/**
+ * @brief Loads an ELF into the current task's address space and enters it.
+ *
+ * @return Only returns (with -1) if the image could not be loaded.
+ */
 int userland_exec(const char* path, int argc, const char* const* argv, const char* const* envp);
 void userland_heap_init(void);
 uint64_t userland_brk(uint64_t requested_break);
-uint64_t userland_mmap_anon(uint64_t length);
-bool userland_prepare_exit(syscall_frame_t* frame, uint64_t exit_code);
+
+/**
+ * @brief Maps @p length bytes into the current program, paged in when
+ * first touched.
+ *
+ * @param addr Where, if @p fixed; whatever was mapped there goes first.
+ * Otherwise the lowest free range of the mmap window is used.
+ * @param flags Page flags once present.
+ * @param shared MAP_SHARED: writes reach the file (on munmap or exit) and
+ * the pages stay shared with forked children.
+ * @param file File to map from @p offset (page aligned), NULL for zeroed
+ * memory. The mapping takes its own reference.
+ * @return The address, 0 if there is no room or no memory.
+ */
+uint64_t userland_mmap(uint64_t addr, uint64_t length, uint64_t flags, bool shared, bool fixed,
+                       user_file_t* file, uint64_t offset);
+
+/**
+ * @brief Unmaps the mmap()ed pages in [addr, addr + length) and frees them,
+ * writing changed MAP_SHARED pages back to their file first.
+ *
+ * @return 0 on success, -1 if out of memory to split a mapping.
+ */
+int userland_munmap(uint64_t addr, uint64_t length);
+
+/**
+ * @brief Registers [start, end) of the current program to be paged in from
+ * its executable, see user_region_t.
+ *
+ * @return 0 on success, -1 if the region table is full.
+ */
+int userland_map_lazy(uint64_t start, uint64_t end, uint64_t flags, uint64_t file_offset, uint64_t file_size);
+
+/**
+ * @brief Gives the current program the open executable its regions are
+ * read from; it is closed with userland_state_release().
+ *
+ * @return 0 on success, -1 if out of memory, leaving @p file to the caller.
+ */
+int userland_set_image(struct vfs_file* file);
+
+/**
+ * @brief Sets up the process state of a program started from scratch; its
+ * descriptors are copied from the calling task.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int userland_state_init(userland_state_t* state);
+
+/**
+ * @brief Closes the executable and forgets the regions and mappings of
+ * @p state. Does not unmap anything, so it is safe on a task that is not
+ * running.
+ */
+void userland_state_release(userland_state_t* state);
+
+/**
+ * @brief Closes the descriptors of @p state, once its program is done.
+ */
+void userland_state_close_files(userland_state_t* state);
+
+/**
+ * @brief Gives a forked child the layout and descriptors of its parent; the
+ * two then share the executable, the mapped and the open files. The child
+ * starts without children of its own.
+ *
+ * @return 0 on success, -1 if out of memory, leaving @p child empty.
+ */
+int userland_state_fork(userland_state_t* child, const userland_state_t* parent);
+
+/**
+ * @brief Maps the page at @p addr if the current program owns it but it
+ * was not touched yet: image and mapped file pages come from the page
+ * cache, stack, heap and anonymous mmap pages come zeroed. A write to a
+ * copy-on-write page copies it.
+ *
+ * @param err_code Page fault error code.
+ * @return true if the faulting access can be retried.
+ */
+bool userland_handle_page_fault(uint64_t addr, uint64_t err_code);
+
+/**
+ * @brief Opens or closes the span in which the kernel reads and writes the
+ * running program's memory on its behalf: syscalls and loading an image.
+ * Kernel page faults are only paged in inside it; anywhere else a kernel
+ * access to a user address is a bug. Closed again before ring 3 is entered.
+ */
+void userland_set_user_access(bool open);
+bool userland_user_access(void);
+
+/**
+ * @brief Pages in [addr, addr + len) ahead of a driver copying into it
+ * with locks held, where a fault could not be served.
+ *
+ * @param write Also copy copy-on-write pages, which DMA would write
+ * through.
+ */
+void userland_prefault(uint64_t addr, uint64_t len, bool write);
+
+/**
+ * @brief Tears down the running program and ends its task.
+ *
+ * @param exit_code Status reported to whoever waits on the task.
+ */
+void userland_exit(int exit_code) __attribute__((noreturn));
 bool userland_is_running(void);
 void userland_abort_from_exception(uint64_t int_no, uint64_t err_code, uint64_t fault_rip) __attribute__((noreturn));
 void sh_exec(void);
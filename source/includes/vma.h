@@ -0,0 +1,119 @@
+/**
+ * @file vma.h
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Memory areas of a program (mmap), kept in a tree ordered by address.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#ifndef VMA_H
+#define VMA_H
+
+#include <basics.h>
+#include <stdbool.h>
+
+struct vfs_file;
+
+/**
+ * @brief An open file pages are read from, shared by the programs forked
+ * off one another and closed with the last of them.
+ */
+typedef struct user_file {
+    struct vfs_file* file;
+    uint32_t refs;
+} user_file_t;
+
+/**
+ * @brief Takes over @p file (kmalloc'd and open) as a shared file.
+ *
+ * @return The shared file with one reference, NULL if out of memory, in
+ * which case @p file stays with the caller.
+ */
+user_file_t* user_file_create(struct vfs_file* file);
+void user_file_get(user_file_t* file);
+
+/**
+ * @brief Drops a reference; the last one closes and frees the file.
+ */
+void user_file_put(user_file_t* file);
+
+/*
+ * One mapping, [start, end) page aligned. Pages are filled in when first
+ * touched: from the file for bytes in [start, file_end), zeroed otherwise.
+ * Nodes form a treap keyed by start, with priorities hashed from it, so a
+ * program that maps at rising addresses still gets a balanced tree.
+ */
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;             // page flags once present
+    bool shared;                // MAP_SHARED: kept shared across fork, written back
+    user_file_t* file;          // NULL for anonymous memory
+    uint64_t file_offset;       // where start is in the file
+    uint64_t file_end;          // end of the file bytes, start if anonymous
+
+    uint32_t prio;
+    struct vma* left;
+    struct vma* right;
+} vma_t;
+
+/**
+ * @brief Allocates a node for [start, end), not linked into any tree.
+ *
+ * @param file Taken with one more reference if not NULL.
+ * @return The node, NULL if out of memory.
+ */
+vma_t* vma_create(uint64_t start, uint64_t end, uint64_t flags, bool shared,
+                  user_file_t* file, uint64_t file_offset, uint64_t file_end);
+
+/**
+ * @brief Links @p vma into @p root. It must not overlap any mapping there.
+ */
+void vma_insert(vma_t** root, vma_t* vma);
+
+/**
+ * @brief Unlinks @p vma from @p root and frees it.
+ */
+void vma_remove(vma_t** root, vma_t* vma);
+
+/**
+ * @brief The mapping holding @p addr, NULL if none.
+ */
+vma_t* vma_find(vma_t* root, uint64_t addr);
+
+/**
+ * @brief The lowest mapping that ends above @p addr, NULL if none; walks
+ * the tree in order from vma_first(root, 0) and vma_first(root, vma->end).
+ */
+vma_t* vma_first(vma_t* root, uint64_t addr);
+
+/**
+ * @brief Cuts @p vma in two at @p at, which must lie inside it.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int vma_split(vma_t** root, vma_t* vma, uint64_t at);
+
+/**
+ * @brief Lowest free range of @p len bytes in [lo, hi).
+ *
+ * @return Its start, 0 if there is none.
+ */
+uint64_t vma_find_gap(vma_t* root, uint64_t lo, uint64_t hi, uint64_t len);
+
+/**
+ * @brief Copies a whole tree for fork(); the copies share the files.
+ *
+ * @param out Receives the copy.
+ * @return 0 on success, -1 if out of memory, with nothing left allocated.
+ */
+int vma_clone(const vma_t* root, vma_t** out);
+
+/**
+ * @brief Frees every node of a tree. Does not unmap anything.
+ */
+void vma_destroy(vma_t* root);
+
+#endif
@@ -13,10 +13,23 @@
 #include <basics.h>
 #include <graphics.h>
 #include <filesystems/iso9660.h>
+#include <filesystems/dcache.h>
+#include <filesystems/page_cache.h>
+#include <filesystems/mount_trie.h>
 #include <nvme.h>
+#include <disk/bio.h>
 #include <memory.h>
 #include <disk/gpt.h>
 #include <disk/mbr.h>
+#include <spinlock.h>
+#include <multitasking.h>
+#include <timer.h>
+#include <lapic.h>
+#include <pci.h>
+#include <cpuid2.h>
+#include <isr.h>
+#include <hal.h>
+#include <paging.h>
 
 ahci_port_mem_t port_mem[32];
 ahci_hba_mem_t* global_ahci_ctrl;
@@ -41,6 +54,11 @@ static inline void ahci_unlock_port_io(int portno)
     __sync_lock_release(&ahci_port_io_lock[portno]);
 }
 
+static inline uint64_t ahci_phys(const void* ptr)
+{
+    return virtual_to_physical((uint64_t)(uintptr_t)ptr);
+}
+
 static int ahci_find_free_slot(ahci_port_t* port)
 {
     uint32_t slots = port->sact | port->ci;
@@ -53,10 +71,9 @@ static int ahci_find_free_slot(ahci_port_t* port)
     return -1; // no free slot
 }
 
-static int ahci_read_sector_raw(int portno, uint64_t lba, void* buffer, uint32_t count);
-static int ahci_write_sector_raw(int portno, uint64_t lba, void* buffer, uint32_t count);
 static int ahci_read_satapi_sector_raw(int portno, uint64_t lba, void* buffer, uint32_t count);
 static int ahci_satapi_read_capacity(int portno, uint32_t* out_last_lba, uint32_t* out_block_size);
+static void ahci_queue_setup(int portno, const uint16* id);
 
 int block_register_device(
     block_device_type_t type,
@@ -108,15 +125,22 @@ const char* block_get_device_name(int device_id)
     return dev->name;
 }
 
-int block_read_sector(int device_id, uint64_t lba, void* buffer, uint32_t count)
+/*
+ * Disks with 512 byte sectors go through their request queue (disk/bio.c),
+ * optical drives too once theirs is set up; until then they are read
+ * directly.
+ */
+static int block_read_raw(block_device_info_t* dev, uint64_t lba, void* buffer, uint32_t count)
 {
-    block_device_info_t* dev = block_get_device(device_id);
-    if (!dev || !buffer || count == 0)
-        return -1;
+    int device_id = (int)(dev - block_devices);
+    if (bio_queueable(device_id))
+        return bio_transfer(device_id, lba, buffer, count, false);
 
     switch (dev->type) {
         case BLOCK_DEVICE_AHCI:
-            return ahci_read_sector_raw(dev->backend_index, lba, buffer, count);
+            if (global_ahci_ctrl->ports[dev->backend_index].sig == satapi_disk)
+                return ahci_read_satapi_sector_raw(dev->backend_index, lba, buffer, count);
+            return -2;
         case BLOCK_DEVICE_NVME:
             return nvme_read_sector(dev->backend_index, lba, buffer, count);
         default:
@@ -124,15 +148,13 @@ int block_read_sector(int device_id, uint64_t lba, void* buffer, uint32_t count)
     }
 }
 
-int block_write_sector(int device_id, uint64_t lba, void* buffer, uint32_t count)
+static int block_write_raw(block_device_info_t* dev, uint64_t lba, void* buffer, uint32_t count)
 {
-    block_device_info_t* dev = block_get_device(device_id);
-    if (!dev || !buffer || count == 0)
-        return -1;
+    int device_id = (int)(dev - block_devices);
+    if (bio_queueable(device_id))
+        return bio_transfer(device_id, lba, buffer, count, true);
 
     switch (dev->type) {
-        case BLOCK_DEVICE_AHCI:
-            return ahci_write_sector_raw(dev->backend_index, lba, buffer, count);
         case BLOCK_DEVICE_NVME:
             return nvme_write_sector(dev->backend_index, lba, buffer, count);
         default:
@@ -140,6 +162,702 @@ int block_write_sector(int device_id, uint64_t lba, void* buffer, uint32_t count
     }
 }
 
+/*
+ * Block buffer cache. Every filesystem reads through block_read_sector(), so
+ * caching here serves FAT, ext2 and ISO9660 alike. Buffers hold an aligned
+ * run of BCACHE_BLOCK_SECTORS sectors, are found through a hash on
+ * (device, block) and are recycled least recently used first. Writes only
+ * dirty the buffer; dirty sectors reach the disk on eviction, when too many
+ * pile up, or on block_sync_all() (vfs_sync). Large transfers skip the cache
+ * so a file copy does not flush out the metadata everyone else needs, but
+ * still see, and update, what is cached.
+ *
+ * Disk waits sleep, so the cache lock is a task mutex. It is let go while a
+ * buffer is being filled (the buffer is marked busy meanwhile) and around
+ * transfers that skip the cache, so readers of different blocks overlap.
+ */
+#define BCACHE_BLOCK_SECTORS   8
+#define BCACHE_BLOCK_SIZE      (BCACHE_BLOCK_SECTORS * SECTOR_SIZE)
+#define BCACHE_MAX_BUFFERS     1024     // 4 MiB of cached data
+#define BCACHE_HASH_BUCKETS    512
+#define BCACHE_DIRTY_LIMIT     (BCACHE_MAX_BUFFERS / 4)
+#define BCACHE_BYPASS_SECTORS  64
+#define BCACHE_SYNC_BATCH      64
+#define BCACHE_PREFETCH_MAX    64       // buffers one read-ahead may claim
+
+typedef struct bcache_buf {
+    int device;
+    uint64_t block;             // first LBA / BCACHE_BLOCK_SECTORS
+    uint8_t valid;              // one bit per sector
+    uint8_t dirty;
+    bool busy;                  // being filled with the lock let go; hands off
+    uint8_t* data;
+    struct bcache_buf* hnext;
+    struct bcache_buf* lru_prev;    // towards the most recently used
+    struct bcache_buf* lru_next;
+} bcache_buf_t;
+
+static bcache_buf_t* bcache_hash[BCACHE_HASH_BUCKETS];
+static bcache_buf_t* bcache_lru_head = NULL;   // most recently used
+static bcache_buf_t* bcache_lru_tail = NULL;
+static uint32_t bcache_buffers = 0;
+static uint32_t bcache_dirty_buffers = 0;
+static block_cache_stats_t bcache_stats;
+static task_mutex_t bcache_lock = TASK_MUTEX_INIT;
+
+typedef enum {
+    BCACHE_OVERLAP_READ,        // copy what the cache has over what was read
+    BCACHE_OVERLAP_WRITE,       // about to be written: the cache takes it, dirty
+    BCACHE_OVERLAP_WRITTEN      // on disk now: clean whatever still matches
+} bcache_overlap_t;
+
+static inline uint32_t bcache_bucket(int device, uint64_t block)
+{
+    uint64_t h = (block ^ ((uint64_t)device << 56)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (BCACHE_HASH_BUCKETS - 1);
+}
+
+static inline uint8_t bcache_mask(uint32_t first, uint32_t count)
+{
+    return (uint8_t)(((1U << count) - 1) << first);
+}
+
+static void bcache_lru_unlink(bcache_buf_t* buf)
+{
+    if (buf->lru_prev)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        bcache_lru_head = buf->lru_next;
+
+    if (buf->lru_next)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        bcache_lru_tail = buf->lru_prev;
+    buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void bcache_lru_push(bcache_buf_t* buf)
+{
+    buf->lru_prev = NULL;
+    buf->lru_next = bcache_lru_head;
+    if (bcache_lru_head)
+        bcache_lru_head->lru_prev = buf;
+    else
+        bcache_lru_tail = buf;
+    bcache_lru_head = buf;
+}
+
+static bcache_buf_t* bcache_find(int device, uint64_t block)
+{
+    for (bcache_buf_t* buf = bcache_hash[bcache_bucket(device, block)]; buf; buf = buf->hnext) {
+        if (buf->device == device && buf->block == block)
+            return buf;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Steps aside for a fill or read-ahead in progress on @p device. The
+ * caller looks its buffer up again afterwards, as anything may have changed.
+ */
+static void bcache_wait_busy(int device)
+{
+    multitasking_mutex_unlock(&bcache_lock);
+    // A read-ahead has no waiter of its own to poll the disk for it.
+    bio_kick(device);
+    multitasking_yield();
+    multitasking_mutex_lock(&bcache_lock);
+}
+
+static bcache_buf_t* bcache_lookup(int device, uint64_t block)
+{
+    bcache_buf_t* buf = bcache_find(device, block);
+    if (buf && buf != bcache_lru_head) {
+        bcache_lru_unlink(buf);
+        bcache_lru_push(buf);
+    }
+    return buf;
+}
+
+static void bcache_unhash(bcache_buf_t* buf)
+{
+    bcache_buf_t** link = &bcache_hash[bcache_bucket(buf->device, buf->block)];
+    while (*link && *link != buf)
+        link = &(*link)->hnext;
+    if (*link)
+        *link = buf->hnext;
+    buf->hnext = NULL;
+}
+
+static void bcache_clear_dirty(bcache_buf_t* buf, uint8_t mask)
+{
+    if (!(buf->dirty & mask))
+        return;
+
+    buf->dirty &= (uint8_t)~mask;
+    if (!buf->dirty)
+        bcache_dirty_buffers--;
+}
+
+/**
+ * @brief Writes the dirty sectors of @p buf, one request per contiguous run.
+ */
+static int bcache_writeback(bcache_buf_t* buf)
+{
+    block_device_info_t* dev = &block_devices[buf->device];
+    uint64_t lba = buf->block * BCACHE_BLOCK_SECTORS;
+    uint32_t s = 0;
+
+    while (s < BCACHE_BLOCK_SECTORS) {
+        if (!(buf->dirty & (1U << s))) {
+            s++;
+            continue;
+        }
+
+        uint32_t end = s;
+        while (end < BCACHE_BLOCK_SECTORS && (buf->dirty & (1U << end)))
+            end++;
+
+        if (block_write_raw(dev, lba + s, buf->data + s * SECTOR_SIZE, end - s) != 0)
+            return -1;
+
+        bcache_stats.writebacks += end - s;
+        bcache_clear_dirty(buf, bcache_mask(s, end - s));
+        s = end;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes back @p n dirty buffers together. Every dirty run becomes a
+ * bio and all are queued before any is waited for, so runs that meet on the
+ * disk go out as one command. Buffers are sorted first, which lets each run
+ * join the one before it.
+ */
+static int bcache_writeback_many(bcache_buf_t** bufs, uint32_t n)
+{
+    for (uint32_t i = 1; i < n; i++) {
+        bcache_buf_t* buf = bufs[i];
+        uint32_t j = i;
+        while (j > 0 && (bufs[j - 1]->device > buf->device ||
+               (bufs[j - 1]->device == buf->device && bufs[j - 1]->block > buf->block))) {
+            bufs[j] = bufs[j - 1];
+            j--;
+        }
+        bufs[j] = buf;
+    }
+
+    // At most every other sector starts a run.
+    bio_t* bios = kmalloc(sizeof(bio_t) * n * (BCACHE_BLOCK_SECTORS / 2));
+    if (!bios) {
+        int rc = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            if (bcache_writeback(bufs[i]) != 0)
+                rc = -1;
+        }
+        return rc;
+    }
+
+    uint64_t plugged = 0;
+    uint32_t nbio = 0;
+    int rc = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        bcache_buf_t* buf = bufs[i];
+        if (!bio_queueable(buf->device)) {
+            if (bcache_writeback(buf) != 0)
+                rc = -1;
+            continue;
+        }
+        if (!(plugged & (1ULL << buf->device))) {
+            bio_plug(buf->device);
+            plugged |= 1ULL << buf->device;
+        }
+
+        for (uint32_t s = 0; s < BCACHE_BLOCK_SECTORS;) {
+            if (!(buf->dirty & (1U << s))) {
+                s++;
+                continue;
+            }
+
+            uint32_t end = s;
+            while (end < BCACHE_BLOCK_SECTORS && (buf->dirty & (1U << end)))
+                end++;
+
+            bio_t* bio = &bios[nbio];
+            memset(bio, 0, sizeof(*bio));
+            bio->device = buf->device;
+            bio->lba = buf->block * BCACHE_BLOCK_SECTORS + s;
+            bio->count = end - s;
+            bio->buffer = buf->data + s * SECTOR_SIZE;
+            bio->write = true;
+            bio->private_data = buf;
+            if (bio_submit(bio) == 0)
+                nbio++;
+            else
+                rc = -1;
+            s = end;
+        }
+    }
+
+    for (int d = 0; plugged; d++, plugged >>= 1) {
+        if (plugged & 1)
+            bio_unplug(d);
+    }
+
+    // The cache lock is held throughout, so no one dirtied these meanwhile.
+    for (uint32_t i = 0; i < nbio; i++) {
+        bio_t* bio = &bios[i];
+        if (bio_wait(bio) != 0) {
+            rc = -1;
+            continue;
+        }
+
+        bcache_buf_t* buf = bio->private_data;
+        uint32_t first = (uint32_t)(bio->lba - buf->block * BCACHE_BLOCK_SECTORS);
+        bcache_stats.writebacks += bio->count;
+        bcache_clear_dirty(buf, bcache_mask(first, bio->count));
+    }
+
+    kfree(bios);
+    return rc;
+}
+
+/**
+ * @brief A buffer for (device, block) with nothing valid in it: a new one
+ * while under the limit, else the least recently used one that is clean or
+ * can be written back. NULL if there is none.
+ */
+static bcache_buf_t* bcache_alloc(int device, uint64_t block)
+{
+    bcache_buf_t* buf = NULL;
+
+    if (bcache_buffers < BCACHE_MAX_BUFFERS) {
+        buf = kmalloc(sizeof(*buf));
+        uint8_t* data = buf ? kmalloc(BCACHE_BLOCK_SIZE) : NULL;
+        if (data) {
+            memset(buf, 0, sizeof(*buf));
+            buf->data = data;
+            bcache_buffers++;
+        } else if (buf) {
+            kfree(buf);
+            buf = NULL;
+        }
+    }
+
+    if (!buf) {
+        for (bcache_buf_t* victim = bcache_lru_tail; victim; victim = victim->lru_prev) {
+            if (victim->busy)
+                continue;
+            if (victim->dirty && bcache_writeback(victim) != 0)
+                continue;
+
+            buf = victim;
+            bcache_lru_unlink(buf);
+            bcache_unhash(buf);
+            bcache_stats.evictions++;
+            break;
+        }
+        if (!buf)
+            return NULL;
+    }
+
+    buf->device = device;
+    buf->block = block;
+    buf->valid = 0;
+    buf->dirty = 0;
+    buf->busy = false;
+
+    uint32_t bucket = bcache_bucket(device, block);
+    buf->hnext = bcache_hash[bucket];
+    bcache_hash[bucket] = buf;
+    bcache_lru_push(buf);
+    return buf;
+}
+
+/**
+ * @brief Reads the sectors of @p buf that are not valid yet. The whole block
+ * is read, which prefetches the neighbours of the sector asked for. The lock
+ * is let go during the read.
+ */
+static int bcache_fill(block_device_info_t* dev, bcache_buf_t* buf)
+{
+    uint64_t lba = buf->block * BCACHE_BLOCK_SECTORS;
+    uint32_t count = BCACHE_BLOCK_SECTORS;
+
+    if (dev->total_sectors) {
+        if (lba >= dev->total_sectors)
+            return -1;
+        if (dev->total_sectors - lba < count)
+            count = (uint32_t)(dev->total_sectors - lba);
+    }
+
+    uint8_t all = bcache_mask(0, count);
+    if ((buf->valid & all) == all)
+        return 0;
+
+    // Some sectors may have been written without being read; keep those.
+    uint8_t* tmp = NULL;
+    if (buf->valid != 0) {
+        tmp = kmalloc(count * SECTOR_SIZE);
+        if (!tmp)
+            return -1;
+    }
+
+    buf->busy = true;
+    multitasking_mutex_unlock(&bcache_lock);
+    int rc = block_read_raw(dev, lba, tmp ? tmp : buf->data, count);
+    multitasking_mutex_lock(&bcache_lock);
+    buf->busy = false;
+
+    if (rc == 0) {
+        for (uint32_t s = 0; tmp && s < count; s++) {
+            if (!(buf->valid & (1U << s)))
+                memcpy(buf->data + s * SECTOR_SIZE, tmp + s * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        buf->valid = all;
+    }
+
+    if (tmp)
+        kfree(tmp);
+    return rc == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Writes back the oldest dirty buffers until at most half the limit
+ * is left dirty.
+ */
+static void bcache_balance_dirty(void)
+{
+    bcache_buf_t* batch[BCACHE_SYNC_BATCH];
+
+    while (bcache_dirty_buffers > BCACHE_DIRTY_LIMIT / 2) {
+        uint32_t n = 0;
+        for (bcache_buf_t* buf = bcache_lru_tail; buf && n < BCACHE_SYNC_BATCH; buf = buf->lru_prev) {
+            if (buf->dirty && !buf->busy)
+                batch[n++] = buf;
+        }
+        if (n == 0 || bcache_writeback_many(batch, n) != 0)
+            break;
+    }
+}
+
+static int bcache_read(int device_id, block_device_info_t* dev, uint64_t lba, uint8_t* out, uint32_t count)
+{
+    while (count > 0) {
+        uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+        uint32_t first = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - first;
+        if (n > count)
+            n = count;
+        uint8_t want = bcache_mask(first, n);
+
+        bcache_buf_t* buf = bcache_lookup(device_id, block);
+        if (buf && buf->busy) {
+            bcache_wait_busy(device_id);
+            continue;
+        }
+
+        if (buf && (buf->valid & want) == want) {
+            bcache_stats.hits++;
+        } else {
+            bcache_stats.misses++;
+            if (!buf)
+                buf = bcache_alloc(device_id, block);
+
+            if (!buf) {
+                // Everything is dirty and the disk refuses writes; go around.
+                if (block_read_raw(dev, lba, out, n) != 0)
+                    return -1;
+                goto next;
+            }
+            if (bcache_fill(dev, buf) != 0 || (buf->valid & want) != want)
+                return -1;
+        }
+
+        memcpy(out, buf->data + first * SECTOR_SIZE, n * SECTOR_SIZE);
+next:
+        lba += n;
+        out += n * SECTOR_SIZE;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int bcache_write(int device_id, block_device_info_t* dev, uint64_t lba, const uint8_t* in, uint32_t count)
+{
+    while (count > 0) {
+        uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+        uint32_t first = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+        uint32_t n = BCACHE_BLOCK_SECTORS - first;
+        if (n > count)
+            n = count;
+        uint8_t mask = bcache_mask(first, n);
+
+        bcache_buf_t* buf = bcache_lookup(device_id, block);
+        if (buf && buf->busy) {
+            bcache_wait_busy(device_id);
+            continue;
+        }
+        if (!buf)
+            buf = bcache_alloc(device_id, block);
+
+        if (!buf) {
+            if (block_write_raw(dev, lba, (void*)in, n) != 0)
+                return -1;
+        } else {
+            memcpy(buf->data + first * SECTOR_SIZE, in, n * SECTOR_SIZE);
+            if (!buf->dirty)
+                bcache_dirty_buffers++;
+            buf->valid |= mask;
+            buf->dirty |= mask;
+        }
+
+        lba += n;
+        in += n * SECTOR_SIZE;
+        count -= n;
+    }
+
+    if (bcache_dirty_buffers > BCACHE_DIRTY_LIMIT)
+        bcache_balance_dirty();
+    return 0;
+}
+
+/**
+ * @brief Cached sectors inside [lba, lba + count) of a transfer that skips
+ * the cache. The cache always holds the newest copy of what it has valid,
+ * so a read picks that up. A write is put in the cache as dirty before it
+ * goes out, so an eviction racing it cannot put older data back on disk,
+ * and is marked clean once it has landed.
+ */
+static void bcache_overlap(int device_id, uint64_t lba, uint8_t* data, uint32_t count, bcache_overlap_t mode)
+{
+    uint64_t end = lba + count;
+
+    for (uint64_t block = lba / BCACHE_BLOCK_SECTORS; block * BCACHE_BLOCK_SECTORS < end; block++) {
+        bcache_buf_t* buf = bcache_find(device_id, block);
+        while (buf && buf->busy && mode == BCACHE_OVERLAP_WRITE) {
+            bcache_wait_busy(device_id);
+            buf = bcache_find(device_id, block);
+        }
+        if (!buf)
+            continue;
+
+        uint64_t base = block * BCACHE_BLOCK_SECTORS;
+        for (uint32_t s = 0; s < BCACHE_BLOCK_SECTORS; s++) {
+            uint64_t sector = base + s;
+            uint8_t bit = (uint8_t)(1U << s);
+            if (sector < lba || sector >= end)
+                continue;
+
+            uint8_t* disk = data + (sector - lba) * SECTOR_SIZE;
+            uint8_t* cached = buf->data + s * SECTOR_SIZE;
+            switch (mode) {
+                case BCACHE_OVERLAP_READ:
+                    if (buf->valid & bit)
+                        memcpy(disk, cached, SECTOR_SIZE);
+                    break;
+                case BCACHE_OVERLAP_WRITE:
+                    memcpy(cached, disk, SECTOR_SIZE);
+                    if (!buf->dirty)
+                        bcache_dirty_buffers++;
+                    buf->valid |= bit;
+                    buf->dirty |= bit;
+                    break;
+                case BCACHE_OVERLAP_WRITTEN:
+                    if ((buf->dirty & bit) && !buf->busy && memcmp(cached, disk, SECTOR_SIZE) == 0)
+                        bcache_clear_dirty(buf, bit);
+                    break;
+            }
+        }
+    }
+}
+
+static bool bcache_usable(const block_device_info_t* dev)
+{
+    return dev->sector_size == SECTOR_SIZE;
+}
+
+int block_read_sector(int device_id, uint64_t lba, void* buffer, uint32_t count)
+{
+    block_device_info_t* dev = block_get_device(device_id);
+    if (!dev || !buffer || count == 0)
+        return -1;
+
+    if (!bcache_usable(dev))
+        return block_read_raw(dev, lba, buffer, count);
+
+    int rc;
+    if (count >= BCACHE_BYPASS_SECTORS) {
+        rc = block_read_raw(dev, lba, buffer, count);
+        multitasking_mutex_lock(&bcache_lock);
+        bcache_stats.bypassed++;
+        if (rc == 0)
+            bcache_overlap(device_id, lba, buffer, count, BCACHE_OVERLAP_READ);
+    } else {
+        multitasking_mutex_lock(&bcache_lock);
+        rc = bcache_read(device_id, dev, lba, buffer, count);
+    }
+    multitasking_mutex_unlock(&bcache_lock);
+    return rc;
+}
+
+int block_write_sector(int device_id, uint64_t lba, void* buffer, uint32_t count)
+{
+    block_device_info_t* dev = block_get_device(device_id);
+    if (!dev || !buffer || count == 0)
+        return -1;
+
+    if (!bcache_usable(dev))
+        return block_write_raw(dev, lba, buffer, count);
+
+    int rc;
+    multitasking_mutex_lock(&bcache_lock);
+    if (count >= BCACHE_BYPASS_SECTORS) {
+        bcache_stats.bypassed++;
+        bcache_overlap(device_id, lba, buffer, count, BCACHE_OVERLAP_WRITE);
+        multitasking_mutex_unlock(&bcache_lock);
+
+        rc = block_write_raw(dev, lba, buffer, count);
+
+        multitasking_mutex_lock(&bcache_lock);
+        if (rc == 0)
+            bcache_overlap(device_id, lba, buffer, count, BCACHE_OVERLAP_WRITTEN);
+    } else {
+        rc = bcache_write(device_id, dev, lba, buffer, count);
+    }
+    multitasking_mutex_unlock(&bcache_lock);
+    return rc;
+}
+
+/**
+ * @brief A read-ahead landed: the buffer takes what arrived and is free
+ * again. Runs in interrupt context, where the buffer is still ours as it
+ * is busy.
+ */
+static void bcache_prefetch_done(bio_t* bio)
+{
+    bcache_buf_t* buf = bio->private_data;
+    if (bio->status == 0)
+        buf->valid = bcache_mask(0, bio->count);
+    __atomic_store_n(&buf->busy, false, __ATOMIC_RELEASE);
+    kfree(bio);
+}
+
+int block_prefetch(int device_id, uint64_t lba, uint32_t count)
+{
+    block_device_info_t* dev = block_get_device(device_id);
+    if (!dev || count == 0 || !bcache_usable(dev) || !bio_queueable(device_id))
+        return -1;
+
+    uint64_t end = lba + count;
+    if (dev->total_sectors && end > dev->total_sectors)
+        end = dev->total_sectors;
+
+    bcache_buf_t* bufs[BCACHE_PREFETCH_MAX];
+    uint32_t n = 0;
+
+    multitasking_mutex_lock(&bcache_lock);
+
+    // Buffers are claimed before anything is queued: claiming one may write
+    // another back and wait for it, which must not happen while plugged.
+    for (uint64_t block = lba / BCACHE_BLOCK_SECTORS;
+         block * BCACHE_BLOCK_SECTORS < end && n < BCACHE_PREFETCH_MAX; block++) {
+        if (bcache_find(device_id, block))
+            continue;
+
+        bcache_buf_t* buf = bcache_alloc(device_id, block);
+        if (!buf)
+            break;
+        buf->busy = true;
+        bufs[n++] = buf;
+    }
+
+    bio_plug(device_id);
+    for (uint32_t i = 0; i < n; i++) {
+        bcache_buf_t* buf = bufs[i];
+        uint64_t first = buf->block * BCACHE_BLOCK_SECTORS;
+        uint32_t sectors = BCACHE_BLOCK_SECTORS;
+        if (dev->total_sectors && dev->total_sectors - first < sectors)
+            sectors = (uint32_t)(dev->total_sectors - first);
+
+        bio_t* bio = kmalloc(sizeof(*bio));
+        if (bio) {
+            memset(bio, 0, sizeof(*bio));
+            bio->device = device_id;
+            bio->lba = first;
+            bio->count = sectors;
+            bio->buffer = buf->data;
+            bio->end_io = bcache_prefetch_done;
+            bio->private_data = buf;
+        }
+        if (!bio || bio_submit(bio) != 0) {
+            if (bio)
+                kfree(bio);
+            buf->busy = false;
+            continue;
+        }
+        bcache_stats.prefetched += sectors;
+    }
+    bio_unplug(device_id);
+
+    multitasking_mutex_unlock(&bcache_lock);
+    return 0;
+}
+
+int block_sync_all(void)
+{
+    bcache_buf_t* batch[BCACHE_SYNC_BATCH];
+    int rc = 0;
+
+    multitasking_mutex_lock(&bcache_lock);
+    for (;;) {
+        uint32_t n = 0;
+        int busy = -1;
+
+        for (bcache_buf_t* buf = bcache_lru_head; buf && n < BCACHE_SYNC_BATCH; buf = buf->lru_next) {
+            if (!buf->dirty)
+                continue;
+            if (buf->busy)
+                busy = buf->device;
+            else
+                batch[n++] = buf;
+        }
+
+        if (n == 0) {
+            if (busy < 0)
+                break;
+            bcache_wait_busy(busy);
+            continue;
+        }
+
+        // A failed write stays dirty; stop rather than retry it forever.
+        if (bcache_writeback_many(batch, n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    multitasking_mutex_unlock(&bcache_lock);
+
+    return rc;
+}
+
+void block_get_cache_stats(block_cache_stats_t* out)
+{
+    if (!out)
+        return;
+
+    multitasking_mutex_lock(&bcache_lock);
+    *out = bcache_stats;
+    out->buffers = bcache_buffers;
+    out->max_buffers = BCACHE_MAX_BUFFERS;
+    out->buffer_bytes = BCACHE_BLOCK_SIZE;
+    out->dirty = bcache_dirty_buffers;
+    multitasking_mutex_unlock(&bcache_lock);
+}
+
 void detect_ahci_devices(ahci_hba_mem_t* ahci_ctrl) {
     global_ahci_ctrl = ahci_ctrl;
 
@@ -197,6 +915,9 @@ void handle_satapi_disk(int portno) {
         total_sectors_512 = blocks * (block_size / SECTOR_SIZE);
     }
 
+    // From here on reads are queued like a disk's, read-ahead included.
+    ahci_queue_setup(portno, NULL);
+
     ahci_disks[portno].present = 1;
     ahci_disks[portno].total_sectors = total_sectors_512;
     ahci_disks[portno].logical_device = block_register_device(
@@ -244,6 +965,8 @@ void handle_sata_disk(int portno) {
         return;
     }
 
+    ahci_queue_setup(portno, id);
+
     uint64_t sectors = ((uint64_t)id[103] << 48) | ((uint64_t)id[102] << 32) | ((uint64_t)id[101] << 16) | ((uint64_t)id[100]);
 
     ahci_disks[portno].total_sectors = sectors;
@@ -379,6 +1102,16 @@ mount_entry_t* add_mount(const char* mount_point, const char* part_name, partiti
 
     mounted_partition_count++;    // track number of mounts
 
+    if (mount_trie_insert(new_mount) != 0) {
+        printf("mount: out of memory");
+        mounted_partition_count--;
+        kfree(new_mount->mount_point);
+        kfree(new_mount->part_name);
+        memset(new_mount, 0, sizeof(mount_entry_t));
+        mount_trie_rebuild();
+        return NULL;
+    }
+
     return new_mount;
 }
 
@@ -392,6 +1125,10 @@ int remove_mount(const char* mount_point)
 
         if (strcmp(m->mount_point, mount_point) == 0) {
 
+            /* Its fs may be freed and its memory reused by a later mount */
+            vfs_dcache_drop_fs(m->fs);
+            page_cache_drop_fs(m->fs);
+
             /* Free allocated strings */
             if (m->mount_point)
                 kfree(m->mount_point);
@@ -409,6 +1146,9 @@ int remove_mount(const char* mount_point)
             memset(&mounted_partitions[mounted_partition_count], 0,
                    sizeof(mount_entry_t));
 
+            /* Entries moved, so the trie's pointers are redone */
+            mount_trie_rebuild();
+
             return 0;
         }
     }
@@ -420,12 +1160,7 @@ int remove_mount(const char* mount_point)
 
 mount_entry_t* find_mount_by_point(const char* mount_point)
 {
-    for(int i = 0; i < mounted_partition_count; i++){
-        if(strcmp(mounted_partitions[i].mount_point, mount_point) == 0){
-            return &mounted_partitions[i];
-        }
-    }
-    return NULL; // not found
+    return mount_trie_find(mount_point);
 }
 
 void list_all_mounts(void)
@@ -454,19 +1189,19 @@ void ahci_init_port(int portno) {
 
     mem->cmd_list = kmalloc_aligned(1024, 1024);
     memset(mem->cmd_list, 0, 1024);
-    port->clb  = (uint32_t)(uintptr_t)mem->cmd_list;
-    port->clbu = 0;
+    port->clb  = (uint32_t)ahci_phys(mem->cmd_list);
+    port->clbu = (uint32_t)(ahci_phys(mem->cmd_list) >> 32);
 
     mem->fis = kmalloc_aligned(256, 256);
     memset(mem->fis, 0, 256);
-    port->fb = (uint32_t)(uintptr_t)mem->fis;
-    port->fbu = 0;
+    port->fb = (uint32_t)ahci_phys(mem->fis);
+    port->fbu = (uint32_t)(ahci_phys(mem->fis) >> 32);
 
     for (int i = 0; i < 32; i++) {
         mem->cmd_tables[i] = kmalloc_aligned(sizeof(ahci_cmd_table_t), 128);
         memset(mem->cmd_tables[i], 0, sizeof(ahci_cmd_table_t));
-        mem->cmd_list[i].ctba = (uint32_t)(uintptr_t)mem->cmd_tables[i];
-        mem->cmd_list[i].ctbau = 0;
+        mem->cmd_list[i].ctba = (uint32_t)ahci_phys(mem->cmd_tables[i]);
+        mem->cmd_list[i].ctbau = (uint32_t)(ahci_phys(mem->cmd_tables[i]) >> 32);
     }
 
     port->serr = 0xFFFFFFFF;
@@ -486,160 +1221,534 @@ static int __attribute__((unused)) ahci_wait_slot0_ready(ahci_port_t* port)
     return -1;
 }
 
-static int ahci_read_sector_raw(int portno, uint64_t lba, void* buffer, uint32_t count)
+/*
+ * SATA command queues. A request takes a command slot as soon as one is free
+ * and the drive accepts more: up to its NCQ queue depth with FPDMA QUEUED
+ * commands, one at a time otherwise. Finished slots are reaped by the port
+ * interrupt or by a polling waiter, whichever gets there first. An error or
+ * a stuck command stops the port; the next waiter resets it, outside the
+ * lock, and what was in flight is retried once.
+ */
+#define AHCI_IO_TIMEOUT_NS     (5 * TIMER_NS_PER_SEC)
+#define AHCI_WAIT_SLICE_NS     (10 * TIMER_NS_PER_MS)   // look again in case an interrupt got lost
+#define AHCI_PORT_IE_MASK      (AHCI_PORT_IS_DHRS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERRORS)
+
+typedef struct {
+    spinlock_t lock;
+    bool active;
+    bool atapi;                 // reads only, as READ(12) packets
+    bool ncq;
+    uint32_t depth;             // commands the drive takes at once
+    uint32_t slots;             // command slots the HBA implements
+    uint32_t inflight;          // issued and not reaped yet
+    uint32_t nr_inflight;
+    ahci_request_t* slot_req[32];
+    ahci_request_t* pending_head;
+    ahci_request_t* pending_tail;
+    int recover_status;         // port stopped, reset owed; aborted slots get this
+    bool resetting;             // a waiter is resetting the port
+} ahci_port_queue_t;
+
+typedef struct {
+    ahci_request_t* req;
+    int status;
+} ahci_done_t;
+
+static ahci_port_queue_t ahci_queues[32];
+static bool ahci_msi = false;
+
+static void ahci_queue_setup(int portno, const uint16* id)
 {
-    int rc = 0;
-    void* dma_buf = NULL;
-    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
-    ahci_port_mem_t* mem = &port_mem[portno];
+    ahci_port_queue_t* q = &ahci_queues[portno];
+    uint32_t cap = global_ahci_ctrl->cap;
+    uint32_t nslots = ((cap >> 8) & 0x1F) + 1;
+
+    q->slots = nslots == 32 ? 0xFFFFFFFFU : (1U << nslots) - 1;
+    q->atapi = id == NULL;
+    q->ncq = id && (cap & AHCI_CAP_SNCQ) && (id[76] & (1U << 8));
+    q->depth = 1;
+    if (q->ncq) {
+        q->depth = (uint32_t)(id[75] & 0x1F) + 1;
+        if (q->depth > nslots)
+            q->depth = nslots;
+    }
+    q->active = true;
 
-    ahci_lock_port_io(portno);
+    if (ahci_msi)
+        global_ahci_ctrl->ports[portno].ie = AHCI_PORT_IE_MASK;
 
-    while (port->tfd & (0x80 | 0x08)); // BSY | DRQ
+    if (q->ncq)
+        printf("[AHCI] Port %d: NCQ, queue depth %u", portno, q->depth);
+}
 
-    int slot = ahci_find_free_slot(port);
-    if (slot < 0) {
-        rc = -1;
-        goto out;
-    }
+/* SCSI READ(12) of @p blocks 2048-byte blocks from @p lba */
+static void ahci_atapi_read12(uint8_t packet[12], uint32_t lba, uint32_t blocks)
+{
+    memset(packet, 0, 12);
+    packet[0] = 0xA8;
+    packet[2] = (uint8_t)(lba >> 24);
+    packet[3] = (uint8_t)(lba >> 16);
+    packet[4] = (uint8_t)(lba >> 8);
+    packet[5] = (uint8_t)lba;
+    packet[6] = (uint8_t)(blocks >> 24);
+    packet[7] = (uint8_t)(blocks >> 16);
+    packet[8] = (uint8_t)(blocks >> 8);
+    packet[9] = (uint8_t)blocks;
+}
+
+static void ahci_issue_locked(int portno, ahci_port_queue_t* q, uint32_t slot, ahci_request_t* req)
+{
+    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
+    ahci_port_mem_t* mem = &port_mem[portno];
 
     ahci_cmd_header_t* hdr = &mem->cmd_list[slot];
-    memset(hdr, 0, sizeof(*hdr));
-    hdr->flags = (5 & AHCI_CMD_HDR_CFL_MASK); // CFL = 5 DWORDS
-    hdr->prdtl = 1;
-    hdr->ctba = (uint32_t)(uintptr_t)mem->cmd_tables[slot];
-    hdr->ctbau = 0;
+    hdr->flags = (5 & AHCI_CMD_HDR_CFL_MASK) | (req->write ? AHCI_CMD_HDR_W_BIT : 0); // CFL = 5 DWORDS
+    hdr->prdtl = (uint16_t)req->nprd;
+    hdr->prdbc = 0;
+    hdr->ctba = (uint32_t)ahci_phys(mem->cmd_tables[slot]);
+    hdr->ctbau = (uint32_t)(ahci_phys(mem->cmd_tables[slot]) >> 32);
 
     ahci_cmd_table_t* tbl = mem->cmd_tables[slot];
     memset(tbl->cfis, 0, 64);
-    memset(tbl->prdt, 0, sizeof(tbl->prdt));
-
-    dma_buf = kmalloc_aligned(count * 512, 4096);
-    if (!dma_buf) {
-        rc = -10;
-        goto out;
-    }
-
-    tbl->prdt[0].dba  = (uint32_t)(uintptr_t)dma_buf;
-    tbl->prdt[0].dbau = 0;
-    tbl->prdt[0].dbc  = (count * 512 - 1) | (1U << 31);
+    memcpy(tbl->prdt, req->prd, req->nprd * sizeof(prdt_entry_t));
+    tbl->prdt[req->nprd - 1].dbc |= 1U << 31;     // interrupt once it is all moved
 
     uint8_t* cfis = tbl->cfis;
     cfis[0] = 0x27;
     cfis[1] = 1 << 7;
-    cfis[2] = READ_DMA_EXT;
 
-    cfis[4]  = (uint8_t)lba;
-    cfis[5]  = (uint8_t)(lba >> 8);
-    cfis[6]  = (uint8_t)(lba >> 16);
+    if (q->atapi) {
+        // ahci_submit() checked the request covers whole 2048-byte blocks.
+        uint32_t per = ISO9660_SECTOR_SIZE / SECTOR_SIZE;
+        hdr->flags |= AHCI_CMD_HDR_A_BIT;
+        memset(tbl->acmd, 0, sizeof(tbl->acmd));
+        ahci_atapi_read12(tbl->acmd, (uint32_t)(req->lba / per), req->count / per);
+        cfis[2] = 0xA0; // ATA PACKET command
+        goto issue;
+    }
+
+    cfis[4]  = (uint8_t)req->lba;
+    cfis[5]  = (uint8_t)(req->lba >> 8);
+    cfis[6]  = (uint8_t)(req->lba >> 16);
     cfis[7]  = 0x40;
-    cfis[8]  = (uint8_t)(lba >> 24);
-    cfis[9]  = (uint8_t)(lba >> 32);
-    cfis[10] = (uint8_t)(lba >> 40);
+    cfis[8]  = (uint8_t)(req->lba >> 24);
+    cfis[9]  = (uint8_t)(req->lba >> 32);
+    cfis[10] = (uint8_t)(req->lba >> 40);
+
+    if (q->ncq) {
+        // FPDMA QUEUED: the count moves to the feature registers and the
+        // tag takes its place.
+        cfis[2]  = req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        cfis[3]  = (uint8_t)req->count;
+        cfis[11] = (uint8_t)(req->count >> 8);
+        cfis[12] = (uint8_t)(slot << 3);
+    } else {
+        cfis[2]  = req->write ? ATA_CMD_WRITE_DMA_EXT : READ_DMA_EXT;
+        cfis[12] = (uint8_t)req->count;
+        cfis[13] = (uint8_t)(req->count >> 8);
+    }
 
-    cfis[12] = count & 0xFF;
-    cfis[13] = (count >> 8) & 0xFF;
+issue:
+    req->slot = (uint8_t)slot;
+    req->issued_ns = timer_now_ns();
+
+    __sync_synchronize();
+    if (q->ncq)
+        port->sact = 1U << slot;
+    port->ci = 1U << slot;
+}
+
+/**
+ * @brief Issues waiting requests while there are free slots and the drive
+ * takes more.
+ */
+static void ahci_start_locked(int portno, ahci_port_queue_t* q)
+{
+    if (q->recover_status)
+        return;
+
+    while (q->pending_head && q->nr_inflight < q->depth) {
+        uint32_t free = q->slots & ~q->inflight;
+        if (!free)
+            break;
+
+        ahci_request_t* req = q->pending_head;
+        q->pending_head = req->next;
+        if (!q->pending_head)
+            q->pending_tail = NULL;
+        req->next = NULL;
+
+        uint32_t slot = (uint32_t)__builtin_ctz(free);
+        q->slot_req[slot] = req;
+        q->inflight |= 1U << slot;
+        q->nr_inflight++;
+        ahci_issue_locked(portno, q, slot, req);
+    }
+}
+
+static void ahci_retire_locked(ahci_port_queue_t* q, uint32_t slot, int status, ahci_done_t* done, uint32_t* ndone)
+{
+    ahci_request_t* req = q->slot_req[slot];
+    q->slot_req[slot] = NULL;
+    q->inflight &= ~(1U << slot);
+    q->nr_inflight--;
+
+    if (!req)
+        return;
+
+    if (status != 0 && req->retries++ == 0) {
+        // One more go, ahead of everything else.
+        req->next = q->pending_head;
+        q->pending_head = req;
+        if (!q->pending_tail)
+            q->pending_tail = req;
+        return;
+    }
+
+    done[*ndone].req = req;
+    done[*ndone].status = status;
+    (*ndone)++;
+}
+
+/**
+ * @brief Retires every slot the HBA is done with: its bit is clear in both
+ * PxCI and, for NCQ, PxSACT.
+ */
+static void ahci_reap_locked(int portno, ahci_port_queue_t* q, ahci_done_t* done, uint32_t* ndone)
+{
+    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
+    uint32_t finished = q->inflight & ~(port->ci | port->sact);
+
+    while (finished) {
+        uint32_t slot = (uint32_t)__builtin_ctz(finished);
+        finished &= finished - 1;
+        ahci_retire_locked(q, slot, 0, done, ndone);
+    }
+}
+
+/**
+ * @brief Stops the port after an error or a timeout. Nothing is issued until
+ * a waiter has reset it with ahci_reset_port(); the interrupt handler must not
+ * sit through that.
+ */
+static void ahci_stop_locked(int portno, ahci_port_queue_t* q, int status, ahci_done_t* done, uint32_t* ndone)
+{
+    // Whatever finished before the error is still good.
+    ahci_reap_locked(portno, q, done, ndone);
+
+    global_ahci_ctrl->ports[portno].cmd &= (uint32_t)~AHCI_PORT_CMD_ST;
+    q->recover_status = status;
+}
+
+/**
+ * @brief Hands finished requests back. Waiters copy read data themselves,
+ * in their own address space; callbacks get it copied here.
+ */
+static void ahci_finish(ahci_done_t* done, uint32_t ndone)
+{
+    for (uint32_t i = 0; i < ndone; i++) {
+        ahci_request_t* req = done[i].req;
+
+        if (req->complete) {
+            if (req->dma) {
+                if (done[i].status == 0 && !req->write)
+                    memcpy(req->buffer, req->dma, req->count * SECTOR_SIZE);
+                kfree(req->dma);
+                req->dma = NULL;
+            }
+            req->status = done[i].status;
+            req->complete(req);
+            continue;
+        }
+
+        // The waiter may drop the request once it sees the status, so that
+        // is written last.
+        multitasking_completion_signal(&req->done);
+        __atomic_store_n(&req->status, done[i].status, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Restarts a port ahci_stop_locked() stopped, which aborts every
+ * command still in flight. A drive that stays busy gets a COMRESET. Runs in
+ * task context without the queue lock, so it may sleep through the waits.
+ */
+static void ahci_reset_port(int portno, ahci_port_queue_t* q)
+{
+    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
+    ahci_done_t done[32];
+    uint32_t ndone = 0;
+
+    for (int i = 0; i < 500 && (port->cmd & AHCI_PORT_CMD_CR); i++)
+        multitasking_sleep_ms(1);
+
+    if (port->tfd & (0x80 | 0x08)) { // BSY | DRQ
+        port->sctl = (port->sctl & ~0xFU) | 1;
+        multitasking_sleep_ms(1);
+        port->sctl &= ~0xFU;
+        for (int i = 0; i < 500 && (port->ssts & 0xF) != AHCI_PORT_DET_PRESENT; i++)
+            multitasking_sleep_ms(1);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
 
     port->serr = 0xFFFFFFFF;
     port->is   = 0xFFFFFFFF;
+    port->cmd |= AHCI_PORT_CMD_ST;
 
-    __sync_synchronize();
-    port->ci = 1 << slot;
+    uint32_t aborted = q->inflight;
+    while (aborted) {
+        uint32_t slot = (uint32_t)__builtin_ctz(aborted);
+        aborted &= aborted - 1;
+        ahci_retire_locked(q, slot, q->recover_status, done, &ndone);
+    }
 
-    while (port->ci & (1 << slot)) {
-        if (port->tfd & (0x01 | 0x20)) {
-            rc = -2;
-            goto out;
+    q->recover_status = 0;
+    q->resetting = false;
+    ahci_start_locked(portno, q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    ahci_finish(done, ndone);
+}
+
+/**
+ * @brief Reaps a port and issues what is pending. Runs from its interrupt and
+ * from waiters (@p check_timeout), which also look for commands that got
+ * stuck and reset a port that was stopped.
+ */
+static void ahci_port_service(int portno, bool check_timeout)
+{
+    ahci_port_queue_t* q = &ahci_queues[portno];
+    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
+    ahci_done_t done[32];
+    uint32_t ndone = 0;
+    bool reset = false;
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+
+    uint32_t is = port->is;
+    port->is = is;
+
+    if (q->recover_status) {
+        // Stopped; the reset retires everything in flight.
+    } else if (is & AHCI_PORT_IS_ERRORS) {
+        ahci_stop_locked(portno, q, -2, done, &ndone);
+    } else {
+        ahci_reap_locked(portno, q, done, &ndone);
+
+        if (check_timeout) {
+            uint64_t now = timer_now_ns();
+            for (uint32_t busy = q->inflight; busy; busy &= busy - 1) {
+                ahci_request_t* req = q->slot_req[__builtin_ctz(busy)];
+                if (req && now - req->issued_ns > AHCI_IO_TIMEOUT_NS) {
+                    ahci_stop_locked(portno, q, -3, done, &ndone);
+                    break;
+                }
+            }
         }
     }
 
-    port->is = 0xFFFFFFFF;
+    if (check_timeout && q->recover_status && !q->resetting) {
+        q->resetting = true;
+        reset = true;
+    }
 
-out:
-    if (dma_buf) {
-        if (rc == 0)
-            memcpy(buffer, dma_buf, count * 512);
-        kfree(dma_buf);
+    ahci_start_locked(portno, q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    ahci_finish(done, ndone);
+    if (reset)
+        ahci_reset_port(portno, q);
+}
+
+static void ahci_interrupt(InterruptFrame* frame)
+{
+    ahci_hba_mem_t* hba = global_ahci_ctrl;
+    uint32_t ports = hba->is;
+
+    for (uint32_t p = ports; p; p &= p - 1) {
+        int portno = __builtin_ctz(p);
+        if (ahci_queues[portno].active)
+            ahci_port_service(portno, false);
+        else
+            hba->ports[portno].is = hba->ports[portno].is;
     }
-    ahci_unlock_port_io(portno);
-    return rc;
+    hba->is = ports;
+
+    lapic_eoi();
+    multitasking_on_device_irq(frame && (frame->cs & 0x3) == 0x3);
 }
 
-static int ahci_write_sector_raw(int portno, uint64_t lba, void* buffer, uint32_t count)
+void ahci_enable_interrupts(uint8_t bus, uint8_t slot, uint8_t func)
 {
-    int rc = 0;
-    void* dma_buf = NULL;
-    ahci_port_t* port = &global_ahci_ctrl->ports[portno];
-    ahci_port_mem_t* mem = &port_mem[portno];
+    if (!global_ahci_ctrl)
+        return;
 
-    ahci_lock_port_io(portno);
+    // Probing runs before the LAPIC driver is up; CPUID has the boot CPU's ID.
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
 
-    while (port->tfd & (0x80 | 0x08)); // BSY | DRQ
+    registerInterruptHandler(AHCI_MSI_VECTOR, ahci_interrupt);
+    if (!pci_enable_msi(bus, slot, func, AHCI_MSI_VECTOR, ebx >> 24)) {
+        warn("[AHCI] No MSI, completing requests by polling", __FILE__);
+        return;
+    }
 
-    int slot = ahci_find_free_slot(port);
-    if (slot < 0) {
-        rc = -1;
-        goto out;
+    for (int i = 0; i < 32; i++) {
+        if (!ahci_queues[i].active)
+            continue;
+        global_ahci_ctrl->ports[i].is = 0xFFFFFFFF;
+        global_ahci_ctrl->ports[i].ie = AHCI_PORT_IE_MASK;
     }
 
-    ahci_cmd_header_t* hdr = &mem->cmd_list[slot];
-    memset(hdr, 0, sizeof(*hdr));
-    hdr->flags = (5 & AHCI_CMD_HDR_CFL_MASK) | AHCI_CMD_HDR_W_BIT;
-    hdr->prdtl = 1;
-    hdr->ctba = (uint32_t)(uintptr_t)mem->cmd_tables[slot];
-    hdr->ctbau = 0;
+    global_ahci_ctrl->is = 0xFFFFFFFF;
+    global_ahci_ctrl->ghc |= AHCI_GHC_IE;
+    ahci_msi = true;
+    done("[AHCI] Completion interrupts through MSI", __FILE__);
+}
 
-    ahci_cmd_table_t* tbl = mem->cmd_tables[slot];
-    memset(tbl->cfis, 0, 64);
-    memset(tbl->prdt, 0, sizeof(tbl->prdt));
+void ahci_poll(int portno)
+{
+    if (portno >= 0 && portno < 32 && ahci_queues[portno].active)
+        ahci_port_service(portno, true);
+}
 
-    dma_buf = kmalloc_aligned(count * 512, 4096);
-    if (!dma_buf) {
-        rc = -10;
-        goto out;
+bool ahci_interrupts_enabled(void)
+{
+    return ahci_msi;
+}
+
+/**
+ * @brief Describes up to @p bytes of @p buffer in PRD entries, one per run
+ * of physically contiguous pages. Stops early where the HBA cannot go:
+ * unmapped or odd addresses, memory above 4 GiB without 64-bit DMA, or a
+ * full table.
+ *
+ * @return Bytes covered from the start of @p buffer.
+ */
+static uint32_t ahci_map_sg(const void* buffer, uint32_t bytes, prdt_entry_t* prd, uint32_t* nprd)
+{
+    uint64_t va = (uint64_t)(uintptr_t)buffer;
+    bool dma64 = (global_ahci_ctrl->cap & AHCI_CAP_S64A) != 0;
+    uint32_t covered = 0;
+    uint32_t n = 0;
+
+    while (covered < bytes) {
+        uint64_t pa = virtual_to_physical(va + covered);
+        uint32_t chunk = (uint32_t)(PAGE_SIZE - ((va + covered) & (PAGE_SIZE - 1)));
+        if (chunk > bytes - covered)
+            chunk = bytes - covered;
+
+        if (pa == 0 || (pa & 1) || (!dma64 && pa + chunk > 0x100000000ULL))
+            break;
+
+        if (n > 0) {
+            prdt_entry_t* last = &prd[n - 1];
+            uint64_t last_pa = ((uint64_t)last->dbau << 32) | last->dba;
+            uint32_t last_len = (last->dbc & 0x3FFFFF) + 1;
+            if (last_pa + last_len == pa && last_len + chunk <= PRDT_MAX_BYTES) {
+                last->dbc += chunk;
+                covered += chunk;
+                continue;
+            }
+        }
+
+        if (n == AHCI_MAX_PRDT)
+            break;
+
+        prd[n].dba = (uint32_t)pa;
+        prd[n].dbau = (uint32_t)(pa >> 32);
+        prd[n].reserved = 0;
+        prd[n].dbc = chunk - 1;
+        n++;
+        covered += chunk;
     }
-    memcpy(dma_buf, buffer, count * 512);
 
-    tbl->prdt[0].dba  = (uint32_t)(uintptr_t)dma_buf;
-    tbl->prdt[0].dbau = 0;
-    tbl->prdt[0].dbc  = (count * 512 - 1) | (1U << 31);
+    *nprd = n;
+    return covered;
+}
 
-    uint8_t* cfis = tbl->cfis;
-    cfis[0] = 0x27;
-    cfis[1] = 1 << 7;
-    cfis[2] = ATA_CMD_WRITE_DMA_EXT;
+uint32_t ahci_dma_sectors(const void* buffer, uint32_t count)
+{
+    prdt_entry_t prd[AHCI_MAX_PRDT];
+    uint32_t nprd;
 
-    cfis[4]  = (uint8_t)lba;
-    cfis[5]  = (uint8_t)(lba >> 8);
-    cfis[6]  = (uint8_t)(lba >> 16);
-    cfis[7]  = 0x40;
-    cfis[8]  = (uint8_t)(lba >> 24);
-    cfis[9]  = (uint8_t)(lba >> 32);
-    cfis[10] = (uint8_t)(lba >> 40);
+    if (count > AHCI_REQ_MAX_SECTORS)
+        count = AHCI_REQ_MAX_SECTORS;
+    return ahci_map_sg(buffer, count * SECTOR_SIZE, prd, &nprd) / SECTOR_SIZE;
+}
 
-    cfis[12] = count & 0xFF;
-    cfis[13] = (count >> 8) & 0xFF;
+int ahci_submit(int portno, ahci_request_t* req)
+{
+    if (!global_ahci_ctrl || portno < 0 || portno >= 32 || !req || !req->buffer)
+        return -1;
 
-    port->serr = 0xFFFFFFFF;
-    port->is   = 0xFFFFFFFF;
+    ahci_port_queue_t* q = &ahci_queues[portno];
+    if (!q->active || req->count == 0 || req->count > AHCI_REQ_MAX_SECTORS)
+        return -1;
 
-    __sync_synchronize();
-    port->ci = 1 << slot;
+    uint32_t per = ISO9660_SECTOR_SIZE / SECTOR_SIZE;
+    if (q->atapi && (req->write || req->lba % per != 0 || req->count % per != 0))
+        return -1;
 
-    while (port->ci & (1 << slot)) {
-        if (port->tfd & (0x01 | 0x20)) {
-            rc = -3;
-            goto out;
+    uint32_t bytes = req->count * SECTOR_SIZE;
+
+    req->dma = NULL;
+    if (ahci_map_sg(req->buffer, bytes, req->prd, &req->nprd) != bytes) {
+        if (req->count > AHCI_BOUNCE_MAX_SECTORS)
+            return -1;
+
+        req->dma = kmalloc_aligned(bytes, 4096);
+        if (!req->dma)
+            return -10;
+        if (ahci_map_sg(req->dma, bytes, req->prd, &req->nprd) != bytes) {
+            kfree(req->dma);
+            req->dma = NULL;
+            return -10;
         }
+        if (req->write)
+            memcpy(req->dma, req->buffer, bytes);
     }
 
-    port->is = 0xFFFFFFFF;
+    req->status = AHCI_REQ_PENDING;
+    req->retries = 0;
+    req->next = NULL;
+    multitasking_completion_init(&req->done);
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->pending_tail)
+        q->pending_tail->next = req;
+    else
+        q->pending_head = req;
+    q->pending_tail = req;
+    ahci_start_locked(portno, q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    return 0;
+}
 
-out:
-    if (dma_buf)
-        kfree(dma_buf);
-    ahci_unlock_port_io(portno);
-    return rc;
+int ahci_wait(int portno, ahci_request_t* req)
+{
+    for (;;) {
+        int status = __atomic_load_n(&req->status, __ATOMIC_ACQUIRE);
+        if (status != AHCI_REQ_PENDING) {
+            if (req->dma) {
+                if (status == 0 && !req->write)
+                    memcpy(req->buffer, req->dma, req->count * SECTOR_SIZE);
+                kfree(req->dma);
+                req->dma = NULL;
+            }
+            return status;
+        }
+
+        ahci_port_service(portno, true);
+        if (__atomic_load_n(&req->status, __ATOMIC_ACQUIRE) != AHCI_REQ_PENDING)
+            continue;
+
+        // Sleeps until the interrupt, or polls while there is none yet.
+        if (!ahci_msi || !multitasking_completion_wait(&req->done, AHCI_WAIT_SLICE_NS))
+            __asm__ __volatile__("pause");
+    }
 }
 
 int ahci_identify(int portno, void* buffer)
@@ -663,8 +1772,8 @@ int ahci_identify(int portno, void* buffer)
     memset(hdr, 0, sizeof(*hdr));
     hdr->flags = (5 & AHCI_CMD_HDR_CFL_MASK); // CFL = 5 DWORDS
     hdr->prdtl = 1;
-    hdr->ctba = (uint32_t)(uintptr_t)mem->cmd_tables[slot];
-    hdr->ctbau = 0;
+    hdr->ctba = (uint32_t)ahci_phys(mem->cmd_tables[slot]);
+    hdr->ctbau = (uint32_t)(ahci_phys(mem->cmd_tables[slot]) >> 32);
 
     ahci_cmd_table_t* tbl = mem->cmd_tables[slot];
     memset(tbl->cfis, 0, 64);
@@ -676,8 +1785,8 @@ int ahci_identify(int portno, void* buffer)
         goto out;
     }
 
-    tbl->prdt[0].dba  = (uint32_t)(uintptr_t)dma_buf;
-    tbl->prdt[0].dbau = 0;
+    tbl->prdt[0].dba  = (uint32_t)ahci_phys(dma_buf);
+    tbl->prdt[0].dbau = (uint32_t)(ahci_phys(dma_buf) >> 32);
     tbl->prdt[0].dbc  = (512 - 1) | (1U << 31);
 
     uint8_t* cfis = tbl->cfis;
@@ -715,12 +1824,24 @@ int ahci_read_sector(int portno, uint64_t lba, void* buffer, uint32_t count)
     if (!global_ahci_ctrl || portno < 0 || portno >= 32)
         return -1;
 
+    // Through the block layer, so optical media share the buffer cache.
     if (global_ahci_ctrl->ports[portno].sig == satapi_disk)
-        return ahci_read_satapi_sector_raw(portno, lba, buffer, count);
+        return block_read_sector(ahci_disks[portno].logical_device, lba, buffer, count);
     
     return block_read_sector(portno, lba, buffer, count);
 }
 
+int ahci_prefetch_sectors(int portno, uint64_t lba, uint32_t count)
+{
+    if (!global_ahci_ctrl || portno < 0 || portno >= 32)
+        return -1;
+
+    if (global_ahci_ctrl->ports[portno].sig == satapi_disk)
+        return block_prefetch(ahci_disks[portno].logical_device, lba, count);
+
+    return block_prefetch(portno, lba, count);
+}
+
 int ahci_write_sector(int portno, uint64_t lba, void* buffer, uint32_t count)
 {
     return block_write_sector(portno, lba, buffer, count);
@@ -749,16 +1870,16 @@ static int ahci_issue_packet_command(
     if (write)
         hdr->flags |= AHCI_CMD_HDR_W_BIT;
     hdr->prdtl = 1;
-    hdr->ctba = (uint32_t)(uintptr_t)mem->cmd_tables[slot];
-    hdr->ctbau = 0;
+    hdr->ctba = (uint32_t)ahci_phys(mem->cmd_tables[slot]);
+    hdr->ctbau = (uint32_t)(ahci_phys(mem->cmd_tables[slot]) >> 32);
 
     ahci_cmd_table_t* tbl = mem->cmd_tables[slot];
     memset(tbl->cfis, 0, sizeof(tbl->cfis));
     memset(tbl->acmd, 0, sizeof(tbl->acmd));
     memset(tbl->prdt, 0, sizeof(tbl->prdt));
 
-    tbl->prdt[0].dba = (uint32_t)(uintptr_t)dma_buf;
-    tbl->prdt[0].dbau = 0;
+    tbl->prdt[0].dba = (uint32_t)ahci_phys(dma_buf);
+    tbl->prdt[0].dbau = (uint32_t)(ahci_phys(dma_buf) >> 32);
     tbl->prdt[0].dbc = (byte_count - 1) | (1U << 31);
     memcpy(tbl->acmd, packet, 12);
 
@@ -802,16 +1923,7 @@ static int ahci_read_satapi_sector_raw(int portno, uint64_t lba, void* buffer, u
         return -3;
 
     uint8_t packet[12];
-    memset(packet, 0, sizeof(packet));
-    packet[0] = 0xA8; // READ(12)
-    packet[2] = (uint8_t)(atapi_lba >> 24);
-    packet[3] = (uint8_t)(atapi_lba >> 16);
-    packet[4] = (uint8_t)(atapi_lba >> 8);
-    packet[5] = (uint8_t)atapi_lba;
-    packet[6] = (uint8_t)(atapi_blocks >> 24);
-    packet[7] = (uint8_t)(atapi_blocks >> 16);
-    packet[8] = (uint8_t)(atapi_blocks >> 8);
-    packet[9] = (uint8_t)atapi_blocks;
+    ahci_atapi_read12(packet, atapi_lba, atapi_blocks);
 
     ahci_lock_port_io(portno);
     int rc = ahci_issue_packet_command(portno, packet, dma_buf, bytes, false);
@@ -52,6 +52,95 @@ void cpuid(uint32 reg, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx) {
     #endif
 }
 
+/**
+ * @brief Executes CPUID for a leaf that takes a sub-leaf in ECX.
+ *
+ * @param leaf The leaf to query (EAX).
+ * @param subleaf The sub-leaf to query (ECX).
+ * @param eax Pointer to store the value of EAX register.
+ * @param ebx Pointer to store the value of EBX register.
+ * @param ecx Pointer to store the value of ECX register.
+ * @param edx Pointer to store the value of EDX register.
+ */
+void cpuid_count(uint32 leaf, uint32 subleaf, uint32 *eax, uint32 *ebx, uint32 *ecx, uint32 *edx) {
+    #if defined (__x86_64__)
+    __asm__ volatile("cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "0" (leaf), "2" (subleaf));
+    #endif
+}
+
+/**
+ * @brief Reads leaf 7 sub-leaf 0 (structured extended features), if the CPU has it.
+ *
+ * @return no when leaf 7 is not implemented; all registers are zeroed then.
+ */
+static bool cpuid_leaf7(uint32 *ebx, uint32 *ecx, uint32 *edx) {
+    uint32 eax, b, c, d;
+    *ebx = *ecx = *edx = 0;
+
+    cpuid(0, &eax, &b, &c, &d);
+    if (eax < 7)
+        return no;
+
+    cpuid_count(7, 0, &eax, ebx, ecx, edx);
+    return yes;
+}
+
+bool cpu_has_sse2(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & (1U << 26)) != 0;
+}
+
+bool cpu_has_erms(void) {
+    uint32 ebx, ecx, edx;
+    cpuid_leaf7(&ebx, &ecx, &edx);
+    return (ebx & (1U << 9)) != 0;
+}
+
+bool cpu_has_fsrm(void) {
+    uint32 ebx, ecx, edx;
+    cpuid_leaf7(&ebx, &ecx, &edx);
+    return (edx & (1U << 4)) != 0;
+}
+
+bool cpu_has_avx(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    // AVX needs the instruction set, XSAVE turned on by the OS (OSXSAVE),
+    // and both the SSE and YMM state components enabled in XCR0.
+    if (!(ecx & (1U << 28)) || !(ecx & (1U << 27)))
+        return no;
+
+    uint32 xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    return (xcr0_lo & 0x6) == 0x6;
+}
+
+bool cpu_has_tsc_deadline(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1U << 24)) != 0;
+}
+
+bool cpu_has_pcid(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1U << 17)) != 0;
+}
+
+bool cpu_has_invariant_tsc(void) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000007)
+        return no;
+
+    cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1U << 8)) != 0;
+}
+
 /**
  * @brief Retrieve the CPU vendor string.
  * 
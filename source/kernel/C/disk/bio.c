@@ -0,0 +1,682 @@
+/**
+ * @file bio.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Block I/O requests: a queue per disk with a merge stage and a
+ * pluggable scheduler in front of the AHCI and NVMe drivers.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+
+#include <disk/bio.h>
+#include <ahci.h>
+#include <nvme.h>
+#include <heap.h>
+#include <memory.h>
+#include <strings.h>
+#include <spinlock.h>
+#include <timer.h>
+
+/*
+ * Every bio lands in a request. Requests wait in the queue of their disk
+ * until the scheduler hands them to the driver; while they wait, bios for
+ * the sectors right before or after join them, so a run of small
+ * filesystem writes leaves as one command. A request whose bios do not sit
+ * back to back in memory is gathered into a staging buffer.
+ *
+ * Completion runs from the driver's callback, in interrupt context or in
+ * whichever waiter polled the driver. It finishes the bios of the request
+ * and hands the next requests to the driver.
+ */
+#define BIO_READ_EXPIRE_NS     (500 * TIMER_NS_PER_MS)
+#define BIO_WRITE_EXPIRE_NS    (5 * TIMER_NS_PER_SEC)
+#define BIO_WAIT_SLICE_NS      (10 * TIMER_NS_PER_MS)   // look again in case an interrupt got lost
+#define BIO_TRANSFER_BATCH     8
+#define BIO_STAGE_SECTORS      256
+#define BIO_KERNEL_HALF        0xFFFF800000000000ULL
+
+typedef struct bio_queue bio_queue_t;
+
+typedef struct bio_request {
+    bio_queue_t* q;
+    uint64_t lba;
+    uint32_t count;
+    bool write;
+    uint64_t deadline_ns;       // earliest of its bios
+    bio_t* head;                // bios in LBA order
+    bio_t* tail;
+    void* stage;                // gathered data, NULL when head->buffer is used
+    struct bio_request* fifo_prev;
+    struct bio_request* fifo_next;
+    struct bio_request* sort_prev;
+    struct bio_request* sort_next;
+    union {
+        ahci_request_t ahci;
+        nvme_request_t nvme;
+    } cmd;
+} bio_request_t;
+
+typedef struct bio_scheduler {
+    const char* name;
+    void (*add)(bio_queue_t* q, bio_request_t* rq);
+    void (*remove)(bio_queue_t* q, bio_request_t* rq);
+    bio_request_t* (*pick)(bio_queue_t* q, uint64_t now);
+} bio_scheduler_t;
+
+struct bio_queue {
+    spinlock_t lock;
+    int device;
+    const bio_scheduler_t* sched;
+    bio_request_t* fifo_head;   // every queued request, oldest first
+    bio_request_t* fifo_tail;
+    bio_request_t* sorted;      // deadline: queued requests by LBA
+    uint64_t next_lba;          // deadline: where the sweep goes on
+    uint32_t plugged;
+    uint64_t busy_since;
+    bio_stats_t stats;
+};
+
+static bio_queue_t bio_queues[MAX_BLOCK_DEVICES];
+static spinlock_t bio_setup_lock = SPINLOCK_INIT;
+
+/* noop: arrival order; merging still applies. */
+
+static void noop_add(bio_queue_t* q, bio_request_t* rq)
+{
+    (void)q;
+    (void)rq;
+}
+
+static void noop_remove(bio_queue_t* q, bio_request_t* rq)
+{
+    (void)q;
+    (void)rq;
+}
+
+static bio_request_t* noop_pick(bio_queue_t* q, uint64_t now)
+{
+    (void)now;
+    return q->fifo_head;
+}
+
+/*
+ * deadline: one-way sweeps in LBA order, except that a request past its
+ * deadline goes first. Reads expire sooner, as someone is waiting on them.
+ */
+
+static void deadline_add(bio_queue_t* q, bio_request_t* rq)
+{
+    bio_request_t* prev = NULL;
+    bio_request_t* cur = q->sorted;
+
+    while (cur && cur->lba < rq->lba) {
+        prev = cur;
+        cur = cur->sort_next;
+    }
+
+    rq->sort_prev = prev;
+    rq->sort_next = cur;
+    if (cur)
+        cur->sort_prev = rq;
+    if (prev)
+        prev->sort_next = rq;
+    else
+        q->sorted = rq;
+}
+
+static void deadline_remove(bio_queue_t* q, bio_request_t* rq)
+{
+    if (rq->sort_prev)
+        rq->sort_prev->sort_next = rq->sort_next;
+    else
+        q->sorted = rq->sort_next;
+    if (rq->sort_next)
+        rq->sort_next->sort_prev = rq->sort_prev;
+    rq->sort_prev = rq->sort_next = NULL;
+}
+
+static bio_request_t* deadline_pick(bio_queue_t* q, uint64_t now)
+{
+    for (bio_request_t* rq = q->fifo_head; rq; rq = rq->fifo_next) {
+        if (rq->deadline_ns <= now)
+            return rq;
+    }
+
+    for (bio_request_t* rq = q->sorted; rq; rq = rq->sort_next) {
+        if (rq->lba >= q->next_lba)
+            return rq;
+    }
+    return q->sorted;   // wrap around to the lowest LBA
+}
+
+static const bio_scheduler_t bio_schedulers[] = {
+    { "noop",     noop_add,     noop_remove,     noop_pick },
+    { "deadline", deadline_add, deadline_remove, deadline_pick },
+};
+
+#define BIO_SCHED_NOOP      (&bio_schedulers[0])
+#define BIO_SCHED_DEADLINE  (&bio_schedulers[1])
+
+bool bio_queueable(int device)
+{
+    block_device_info_t* dev = block_get_device(device);
+    if (!dev || dev->sector_size != SECTOR_SIZE)
+        return false;
+
+    if (dev->type == BLOCK_DEVICE_NVME)
+        return true;
+    return dev->type == BLOCK_DEVICE_AHCI && global_ahci_ctrl;
+}
+
+/**
+ * @brief The queue of @p device, set up on first use: deadline for SATA,
+ * where seeks cost, noop for NVMe.
+ */
+static bio_queue_t* bio_queue(int device)
+{
+    bio_queue_t* q = &bio_queues[device];
+
+    if (__atomic_load_n(&q->sched, __ATOMIC_ACQUIRE))
+        return q;
+
+    uint64_t flags = spin_lock_irqsave(&bio_setup_lock);
+    if (!q->sched) {
+        q->device = device;
+        const bio_scheduler_t* sched = block_devices[device].type == BLOCK_DEVICE_NVME ? BIO_SCHED_NOOP : BIO_SCHED_DEADLINE;
+        __atomic_store_n(&q->sched, sched, __ATOMIC_RELEASE);
+    }
+    spin_unlock_irqrestore(&bio_setup_lock, flags);
+    return q;
+}
+
+static void bio_fifo_unlink(bio_queue_t* q, bio_request_t* rq)
+{
+    if (rq->fifo_prev)
+        rq->fifo_prev->fifo_next = rq->fifo_next;
+    else
+        q->fifo_head = rq->fifo_next;
+    if (rq->fifo_next)
+        rq->fifo_next->fifo_prev = rq->fifo_prev;
+    else
+        q->fifo_tail = rq->fifo_prev;
+    rq->fifo_prev = rq->fifo_next = NULL;
+}
+
+/**
+ * @brief Adds @p bio to a queued request it extends at either end, newest
+ * requests first. Returns false if none fits.
+ */
+static bool bio_merge_locked(bio_queue_t* q, bio_t* bio)
+{
+    if (bio->count > BIO_MERGE_MAX_SECTORS)
+        return false;
+
+    for (bio_request_t* rq = q->fifo_tail; rq; rq = rq->fifo_prev) {
+        if (rq->write != bio->write || rq->count + bio->count > BIO_MERGE_MAX_SECTORS)
+            continue;
+
+        if (rq->lba + rq->count == bio->lba) {
+            rq->tail->next = bio;
+            rq->tail = bio;
+        } else if (bio->lba + bio->count == rq->lba) {
+            bio->next = rq->head;
+            rq->head = bio;
+            rq->lba = bio->lba;
+        } else {
+            continue;
+        }
+
+        rq->count += bio->count;
+        if (bio->deadline_ns < rq->deadline_ns)
+            rq->deadline_ns = bio->deadline_ns;
+        q->stats.merges++;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Data buffer of @p rq for the driver: the bios' own memory when it
+ * is one piece, else a staging buffer, filled here for writes.
+ */
+static void* bio_request_buffer(bio_request_t* rq)
+{
+    uint8_t* expect = rq->head->buffer;
+    for (bio_t* bio = rq->head; bio; bio = bio->next) {
+        if (bio->buffer != expect)
+            break;
+        expect += bio->count * SECTOR_SIZE;
+        if (!bio->next)
+            return rq->head->buffer;
+    }
+
+    rq->stage = kmalloc_aligned(rq->count * SECTOR_SIZE, 4096);
+    if (!rq->stage)
+        return NULL;
+
+    if (rq->write) {
+        uint8_t* p = rq->stage;
+        for (bio_t* bio = rq->head; bio; bio = bio->next) {
+            memcpy(p, bio->buffer, bio->count * SECTOR_SIZE);
+            p += bio->count * SECTOR_SIZE;
+        }
+    }
+    return rq->stage;
+}
+
+static void bio_request_end(bio_request_t* rq, int status);
+static void bio_queue_run(bio_queue_t* q);
+
+static void bio_ahci_done(ahci_request_t* req)
+{
+    bio_request_t* rq = req->private_data;
+    bio_request_end(rq, req->status);
+    bio_queue_run(rq->q);
+}
+
+static void bio_nvme_done(nvme_request_t* req)
+{
+    bio_request_t* rq = req->private_data;
+    bio_request_end(rq, req->status);
+    bio_queue_run(rq->q);
+}
+
+static int bio_dispatch(bio_request_t* rq)
+{
+    block_device_info_t* dev = &block_devices[rq->q->device];
+    void* buffer = bio_request_buffer(rq);
+    if (!buffer)
+        return -10;
+
+    if (dev->type == BLOCK_DEVICE_NVME) {
+        nvme_request_t* req = &rq->cmd.nvme;
+        memset(req, 0, sizeof(*req));
+        req->lba = rq->lba;
+        req->count = rq->count;
+        req->buffer = buffer;
+        req->write = rq->write;
+        req->complete = bio_nvme_done;
+        req->private_data = rq;
+        return nvme_submit(dev->backend_index, req);
+    }
+
+    ahci_request_t* req = &rq->cmd.ahci;
+    memset(req, 0, sizeof(*req));
+    req->lba = rq->lba;
+    req->count = rq->count;
+    req->buffer = buffer;
+    req->write = rq->write;
+    req->complete = bio_ahci_done;
+    req->private_data = rq;
+    return ahci_submit(dev->backend_index, req);
+}
+
+/**
+ * @brief Finishes every bio of @p rq and frees it. Does not start more
+ * requests; the callers do.
+ */
+static void bio_request_end(bio_request_t* rq, int status)
+{
+    bio_queue_t* q = rq->q;
+
+    if (rq->stage) {
+        if (status == 0 && !rq->write) {
+            uint8_t* p = rq->stage;
+            for (bio_t* bio = rq->head; bio; bio = bio->next) {
+                memcpy(bio->buffer, p, bio->count * SECTOR_SIZE);
+                p += bio->count * SECTOR_SIZE;
+            }
+        }
+        kfree(rq->stage);
+    }
+
+    uint64_t now = timer_now_ns();
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    for (bio_t* bio = rq->head; bio; bio = bio->next) {
+        uint64_t latency = now - bio->submit_ns;
+        if (bio->write)
+            q->stats.write_ns += latency;
+        else
+            q->stats.read_ns += latency;
+        if (latency > q->stats.max_ns)
+            q->stats.max_ns = latency;
+    }
+    if (status != 0)
+        q->stats.errors++;
+    if (--q->stats.inflight == 0)
+        q->stats.busy_ns += now - q->busy_since;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    bio_t* bio = rq->head;
+    kfree(rq);
+
+    while (bio) {
+        // The waiter may drop the bio once it sees the status, so that is
+        // written last and the link read before.
+        bio_t* next = bio->next;
+        if (bio->end_io) {
+            bio->status = status;
+            bio->end_io(bio);
+        } else {
+            multitasking_completion_signal(&bio->done);
+            __atomic_store_n(&bio->status, status, __ATOMIC_RELEASE);
+        }
+        bio = next;
+    }
+}
+
+/**
+ * @brief Hands requests to the driver in the order the scheduler picks them,
+ * while the disk has room for more and the queue is not plugged.
+ */
+static void bio_queue_run(bio_queue_t* q)
+{
+    for (;;) {
+        uint64_t now = timer_now_ns();
+        uint64_t flags = spin_lock_irqsave(&q->lock);
+
+        bio_request_t* rq = NULL;
+        if (!q->plugged && q->stats.inflight < BIO_MAX_INFLIGHT)
+            rq = q->sched->pick(q, now);
+        if (!rq) {
+            spin_unlock_irqrestore(&q->lock, flags);
+            return;
+        }
+
+        bio_fifo_unlink(q, rq);
+        q->sched->remove(q, rq);
+        q->next_lba = rq->lba + rq->count;
+        q->stats.queued--;
+        if (q->stats.inflight++ == 0)
+            q->busy_since = now;
+        q->stats.requests++;
+        spin_unlock_irqrestore(&q->lock, flags);
+
+        int rc = bio_dispatch(rq);
+        if (rc != 0)
+            bio_request_end(rq, rc);
+    }
+}
+
+int bio_submit(bio_t* bio)
+{
+    if (!bio || !bio->buffer || bio->count == 0 || !bio_queueable(bio->device))
+        return -1;
+
+    bio_queue_t* q = bio_queue(bio->device);
+    uint64_t now = timer_now_ns();
+
+    bio->status = BIO_PENDING;
+    bio->next = NULL;
+    bio->submit_ns = now;
+    bio->deadline_ns = now + (bio->write ? BIO_WRITE_EXPIRE_NS : BIO_READ_EXPIRE_NS);
+    multitasking_completion_init(&bio->done);
+
+    // Allocated before the queue lock, which keeps interrupts off.
+    bio_request_t* rq = kmalloc(sizeof(*rq));
+    if (!rq)
+        return -10;
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+
+    if (bio->write) {
+        q->stats.writes++;
+        q->stats.write_sectors += bio->count;
+    } else {
+        q->stats.reads++;
+        q->stats.read_sectors += bio->count;
+    }
+
+    if (bio_merge_locked(q, bio)) {
+        spin_unlock_irqrestore(&q->lock, flags);
+        kfree(rq);
+    } else {
+        memset(rq, 0, sizeof(*rq));
+        rq->q = q;
+        rq->lba = bio->lba;
+        rq->count = bio->count;
+        rq->write = bio->write;
+        rq->deadline_ns = bio->deadline_ns;
+        rq->head = rq->tail = bio;
+
+        rq->fifo_prev = q->fifo_tail;
+        if (q->fifo_tail)
+            q->fifo_tail->fifo_next = rq;
+        else
+            q->fifo_head = rq;
+        q->fifo_tail = rq;
+        q->sched->add(q, rq);
+        q->stats.queued++;
+        spin_unlock_irqrestore(&q->lock, flags);
+    }
+
+    bio_queue_run(q);
+    return 0;
+}
+
+static void bio_poll(int device)
+{
+    block_device_info_t* dev = &block_devices[device];
+    if (dev->type == BLOCK_DEVICE_NVME)
+        nvme_poll(dev->backend_index);
+    else
+        ahci_poll(dev->backend_index);
+}
+
+static bool bio_has_interrupts(int device)
+{
+    block_device_info_t* dev = &block_devices[device];
+    if (dev->type == BLOCK_DEVICE_NVME)
+        return nvme_interrupts_enabled(dev->backend_index);
+    return ahci_interrupts_enabled();
+}
+
+int bio_wait(bio_t* bio)
+{
+    bio_queue_t* q = bio_queue(bio->device);
+
+    for (;;) {
+        int status = __atomic_load_n(&bio->status, __ATOMIC_ACQUIRE);
+        if (status != BIO_PENDING)
+            return status;
+
+        bio_poll(bio->device);
+        bio_queue_run(q);
+        if (__atomic_load_n(&bio->status, __ATOMIC_ACQUIRE) != BIO_PENDING)
+            continue;
+
+        // Sleeps until the interrupt, or polls while there is none yet.
+        if (!bio_has_interrupts(bio->device) || !multitasking_completion_wait(&bio->done, BIO_WAIT_SLICE_NS))
+            __asm__ __volatile__("pause");
+    }
+}
+
+void bio_kick(int device)
+{
+    if (!bio_queueable(device))
+        return;
+
+    bio_poll(device);
+    bio_queue_run(bio_queue(device));
+}
+
+void bio_plug(int device)
+{
+    if (!bio_queueable(device))
+        return;
+
+    bio_queue_t* q = bio_queue(device);
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    q->plugged++;
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+void bio_unplug(int device)
+{
+    if (!bio_queueable(device))
+        return;
+
+    bio_queue_t* q = bio_queue(device);
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->plugged)
+        q->plugged--;
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    bio_queue_run(q);
+}
+
+/*
+ * The heap and the higher half are mapped alike in every address space;
+ * anything else may not be there when the completion runs.
+ */
+static bool bio_kernel_buffer(const void* buffer, uint32_t bytes)
+{
+    uint64_t start = (uint64_t)(uintptr_t)buffer;
+    if (start >= BIO_KERNEL_HALF)
+        return true;
+    return start >= heap_begin && start + bytes <= heap_end;
+}
+
+/**
+ * @brief Sectors of @p buffer that one command can take without a bounce,
+ * or what the driver can always bounce.
+ */
+static uint32_t bio_chunk_sectors(int device, const void* buffer, uint32_t count)
+{
+    block_device_info_t* dev = &block_devices[device];
+    uint32_t chunk = dev->type == BLOCK_DEVICE_NVME
+        ? nvme_dma_sectors(dev->backend_index, buffer, count)
+        : ahci_dma_sectors(buffer, count);
+
+    if (chunk == 0)
+        chunk = count < BIO_MERGE_MAX_SECTORS ? count : BIO_MERGE_MAX_SECTORS;
+    return chunk;
+}
+
+static int bio_transfer_staged(int device, uint64_t lba, uint8_t* buffer, uint32_t count, bool write)
+{
+    uint32_t max = count < BIO_STAGE_SECTORS ? count : BIO_STAGE_SECTORS;
+    uint8_t* stage = kmalloc_aligned(max * SECTOR_SIZE, 4096);
+    if (!stage)
+        return -10;
+
+    int rc = 0;
+    while (count > 0 && rc == 0) {
+        uint32_t chunk = count < max ? count : max;
+
+        if (write)
+            memcpy(stage, buffer, chunk * SECTOR_SIZE);
+        rc = bio_transfer(device, lba, stage, chunk, write);
+        if (rc == 0 && !write)
+            memcpy(buffer, stage, chunk * SECTOR_SIZE);
+
+        lba += chunk;
+        buffer += chunk * SECTOR_SIZE;
+        count -= chunk;
+    }
+
+    kfree(stage);
+    return rc;
+}
+
+int bio_transfer(int device, uint64_t lba, void* buffer, uint32_t count, bool write)
+{
+    if (!bio_queueable(device) || !buffer)
+        return -1;
+
+    if (!bio_kernel_buffer(buffer, count * SECTOR_SIZE))
+        return bio_transfer_staged(device, lba, buffer, count, write);
+
+    bio_t bios[BIO_TRANSFER_BATCH];
+    uint8_t* p = buffer;
+    int rc = 0;
+
+    while (count > 0 && rc == 0) {
+        uint32_t n = 0;
+
+        // Plugged, so the batch reaches the scheduler whole.
+        bio_plug(device);
+        while (n < BIO_TRANSFER_BATCH && count > 0) {
+            uint32_t chunk = bio_chunk_sectors(device, p, count);
+            bio_t* bio = &bios[n];
+
+            memset(bio, 0, sizeof(*bio));
+            bio->device = device;
+            bio->lba = lba;
+            bio->count = chunk;
+            bio->buffer = p;
+            bio->write = write;
+
+            rc = bio_submit(bio);
+            if (rc != 0)
+                break;
+
+            n++;
+            lba += chunk;
+            p += chunk * SECTOR_SIZE;
+            count -= chunk;
+        }
+        bio_unplug(device);
+
+        for (uint32_t i = 0; i < n; i++) {
+            int status = bio_wait(&bios[i]);
+            if (status != 0 && rc == 0)
+                rc = status;
+        }
+    }
+
+    return rc;
+}
+
+int bio_set_scheduler(int device, const char* name)
+{
+    if (!bio_queueable(device) || !name)
+        return -1;
+
+    const bio_scheduler_t* sched = NULL;
+    for (uint32_t i = 0; i < sizeof(bio_schedulers) / sizeof(bio_schedulers[0]); i++) {
+        if (strcmp(bio_schedulers[i].name, name) == 0)
+            sched = &bio_schedulers[i];
+    }
+    if (!sched)
+        return -1;
+
+    bio_queue_t* q = bio_queue(device);
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->sched != sched) {
+        // Queued requests move over in arrival order.
+        for (bio_request_t* rq = q->fifo_head; rq; rq = rq->fifo_next)
+            q->sched->remove(q, rq);
+        q->sched = sched;
+        for (bio_request_t* rq = q->fifo_head; rq; rq = rq->fifo_next)
+            sched->add(q, rq);
+    }
+    spin_unlock_irqrestore(&q->lock, flags);
+    return 0;
+}
+
+const char* bio_scheduler_name(int index)
+{
+    if (index < 0 || index >= (int)(sizeof(bio_schedulers) / sizeof(bio_schedulers[0])))
+        return NULL;
+    return bio_schedulers[index].name;
+}
+
+bool bio_get_stats(int device, bio_stats_t* out)
+{
+    if (!out || !bio_queueable(device))
+        return false;
+
+    bio_queue_t* q = bio_queue(device);
+    uint64_t now = timer_now_ns();
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    *out = q->stats;
+    if (q->stats.inflight)
+        out->busy_ns += now - q->busy_since;
+    out->scheduler = q->sched->name;
+    spin_unlock_irqrestore(&q->lock, flags);
+    return true;
+}
@@ -17,6 +17,7 @@
 #include <filesystems/vfs.h>
 #include <paging.h>
 #include <userland.h>
+#include <filesystems/page_cache.h>
 
 static uint32_t* elf_vfs_pos_ptr(vfs_file_t* file)
 {
@@ -54,20 +55,7 @@ static int elf_vfs_seek(vfs_file_t* file, uint32_t offset)
     if (!pos)
         return -1;
 
-    if (file->mnt->type == FS_FAT32) {
-        fat32_file_t* fat32 = &file->f.fat32;
-        uint32_t cluster_size = fat32->fs->sectors_per_cluster * FAT32_SECTOR_SIZE;
-        uint32_t cluster = fat32->start_cluster;
-        uint32_t steps = cluster_size ? (offset / cluster_size) : 0;
-
-        while (steps > 0 && cluster < FAT32_CLUSTER_EOC) {
-            cluster = fat32_read_fat(fat32->fs, cluster);
-            steps--;
-        }
-
-        fat32->current_cluster = cluster;
-    }
-
+    // FAT32 reads find the cluster for the new position themselves.
     *pos = offset;
     return 0;
 }
@@ -81,7 +69,7 @@ static int elf_vfs_read_exact(vfs_file_t* file, uint32_t offset, void* buf, uint
     return (rd >= 0 && (uint32_t)rd == size) ? 0 : -1;
 }
 
-static int elf_vfs_read_exact_path(const char* path, uint32_t offset, void* buf, uint32_t size)
+__attribute__((unused)) static int elf_vfs_read_exact_path(const char* path, uint32_t offset, void* buf, uint32_t size)
 {
     vfs_file_t file;
     if (vfs_open(path, VFS_RDONLY, &file) != 0)
@@ -123,7 +111,7 @@ static int elf_load_tls_template_from_memory(void* file_base_address, uint64_t f
     return 0;
 }
 
-__attribute__((unused)) static int elf_load_tls_template_from_vfs(const char* path, elf_image_info_t* info)
+static int elf_load_tls_template_from_vfs(vfs_file_t* file, elf_image_info_t* info)
 {
     if (!info || info->tls_filesz == 0)
         return 0;
@@ -134,7 +122,7 @@ __attribute__((unused)) static int elf_load_tls_template_from_vfs(const char* pa
         return -1;
     }
 
-    if (elf_vfs_read_exact_path(path, (uint32_t)info->tls_offset, info->tls_template, (uint32_t)info->tls_filesz) != 0) {
+    if (elf_read_image(file, info->tls_offset, info->tls_template, (uint32_t)info->tls_filesz) != 0) {
         eprintf("elf: failed to read TLS template");
         kfree(info->tls_template);
         info->tls_template = NULL;
@@ -398,7 +386,10 @@ static uint64_t elf_stage_phdrs_for_user(Elf64_Phdr* headers, uint64_t phdr_byte
 
     for (uint64_t off = 0; off < aligned; off += PAGE_SIZE) {
         uint64_t phys = allocate_page();
-        map_user_page(base + off, phys, USER_DATA_FLAGS);
+        if (!phys || !map_user_page(base + off, phys, USER_DATA_FLAGS)) {
+            free_page(phys);
+            return 0;
+        }
     }
 
     memset((void*)base, 0, aligned);
@@ -446,7 +437,11 @@ static int elf_map_program_header(Elf64_Phdr* ph, void* file_base, uint64_t file
 
     for (uint64_t page = seg_start; page < seg_end; page += PAGE_SIZE) {
         uint64_t phys = allocate_page();
-        map_user_page(page, phys, page_flags);
+        if (!phys || !map_user_page(page, phys, page_flags)) {
+            free_page(phys);
+            eprintf("elf: out of memory mapping a segment");
+            return -1;
+        }
     }
 
     void* segment = (void*)(load_bias + ph->p_vaddr);
@@ -461,6 +456,30 @@ static int elf_map_program_header(Elf64_Phdr* ph, void* file_base, uint64_t file
     return 0;
 }
 
+/*
+ * Hands a PT_LOAD segment to the pager: its pages are read from the file,
+ * or zeroed past p_filesz, the first time they are touched.
+ */
+static int elf_register_program_header(const Elf64_Phdr* ph, uint64_t load_bias)
+{
+    if (ph->p_type != PT_LOAD)
+        return 0;
+
+    uint64_t page_flags = PAGE_PRESENT | PAGE_USER;
+    if (ph->p_flags & PF_W)
+        page_flags |= PAGE_RW;
+    if (!(ph->p_flags & PF_X))
+        page_flags |= PAGE_NX;
+
+    uint64_t start = load_bias + ph->p_vaddr;
+    if (userland_map_lazy(start, start + ph->p_memsz, page_flags, ph->p_offset, ph->p_filesz) != 0) {
+        eprintf("elf: too many PT_LOAD segments");
+        return -1;
+    }
+
+    return 0;
+}
+
 __attribute__((unused)) static int elf_map_program_header_from_vfs(Elf64_Phdr* ph, const char* path, uint64_t file_size, uint16_t seg_index, uint64_t load_bias)
 {
     if (ph->p_type != PT_LOAD)
@@ -482,7 +501,11 @@ __attribute__((unused)) static int elf_map_program_header_from_vfs(Elf64_Phdr* p
 
     for (uint64_t page = seg_start; page < seg_end; page += PAGE_SIZE) {
         uint64_t phys = allocate_page();
-        map_user_page(page, phys, page_flags);
+        if (!phys || !map_user_page(page, phys, page_flags)) {
+            free_page(phys);
+            eprintf("elf: out of memory mapping a segment");
+            return -1;
+        }
     }
 
     // printf("elf: seg %u off=%x vaddr=%x filesz=%u memsz=%u", seg_index, ph->p_offset, load_bias + ph->p_vaddr, ph->p_filesz, ph->p_memsz);
@@ -590,34 +613,20 @@ void* elf_load_from_memory(void* file_base_address, uint64_t file_size)
     return elf_load_from_memory_ex(file_base_address, file_size, NULL);
 }
 
-void* elf_load_from_vfs_ex(const char* path, elf_image_info_t* info)
+static uint64_t elf_vfs_file_size(vfs_file_t* file)
 {
-    if (!path)
-        return NULL;
-
-    vfs_file_t file;
-    if (vfs_open(path, VFS_RDONLY, &file) != 0) {
-        eprintf("elf: failed to open %s", path);
-        return NULL;
-    }
-
-    uint64_t size = 0;
-    switch (file.mnt->type) {
+    switch (file->mnt->type) {
         case FS_FAT16:
-            size = file.f.fat16.entry.filesize;
-            break;
+            return file->f.fat16.entry.filesize;
         case FS_FAT32:
-            size = file.f.fat32.entry.file_size;
-            break;
+            return file->f.fat32.entry.file_size;
         case FS_ISO9660:
-            size = file.f.iso9660.entry.size;
-            break;
+            return file->f.iso9660.entry.size;
         case FS_UNKNOWN:
         case FS_FAT12:
         case FS_EXFAT:
         case FS_EXT2:
-            size = ((uint64_t)file.f.ext2.inode.i_size_high << 32) | file.f.ext2.inode.i_size;
-            break;
+            return ((uint64_t)file->f.ext2.inode.i_size_high << 32) | file->f.ext2.inode.i_size;
         case FS_EXT3:
         case FS_EXT4:
         case FS_XFS:
@@ -627,45 +636,176 @@ void* elf_load_from_vfs_ex(const char* path, elf_image_info_t* info)
         case FS_PROC:
         case FS_DEV:
         default:
-            vfs_close(&file);
-            return NULL;
+            return 0;
     }
+}
 
-    if (size == 0) {
-        vfs_close(&file);
-        return NULL;
+static int elf_fill_page(vfs_file_t* file, uint64_t offset, void* page)
+{
+    uint64_t size = elf_vfs_file_size(file);
+
+    memset(page, 0, PAGE_SIZE);
+    if (offset >= size)
+        return 0;
+    if (offset > UINT32_MAX)
+        return -1;
+
+    uint32_t want = size - offset < PAGE_SIZE ? (uint32_t)(size - offset) : (uint32_t)PAGE_SIZE;
+    return elf_vfs_read_exact(file, (uint32_t)offset, page, want);
+}
+
+int elf_read_image(vfs_file_t* file, uint64_t offset, void* buf, uint32_t size)
+{
+    if (!file)
+        return -1;
+    return page_cache_read(file, offset, buf, size, elf_fill_page);
+}
+
+uintptr_t elf_image_page(vfs_file_t* file, uint64_t index)
+{
+    if (!file)
+        return 0;
+    return page_cache_get(file, index, elf_fill_page);
+}
+
+int elf_open_image(const char* path, elf_image_t* image)
+{
+    if (!path || !image)
+        return -1;
+
+    memset(image, 0, sizeof(*image));
+    if (vfs_open(path, VFS_RDONLY, &image->file) != 0) {
+        eprintf("elf: failed to open %s", path);
+        return -1;
     }
 
-    Elf64_Ehdr header = {0};
-    if (elf_vfs_read_exact(&file, 0, &header, sizeof(header)) != 0) {
+    image->size = elf_vfs_file_size(&image->file);
+    if (image->size == 0) {
+        vfs_close(&image->file);
+        return -1;
+    }
+
+    if (elf_read_image(&image->file, 0, &image->header, sizeof(image->header)) != 0) {
         eprintf("elf: failed to read header");
-        vfs_close(&file);
-        return NULL;
+        vfs_close(&image->file);
+        return -1;
     }
 
-    if (elf_validate_header(&header, size) != 0) {
-        vfs_close(&file);
-        return NULL;
+    if (elf_validate_header(&image->header, image->size) != 0) {
+        vfs_close(&image->file);
+        return -1;
     }
 
-    uint8_t* file_image = kmalloc(size);
-    if (!file_image) {
-        vfs_close(&file);
-        eprintf("elf: failed to allocate file image");
-        return NULL;
+    uint32_t phdr_bytes = (uint32_t)image->header.e_phnum * image->header.e_phentsize;
+    image->phdrs = kmalloc(phdr_bytes ? phdr_bytes : 1);
+    if (!image->phdrs) {
+        vfs_close(&image->file);
+        eprintf("elf: failed to allocate program headers");
+        return -1;
     }
 
-    if (elf_vfs_read_exact(&file, 0, file_image, size) != 0) {
-        vfs_close(&file);
-        kfree(file_image);
-        eprintf("elf: failed to read file image");
+    if (elf_read_image(&image->file, image->header.e_phoff, image->phdrs, phdr_bytes) != 0) {
+        eprintf("elf: failed to read program headers");
+        elf_close_image(image);
+        return -1;
+    }
+
+    // Checked here, while exec can still return to the old program.
+    uint32_t loads = 0;
+    for (uint16_t i = 0; i < image->header.e_phnum; i++) {
+        Elf64_Phdr* ph = &image->phdrs[i];
+        if (ph->p_type != PT_LOAD)
+            continue;
+        if (ph->p_offset + ph->p_filesz > image->size || ph->p_memsz < ph->p_filesz ||
+            ++loads > USER_REGIONS_MAX) {
+            eprintf("elf: invalid PT_LOAD bounds");
+            elf_close_image(image);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void elf_close_image(elf_image_t* image)
+{
+    if (!image)
+        return;
+
+    if (image->phdrs) {
+        kfree(image->phdrs);
+        image->phdrs = NULL;
+        vfs_close(&image->file);
+    }
+}
+
+void* elf_map_image(elf_image_t* image, elf_image_info_t* info)
+{
+    if (!image || !image->phdrs)
         return NULL;
+
+    Elf64_Ehdr* header = &image->header;
+    Elf64_Phdr* headers = image->phdrs;
+    uint64_t load_bias = elf_compute_load_bias(header, headers);
+    vfs_file_t* file = NULL;
+    void* entry = NULL;
+
+    if (info)
+        memset(info, 0, sizeof(*info));
+
+    for (uint16_t i = 0; i < header->e_phnum; i++) {
+        if (info)
+            elf_record_tls_segment(&headers[i], info);
+        if (elf_register_program_header(&headers[i], load_bias) != 0)
+            goto out;
     }
-    vfs_close(&file);
 
-    void* entry = elf_load_from_memory_ex(file_image, size, info);
-    kfree(file_image);
+    // The pager reads the segments from here for as long as the program runs.
+    file = kmalloc(sizeof(vfs_file_t));
+    if (!file) {
+        eprintf("elf: failed to allocate image file");
+        goto out;
+    }
+    memcpy(file, &image->file, sizeof(vfs_file_t));
+    if (userland_set_image(file) != 0) {
+        eprintf("elf: failed to allocate image file");
+        kfree(file);
+        goto out;
+    }
+    image->phdrs = NULL;
+
+    if (info) {
+        info->entry = load_bias + header->e_entry;
+        info->phdr_addr = elf_stage_phdrs_for_user(headers, (uint64_t)header->e_phnum * header->e_phentsize);
+        if (info->phdr_addr == 0)
+            info->phdr_addr = elf_runtime_addr_for_offset(headers, header->e_phnum, header->e_phoff, load_bias);
+        info->phentsize = header->e_phentsize;
+        info->phnum = header->e_phnum;
+        if (elf_load_tls_template_from_vfs(file, info) != 0)
+            goto out_mapped;
+    }
+
+    if (elf_apply_runtime_relocations(load_bias, headers, header->e_phnum) != 0)
+        goto out_mapped;
+
+    entry = (void*)(load_bias + header->e_entry);
+
+out_mapped:
+    kfree(headers);
     return entry;
+
+out:
+    elf_close_image(image);
+    return NULL;
+}
+
+void* elf_load_from_vfs_ex(const char* path, elf_image_info_t* info)
+{
+    elf_image_t image;
+    if (elf_open_image(path, &image) != 0)
+        return NULL;
+
+    return elf_map_image(&image, info);
 }
 
 void* elf_load_from_vfs(const char* path)
@@ -0,0 +1,336 @@
+/**
+ * @file dcache.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Path lookup cache of the VFS: positive and negative entries per
+ * (filesystem, parent, name), kept until the VFS changes that part of the tree.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#include <filesystems/dcache.h>
+#include <heap.h>
+#include <memory.h>
+#include <strings.h>
+#include <multitasking.h>
+
+/*
+ * Held for a whole lookup, filesystem calls included, so an entry seen on
+ * the way down cannot be dropped under it. The VFS invalidates only after
+ * changing the disk, so whatever a lookup inserted first is dropped then.
+ */
+static task_mutex_t dcache_lock = TASK_MUTEX_INIT;
+
+static vfs_dentry_t* dcache_hash[VFS_DCACHE_BUCKETS];
+static vfs_dentry_t* dcache_lru;        // least recently used
+static vfs_dentry_t* dcache_mru;
+static uint32_t dcache_count;
+
+static inline char dcache_fold(bool fold, char c)
+{
+    return (fold && c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+// FAT and ISO 9660 match names without case.
+static inline bool dcache_folds(mount_entry_t* mnt)
+{
+    return mnt->type != FS_EXT2;
+}
+
+static uint32_t dcache_hash_name(uint32_t hash, const char* name, size_t len, bool fold)
+{
+    hash = (hash ^ '/') * 16777619u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)dcache_fold(fold, name[i])) * 16777619u;
+    return hash;
+}
+
+static uint32_t dcache_hash_fs(void* fs)
+{
+    uint64_t p = (uint64_t)fs;
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 8; i++)
+        hash = (hash ^ (uint8_t)(p >> (i * 8))) * 16777619u;
+    return hash;
+}
+
+static bool dcache_name_eq(const vfs_dentry_t* d, const char* name, size_t len, bool fold)
+{
+    if (d->name[len] != '\0')
+        return false;
+    for (size_t i = 0; i < len; i++)
+        if (dcache_fold(fold, d->name[i]) != dcache_fold(fold, name[i]))
+            return false;
+    return true;
+}
+
+/* Splits the next component off @p *path; 0 at the end */
+static size_t dcache_next(const char** path, const char** name)
+{
+    const char* p = *path;
+    while (*p == '/')
+        p++;
+    *name = p;
+    while (*p && *p != '/')
+        p++;
+    *path = p;
+    return (size_t)(p - *name);
+}
+
+static void dcache_lru_remove(vfs_dentry_t* d)
+{
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else dcache_lru = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else dcache_mru = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void dcache_lru_push(vfs_dentry_t* d)
+{
+    d->lru_prev = dcache_mru;
+    d->lru_next = NULL;
+    if (dcache_mru) dcache_mru->lru_next = d;
+    else dcache_lru = d;
+    dcache_mru = d;
+}
+
+static vfs_dentry_t* dcache_find(void* fs, vfs_dentry_t* parent, uint32_t hash,
+                                 const char* name, size_t len, bool fold)
+{
+    for (vfs_dentry_t* d = dcache_hash[hash % VFS_DCACHE_BUCKETS]; d; d = d->hash_next) {
+        if (d->hash == hash && d->fs == fs && d->parent == parent &&
+            dcache_name_eq(d, name, len, fold))
+            return d;
+    }
+    return NULL;
+}
+
+static void dcache_free(vfs_dentry_t* d)
+{
+    vfs_dentry_t** link = &dcache_hash[d->hash % VFS_DCACHE_BUCKETS];
+    while (*link != d)
+        link = &(*link)->hash_next;
+    *link = d->hash_next;
+
+    dcache_lru_remove(d);
+    if (d->parent)
+        d->parent->children--;
+    kfree(d);
+    dcache_count--;
+}
+
+/* Drops leaves, oldest first, until the cache is back in size; never @p keep */
+static void dcache_trim(vfs_dentry_t* keep)
+{
+    vfs_dentry_t* d = dcache_lru;
+    while (d && dcache_count > VFS_DCACHE_MAX) {
+        vfs_dentry_t* next = d->lru_next;
+        if (d != keep && d->children == 0)
+            dcache_free(d);
+        d = next;
+    }
+}
+
+static vfs_dentry_t* dcache_insert(void* fs, vfs_dentry_t* parent, uint32_t hash,
+                                   const char* name, size_t len, int rc, const vfs_lookup_t* info)
+{
+    vfs_dentry_t* d = kmalloc(sizeof(vfs_dentry_t));
+    if (!d)
+        return NULL;
+
+    memset(d, 0, sizeof(*d));
+    d->fs = fs;
+    d->parent = parent;
+    d->hash = hash;
+    d->negative = rc == VFS_LOOKUP_NOENT;
+    if (!d->negative)
+        d->info = *info;
+    memcpy(d->name, name, len);
+
+    d->hash_next = dcache_hash[hash % VFS_DCACHE_BUCKETS];
+    dcache_hash[hash % VFS_DCACHE_BUCKETS] = d;
+    dcache_lru_push(d);
+    if (parent)
+        parent->children++;
+    dcache_count++;
+
+    dcache_trim(d);
+    return d;
+}
+
+int vfs_dcache_lookup(mount_entry_t* mnt, const char* rel, vfs_dcache_fill_t fill, vfs_lookup_t* out)
+{
+    if (!mnt || !rel || !fill || !out)
+        return -1;
+
+    bool fold = dcache_folds(mnt);
+    uint32_t hash = dcache_hash_fs(mnt->fs);
+    vfs_dentry_t* parent = NULL;
+    vfs_dentry_t* d = NULL;
+    const char* p = rel;
+    const char* name;
+    size_t len;
+    int rc = 0;
+
+    multitasking_mutex_lock(&dcache_lock);
+
+    while ((len = dcache_next(&p, &name)) != 0) {
+        if (len >= VFS_DCACHE_NAME_MAX) {
+            rc = fill(mnt, rel, out);
+            goto out;
+        }
+
+        hash = dcache_hash_name(hash, name, len, fold);
+        d = dcache_find(mnt->fs, parent, hash, name, len, fold);
+
+        if (d) {
+            dcache_lru_remove(d);
+            dcache_lru_push(d);
+        } else {
+            char prefix[256];
+            size_t plen = (size_t)(p - rel);
+            if (plen >= sizeof(prefix)) {
+                rc = fill(mnt, rel, out);
+                goto out;
+            }
+            memcpy(prefix, rel, plen);
+            prefix[plen] = '\0';
+
+            vfs_lookup_t info;
+            rc = fill(mnt, prefix, &info);
+            if (rc != 0 && rc != VFS_LOOKUP_NOENT)
+                goto out;
+
+            d = dcache_insert(mnt->fs, parent, hash, name, len, rc, &info);
+            if (!d) {
+                // Out of memory: answer without caching.
+                rc = fill(mnt, rel, out);
+                goto out;
+            }
+        }
+
+        if (d->negative) {
+            rc = VFS_LOOKUP_NOENT;
+            goto out;
+        }
+
+        const char* rest = p;
+        while (*rest == '/')
+            rest++;
+        if (*rest && !d->info.is_dir) {
+            rc = VFS_LOOKUP_NOENT;
+            goto out;
+        }
+        parent = d;
+    }
+
+    if (!d) {
+        // The mount point itself
+        memset(out, 0, sizeof(*out));
+        out->is_dir = true;
+        rc = 0;
+    } else {
+        *out = d->info;
+        rc = 0;
+    }
+
+out:
+    multitasking_mutex_unlock(&dcache_lock);
+    return rc;
+}
+
+uint32_t vfs_dcache_hash(mount_entry_t* mnt, const char* rel)
+{
+    bool fold = dcache_folds(mnt);
+    uint32_t hash = dcache_hash_fs(mnt->fs);
+    const char* name;
+    size_t len;
+
+    while ((len = dcache_next(&rel, &name)) != 0)
+        hash = dcache_hash_name(hash, name, len, fold);
+    return hash;
+}
+
+static bool dcache_below(const vfs_dentry_t* d, const vfs_dentry_t* top)
+{
+    for (d = d->parent; d; d = d->parent)
+        if (d == top)
+            return true;
+    return false;
+}
+
+/*
+ * Drops everything below @p top (the whole filesystem if NULL). Only
+ * leaves are freed on each pass, so the parents checked stay valid.
+ */
+static void dcache_drop_below(void* fs, vfs_dentry_t* top)
+{
+    bool dropped = true;
+    while (dropped) {
+        dropped = false;
+        vfs_dentry_t* d = dcache_lru;
+        while (d) {
+            vfs_dentry_t* next = d->lru_next;
+            if (d->fs == fs && d->children == 0 && (!top || dcache_below(d, top))) {
+                dcache_free(d);
+                dropped = true;
+            }
+            d = next;
+        }
+    }
+}
+
+void vfs_dcache_invalidate(mount_entry_t* mnt, const char* rel)
+{
+    if (!mnt || !rel)
+        return;
+
+    bool fold = dcache_folds(mnt);
+    uint32_t hash = dcache_hash_fs(mnt->fs);
+    const char* name;
+    size_t len;
+
+    multitasking_mutex_lock(&dcache_lock);
+
+    // Find the parent directory; if it is not cached, nothing below it is.
+    vfs_dentry_t* parent = NULL;
+    while ((len = dcache_next(&rel, &name)) != 0) {
+        const char* rest = rel;
+        while (*rest == '/')
+            rest++;
+        if (!*rest)
+            break;
+
+        hash = dcache_hash_name(hash, name, len, fold);
+        parent = dcache_find(mnt->fs, parent, hash, name, len, fold);
+        if (!parent) {
+            multitasking_mutex_unlock(&dcache_lock);
+            return;
+        }
+    }
+
+    dcache_drop_below(mnt->fs, parent);
+    multitasking_mutex_unlock(&dcache_lock);
+}
+
+void vfs_dcache_drop_hash(void* fs, uint32_t hash)
+{
+    multitasking_mutex_lock(&dcache_lock);
+    vfs_dentry_t* d = dcache_hash[hash % VFS_DCACHE_BUCKETS];
+    while (d) {
+        vfs_dentry_t* next = d->hash_next;
+        if (d->hash == hash && d->fs == fs && d->children == 0)
+            dcache_free(d);
+        d = next;
+    }
+    multitasking_mutex_unlock(&dcache_lock);
+}
+
+void vfs_dcache_drop_fs(void* fs)
+{
+    multitasking_mutex_lock(&dcache_lock);
+    dcache_drop_below(fs, NULL);
+    multitasking_mutex_unlock(&dcache_lock);
+}
@@ -14,14 +14,15 @@
  *
  * Block size is assumed <= EXT2_MAX_BLOCK_SIZE (4096 bytes), which
  * covers the overwhelming majority of real-world ext2 filesystems and
- * keeps all I/O on fixed-size stack buffers (no heap dependency, same
- * convention as the FAT16 driver in this tree).
+ * keeps all I/O on fixed-size stack buffers (same convention as the
+ * FAT16 driver in this tree). Only the inode cache lives on the heap.
  */
 
 #include <filesystems/ext2.h>
 #include <graphics.h>
 #include <strings.h>
 #include <memory.h>
+#include <heap.h>
 
 #define EXT2_MAX_BLOCK_SIZE 4096U
 #define EXT2_PTRS_PER_BLOCK_MAX (EXT2_MAX_BLOCK_SIZE / 4)
@@ -118,6 +119,10 @@ partition_fs_type_t detect_ext2_type_enum(int portno, uint32_t partition_lba) {
     return FS_UNKNOWN;
 }
 
+static void ext2_load_inode_tables(ext2_fs_t* fs);
+static int ext2_icache_flush(ext2_fs_t* fs);
+static void ext2_icache_free(ext2_fs_t* fs, ext2_icache_entry_t* e);
+
 int ext2_mount(int portno, uint32_t partition_lba, ext2_fs_t* fs) {
     uint8_t buf[1024];
     uint32_t sb_sector = partition_lba + (EXT2_SUPERBLOCK_OFFSET / 512);
@@ -151,6 +156,9 @@ int ext2_mount(int portno, uint32_t partition_lba, ext2_fs_t* fs) {
         fs->inode_size = fs->sb.s_inode_size;
         if (fs->inode_size == 0) fs->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
         fs->has_filetype = (fs->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) != 0;
+        fs->has_dir_index = (fs->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+        if (fs->sb.s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+            fs->dx_hash_unsigned = 3;
     } else {
         fs->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
         fs->has_filetype = 0;
@@ -166,11 +174,21 @@ int ext2_mount(int portno, uint32_t partition_lba, ext2_fs_t* fs) {
     strcpy(fs->cwd_path, "/");
     fs->sb_dirty = 0;
 
+    fs->icache_lock = (task_mutex_t)TASK_MUTEX_INIT;
+    ext2_load_inode_tables(fs);
+
     return EXT2_OK;
 }
 
 void ext2_unmount(ext2_fs_t* fs) {
     if (!fs) return;
+
+    ext2_icache_flush(fs);
+    while (fs->icache_lru)
+        ext2_icache_free(fs, fs->icache_lru);
+    if (fs->inode_tables)
+        kfree(fs->inode_tables);
+
     if (fs->sb_dirty)
         ext2_write_superblock(fs);
     memset(fs, 0, sizeof(ext2_fs_t));
@@ -178,18 +196,47 @@ void ext2_unmount(ext2_fs_t* fs) {
 
 /* ===================== Inode I/O ===================== */
 
+/*
+ * Inode table locations never change, so they are read from the group
+ * descriptors once at mount instead of once per inode access.
+ */
+static void ext2_load_inode_tables(ext2_fs_t* fs) {
+    uint8_t buf[EXT2_MAX_BLOCK_SIZE];
+    uint32_t entries_per_block = fs->block_size / sizeof(ext2_group_desc_t);
+
+    uint32_t* tables = kmalloc(fs->groups_count * sizeof(uint32_t));
+    if (!tables)
+        return;
+
+    for (uint32_t group = 0; group < fs->groups_count; group++) {
+        uint32_t idx = group % entries_per_block;
+        if (idx == 0 && ext2_read_block(fs, fs->gdt_block + group / entries_per_block, buf) != EXT2_OK) {
+            kfree(tables);
+            return;
+        }
+        tables[group] = ((ext2_group_desc_t*)buf)[idx].bg_inode_table;
+    }
+    fs->inode_tables = tables;
+}
+
 static int ext2_inode_location(ext2_fs_t* fs, uint32_t ino, uint32_t* out_block, uint32_t* out_offset) {
     if (ino == 0) return EXT2_ERR_INVAL;
 
     uint32_t group = (ino - 1) / fs->inodes_per_group;
     uint32_t index = (ino - 1) % fs->inodes_per_group;
+    uint32_t table;
 
-    ext2_group_desc_t gd;
-    if (ext2_read_group_desc(fs, group, &gd) != EXT2_OK)
-        return EXT2_ERR_IO;
+    if (fs->inode_tables && group < fs->groups_count) {
+        table = fs->inode_tables[group];
+    } else {
+        ext2_group_desc_t gd;
+        if (ext2_read_group_desc(fs, group, &gd) != EXT2_OK)
+            return EXT2_ERR_IO;
+        table = gd.bg_inode_table;
+    }
 
     uint32_t inodes_per_block = fs->block_size / fs->inode_size;
-    uint32_t block = gd.bg_inode_table + (index / inodes_per_block);
+    uint32_t block = table + (index / inodes_per_block);
     uint32_t offset = (index % inodes_per_block) * fs->inode_size;
 
     *out_block = block;
@@ -197,7 +244,7 @@ static int ext2_inode_location(ext2_fs_t* fs, uint32_t ino, uint32_t* out_block,
     return EXT2_OK;
 }
 
-static int ext2_read_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* out) {
+static int ext2_read_inode_disk(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* out) {
     uint8_t buf[EXT2_MAX_BLOCK_SIZE];
     uint32_t block, offset;
 
@@ -212,7 +259,7 @@ static int ext2_read_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* out) {
     return EXT2_OK;
 }
 
-static int ext2_write_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* in) {
+static int ext2_write_inode_disk(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* in) {
     uint8_t buf[EXT2_MAX_BLOCK_SIZE];
     uint32_t block, offset;
 
@@ -230,6 +277,184 @@ static int ext2_write_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* in) {
     return EXT2_OK;
 }
 
+/* ===================== Inode cache ===================== */
+
+/*
+ * Inodes are hashed by number and kept on an LRU list. ext2_write_inode()
+ * only updates the cached copy; it reaches the disk in ext2_sync(), at
+ * unmount, or when the entry is dropped. Entries referenced by open files
+ * are never dropped, the others once the cache holds EXT2_ICACHE_MAX.
+ * Every function here expects icache_lock to be held.
+ */
+
+static void ext2_icache_lru_remove(ext2_fs_t* fs, ext2_icache_entry_t* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else fs->icache_lru = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else fs->icache_mru = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void ext2_icache_lru_push(ext2_fs_t* fs, ext2_icache_entry_t* e) {
+    e->lru_prev = fs->icache_mru;
+    e->lru_next = NULL;
+    if (fs->icache_mru) fs->icache_mru->lru_next = e;
+    else fs->icache_lru = e;
+    fs->icache_mru = e;
+}
+
+static ext2_icache_entry_t* ext2_icache_find(ext2_fs_t* fs, uint32_t ino) {
+    for (ext2_icache_entry_t* e = fs->icache[ino % EXT2_ICACHE_BUCKETS]; e; e = e->hash_next)
+        if (e->ino == ino)
+            return e;
+    return NULL;
+}
+
+static void ext2_icache_free(ext2_fs_t* fs, ext2_icache_entry_t* e) {
+    ext2_icache_entry_t** link = &fs->icache[e->ino % EXT2_ICACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->hash_next;
+    *link = e->hash_next;
+
+    ext2_icache_lru_remove(fs, e);
+    for (int level = 0; level < 3; level++)
+        if (e->memo.tbl[level])
+            kfree(e->memo.tbl[level]);
+    kfree(e);
+    fs->icache_count--;
+}
+
+static int ext2_icache_writeback(ext2_fs_t* fs, ext2_icache_entry_t* e) {
+    if (!e->dirty)
+        return EXT2_OK;
+    if (ext2_write_inode_disk(fs, e->ino, &e->inode) != EXT2_OK)
+        return EXT2_ERR_IO;
+    e->dirty = 0;
+    return EXT2_OK;
+}
+
+/* Drops unreferenced entries, oldest first, until the cache is back in size */
+static void ext2_icache_trim(ext2_fs_t* fs) {
+    ext2_icache_entry_t* e = fs->icache_lru;
+    while (e && fs->icache_count > EXT2_ICACHE_MAX) {
+        ext2_icache_entry_t* next = e->lru_next;
+        if (e->refs == 0 && ext2_icache_writeback(fs, e) == EXT2_OK)
+            ext2_icache_free(fs, e);
+        e = next;
+    }
+}
+
+/*
+ * Cache entry of @p ino, made most recently used. A missing entry is read
+ * from disk if @p load, else left for the caller to fill in. NULL on I/O
+ * error or if out of memory.
+ */
+static ext2_icache_entry_t* ext2_icache_get(ext2_fs_t* fs, uint32_t ino, int load) {
+    ext2_icache_entry_t* e = ext2_icache_find(fs, ino);
+    if (e) {
+        ext2_icache_lru_remove(fs, e);
+        ext2_icache_lru_push(fs, e);
+        return e;
+    }
+
+    e = kmalloc(sizeof(ext2_icache_entry_t));
+    if (!e)
+        return NULL;
+    memset(e, 0, sizeof(ext2_icache_entry_t));
+    e->ino = ino;
+
+    if (load && ext2_read_inode_disk(fs, ino, &e->inode) != EXT2_OK) {
+        kfree(e);
+        return NULL;
+    }
+
+    e->hash_next = fs->icache[ino % EXT2_ICACHE_BUCKETS];
+    fs->icache[ino % EXT2_ICACHE_BUCKETS] = e;
+    ext2_icache_lru_push(fs, e);
+    fs->icache_count++;
+    return e;
+}
+
+static int ext2_read_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* out) {
+    if (ino == 0) return EXT2_ERR_INVAL;
+
+    multitasking_mutex_lock(&fs->icache_lock);
+    ext2_icache_entry_t* e = ext2_icache_get(fs, ino, 1);
+    int rc = EXT2_OK;
+    if (e)
+        *out = e->inode;
+    else
+        rc = ext2_read_inode_disk(fs, ino, out);
+    ext2_icache_trim(fs);
+    multitasking_mutex_unlock(&fs->icache_lock);
+    return rc;
+}
+
+static int ext2_write_inode(ext2_fs_t* fs, uint32_t ino, ext2_inode_t* in) {
+    if (ino == 0) return EXT2_ERR_INVAL;
+
+    multitasking_mutex_lock(&fs->icache_lock);
+    ext2_icache_entry_t* e = ext2_icache_get(fs, ino, 0);
+    int rc = EXT2_OK;
+    if (e) {
+        e->inode = *in;
+        e->dirty = 1;
+    } else {
+        rc = ext2_write_inode_disk(fs, ino, in);
+    }
+    ext2_icache_trim(fs);
+    multitasking_mutex_unlock(&fs->icache_lock);
+    return rc;
+}
+
+/* Takes a reference to the cache entry of @p ino for an open file */
+static ext2_icache_entry_t* ext2_iget(ext2_fs_t* fs, uint32_t ino) {
+    multitasking_mutex_lock(&fs->icache_lock);
+    ext2_icache_entry_t* e = ext2_icache_get(fs, ino, 1);
+    if (e)
+        e->refs++;
+    multitasking_mutex_unlock(&fs->icache_lock);
+    return e;
+}
+
+static void ext2_iput(ext2_fs_t* fs, ext2_icache_entry_t* e) {
+    if (!e) return;
+    multitasking_mutex_lock(&fs->icache_lock);
+    if (e->refs)
+        e->refs--;
+    ext2_icache_trim(fs);
+    multitasking_mutex_unlock(&fs->icache_lock);
+}
+
+static int ext2_icache_flush(ext2_fs_t* fs) {
+    int rc = EXT2_OK;
+    multitasking_mutex_lock(&fs->icache_lock);
+    for (ext2_icache_entry_t* e = fs->icache_lru; e; e = e->lru_next)
+        if (ext2_icache_writeback(fs, e) != EXT2_OK)
+            rc = EXT2_ERR_IO;
+    multitasking_mutex_unlock(&fs->icache_lock);
+    return rc;
+}
+
+/*
+ * Indirect block @p block was rewritten (@p tbl) or, with tbl NULL,
+ * freed: every memo holding it is updated or forgotten.
+ */
+static void ext2_memo_update(ext2_fs_t* fs, uint32_t block, const uint32_t* tbl) {
+    multitasking_mutex_lock(&fs->icache_lock);
+    for (ext2_icache_entry_t* e = fs->icache_lru; e; e = e->lru_next) {
+        for (int level = 0; level < 3; level++) {
+            if (!e->memo.tbl[level] || e->memo.block[level] != block)
+                continue;
+            if (tbl)
+                memcpy(e->memo.tbl[level], tbl, fs->block_size);
+            else
+                e->memo.block[level] = 0;
+        }
+    }
+    multitasking_mutex_unlock(&fs->icache_lock);
+}
+
 /* ===================== Bitmap allocation ===================== */
 
 static inline int bit_test(uint8_t* map, uint32_t bit) {
@@ -387,14 +612,51 @@ static void ext2_free_inode(ext2_fs_t* fs, uint32_t ino, int is_dir) {
 
 /* ===================== Block mapping (direct/indirect) ===================== */
 
+/*
+ * Indirect table @p block, at @p level of the lookup (0 = the table that
+ * maps data blocks). With a memo, the table last read at each level is
+ * kept, so reading through a large file reads every indirect block once
+ * rather than once per data block. Lookups that allocate always get
+ * their own copy in @p scratch, which they may change and write back.
+ */
+static uint32_t* ext2_bmap_table(ext2_fs_t* fs, ext2_bmap_memo_t* memo, int level,
+                                 uint32_t block, uint32_t* scratch, int alloc) {
+    if (memo && memo->tbl[level] && memo->block[level] == block) {
+        if (!alloc)
+            return memo->tbl[level];
+        memcpy(scratch, memo->tbl[level], fs->block_size);
+        return scratch;
+    }
+
+    if (ext2_read_block(fs, block, scratch) != EXT2_OK)
+        return NULL;
+
+    if (memo) {
+        if (!memo->tbl[level])
+            memo->tbl[level] = kmalloc(fs->block_size);
+        if (memo->tbl[level]) {
+            memcpy(memo->tbl[level], scratch, fs->block_size);
+            memo->block[level] = block;
+        }
+    }
+    return scratch;
+}
+
+/* Writes an indirect table and brings the memos holding it up to date */
+static void ext2_bmap_store(ext2_fs_t* fs, uint32_t block, uint32_t* tbl) {
+    ext2_write_block(fs, block, tbl);
+    ext2_memo_update(fs, block, tbl);
+}
+
 /*
  * Resolve logical block index -> physical block number for an inode.
  * If `alloc` is non-zero, missing blocks (including indirect blocks
  * themselves) are allocated and the inode's metadata is rewritten by
  * the caller after this returns (we write indirect blocks immediately
- * since they don't live in the inode struct).
+ * since they don't live in the inode struct). `memo` may be NULL.
  */
-static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, int alloc, uint32_t pref_group) {
+static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, int alloc,
+                          uint32_t pref_group, ext2_bmap_memo_t* memo) {
     uint32_t ptrs = fs->block_size / 4;
 
     if (lblock < EXT2_NDIR_BLOCKS) {
@@ -416,15 +678,16 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             inode->i_block[EXT2_IND_BLOCK] = ind;
         }
 
-        uint32_t tbl[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, ind, tbl) != EXT2_OK) return 0;
+        uint32_t scratch[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* tbl = ext2_bmap_table(fs, memo, 0, ind, scratch, alloc);
+        if (!tbl) return 0;
 
         uint32_t result = tbl[lblock];
         if (result == 0 && alloc) {
             result = ext2_alloc_block(fs, pref_group);
             if (result == 0) return 0;
             tbl[lblock] = result;
-            ext2_write_block(fs, ind, tbl);
+            ext2_bmap_store(fs, ind, tbl);
         }
         return result;
     }
@@ -439,8 +702,9 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             inode->i_block[EXT2_DIND_BLOCK] = dind;
         }
 
-        uint32_t l1[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, dind, l1) != EXT2_OK) return 0;
+        uint32_t s1[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* l1 = ext2_bmap_table(fs, memo, 1, dind, s1, alloc);
+        if (!l1) return 0;
 
         uint32_t idx1 = lblock / ptrs;
         uint32_t idx2 = lblock % ptrs;
@@ -454,17 +718,18 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             l1[idx1] = ind;
             wrote_l1 = 1;
         }
-        if (wrote_l1) ext2_write_block(fs, dind, l1);
+        if (wrote_l1) ext2_bmap_store(fs, dind, l1);
 
-        uint32_t l2[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, ind, l2) != EXT2_OK) return 0;
+        uint32_t s2[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* l2 = ext2_bmap_table(fs, memo, 0, ind, s2, alloc);
+        if (!l2) return 0;
 
         uint32_t result = l2[idx2];
         if (result == 0 && alloc) {
             result = ext2_alloc_block(fs, pref_group);
             if (result == 0) return 0;
             l2[idx2] = result;
-            ext2_write_block(fs, ind, l2);
+            ext2_bmap_store(fs, ind, l2);
         }
         return result;
     }
@@ -479,8 +744,9 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             inode->i_block[EXT2_TIND_BLOCK] = tind;
         }
 
-        uint32_t l1[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, tind, l1) != EXT2_OK) return 0;
+        uint32_t s1[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* l1 = ext2_bmap_table(fs, memo, 2, tind, s1, alloc);
+        if (!l1) return 0;
 
         uint32_t idx1 = lblock / (ptrs * ptrs);
         uint32_t rem  = lblock % (ptrs * ptrs);
@@ -493,11 +759,12 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             dind = ext2_alloc_block(fs, pref_group);
             if (dind == 0) return 0;
             l1[idx1] = dind;
-            ext2_write_block(fs, tind, l1);
+            ext2_bmap_store(fs, tind, l1);
         }
 
-        uint32_t l2[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, dind, l2) != EXT2_OK) return 0;
+        uint32_t s2[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* l2 = ext2_bmap_table(fs, memo, 1, dind, s2, alloc);
+        if (!l2) return 0;
 
         uint32_t ind = l2[idx2];
         if (ind == 0) {
@@ -505,18 +772,19 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
             ind = ext2_alloc_block(fs, pref_group);
             if (ind == 0) return 0;
             l2[idx2] = ind;
-            ext2_write_block(fs, dind, l2);
+            ext2_bmap_store(fs, dind, l2);
         }
 
-        uint32_t l3[EXT2_PTRS_PER_BLOCK_MAX];
-        if (ext2_read_block(fs, ind, l3) != EXT2_OK) return 0;
+        uint32_t s3[EXT2_PTRS_PER_BLOCK_MAX];
+        uint32_t* l3 = ext2_bmap_table(fs, memo, 0, ind, s3, alloc);
+        if (!l3) return 0;
 
         uint32_t result = l3[idx3];
         if (result == 0 && alloc) {
             result = ext2_alloc_block(fs, pref_group);
             if (result == 0) return 0;
             l3[idx3] = result;
-            ext2_write_block(fs, ind, l3);
+            ext2_bmap_store(fs, ind, l3);
         }
         return result;
     }
@@ -528,6 +796,10 @@ static uint32_t ext2_bmap(ext2_fs_t* fs, ext2_inode_t* inode, uint32_t lblock, i
 static void ext2_free_indirect(ext2_fs_t* fs, uint32_t block, int depth) {
     if (block == 0) return;
 
+    /* An indirect table going away must not be found in a memo later */
+    if (depth >= 0)
+        ext2_memo_update(fs, block, NULL);
+
     if (depth > 0) {
         uint32_t tbl[EXT2_PTRS_PER_BLOCK_MAX];
         if (ext2_read_block(fs, block, tbl) == EXT2_OK) {
@@ -578,7 +850,7 @@ static int ext2_iterate_dir(ext2_fs_t* fs, ext2_inode_t* dir, ext2_dirent_cb cb,
     uint32_t nblocks = (dir->i_size + fs->block_size - 1) / fs->block_size;
 
     for (uint32_t lb = 0; lb < nblocks; lb++) {
-        uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0);
+        uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0, NULL);
         if (pb == 0) continue;
         if (ext2_read_block(fs, pb, buf) != EXT2_OK) continue;
 
@@ -604,6 +876,747 @@ static int ext2_iterate_dir(ext2_fs_t* fs, ext2_inode_t* dir, ext2_dirent_cb cb,
     return 0;
 }
 
+/* ===================== Hashed directory index (HTree) ===================== */
+
+/*
+ * A dir_index directory keeps its entries in ordinary leaf blocks, sorted
+ * into them by the hash of the name. Block 0 holds "." and ".." and, in
+ * the space of "..", the root of an index of (hash, leaf block) pairs;
+ * big directories get one more level of index blocks, each hidden behind
+ * an empty entry covering the whole block. Code that does not know about
+ * the index still sees a valid directory, which is why a lookup that
+ * cannot use the index just scans the blocks.
+ */
+
+#define EXT2_DX_HASH_LEGACY             0
+#define EXT2_DX_HASH_HALF_MD4           1
+#define EXT2_DX_HASH_TEA                2
+#define EXT2_DX_HASH_LEGACY_UNSIGNED    3
+#define EXT2_DX_HASH_HALF_MD4_UNSIGNED  4
+#define EXT2_DX_HASH_TEA_UNSIGNED       5
+
+#define EXT2_DX_MAX_LEVELS      2       /* root plus one level of nodes, as in ext3 */
+#define EXT2_DX_ROOT_INFO_OFF   24      /* behind the "." and ".." entries */
+#define EXT2_DX_FULL            1       /* index cannot take another block */
+
+typedef struct {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;       /* 8 */
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+} __attribute__((packed)) ext2_dx_root_info_t;
+
+typedef struct {
+    uint32_t hash;              /* lowest hash in the block; bit 0 = continues the previous one */
+    uint32_t block;             /* logical block in the directory */
+} __attribute__((packed)) ext2_dx_entry_t;
+
+/* Takes the place of the hash of the first entry of every index block */
+typedef struct {
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed)) ext2_dx_countlimit_t;
+
+typedef struct {
+    uint32_t         lb;        /* logical block of the index block */
+    uint8_t*         buf;
+    ext2_dx_entry_t* entries;
+    ext2_dx_entry_t* at;        /* entry followed down */
+} ext2_dx_frame_t;
+
+typedef struct {
+    ext2_inode_t*    dir;
+    int              version;   /* hash, with the unsigned offset added */
+    uint32_t         hash;
+    int              levels;    /* index blocks below the root */
+    ext2_dx_frame_t  frames[EXT2_DX_MAX_LEVELS];
+    ext2_dx_frame_t* frame;     /* deepest, the one pointing at the leaf */
+    uint8_t*         mem;       /* buffers of the frames */
+} ext2_dx_path_t;
+
+static inline uint16_t ext2_dx_count(ext2_dx_entry_t* e) {
+    return ((ext2_dx_countlimit_t*)e)->count;
+}
+
+static inline uint16_t ext2_dx_limit(ext2_dx_entry_t* e) {
+    return ((ext2_dx_countlimit_t*)e)->limit;
+}
+
+static inline void ext2_dx_set_count(ext2_dx_entry_t* e, uint16_t count) {
+    ((ext2_dx_countlimit_t*)e)->count = count;
+}
+
+static inline void ext2_dx_set_limit(ext2_dx_entry_t* e, uint16_t limit) {
+    ((ext2_dx_countlimit_t*)e)->limit = limit;
+}
+
+static inline uint32_t ext2_dx_block(ext2_dx_entry_t* e) {
+    return e->block & 0x0FFFFFFF;
+}
+
+static inline uint16_t ext2_dx_root_limit(ext2_fs_t* fs) {
+    return (fs->block_size - EXT2_DX_ROOT_INFO_OFF - sizeof(ext2_dx_root_info_t)) / sizeof(ext2_dx_entry_t);
+}
+
+static inline uint16_t ext2_dx_node_limit(ext2_fs_t* fs) {
+    return (fs->block_size - EXT2_DIR_ENTRY_FIXED_SIZE) / sizeof(ext2_dx_entry_t);
+}
+
+static inline int ext2_is_dx(ext2_fs_t* fs, ext2_inode_t* dir) {
+    return fs->has_dir_index && (dir->i_flags & EXT2_INDEX_FL);
+}
+
+/* "." and ".." live in block 0, outside the hashed leaves */
+static inline int ext2_is_dot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/* --- name hashes, bit for bit those of Linux (fs/ext4/hash.c) --- */
+
+static inline uint32_t ext2_rol32(uint32_t x, int s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+static void ext2_tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define EXT2_MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define EXT2_MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define EXT2_MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define EXT2_MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ext2_rol32(a, s))
+#define EXT2_MD4_K2 013240474631U
+#define EXT2_MD4_K3 015666365641U
+
+static void ext2_half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[0],  3);
+    EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[1],  7);
+    EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[2], 11);
+    EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[3], 19);
+    EXT2_MD4_ROUND(EXT2_MD4_F, a, b, c, d, in[4],  3);
+    EXT2_MD4_ROUND(EXT2_MD4_F, d, a, b, c, in[5],  7);
+    EXT2_MD4_ROUND(EXT2_MD4_F, c, d, a, b, in[6], 11);
+    EXT2_MD4_ROUND(EXT2_MD4_F, b, c, d, a, in[7], 19);
+
+    EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[1] + EXT2_MD4_K2,  3);
+    EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[3] + EXT2_MD4_K2,  5);
+    EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[5] + EXT2_MD4_K2,  9);
+    EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[7] + EXT2_MD4_K2, 13);
+    EXT2_MD4_ROUND(EXT2_MD4_G, a, b, c, d, in[0] + EXT2_MD4_K2,  3);
+    EXT2_MD4_ROUND(EXT2_MD4_G, d, a, b, c, in[2] + EXT2_MD4_K2,  5);
+    EXT2_MD4_ROUND(EXT2_MD4_G, c, d, a, b, in[4] + EXT2_MD4_K2,  9);
+    EXT2_MD4_ROUND(EXT2_MD4_G, b, c, d, a, in[6] + EXT2_MD4_K2, 13);
+
+    EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[3] + EXT2_MD4_K3,  3);
+    EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[7] + EXT2_MD4_K3,  9);
+    EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[2] + EXT2_MD4_K3, 11);
+    EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[6] + EXT2_MD4_K3, 15);
+    EXT2_MD4_ROUND(EXT2_MD4_H, a, b, c, d, in[1] + EXT2_MD4_K3,  3);
+    EXT2_MD4_ROUND(EXT2_MD4_H, d, a, b, c, in[5] + EXT2_MD4_K3,  9);
+    EXT2_MD4_ROUND(EXT2_MD4_H, c, d, a, b, in[0] + EXT2_MD4_K3, 11);
+    EXT2_MD4_ROUND(EXT2_MD4_H, b, c, d, a, in[4] + EXT2_MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/* Name bytes read as signed or unsigned char, depending on the filesystem */
+static inline int ext2_hash_char(const char* p, int is_unsigned) {
+    return is_unsigned ? (int)(uint8_t)*p : (int)(int8_t)*p;
+}
+
+static uint32_t ext2_dx_hack_hash(const char* name, int len, int is_unsigned) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    while (len--) {
+        hash = hash1 + (hash0 ^ (uint32_t)(ext2_hash_char(name++, is_unsigned) * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void ext2_str2hashbuf(const char* msg, int len, uint32_t* buf, int num, int is_unsigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4)
+        len = num * 4;
+    for (int i = 0; i < len; i++) {
+        val = (uint32_t)ext2_hash_char(msg + i, is_unsigned) + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+static uint32_t ext2_dx_hash(ext2_fs_t* fs, int version, const char* name, int len) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t seed[4];
+    uint32_t in[8];
+    uint32_t hash;
+
+    memcpy(seed, fs->sb.s_hash_seed, sizeof(seed));
+    if (seed[0] | seed[1] | seed[2] | seed[3])
+        memcpy(buf, seed, sizeof(buf));
+
+    int is_unsigned = version >= EXT2_DX_HASH_LEGACY_UNSIGNED;
+
+    switch (version) {
+    case EXT2_DX_HASH_LEGACY:
+    case EXT2_DX_HASH_LEGACY_UNSIGNED:
+        hash = ext2_dx_hack_hash(name, len, is_unsigned);
+        break;
+    case EXT2_DX_HASH_HALF_MD4:
+    case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+        for (; len > 0; len -= 32, name += 32) {
+            ext2_str2hashbuf(name, len, in, 8, is_unsigned);
+            ext2_half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case EXT2_DX_HASH_TEA:
+    case EXT2_DX_HASH_TEA_UNSIGNED:
+        for (; len > 0; len -= 16, name += 16) {
+            ext2_str2hashbuf(name, len, in, 4, is_unsigned);
+            ext2_tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        return 0;
+    }
+
+    /* bit 0 is the collision flag of index entries; ~0 marks the end of a readdir */
+    hash &= ~1U;
+    if (hash == 0xFFFFFFFEU)
+        hash = 0xFFFFFFFCU;
+    return hash;
+}
+
+/* --- directory blocks --- */
+
+/* Reads logical block @p lb of a directory, which must lie within it */
+static int ext2_dir_read(ext2_fs_t* fs, ext2_inode_t* dir, uint32_t lb, void* buf, uint32_t* out_pb) {
+    if ((uint64_t)lb * fs->block_size >= dir->i_size)
+        return EXT2_ERR_CORRUPT;
+    uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0, NULL);
+    if (pb == 0)
+        return EXT2_ERR_CORRUPT;
+    if (out_pb) *out_pb = pb;
+    return ext2_read_block(fs, pb, buf);
+}
+
+static int ext2_dir_write(ext2_fs_t* fs, ext2_inode_t* dir, uint32_t lb, const void* buf) {
+    uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0, NULL);
+    if (pb == 0)
+        return EXT2_ERR_CORRUPT;
+    return ext2_write_block(fs, pb, buf);
+}
+
+/* Adds a block at the end of a directory; the caller writes the inode */
+static uint32_t ext2_dir_append_block(ext2_fs_t* fs, ext2_inode_t* dir, uint32_t pref_group, uint32_t* out_lb) {
+    uint32_t lb = (dir->i_size + fs->block_size - 1) / fs->block_size;
+    uint32_t pb = ext2_bmap(fs, dir, lb, 1, pref_group, NULL);
+    if (pb == 0)
+        return 0;
+
+    dir->i_size = (lb + 1) * fs->block_size;
+    dir->i_blocks += fs->sectors_per_block;
+    if (out_lb) *out_lb = lb;
+    return pb;
+}
+
+/* Offset of @p name in one directory block, or -1 */
+static int32_t ext2_dirblock_find(ext2_fs_t* fs, const uint8_t* buf, const char* name) {
+    size_t len = strlen(name);
+    uint32_t off = 0;
+
+    while (off + EXT2_DIR_ENTRY_FIXED_SIZE <= fs->block_size) {
+        ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
+        if (de->rec_len == 0) break;
+
+        if (de->inode != 0 && de->name_len == len &&
+            memcmp(buf + off + EXT2_DIR_ENTRY_FIXED_SIZE, name, len) == 0)
+            return (int32_t)off;
+
+        off += de->rec_len;
+    }
+    return -1;
+}
+
+/* Puts an entry into the first gap of the block that fits it; 0 if none does */
+static int ext2_dirblock_insert(ext2_fs_t* fs, uint8_t* buf, uint32_t new_ino, const char* name, uint8_t type) {
+    uint8_t name_len = (uint8_t)strlen(name);
+    uint16_t need = ext2_dirent_min_len(name_len);
+    uint32_t off = 0;
+
+    while (off < fs->block_size) {
+        ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
+        if (de->rec_len == 0) break;
+
+        uint16_t used = de->inode ? ext2_dirent_min_len(de->name_len) : 0;
+        uint16_t avail = de->rec_len - used;
+
+        if (avail >= need) {
+            uint16_t old_rec_len = de->rec_len;
+
+            if (de->inode != 0) {
+                /* split this entry */
+                de->rec_len = used;
+                ext2_raw_dirent_t* nde = (ext2_raw_dirent_t*)(buf + off + used);
+                nde->inode = new_ino;
+                nde->rec_len = old_rec_len - used;
+                nde->name_len = name_len;
+                nde->file_type = fs->has_filetype ? type : 0;
+                memcpy(buf + off + used + EXT2_DIR_ENTRY_FIXED_SIZE, name, name_len);
+            } else {
+                de->inode = new_ino;
+                de->name_len = name_len;
+                de->file_type = fs->has_filetype ? type : 0;
+                de->rec_len = old_rec_len;
+                memcpy(buf + off + EXT2_DIR_ENTRY_FIXED_SIZE, name, name_len);
+            }
+            return 1;
+        }
+
+        off += de->rec_len;
+    }
+    return 0;
+}
+
+/* Removes the entry at @p off, merging its space into the one before it */
+static void ext2_dirblock_remove(ext2_fs_t* fs, uint8_t* buf, uint32_t off) {
+    uint32_t prev_off = (uint32_t)-1;
+    uint32_t cur = 0;
+
+    while (cur < off && cur < fs->block_size) {
+        ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + cur);
+        if (de->rec_len == 0) break;
+        prev_off = cur;
+        cur += de->rec_len;
+    }
+
+    ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
+    if (cur == off && prev_off != (uint32_t)-1) {
+        ext2_raw_dirent_t* prev = (ext2_raw_dirent_t*)(buf + prev_off);
+        prev->rec_len += de->rec_len;
+    } else {
+        de->inode = 0;
+    }
+}
+
+/* --- index walk --- */
+
+static void ext2_dx_release(ext2_dx_path_t* path) {
+    if (path->mem)
+        kfree(path->mem);
+    path->mem = NULL;
+}
+
+static int ext2_dx_node_ok(ext2_dx_entry_t* entries, uint16_t limit) {
+    uint16_t count = ext2_dx_count(entries);
+    return ext2_dx_limit(entries) == limit && count != 0 && count <= limit;
+}
+
+/* Last entry of an index block with a hash not above @p hash */
+static ext2_dx_entry_t* ext2_dx_search(ext2_dx_entry_t* entries, uint32_t hash) {
+    ext2_dx_entry_t* p = entries + 1;
+    ext2_dx_entry_t* q = entries + ext2_dx_count(entries) - 1;
+
+    while (p <= q) {
+        ext2_dx_entry_t* m = p + (q - p) / 2;
+        if (m->hash > hash)
+            q = m - 1;
+        else
+            p = m + 1;
+    }
+    return p - 1;
+}
+
+/*
+ * Follows the index of @p dir down towards the leaf @p name hashes to.
+ * EXT2_ERR_CORRUPT means there is no index we can use; the directory is
+ * then still readable block by block.
+ */
+static int ext2_dx_probe(ext2_fs_t* fs, ext2_inode_t* dir, const char* name, ext2_dx_path_t* path) {
+    memset(path, 0, sizeof(*path));
+    path->dir = dir;
+    path->mem = kmalloc(fs->block_size * EXT2_DX_MAX_LEVELS);
+    if (!path->mem)
+        return EXT2_ERR_NOSPACE;
+
+    ext2_dx_frame_t* f = &path->frames[0];
+    f->buf = path->mem;
+    f->lb = 0;
+    if (ext2_dir_read(fs, dir, 0, f->buf, NULL) != EXT2_OK)
+        goto bad;
+
+    ext2_raw_dirent_t* dot = (ext2_raw_dirent_t*)f->buf;
+    ext2_dx_root_info_t* info = (ext2_dx_root_info_t*)(f->buf + EXT2_DX_ROOT_INFO_OFF);
+    if (dot->rec_len != 12 || info->reserved_zero != 0 ||
+        info->info_length != sizeof(ext2_dx_root_info_t) || (info->unused_flags & 1) ||
+        info->hash_version > EXT2_DX_HASH_TEA || info->indirect_levels >= EXT2_DX_MAX_LEVELS)
+        goto bad;
+
+    path->version = info->hash_version + fs->dx_hash_unsigned;
+    path->hash = ext2_dx_hash(fs, path->version, name, (int)strlen(name));
+    path->levels = info->indirect_levels;
+    f->entries = (ext2_dx_entry_t*)(f->buf + EXT2_DX_ROOT_INFO_OFF + info->info_length);
+    uint16_t limit = ext2_dx_root_limit(fs);
+
+    for (int level = 0; ; level++) {
+        if (!ext2_dx_node_ok(f->entries, limit))
+            goto bad;
+
+        f->at = ext2_dx_search(f->entries, path->hash);
+        path->frame = f;
+        if (level == path->levels)
+            return EXT2_OK;
+
+        ext2_dx_frame_t* next = f + 1;
+        next->buf = path->mem + (level + 1) * fs->block_size;
+        next->lb = ext2_dx_block(f->at);
+        if (ext2_dir_read(fs, dir, next->lb, next->buf, NULL) != EXT2_OK)
+            goto bad;
+        next->entries = (ext2_dx_entry_t*)(next->buf + EXT2_DIR_ENTRY_FIXED_SIZE);
+        limit = ext2_dx_node_limit(fs);
+        f = next;
+    }
+
+bad:
+    ext2_dx_release(path);
+    return EXT2_ERR_CORRUPT;
+}
+
+/*
+ * Moves on to the next leaf if it may hold more names with our hash,
+ * which happens when a leaf was split between names of equal hash.
+ */
+static int ext2_dx_next_leaf(ext2_fs_t* fs, ext2_dx_path_t* path) {
+    ext2_dx_frame_t* f = path->frame;
+    int up = 0;
+
+    while (1) {
+        f->at++;
+        if (f->at < f->entries + ext2_dx_count(f->entries))
+            break;
+        if (f == path->frames)
+            return 0;
+        f--;
+        up++;
+    }
+
+    if ((f->at->hash & ~1U) != path->hash)
+        return 0;
+
+    while (up--) {
+        ext2_dx_frame_t* next = f + 1;
+        next->lb = ext2_dx_block(f->at);
+        if (ext2_dir_read(fs, path->dir, next->lb, next->buf, NULL) != EXT2_OK)
+            return 0;
+        next->entries = (ext2_dx_entry_t*)(next->buf + EXT2_DIR_ENTRY_FIXED_SIZE);
+        if (!ext2_dx_node_ok(next->entries, ext2_dx_node_limit(fs)))
+            return 0;
+        next->at = next->entries;
+        f = next;
+    }
+    return 1;
+}
+
+/*
+ * Looks @p name up through the index, reading only the leaves it can be
+ * in. On success @p buf holds physical block @p out_pb with the entry at
+ * @p out_off. EXT2_ERR_CORRUPT: no usable index, scan instead.
+ */
+static int ext2_dx_find(ext2_fs_t* fs, ext2_inode_t* dir, const char* name,
+                        uint8_t* buf, uint32_t* out_pb, uint32_t* out_off) {
+    ext2_dx_path_t path;
+    int rc = ext2_dx_probe(fs, dir, name, &path);
+    if (rc != EXT2_OK)
+        return rc;
+
+    rc = EXT2_ERR_NOT_FOUND;
+    do {
+        uint32_t pb;
+        if (ext2_dir_read(fs, dir, ext2_dx_block(path.frame->at), buf, &pb) != EXT2_OK) {
+            rc = EXT2_ERR_CORRUPT;
+            break;
+        }
+
+        int32_t off = ext2_dirblock_find(fs, buf, name);
+        if (off >= 0) {
+            *out_pb = pb;
+            *out_off = (uint32_t)off;
+            rc = EXT2_OK;
+            break;
+        }
+    } while (ext2_dx_next_leaf(fs, &path));
+
+    ext2_dx_release(&path);
+    return rc;
+}
+
+/* --- insertion --- */
+
+/* Inserts (hash, block) right after the entry the frame follows */
+static void ext2_dx_insert(ext2_dx_frame_t* f, uint32_t hash, uint32_t block) {
+    uint16_t count = ext2_dx_count(f->entries);
+    ext2_dx_entry_t* at = f->at + 1;
+
+    memmove(at + 1, at, (size_t)(f->entries + count - at) * sizeof(ext2_dx_entry_t));
+    at->hash = hash;
+    at->block = block;
+    ext2_dx_set_count(f->entries, count + 1);
+}
+
+static void ext2_dx_init_node(ext2_fs_t* fs, uint8_t* buf) {
+    memset(buf, 0, fs->block_size);
+    ext2_raw_dirent_t* fake = (ext2_raw_dirent_t*)buf;
+    fake->rec_len = (uint16_t)fs->block_size;
+    ext2_dx_set_limit((ext2_dx_entry_t*)(buf + EXT2_DIR_ENTRY_FIXED_SIZE), ext2_dx_node_limit(fs));
+}
+
+/*
+ * Makes room for one more leaf in the index block the path ends in. A
+ * full root with no nodes below gets a level of nodes; a full node is
+ * split in two under the root. Anything beyond is EXT2_DX_FULL.
+ */
+static int ext2_dx_make_room(ext2_fs_t* fs, ext2_inode_t* dir, ext2_dx_path_t* path,
+                             uint8_t* scratch, uint32_t pref_group) {
+    ext2_dx_frame_t* root = &path->frames[0];
+    ext2_dx_frame_t* f = path->frame;
+    uint16_t count = ext2_dx_count(f->entries);
+    uint32_t lb;
+
+    if (count < ext2_dx_limit(f->entries))
+        return EXT2_OK;
+
+    if (path->levels == 0) {
+        if (ext2_dir_append_block(fs, dir, pref_group, &lb) == 0)
+            return EXT2_ERR_NOSPACE;
+
+        /* All root entries move into the new node; the root points at it */
+        ext2_dx_frame_t* node = &path->frames[1];
+        node->buf = path->mem + fs->block_size;
+        node->lb = lb;
+        ext2_dx_init_node(fs, node->buf);
+        node->entries = (ext2_dx_entry_t*)(node->buf + EXT2_DIR_ENTRY_FIXED_SIZE);
+        node->entries[0].block = root->entries[0].block;
+        memcpy(node->entries + 1, root->entries + 1, (count - 1) * sizeof(ext2_dx_entry_t));
+        ext2_dx_set_count(node->entries, count);
+        node->at = node->entries + (root->at - root->entries);
+
+        ext2_dx_set_count(root->entries, 1);
+        root->entries[0].block = lb;
+        root->at = root->entries;
+        ((ext2_dx_root_info_t*)(root->buf + EXT2_DX_ROOT_INFO_OFF))->indirect_levels = 1;
+
+        path->levels = 1;
+        path->frame = node;
+
+        if (ext2_dir_write(fs, dir, node->lb, node->buf) != EXT2_OK ||
+            ext2_dir_write(fs, dir, root->lb, root->buf) != EXT2_OK)
+            return EXT2_ERR_IO;
+        return EXT2_OK;
+    }
+
+    if (path->levels != 1 || ext2_dx_count(root->entries) >= ext2_dx_limit(root->entries))
+        return EXT2_DX_FULL;
+
+    if (ext2_dir_append_block(fs, dir, pref_group, &lb) == 0)
+        return EXT2_ERR_NOSPACE;
+
+    /* Upper half of the node goes to a new node, listed in the root after it */
+    uint16_t keep = count / 2;
+    uint16_t move = count - keep;
+    uint32_t hash2 = f->entries[keep].hash;
+    uint32_t at = (uint32_t)(f->at - f->entries);
+
+    ext2_dx_init_node(fs, scratch);
+    ext2_dx_entry_t* nentries = (ext2_dx_entry_t*)(scratch + EXT2_DIR_ENTRY_FIXED_SIZE);
+    nentries[0].block = f->entries[keep].block;
+    memcpy(nentries + 1, f->entries + keep + 1, (move - 1) * sizeof(ext2_dx_entry_t));
+    ext2_dx_set_count(nentries, move);
+    ext2_dx_set_count(f->entries, keep);
+
+    ext2_dx_insert(root, hash2, lb);
+
+    if (ext2_dir_write(fs, dir, lb, scratch) != EXT2_OK ||
+        ext2_dir_write(fs, dir, f->lb, f->buf) != EXT2_OK ||
+        ext2_dir_write(fs, dir, root->lb, root->buf) != EXT2_OK)
+        return EXT2_ERR_IO;
+
+    if (at >= keep) {
+        memcpy(f->buf, scratch, fs->block_size);
+        f->lb = lb;
+        f->at = f->entries + (at - keep);
+        root->at++;
+    }
+    return EXT2_OK;
+}
+
+typedef struct {
+    uint32_t hash;
+    uint16_t off;
+    uint16_t size;
+} ext2_dx_map_t;
+
+/* Copies the entries of @p map into an empty block, the last one reaching its end */
+static void ext2_dx_pack(ext2_fs_t* fs, const uint8_t* from, const ext2_dx_map_t* map, uint32_t n, uint8_t* to) {
+    uint32_t off = 0;
+    ext2_raw_dirent_t* last = NULL;
+
+    memset(to, 0, fs->block_size);
+    for (uint32_t i = 0; i < n; i++) {
+        memcpy(to + off, from + map[i].off, map[i].size);
+        last = (ext2_raw_dirent_t*)(to + off);
+        last->rec_len = map[i].size;
+        off += map[i].size;
+    }
+    if (last)
+        last->rec_len += fs->block_size - off;
+    else
+        ((ext2_raw_dirent_t*)to)->rec_len = (uint16_t)fs->block_size;
+}
+
+/*
+ * Adds an entry to the leaf its name hashes to. A full leaf is split in
+ * two by hash, the upper half going to a new block of the directory.
+ */
+static int ext2_dx_add_entry(ext2_fs_t* fs, uint32_t dir_ino, ext2_inode_t* dir,
+                             uint32_t new_ino, const char* name, uint8_t type, uint32_t pref_group) {
+    uint32_t max_entries = fs->block_size / ext2_dirent_min_len(1);
+    uint8_t* mem = kmalloc(fs->block_size * 3 + max_entries * sizeof(ext2_dx_map_t));
+    if (!mem)
+        return EXT2_ERR_NOSPACE;
+    uint8_t* leaf = mem;
+    uint8_t* other = mem + fs->block_size;
+    uint8_t* scratch = mem + fs->block_size * 2;
+    ext2_dx_map_t* map = (ext2_dx_map_t*)(mem + fs->block_size * 3);
+
+    ext2_dx_path_t path;
+    int rc = ext2_dx_probe(fs, dir, name, &path);
+    if (rc != EXT2_OK)
+        goto out_mem;
+
+    uint32_t leaf_lb = ext2_dx_block(path.frame->at);
+    uint32_t leaf_pb;
+    if (ext2_dir_read(fs, dir, leaf_lb, leaf, &leaf_pb) != EXT2_OK) {
+        rc = EXT2_ERR_CORRUPT;
+        goto out;
+    }
+
+    if (ext2_dirblock_insert(fs, leaf, new_ino, name, type)) {
+        rc = ext2_write_block(fs, leaf_pb, leaf);
+        goto out;
+    }
+
+    rc = ext2_dx_make_room(fs, dir, &path, scratch, pref_group);
+    if (rc != EXT2_OK)
+        goto out_inode;
+
+    /* Hash every entry of the leaf and sort them by it */
+    uint32_t n = 0;
+    for (uint32_t off = 0; off + EXT2_DIR_ENTRY_FIXED_SIZE <= fs->block_size && n < max_entries; ) {
+        ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(leaf + off);
+        if (de->rec_len == 0) break;
+        if (de->inode != 0) {
+            ext2_dx_map_t m = {
+                .hash = ext2_dx_hash(fs, path.version,
+                                     (const char*)(leaf + off + EXT2_DIR_ENTRY_FIXED_SIZE), de->name_len),
+                .off = (uint16_t)off,
+                .size = ext2_dirent_min_len(de->name_len),
+            };
+            uint32_t i = n++;
+            while (i > 0 && map[i - 1].hash > m.hash) {
+                map[i] = map[i - 1];
+                i--;
+            }
+            map[i] = m;
+        }
+        off += de->rec_len;
+    }
+    if (n < 2) {
+        rc = EXT2_ERR_CORRUPT;
+        goto out_inode;
+    }
+
+    /* Split in the middle by size, as Linux does */
+    uint32_t size = 0, move = 0;
+    for (uint32_t i = n - 1; i > 0; i--) {
+        if (size + map[i].size / 2 > fs->block_size / 2)
+            break;
+        size += map[i].size;
+        move++;
+    }
+    if (move == 0)
+        move = 1;
+    uint32_t split = n - move;
+    uint32_t hash2 = map[split].hash;
+    uint32_t continued = hash2 == map[split - 1].hash;
+
+    uint32_t new_lb;
+    uint32_t new_pb = ext2_dir_append_block(fs, dir, pref_group, &new_lb);
+    if (new_pb == 0) {
+        rc = EXT2_ERR_NOSPACE;
+        goto out_inode;
+    }
+
+    ext2_dx_pack(fs, leaf, map + split, move, other);
+    ext2_dx_pack(fs, leaf, map, split, scratch);
+    memcpy(leaf, scratch, fs->block_size);
+
+    uint8_t* target = path.hash >= hash2 ? other : leaf;
+    if (!ext2_dirblock_insert(fs, target, new_ino, name, type)) {
+        /* The new block is in the directory already: leave it empty */
+        ext2_dx_pack(fs, leaf, map, 0, other);
+        rc = ext2_write_block(fs, new_pb, other) == EXT2_OK ? EXT2_ERR_NOSPACE : EXT2_ERR_IO;
+        goto out_inode;
+    }
+
+    ext2_dx_insert(path.frame, hash2 | continued, new_lb);
+
+    if (ext2_write_block(fs, new_pb, other) != EXT2_OK ||
+        ext2_write_block(fs, leaf_pb, leaf) != EXT2_OK ||
+        ext2_dir_write(fs, dir, path.frame->lb, path.frame->buf) != EXT2_OK)
+        rc = EXT2_ERR_IO;
+
+out_inode:
+    /* Blocks may have been added even if the insert failed */
+    if (ext2_write_inode(fs, dir_ino, dir) != EXT2_OK && rc == EXT2_OK)
+        rc = EXT2_ERR_IO;
+out:
+    ext2_dx_release(&path);
+out_mem:
+    kfree(mem);
+    return rc;
+}
+
 typedef struct {
     const char* target;
     uint32_t    found_ino;
@@ -631,6 +1644,21 @@ int ext2_find_in_dir(ext2_fs_t* fs, uint32_t dir_ino, const char* name, uint32_t
     if ((dir.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
         return EXT2_ERR_NOTDIR;
 
+    if (ext2_is_dx(fs, &dir) && !ext2_is_dot(name)) {
+        uint8_t buf[EXT2_MAX_BLOCK_SIZE];
+        uint32_t pb, off;
+        int rc = ext2_dx_find(fs, &dir, name, buf, &pb, &off);
+        if (rc == EXT2_OK) {
+            ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
+            if (out_ino) *out_ino = de->inode;
+            if (out_type) *out_type = de->file_type;
+            return EXT2_OK;
+        }
+        if (rc == EXT2_ERR_NOT_FOUND)
+            return rc;
+        /* no usable index: scan */
+    }
+
     find_ctx_t ctx = { .target = name, .found = 0 };
     ext2_iterate_dir(fs, &dir, find_cb, &ctx);
 
@@ -672,130 +1700,82 @@ int ext2_list_dir(ext2_fs_t* fs, uint32_t dir_ino) {
 }
 
 /* Insert a new directory entry (inode, name, type) into dir_ino, growing the
- * directory by one block if no existing entry has enough free space. */
+ * directory by one block if no existing entry has enough free space. Indexed
+ * directories put it in the leaf its hash belongs to. */
 static int ext2_dir_add_entry(ext2_fs_t* fs, uint32_t dir_ino, ext2_inode_t* dir,
                                uint32_t new_ino, const char* name, uint8_t type, uint32_t pref_group) {
     uint8_t buf[EXT2_MAX_BLOCK_SIZE];
-    uint8_t name_len = (uint8_t)strlen(name);
-    uint16_t need = ext2_dirent_min_len(name_len);
+
+    if (ext2_is_dx(fs, dir)) {
+        int rc = ext2_dx_add_entry(fs, dir_ino, dir, new_ino, name, type, pref_group);
+        if (rc != EXT2_DX_FULL && rc != EXT2_ERR_CORRUPT)
+            return rc;
+
+        /* The index cannot take it: drop the index and carry on without
+         * it; every entry is still found by a plain scan. */
+        dir->i_flags &= ~EXT2_INDEX_FL;
+        if (ext2_write_inode(fs, dir_ino, dir) != EXT2_OK)
+            return EXT2_ERR_IO;
+    }
 
     uint32_t nblocks = (dir->i_size + fs->block_size - 1) / fs->block_size;
 
     for (uint32_t lb = 0; lb < nblocks; lb++) {
-        uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0);
+        uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0, NULL);
         if (pb == 0) continue;
         if (ext2_read_block(fs, pb, buf) != EXT2_OK) continue;
 
-        uint32_t off = 0;
-        while (off < fs->block_size) {
-            ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
-            if (de->rec_len == 0) break;
-
-            uint16_t used = de->inode ? ext2_dirent_min_len(de->name_len) : 0;
-            uint16_t avail = de->rec_len - used;
-
-            if (avail >= need) {
-                uint16_t old_rec_len = de->rec_len;
-
-                if (de->inode != 0) {
-                    /* split this entry */
-                    de->rec_len = used;
-                    ext2_raw_dirent_t* nde = (ext2_raw_dirent_t*)(buf + off + used);
-                    nde->inode = new_ino;
-                    nde->rec_len = old_rec_len - used;
-                    nde->name_len = name_len;
-                    nde->file_type = fs->has_filetype ? type : 0;
-                    memcpy(buf + off + used + EXT2_DIR_ENTRY_FIXED_SIZE, name, name_len);
-                } else {
-                    de->inode = new_ino;
-                    de->name_len = name_len;
-                    de->file_type = fs->has_filetype ? type : 0;
-                    de->rec_len = old_rec_len;
-                    memcpy(buf + off + EXT2_DIR_ENTRY_FIXED_SIZE, name, name_len);
-                }
-
-                return ext2_write_block(fs, pb, buf);
-            }
-
-            off += de->rec_len;
-        }
+        if (ext2_dirblock_insert(fs, buf, new_ino, name, type))
+            return ext2_write_block(fs, pb, buf);
     }
 
     /* No space found: allocate a new block for the directory */
-    uint32_t nb = ext2_alloc_block(fs, pref_group);
+    uint32_t nb = ext2_dir_append_block(fs, dir, pref_group, NULL);
     if (nb == 0) return EXT2_ERR_NOSPACE;
 
-    /* Hook it into the inode's block map at index nblocks */
-    if (ext2_bmap(fs, dir, nblocks, 1, pref_group) == 0) {
-        ext2_free_block(fs, nb);
-        return EXT2_ERR_NOSPACE;
-    }
-    /* ext2_bmap with alloc=1 may have allocated a *different* block than nb
-     * for direct entries (since it allocates internally); fetch what it set. */
-    uint32_t real_block = ext2_bmap(fs, dir, nblocks, 0, 0);
-    if (real_block == 0) return EXT2_ERR_NOSPACE;
-    if (real_block != nb) {
-        /* free our scratch alloc, we didn't need it for direct case */
-        ext2_free_block(fs, nb);
-        nb = real_block;
-    }
-
     memset(buf, 0, fs->block_size);
-    ext2_raw_dirent_t* nde = (ext2_raw_dirent_t*)buf;
-    nde->inode = new_ino;
-    nde->rec_len = (uint16_t)fs->block_size;
-    nde->name_len = name_len;
-    nde->file_type = fs->has_filetype ? type : 0;
-    memcpy(buf + EXT2_DIR_ENTRY_FIXED_SIZE, name, name_len);
+    ((ext2_raw_dirent_t*)buf)->rec_len = (uint16_t)fs->block_size;
+    ext2_dirblock_insert(fs, buf, new_ino, name, type);
 
     if (ext2_write_block(fs, nb, buf) != EXT2_OK)
         return EXT2_ERR_IO;
 
-    dir->i_size += fs->block_size;
-    dir->i_blocks += fs->sectors_per_block;
-
     return ext2_write_inode(fs, dir_ino, dir);
 }
 
 /* Remove an entry by name; merges its space into the previous entry in the same block. */
 static int ext2_dir_remove_entry(ext2_fs_t* fs, ext2_inode_t* dir, const char* name, uint32_t* removed_ino, uint8_t* removed_type) {
     uint8_t buf[EXT2_MAX_BLOCK_SIZE];
+    uint32_t pb = 0;
+    int32_t off = -1;
+
+    if (ext2_is_dx(fs, dir) && !ext2_is_dot(name)) {
+        uint32_t dx_off;
+        int rc = ext2_dx_find(fs, dir, name, buf, &pb, &dx_off);
+        if (rc == EXT2_ERR_NOT_FOUND)
+            return rc;
+        if (rc == EXT2_OK)
+            off = (int32_t)dx_off;
+    }
+
     uint32_t nblocks = (dir->i_size + fs->block_size - 1) / fs->block_size;
 
-    for (uint32_t lb = 0; lb < nblocks; lb++) {
-        uint32_t pb = ext2_bmap(fs, dir, lb, 0, 0);
+    for (uint32_t lb = 0; off < 0 && lb < nblocks; lb++) {
+        pb = ext2_bmap(fs, dir, lb, 0, 0, NULL);
         if (pb == 0) continue;
         if (ext2_read_block(fs, pb, buf) != EXT2_OK) continue;
+        off = ext2_dirblock_find(fs, buf, name);
+    }
 
-        uint32_t off = 0;
-        uint32_t prev_off = (uint32_t)-1;
-
-        while (off < fs->block_size) {
-            ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
-            if (de->rec_len == 0) break;
-
-            if (de->inode != 0 && de->name_len == strlen(name) &&
-                memcmp(buf + off + EXT2_DIR_ENTRY_FIXED_SIZE, name, de->name_len) == 0) {
-
-                if (removed_ino) *removed_ino = de->inode;
-                if (removed_type) *removed_type = de->file_type;
-
-                if (prev_off != (uint32_t)-1) {
-                    ext2_raw_dirent_t* prev = (ext2_raw_dirent_t*)(buf + prev_off);
-                    prev->rec_len += de->rec_len;
-                } else {
-                    de->inode = 0;
-                }
+    if (off < 0)
+        return EXT2_ERR_NOT_FOUND;
 
-                return ext2_write_block(fs, pb, buf);
-            }
+    ext2_raw_dirent_t* de = (ext2_raw_dirent_t*)(buf + off);
+    if (removed_ino) *removed_ino = de->inode;
+    if (removed_type) *removed_type = de->file_type;
 
-            prev_off = off;
-            off += de->rec_len;
-        }
-    }
-
-    return EXT2_ERR_NOT_FOUND;
+    ext2_dirblock_remove(fs, buf, (uint32_t)off);
+    return ext2_write_block(fs, pb, buf);
 }
 
 /* ===================== Path resolution ===================== */
@@ -903,6 +1883,10 @@ static uint32_t ext2_now(void) {
 
 /* ===================== open / create / read / write / close ===================== */
 
+static inline ext2_bmap_memo_t* ext2_file_memo(ext2_file_t* f) {
+    return f->ic ? &f->ic->memo : NULL;
+}
+
 int ext2_open(ext2_fs_t* fs, const char* path, ext2_file_t* f) {
     uint32_t ino;
     ext2_inode_t inode;
@@ -917,6 +1901,7 @@ int ext2_open(ext2_fs_t* fs, const char* path, ext2_file_t* f) {
     f->inode = inode;
     f->pos = 0;
     f->is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    f->ic = ext2_iget(fs, ino);
 
     return EXT2_OK;
 }
@@ -970,6 +1955,7 @@ int ext2_create(ext2_fs_t* fs, const char* path, uint16_t mode, ext2_file_t* f)
         f->inode = inode;
         f->pos = 0;
         f->is_dir = 0;
+        f->ic = ext2_iget(fs, new_ino);
     }
 
     return EXT2_OK;
@@ -993,7 +1979,7 @@ int ext2_read(ext2_file_t* f, uint8_t* out, uint32_t size) {
         uint32_t chunk = fs->block_size - off_in_block;
         if (chunk > size - total_read) chunk = size - total_read;
 
-        uint32_t pb = ext2_bmap(fs, &f->inode, lblock, 0, 0);
+        uint32_t pb = ext2_bmap(fs, &f->inode, lblock, 0, 0, ext2_file_memo(f));
         if (pb == 0) {
             memset(out + total_read, 0, chunk); /* sparse hole */
         } else {
@@ -1009,6 +1995,40 @@ int ext2_read(ext2_file_t* f, uint8_t* out, uint32_t size) {
     return (int)total_read;
 }
 
+/* Queues [offset, offset + bytes) of the file into the block cache, no wait */
+int ext2_readahead(ext2_file_t* f, uint32_t offset, uint32_t bytes) {
+    if (!f || !f->fs || bytes == 0) return EXT2_ERR_INVAL;
+    ext2_fs_t* fs = f->fs;
+
+    if (offset >= f->inode.i_size) return EXT2_OK;
+    if (bytes > f->inode.i_size - offset)
+        bytes = f->inode.i_size - offset;
+
+    uint32_t first = offset / fs->block_size;
+    uint32_t last = (offset + bytes - 1) / fs->block_size;
+    uint32_t run_start = 0;
+    uint32_t run_blocks = 0;
+
+    /* One request per run of blocks that are contiguous on disk */
+    for (uint32_t lblock = first; lblock <= last; lblock++) {
+        uint32_t pb = ext2_bmap(fs, &f->inode, lblock, 0, 0, ext2_file_memo(f));
+        if (run_blocks && pb == run_start + run_blocks) {
+            run_blocks++;
+            continue;
+        }
+        if (run_blocks)
+            ahci_prefetch_sectors(fs->portno, ext2_block_to_lba(fs, run_start),
+                                  run_blocks * fs->sectors_per_block);
+        run_start = pb;
+        run_blocks = pb ? 1 : 0;    /* holes read as zeroes */
+    }
+    if (run_blocks)
+        ahci_prefetch_sectors(fs->portno, ext2_block_to_lba(fs, run_start),
+                              run_blocks * fs->sectors_per_block);
+
+    return EXT2_OK;
+}
+
 int ext2_write(ext2_file_t* f, const uint8_t* data, uint32_t size) {
     if (!f || !f->fs) return EXT2_ERR_INVAL;
     if (f->is_dir) return EXT2_ERR_ISDIR;
@@ -1026,7 +2046,7 @@ int ext2_write(ext2_file_t* f, const uint8_t* data, uint32_t size) {
         uint32_t chunk = fs->block_size - off_in_block;
         if (chunk > size - total_written) chunk = size - total_written;
 
-        uint32_t pb = ext2_bmap(fs, &f->inode, lblock, 1, group);
+        uint32_t pb = ext2_bmap(fs, &f->inode, lblock, 1, group, ext2_file_memo(f));
         if (pb == 0)
             return total_written > 0 ? (int)total_written : EXT2_ERR_NOSPACE;
 
@@ -1061,7 +2081,8 @@ int ext2_write(ext2_file_t* f, const uint8_t* data, uint32_t size) {
 
 void ext2_close(ext2_file_t* f) {
     if (!f || !f->fs) return;
-    /* metadata is written eagerly on every ext2_write(), nothing to flush here */
+    /* the inode stays in the cache; ext2_sync() writes it back */
+    ext2_iput(f->fs, f->ic);
     memset(f, 0, sizeof(ext2_file_t));
 }
 
@@ -1218,7 +2239,7 @@ int ext2_rmdir(ext2_fs_t* fs, const char* path) {
         uint8_t buf[EXT2_MAX_BLOCK_SIZE];
         uint32_t nblocks = (target.i_size + fs->block_size - 1) / fs->block_size;
         for (uint32_t lb = 0; lb < nblocks && entry_count <= 2; lb++) {
-            uint32_t pb = ext2_bmap(fs, &target, lb, 0, 0);
+            uint32_t pb = ext2_bmap(fs, &target, lb, 0, 0, NULL);
             if (pb == 0) continue;
             if (ext2_read_block(fs, pb, buf) != EXT2_OK) continue;
             uint32_t off = 0;
@@ -1400,8 +2421,6 @@ int ext2_rename(ext2_fs_t* fs, const char* src_path, const char* dst_path) {
     }
 
     ext2_inode_t src_parent, dst_parent;
-    if (ext2_read_inode(fs, src_parent_ino, &src_parent) != EXT2_OK)
-        return EXT2_ERR_IO;
     if (ext2_read_inode(fs, dst_parent_ino, &dst_parent) != EXT2_OK)
         return EXT2_ERR_IO;
 
@@ -1410,6 +2429,10 @@ int ext2_rename(ext2_fs_t* fs, const char* src_path, const char* dst_path) {
     if (ext2_dir_add_entry(fs, dst_parent_ino, &dst_parent, src_ino, dst_name, src_type, group) != EXT2_OK)
         return EXT2_ERR_NOSPACE;
 
+    /* read after the add, which may have changed it if it is the same directory */
+    if (ext2_read_inode(fs, src_parent_ino, &src_parent) != EXT2_OK)
+        return EXT2_ERR_IO;
+
     if (ext2_dir_remove_entry(fs, &src_parent, src_name, NULL, NULL) != EXT2_OK)
         return EXT2_ERR_NOT_FOUND;
 
@@ -1448,6 +2471,8 @@ int ext2_sync(ext2_fs_t *fs)
     if (!fs)
         return EXT2_ERR_INVAL;
 
+    int irc = ext2_icache_flush(fs);
+
     /*
      * If, for some reason, the superblock is still marked dirty,
      * commit it now.
@@ -1460,12 +2485,11 @@ int ext2_sync(ext2_fs_t *fs)
 
     /*
      * Future:
-     *  - Flush inode cache
      *  - Flush block cache
      *  - Flush bitmap cache
      *  - Flush directory cache
      *  - ATA FLUSH CACHE
      */
 
-    return EXT2_OK;
+    return irc;
 }
\ No newline at end of file
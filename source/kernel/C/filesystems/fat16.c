@@ -13,6 +13,7 @@
 #include <memory.h>
 #include <debugger.h>
 #include <strings.h>
+#include <filesystems/page_cache.h>
 
 typedef struct {
     char name[13];
@@ -96,7 +97,17 @@ int fat16_mount(int portno, uint32_t partition_lba, fat16_fs_t* fs) {
     fs->data_start = fs->root_dir_start + fs->root_dir_sectors;
     fs->cwd_cluster = FAT16_ROOT_CLUSTER;
     strcpy(fs->cwd_path, "/");
-    
+
+    uint32_t total_sectors = bs->total_sectors_short ? bs->total_sectors_short : bs->total_sectors_long;
+    uint32_t used = fs->data_start - partition_lba;
+    fs->cluster_count = (total_sectors > used && bs->sectors_per_cluster)
+                        ? (total_sectors - used) / bs->sectors_per_cluster : 0;
+
+    /* The whole FAT is at most 128 KiB; keep it in memory */
+    if (fat_table_init(&fs->fat, portno, fs->fat_start, bs->sectors_per_fat, bs->num_fats,
+                       2, fs->cluster_count, FAT16_EOC) != 0)
+        return FAT_ERR_IO;
+
     return FAT_OK;
 }
 
@@ -106,12 +117,10 @@ void fat16_unmount(fat16_fs_t* fs)
         return;
 
     /*
-     * FAT16 has no runtime state that must be flushed
-     * because:
-     *  - FAT updates are written immediately
-     *  - directory entries are written immediately
-     *  - no write-back cache exists
+     * The FAT is cached in memory; write it back and drop it. Directory
+     * entries are written immediately.
      */
+    fat_table_release(&fs->fat);
 
     /* Clear sensitive fields (debug-friendly) */
     fs->portno = 0;
@@ -145,43 +154,8 @@ static int fat16_next_cluster_safe(fat16_fs_t* fs,
     return FAT_OK;
 }
 
-static int fat16_next_cluster_with_fallback(fat16_fs_t* fs,
-                                            uint16_t current,
-                                            uint16_t* next,
-                                            uint32_t* depth)
-{
-    int rc = fat16_next_cluster_safe(fs, current, next, depth);
-    if (rc != FAT_OK)
-        return rc;
-
-    /* A FAT entry of 0 in a live chain means corruption, not free cluster */
-    if (*next == 0) {
-        eprintf("fat16: FAT entry 0 in live chain at cluster %u", current);
-        return FAT_ERR_CORRUPT;
-    }
-
-    return FAT_OK;
-}
-
-
 uint16_t fat16_read_fat_fs(fat16_fs_t* fs, uint16_t cluster) {
-    uint8_t buf[512];
-    uint32_t offset = (uint32_t)cluster * 2;
-    uint32_t bps    = fs->bs.bytes_per_sector;
-    uint32_t sector = fs->fat_start + offset / bps;
-    uint32_t off    = offset % bps;
-
-    ahci_read_sector(fs->portno, sector, buf, 1);
-
-    /* If the 2-byte entry straddles a sector boundary, read the high byte
-     * from the next sector. */
-    if (off + 1 >= bps) {
-        uint8_t buf2[512];
-        ahci_read_sector(fs->portno, sector + 1, buf2, 1);
-        return (uint16_t)buf[off] | ((uint16_t)buf2[0] << 8);
-    }
-
-    return *(uint16_t*)(buf + off);
+    return (uint16_t)fat_table_get(&fs->fat, cluster);
 }
 
 // HELPERS ============
@@ -536,68 +510,116 @@ int fat16_open(fat16_fs_t* fs, const char* path, fat16_file_t* f) {
     return FAT_OK;
 }
 
+/**
+ * @brief Cluster number @p index of the chain of @p f, 0 if the chain is
+ * shorter. Lookups go through the extent map of the file, so a seek costs a
+ * binary search once the chain up to it has been mapped. With @p extend, a
+ * chain that ends early is grown instead, as one run if it fits.
+ *
+ * @param run If not NULL, receives how many clusters from there on are
+ * consecutive on disk.
+ */
+static uint16_t fat16_file_cluster(fat16_file_t* f, uint32_t index, bool extend, uint32_t* run)
+{
+    for (;;) {
+        uint32_t cluster = fat_extent_map(&f->fs->fat, &f->map, f->entry.first_cluster, index, run);
+        if (cluster || !extend)
+            return (uint16_t)cluster;
+
+        /* Only a chain that really ends there is grown */
+        uint32_t last;
+        uint32_t have = fat_extent_count(&f->map, &last);
+        uint32_t got;
+        if (have == 0 || fat16_read_fat_fs(f->fs, (uint16_t)last) < FAT16_EOC)
+            return 0;
+        if (!fat16_allocate_run(f->fs, (uint16_t)last, index + 1 - have, &got))
+            return 0;
+    }
+}
+
 int fat16_read(fat16_file_t* f, uint8_t* out, uint32_t size) {
     if (!f || !f->fs || !out || size == 0)
         return 0;
 
     uint32_t read = 0;
     uint8_t sector[512];
-    uint32_t depth = 0;
     uint32_t bps = f->fs->bs.bytes_per_sector;
     uint32_t cluster_size = f->fs->bs.sectors_per_cluster * bps;
-    uint16_t cluster = f->entry.first_cluster;
 
-    if (cluster_size == 0 || cluster < 2)
+    if (cluster_size == 0 || f->entry.first_cluster < 2)
+        return 0;
+    if (f->pos >= f->entry.filesize)
         return 0;
 
-    uint32_t start_cluster_index = f->pos / cluster_size;
-    for (uint32_t i = 0; i < start_cluster_index; ++i) {
-        uint16_t next = 0;
-        if (fat16_next_cluster_with_fallback(f->fs, cluster, &next, &depth) != FAT_OK) {
-            eprintf("fat16: seek walk failed pos=%x idx=%u cluster=%u", f->pos, start_cluster_index, cluster);
-            return 0;
+    while (read < size && f->pos < f->entry.filesize) {
+        uint32_t run;
+        uint16_t cluster = fat16_file_cluster(f, f->pos / cluster_size, false, &run);
+        if (cluster == 0) {
+            eprintf("fat16: short read pos=%x read=%u want=%u", f->pos, read, size);
+            return read;
         }
-        cluster = next;
-    }
+        f->cluster = cluster;
 
-    while (read < size && f->pos < f->entry.filesize) {
-        uint32_t sector_in_cluster =
-            (f->pos / bps) % f->fs->bs.sectors_per_cluster;
+        /* Up to the end of the run, the request or the file */
+        uint32_t want = run * cluster_size - f->pos % cluster_size;
+        if (want > size - read)
+            want = size - read;
+        if (want > f->entry.filesize - f->pos)
+            want = f->entry.filesize - f->pos;
 
-        uint32_t lba =
-            fat16_cluster_lba(f->fs, cluster) + sector_in_cluster;
+        uint32_t lba = fat16_cluster_lba(f->fs, cluster) + (f->pos % cluster_size) / bps;
+        uint32_t off = f->pos % bps;
+        uint32_t to_copy;
+
+        if (off == 0 && want >= bps) {
+            /* Whole sectors of the run go to the caller in one request */
+            uint32_t sectors = want / bps;
+            if (ahci_read_sector(f->fs->portno, lba, out + read, sectors) != 0)
+                return read;
+            to_copy = sectors * bps;
+        } else {
+            if (ahci_read_sector(f->fs->portno, lba, sector, 1) != 0)
+                return read;
+            to_copy = bps - off;
+            if (to_copy > want)
+                to_copy = want;
+            memcpy(out + read, sector + off, to_copy);
+        }
 
-        ahci_read_sector(f->fs->portno, lba, sector, 1);
+        f->pos += to_copy;
+        read += to_copy;
+    }
 
-        uint32_t off = f->pos % bps;
-        uint32_t to_copy = bps - off;
+    return read;
+}
+
+/* Queues [offset, offset + bytes) of the file into the block cache, no wait */
+int fat16_readahead(fat16_file_t* f, uint32_t offset, uint32_t bytes)
+{
+    if (!f || !f->fs || bytes == 0 || f->entry.first_cluster < 2)
+        return -1;
 
-        if (to_copy > size - read)
-            to_copy = size - read;
-        if (to_copy > f->entry.filesize - f->pos)
-            to_copy = f->entry.filesize - f->pos;
+    uint32_t spc = f->fs->bs.sectors_per_cluster;
+    uint32_t cluster_size = spc * f->fs->bs.bytes_per_sector;
+    if (cluster_size == 0)
+        return -1;
 
-        memcpy(out + read, sector + off, to_copy);
+    uint32_t index = offset / cluster_size;
+    uint32_t last = (offset + bytes - 1) / cluster_size;
 
-        uint32_t cluster_index_before = f->pos / cluster_size;
-        f->pos += to_copy;
-        read += to_copy;
-        f->cluster = cluster;
+    while (index <= last) {
+        uint32_t run;
+        uint16_t cluster = fat16_file_cluster(f, index, false, &run);
+        if (!cluster)
+            break;
+        if (run > last - index + 1)
+            run = last - index + 1;
 
-        if (read < size && f->pos < f->entry.filesize) {
-            uint32_t cluster_index_after = f->pos / cluster_size;
-            if (cluster_index_after != cluster_index_before) {
-                uint16_t next = 0;
-                if (fat16_next_cluster_with_fallback(f->fs, cluster, &next, &depth) != FAT_OK) {
-                    eprintf("fat16: short read pos=%x read=%u want=%u cluster=%u", f->pos, read, size, cluster);
-                    return read;
-                }
-                cluster = next;
-            }
-        }
+        ahci_prefetch_sectors(f->fs->portno, fat16_cluster_lba(f->fs, cluster), run * spc);
+        index += run;
     }
 
-    return read;
+    return 0;
 }
 
 int fat16_write(fat16_file_t* f, const uint8_t* data, uint32_t size)
@@ -618,36 +640,24 @@ int fat16_write(fat16_file_t* f, const uint8_t* data, uint32_t size)
         fat16_write_fat_entry(f->fs, c, FAT16_EOC);
         f->entry.first_cluster = c;
         f->cluster = c;
+        fat_extent_reset(&f->map);
     }
 
-    /* Cache current cluster to avoid re-walking from head every sector */
-    uint16_t cur_cluster = f->cluster;
-    if (cur_cluster < 2)
-        cur_cluster = f->entry.first_cluster;
+    /* Grow the chain for the whole write up front so it can be one run */
+    if (size)
+        fat16_file_cluster(f, (f->pos + size - 1) / cluster_size, true, NULL);
 
     while (written < size) {
         uint32_t cluster_index = f->pos / cluster_size;
         uint32_t sector_in_cluster =
             (f->pos / bps) % f->fs->bs.sectors_per_cluster;
 
-        /* Only re-walk from head if cluster cache is stale (e.g. seek) */
-        uint16_t cluster = f->entry.first_cluster;
-        for (uint32_t i = 0; i < cluster_index; i++) {
-            uint16_t next = fat16_read_fat_fs(f->fs, cluster);
-
-            if (next >= FAT16_EOC) {
-                next = fat16_allocate_cluster(f->fs);
-                if (!next)
-                    return written;
-
-                fat16_write_fat_entry(f->fs, cluster, next);
-                fat16_write_fat_entry(f->fs, next, FAT16_EOC);
-            }
-
-            cluster = next;
-        }
+        /* Looked up in the extent map, growing the chain as needed */
+        uint16_t cluster = fat16_file_cluster(f, cluster_index, true, NULL);
+        if (!cluster)
+            return written;
 
-        cur_cluster = cluster;
+        f->cluster = cluster;
 
         uint32_t lba =
             fat16_cluster_lba(f->fs, cluster) + sector_in_cluster;
@@ -666,8 +676,6 @@ int fat16_write(fat16_file_t* f, const uint8_t* data, uint32_t size)
         written += to_copy;
     }
 
-    f->cluster = cur_cluster;
-
     /* Only update filesize if we extended the file */
     if (f->pos > f->entry.filesize)
         f->entry.filesize = f->pos;
@@ -682,93 +690,49 @@ int fat16_write(fat16_file_t* f, const uint8_t* data, uint32_t size)
 }
 
 void fat16_close(fat16_file_t* f) {
+    if (f->fs)
+        fat_table_flush(&f->fs->fat);
+    fat_extent_reset(&f->map);
     memset(f, 0, sizeof(*f));
 }
 
 // WRITE WITH EXTEND = START ========
 uint16_t fat16_find_free_cluster(fat16_fs_t* fs) {
-    uint8_t sector[512];
-    uint32_t bps = fs->bs.bytes_per_sector;
-    uint32_t entries_per_sector = bps / 2; /* each FAT16 entry is 2 bytes */
-
-    for (uint32_t s = 0; s < fs->bs.sectors_per_fat; s++) {
-        ahci_read_sector(fs->portno, fs->fat_start + s, sector, 1);
-
-        uint16_t* fat = (uint16_t*)sector;
-        for (uint32_t i = 0; i < entries_per_sector; i++) {
-            uint32_t cluster = s * entries_per_sector + i;
-
-            if (cluster < 2)
-                continue;
-
-            if (cluster >= 0xFFF8) /* past valid cluster range */
-                return 0;
-
-            if (fat[i] == 0x0000)
-                return (uint16_t)cluster;
-        }
-    }
-
-    return 0; /* disk full */
+    /* From the in-memory free bitmap; 0 = disk full */
+    return (uint16_t)fat_table_find_run(&fs->fat, fs->fat.next_free, 1);
 }
 
 void fat16_write_fat_entry(fat16_fs_t* fs, uint16_t cluster, uint16_t value) {
-    uint32_t offset  = (uint32_t)cluster * 2;
-    uint32_t bps     = fs->bs.bytes_per_sector;
-    uint32_t sec_off = offset / bps;
-    uint32_t byte_off = offset % bps;
-
-    uint8_t buf[512];
-
-    /* Write to every FAT copy */
-    for (uint8_t fat_n = 0; fat_n < fs->bs.num_fats; fat_n++) {
-        uint32_t fat_base = fs->fat_start + fat_n * fs->bs.sectors_per_fat;
-        uint32_t sector   = fat_base + sec_off;
-
-        ahci_read_sector(fs->portno, sector, buf, 1);
-
-        if (byte_off + 1 >= bps) {
-            /* Entry straddles sector boundary */
-            buf[byte_off] = (uint8_t)(value & 0xFF);
-            ahci_write_sector(fs->portno, sector, buf, 1);
-
-            ahci_read_sector(fs->portno, sector + 1, buf, 1);
-            buf[0] = (uint8_t)(value >> 8);
-            ahci_write_sector(fs->portno, sector + 1, buf, 1);
-        } else {
-            *(uint16_t*)(buf + byte_off) = value;
-            ahci_write_sector(fs->portno, sector, buf, 1);
-        }
-    }
+    /* Reaches every FAT copy on the next flush */
+    fat_table_set(&fs->fat, cluster, value);
 }
 
-uint16_t fat16_allocate_cluster(fat16_fs_t* fs) {
-    uint16_t cluster = fat16_find_free_cluster(fs);
-    if (cluster == 0)
+uint16_t fat16_allocate_run(fat16_fs_t* fs, uint16_t prev, uint32_t count, uint32_t* got) {
+    uint16_t first = (uint16_t)fat_table_alloc(&fs->fat, prev, count, got);
+    if (first == 0)
         return 0;
 
-    fat16_write_fat_entry(fs, cluster, FAT16_EOC);
-
-    /* Zero out the newly allocated cluster */
+    /* Zero out the newly allocated clusters */
     uint8_t zero[512];
     memset(zero, 0, sizeof(zero));
-    uint32_t lba = fat16_cluster_lba(fs, cluster);
 
-    for (uint32_t s = 0; s < fs->bs.sectors_per_cluster; s++)
-        ahci_write_sector(fs->portno, lba + s, zero, 1);
+    for (uint32_t i = 0; i < *got; i++) {
+        uint32_t lba = fat16_cluster_lba(fs, (uint16_t)(first + i));
+        for (uint32_t s = 0; s < fs->bs.sectors_per_cluster; s++)
+            ahci_write_sector(fs->portno, lba + s, zero, 1);
+    }
 
-    return cluster;
+    return first;
 }
 
-uint16_t fat16_append_cluster(fat16_fs_t* fs, uint16_t last_cluster) {
-    uint16_t new_cluster = fat16_allocate_cluster(fs);
-    if (!new_cluster)
-        return 0;
-
-    fat16_write_fat_entry(fs, last_cluster, new_cluster);
-    fat16_write_fat_entry(fs, new_cluster, FAT16_EOC);
+uint16_t fat16_allocate_cluster(fat16_fs_t* fs) {
+    uint32_t got;
+    return fat16_allocate_run(fs, 0, 1, &got);
+}
 
-    return new_cluster;
+uint16_t fat16_append_cluster(fat16_fs_t* fs, uint16_t last_cluster) {
+    uint32_t got;
+    return fat16_allocate_run(fs, last_cluster, 1, &got);
 }
 
 void fat16_update_root_entry(
@@ -810,6 +774,9 @@ void fat16_free_chain(fat16_fs_t* fs, uint16_t start_cluster)
     uint16_t cluster = start_cluster;
     uint32_t depth = 0;
 
+    // Pages are cached by first cluster, which the next file may get.
+    page_cache_invalidate(fs, start_cluster);
+
     while (cluster >= 2 && cluster < FAT16_EOC) {
         uint16_t next;
 
@@ -1059,6 +1026,7 @@ int fat16_truncate(fat16_file_t* f, uint32_t new_size)
         f->entry.filesize = 0;
         f->pos = 0;
         f->cluster = 0;
+        fat_extent_reset(&f->map);
         return FAT_OK;
     }
 
@@ -1069,6 +1037,9 @@ int fat16_truncate(fat16_file_t* f, uint32_t new_size)
     uint32_t keep_clusters =
         (new_size + cluster_size - 1) / cluster_size;
 
+    /* Cached pages past the new end would come back if the file grows */
+    page_cache_invalidate(f->fs, f->entry.first_cluster);
+
     uint16_t cluster = f->entry.first_cluster;
     uint16_t prev    = 0;
 
@@ -1096,6 +1067,10 @@ int fat16_truncate(fat16_file_t* f, uint32_t new_size)
     if (f->pos > new_size)
         f->pos = new_size;
 
+    /* The cached cluster and the tail of the map may have been freed */
+    f->cluster = f->entry.first_cluster;
+    fat_extent_reset(&f->map);
+
     return FAT_OK;
 }
 
@@ -1713,11 +1688,9 @@ int fat16_sync(fat16_fs_t *fs)
 
     /*
      * Future work:
-     *  - Flush FAT cache
      *  - Flush directory cache
-     *  - Flush data block cache
      *  - Issue ATA FLUSH CACHE if supported
      */
 
-    return 0;
+    return fat_table_flush(&fs->fat) == 0 ? 0 : -1;
 }
\ No newline at end of file
@@ -9,12 +9,14 @@
  * 
  */
 #include <filesystems/fat32.h>
+#include <ahci.h>
 #include <heap.h>
 #include <stdint.h>
 #include <strings.h>
 #include <basics.h>
 #include <graphics.h>
 #include <memory.h>
+#include <filesystems/page_cache.h>
 
 /* ========================== */
 /*  LOW LEVEL DISK WRAPPERS   */
@@ -25,7 +27,7 @@ static inline int fat32_read_sector(fat32_fs_t* fs, uint32_t lba, void* buf) {
 }
 
 static inline int fat32_write_sector(fat32_fs_t* fs, uint32_t lba, const void* buf) {
-    return ahci_write_sector(fs->portno, lba, buf, 1);
+    return ahci_write_sector(fs->portno, lba, (void*)buf, 1);
 }
 
 /* ========================== */
@@ -50,51 +52,26 @@ static int fat32_zero_cluster(fat32_fs_t* fs, uint32_t cluster) {
 }
 
 uint32_t fat32_read_fat(fat32_fs_t* fs, uint32_t cluster) {
-    uint32_t offset = cluster * 4;
-    uint32_t lba = fs->fat_start_lba + (offset / FAT32_SECTOR_SIZE);
-    uint32_t off = offset % FAT32_SECTOR_SIZE;
-
-    uint8_t sector[FAT32_SECTOR_SIZE];
-    if (fat32_read_sector(fs, lba, sector))
-        return FAT32_CLUSTER_EOC;
-
-    return (*(uint32_t*)(sector + off)) & 0x0FFFFFFF;
+    return fat_table_get(&fs->fat, cluster);
 }
 
 static int fat32_write_fat(fat32_fs_t* fs, uint32_t cluster, uint32_t value) {
-    uint32_t offset = cluster * 4;
-    uint32_t lba = fs->fat_start_lba + (offset / FAT32_SECTOR_SIZE);
-    uint32_t off = offset % FAT32_SECTOR_SIZE;
-
-    uint8_t sector[FAT32_SECTOR_SIZE];
-    if (fat32_read_sector(fs, lba, sector))
-        return -1;
+    return fat_table_set(&fs->fat, cluster, value);
+}
 
-    *(uint32_t*)(sector + off) = (value & 0x0FFFFFFF) | (*(uint32_t*)(sector + off) & 0xF0000000);
-    return fat32_write_sector(fs, lba, sector);
+uint32_t fat32_alloc_run(fat32_fs_t* fs, uint32_t prev, uint32_t count, uint32_t* got) {
+    return fat_table_alloc(&fs->fat, prev, count, got);
 }
 
 uint32_t fat32_alloc_cluster(fat32_fs_t* fs) {
-    uint32_t start = fs->last_alloc ? fs->last_alloc : 2;
-    uint32_t end = fs->total_clusters + 2;
-
-    for (uint32_t pass = 0; pass < 2; pass++) {
-        uint32_t from = (pass == 0) ? start : 2;
-        uint32_t to = (pass == 0) ? end : start;
-
-        for (uint32_t c = from; c < to; c++) {
-            if (fat32_read_fat(fs, c) == FAT32_CLUSTER_FREE) {
-                if (fat32_write_fat(fs, c, FAT32_CLUSTER_EOC))
-                    return 0;
-                fs->last_alloc = c;
-                return c;
-            }
-        }
-    }
-    return 0;
+    uint32_t got;
+    return fat32_alloc_run(fs, 0, 1, &got);
 }
 
 static void fat32_free_chain(fat32_fs_t* fs, uint32_t cluster) {
+    // Pages are cached by first cluster, which the next file may get.
+    page_cache_invalidate(fs, cluster);
+
     while (cluster >= 2 && cluster < FAT32_CLUSTER_EOC) {
         uint32_t next = fat32_read_fat(fs, cluster);
         fat32_write_fat(fs, cluster, FAT32_CLUSTER_FREE);
@@ -151,6 +128,35 @@ static int fat32_read_cluster(fat32_fs_t* fs, uint32_t cluster, uint8_t* buf) {
 /*  MOUNT                     */
 /* ========================== */
 
+/*
+ * The FSInfo sector caches the free count and where the last allocation
+ * ended. The count is recomputed while loading the FAT anyway; the hint
+ * saves a search from cluster 2 after a remount.
+ */
+static void fat32_read_fsinfo(fat32_fs_t* fs)
+{
+    uint8_t sector[FAT32_SECTOR_SIZE];
+    uint16_t rel = fs->bpb.fs_info_sector;
+
+    fs->fsinfo_lba = 0;
+    if (rel == 0 || rel == 0xFFFF || rel >= fs->bpb.reserved_sectors)
+        return;
+    if (fat32_read_sector(fs, fs->partition_lba + rel, sector))
+        return;
+
+    fat32_fsinfo_t* info = (fat32_fsinfo_t*)sector;
+    if (info->lead_sig != FAT32_FSINFO_LEAD_SIG || info->struct_sig != FAT32_FSINFO_STRUCT_SIG ||
+        info->trail_sig != FAT32_FSINFO_TRAIL_SIG)
+        return;
+
+    fs->fsinfo_lba = fs->partition_lba + rel;
+    fs->fsinfo_free = info->free_count;
+    fs->fsinfo_next = info->next_free;
+
+    if (info->next_free >= 2 && info->next_free < fs->fat.clusters + 2)
+        fs->fat.next_free = info->next_free;
+}
+
 int fat32_mount(int portno, uint32_t part_lba, fat32_fs_t* fs) {
     uint8_t sector[FAT32_SECTOR_SIZE];
 
@@ -177,9 +183,58 @@ int fat32_mount(int portno, uint32_t part_lba, fat32_fs_t* fs) {
                              fs->bpb.fat_count * fs->bpb.fat_size_32);
 
     fs->total_clusters = data / fs->sectors_per_cluster;
+
+    /* With mirroring off only the active FAT is used */
+    uint32_t fat_lba = fs->fat_start_lba;
+    uint8_t fat_count = fs->bpb.fat_count;
+    if (fs->bpb.ext_flags & FAT32_EXT_NO_MIRROR) {
+        fat_lba += (fs->bpb.ext_flags & FAT32_EXT_ACTIVE_FAT) * fs->bpb.fat_size_32;
+        fat_count = 1;
+    }
+
+    if (fat_table_init(&fs->fat, portno, fat_lba, fs->bpb.fat_size_32, fat_count,
+                       4, fs->total_clusters, FAT32_CLUSTER_EOC) != 0)
+        return -1;
+
+    fat32_read_fsinfo(fs);
     return 0;
 }
 
+int fat32_fs_sync(fat32_fs_t* fs)
+{
+    if (!fs)
+        return FAT_ERR_INVALID;
+
+    int rc = fat_table_flush(&fs->fat) == 0 ? FAT_OK : FAT_ERR_IO;
+
+    if (fs->fsinfo_lba &&
+        (fs->fsinfo_free != fs->fat.free_count || fs->fsinfo_next != fs->fat.next_free)) {
+        uint8_t sector[FAT32_SECTOR_SIZE];
+        if (fat32_read_sector(fs, fs->fsinfo_lba, sector) == 0) {
+            fat32_fsinfo_t* info = (fat32_fsinfo_t*)sector;
+            info->free_count = fs->fat.free_count;
+            info->next_free = fs->fat.next_free;
+            if (fat32_write_sector(fs, fs->fsinfo_lba, sector) == 0) {
+                fs->fsinfo_free = info->free_count;
+                fs->fsinfo_next = info->next_free;
+            } else {
+                rc = FAT_ERR_IO;
+            }
+        }
+    }
+
+    return rc;
+}
+
+void fat32_unmount(fat32_fs_t* fs)
+{
+    if (!fs)
+        return;
+
+    fat32_fs_sync(fs);
+    fat_table_release(&fs->fat);
+}
+
 /* ========================== */
 /*  OPEN (LFN + 8.3)          */
 /* ========================== */
@@ -245,6 +300,22 @@ int fat32_open(fat32_fs_t* fs, const char* path, fat32_file_t* f) {
 /*  READ                      */
 /* ========================== */
 
+/**
+ * @brief Cluster number @p index of the file, looked up in its extent map,
+ * which is extended from the FAT only as far as needed. Returns 0 if the
+ * chain is shorter.
+ *
+ * @param run If not NULL, receives how many clusters from there on are
+ * consecutive on disk.
+ */
+static uint32_t fat32_file_cluster(fat32_file_t* f, uint32_t index, uint32_t* run)
+{
+    uint32_t cluster = fat_extent_map(&f->fs->fat, &f->map, f->start_cluster, index, run);
+    if (cluster)
+        f->current_cluster = cluster;
+    return cluster;
+}
+
 int fat32_read(fat32_file_t* f, void* buf, uint32_t len) {
     if (!f || !buf) return -1;
 
@@ -252,36 +323,73 @@ int fat32_read(fat32_file_t* f, void* buf, uint32_t len) {
     uint32_t done = 0;
     uint32_t cluster_size =
         f->fs->sectors_per_cluster * FAT32_SECTOR_SIZE;
-
-    uint8_t* clbuf = kmalloc(cluster_size);
-    if (!clbuf)
-        return -1;
+    uint8_t sector[FAT32_SECTOR_SIZE];
 
     while (len && f->pos < f->entry.file_size) {
-        if (fat32_read_cluster(f->fs, f->current_cluster, clbuf)) {
-            kfree(clbuf);
-            return -1;
-        }
-
-        uint32_t off = f->pos % cluster_size;
-        uint32_t take = cluster_size - off;
+        uint32_t run;
+        uint32_t cluster = fat32_file_cluster(f, f->pos / cluster_size, &run);
+        if (!cluster)
+            break;
+
+        // As far as the run of consecutive clusters, the request and the
+        // file all go.
+        uint32_t take = run * cluster_size - f->pos % cluster_size;
         if (take > len) take = len;
         if (take > f->entry.file_size - f->pos)
             take = f->entry.file_size - f->pos;
 
-        memcpy(out + done, clbuf + off, take);
+        uint32_t lba = fat32_cluster_lba(f->fs, cluster) +
+                       (f->pos % cluster_size) / FAT32_SECTOR_SIZE;
+        uint32_t off = f->pos % FAT32_SECTOR_SIZE;
+
+        if (off == 0 && take >= FAT32_SECTOR_SIZE) {
+            // Whole sectors are read straight into the caller's buffer.
+            uint32_t sectors = take / FAT32_SECTOR_SIZE;
+            if (ahci_read_sector(f->fs->portno, lba, out + done, sectors) != 0)
+                return -1;
+            take = sectors * FAT32_SECTOR_SIZE;
+        } else {
+            if (ahci_read_sector(f->fs->portno, lba, sector, 1) != 0)
+                return -1;
+            if (take > FAT32_SECTOR_SIZE - off)
+                take = FAT32_SECTOR_SIZE - off;
+            memcpy(out + done, sector + off, take);
+        }
 
         done += take;
         f->pos += take;
         len -= take;
-
-        if (off + take >= cluster_size)
-            f->current_cluster = fat32_read_fat(f->fs, f->current_cluster);
     }
-    kfree(clbuf);
     return done;
 }
 
+/* Queues [offset, offset + bytes) of the file into the block cache, no wait */
+int fat32_readahead(fat32_file_t* f, uint32_t offset, uint32_t bytes)
+{
+    if (!f || !f->fs || bytes == 0)
+        return -1;
+
+    uint32_t spc = f->fs->sectors_per_cluster;
+    uint32_t cluster_size = spc * FAT32_SECTOR_SIZE;
+    uint32_t index = offset / cluster_size;
+    uint32_t last = (offset + bytes - 1) / cluster_size;
+
+    // Not fat32_file_cluster(): the file keeps its place.
+    while (index <= last) {
+        uint32_t run;
+        uint32_t cluster = fat_extent_map(&f->fs->fat, &f->map, f->start_cluster, index, &run);
+        if (!cluster)
+            break;
+        if (run > last - index + 1)
+            run = last - index + 1;
+
+        ahci_prefetch_sectors(f->fs->portno, fat32_cluster_lba(f->fs, cluster), run * spc);
+        index += run;
+    }
+
+    return 0;
+}
+
 /* ========================== */
 /*  WRITE (AUTO EXTEND)       */
 /* ========================== */
@@ -300,6 +408,7 @@ int fat32_write(fat32_file_t* f, const void* buf, uint32_t len) {
             return -1;
         fat32_zero_cluster(f->fs, f->start_cluster);
         f->current_cluster = f->start_cluster;
+        fat_extent_reset(&f->map);
     }
 
     uint8_t* clbuf = kmalloc(cluster_size);
@@ -307,7 +416,28 @@ int fat32_write(fat32_file_t* f, const void* buf, uint32_t len) {
         return -1;
 
     while (len) {
-        if (fat32_read_cluster(f->fs, f->current_cluster, clbuf)) {
+        uint32_t cluster = fat32_file_cluster(f, f->pos / cluster_size, NULL);
+        if (!cluster) {
+            // The chain ends before pos: grow it by what the rest of the
+            // write needs, in one run if the free space allows. The map
+            // then covers the whole chain and simply extends past it.
+            uint32_t last;
+            uint32_t have = fat_extent_count(&f->map, &last);
+            uint32_t need = (f->pos + len - 1) / cluster_size + 1 - have;
+            uint32_t got = 0;
+            uint32_t next = 0;
+            if (have && fat32_read_fat(f->fs, last) >= FAT32_CLUSTER_EOC)
+                next = fat32_alloc_run(f->fs, last, need, &got);
+            if (!next) {
+                kfree(clbuf);
+                return -1;
+            }
+            for (uint32_t i = 0; i < got; i++)
+                fat32_zero_cluster(f->fs, next + i);
+            continue;
+        }
+
+        if (fat32_read_cluster(f->fs, cluster, clbuf)) {
             kfree(clbuf);
             return -1;
         }
@@ -318,7 +448,7 @@ int fat32_write(fat32_file_t* f, const void* buf, uint32_t len) {
 
         memcpy(clbuf + off, in + done, take);
 
-        uint32_t lba = fat32_cluster_lba(f->fs, f->current_cluster);
+        uint32_t lba = fat32_cluster_lba(f->fs, cluster);
         for (uint32_t i = 0; i < f->fs->sectors_per_cluster; i++)
             if (fat32_write_sector(f->fs, lba + i,
                 clbuf + i * FAT32_SECTOR_SIZE)) {
@@ -329,20 +459,6 @@ int fat32_write(fat32_file_t* f, const void* buf, uint32_t len) {
         done += take;
         f->pos += take;
         len -= take;
-
-        if (off + take >= cluster_size) {
-            uint32_t next = fat32_read_fat(f->fs, f->current_cluster);
-            if (next >= FAT32_CLUSTER_EOC) {
-                next = fat32_alloc_cluster(f->fs);
-                if (!next) {
-                    kfree(clbuf);
-                    return -1;
-                }
-                fat32_write_fat(f->fs, f->current_cluster, next);
-                fat32_zero_cluster(f->fs, next);
-            }
-            f->current_cluster = next;
-        }
     }
 
     if (f->pos > f->entry.file_size)
@@ -364,6 +480,9 @@ void fat32_close(fat32_file_t* f)
         return;
 
     fat32_sync(f);
+    if (f->fs)
+        fat_table_flush(&f->fs->fat);
+    fat_extent_reset(&f->map);
 
     memset(f, 0, sizeof(*f));
 }
@@ -488,6 +607,10 @@ int fat32_truncate(fat32_file_t* file, uint32_t new_size)
 
     fat32_update_entry(fs, entry);
 
+    /* The cluster the file was at, and the end of the map, may be gone */
+    file->current_cluster = file->start_cluster;
+    fat_extent_reset(&file->map);
+
     return FAT_OK;
 }
 
@@ -653,6 +776,9 @@ void fat32_free_chain_from(
 {
     uint32_t c = start;
 
+    // Whole chain or a truncate: either way the cached pages are stale.
+    page_cache_invalidate(fs, start);
+
     while (keep-- && c < FAT32_CLUSTER_EOC)
         c = fat32_read_fat(fs, c);
 
@@ -669,15 +795,18 @@ void fat32_extend_chain(
     uint32_t count)
 {
     uint32_t c = start;
+    uint32_t next;
 
-    while (fat32_read_fat(fs, c) < FAT32_CLUSTER_EOC)
-        c = fat32_read_fat(fs, c);
+    while ((next = fat32_read_fat(fs, c)) < FAT32_CLUSTER_EOC)
+        c = next;
 
-    while (count--) {
-        uint32_t n = fat32_alloc_cluster(fs);
-        fat32_write_fat(fs, c, n);
-        fat32_write_fat(fs, n, FAT32_CLUSTER_EOC);
-        c = n;
+    while (count) {
+        uint32_t got = 0;
+        uint32_t n = fat32_alloc_run(fs, c, count, &got);
+        if (!n)
+            return;
+        c = n + got - 1;
+        count -= got;
     }
 }
 
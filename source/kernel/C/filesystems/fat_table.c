@@ -0,0 +1,450 @@
+/**
+ * @file fat_table.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief In-memory FAT with dirty-sector write-back and a free-cluster bitmap.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#include <filesystems/fat_table.h>
+#include <ahci.h>
+#include <heap.h>
+#include <memory.h>
+
+#define FAT_TABLE_CHUNK_BYTES   (FAT_TABLE_CHUNK_SECTORS * FAT_TABLE_SECTOR_SIZE)
+
+static inline bool fat_table_is_free(const fat_table_t* t, uint32_t cluster)
+{
+    return (t->free_map[cluster / 32] >> (cluster % 32)) & 1;
+}
+
+static inline uint32_t fat_table_limit(const fat_table_t* t)
+{
+    return t->clusters + 2;
+}
+
+static uint32_t fat_chunk_sectors(const fat_table_t* t, uint32_t chunk)
+{
+    uint32_t left = t->fat_sectors - chunk * FAT_TABLE_CHUNK_SECTORS;
+    return left < FAT_TABLE_CHUNK_SECTORS ? left : FAT_TABLE_CHUNK_SECTORS;
+}
+
+/**
+ * @brief Writes the dirty sectors of @p chunk to every FAT copy.
+ */
+static int fat_chunk_flush(fat_table_t* t, uint32_t chunk)
+{
+    fat_chunk_t* c = &t->chunks[chunk];
+    uint32_t sectors = fat_chunk_sectors(t, chunk);
+    int rc = 0;
+
+    for (uint32_t s = 0; s < sectors;) {
+        if (!(c->dirty & (1ULL << s))) {
+            s++;
+            continue;
+        }
+
+        uint32_t end = s;
+        while (end < sectors && (c->dirty & (1ULL << end)))
+            end++;
+
+        uint32_t lba = t->fat_lba + chunk * FAT_TABLE_CHUNK_SECTORS + s;
+        bool ok = true;
+        for (uint32_t copy = 0; copy < t->fat_count; copy++) {
+            if (ahci_write_sector(t->portno, lba + copy * t->fat_sectors,
+                                  c->data + s * FAT_TABLE_SECTOR_SIZE, end - s) != 0)
+                ok = false;
+        }
+
+        if (ok) {
+            uint32_t n = end - s;
+            c->dirty &= ~((n == 64 ? ~0ULL : (1ULL << n) - 1) << s);
+        } else {
+            rc = -1;
+        }
+        s = end;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Drops one loaded chunk, writing it back first if it is dirty.
+ */
+static void fat_chunk_evict(fat_table_t* t)
+{
+    for (uint32_t i = 0; i < t->nchunks; i++) {
+        uint32_t victim = t->clock;
+        t->clock = (t->clock + 1) % t->nchunks;
+
+        fat_chunk_t* c = &t->chunks[victim];
+        if (!c->data)
+            continue;
+        if (c->dirty && fat_chunk_flush(t, victim) != 0)
+            continue;
+
+        kfree(c->data);
+        c->data = NULL;
+        t->loaded--;
+        return;
+    }
+}
+
+static uint8_t* fat_chunk_get(fat_table_t* t, uint32_t chunk)
+{
+    fat_chunk_t* c = &t->chunks[chunk];
+    if (c->data)
+        return c->data;
+
+    if (t->loaded >= FAT_TABLE_MAX_CHUNKS)
+        fat_chunk_evict(t);
+
+    uint8_t* data = kmalloc(FAT_TABLE_CHUNK_BYTES);
+    if (!data)
+        return NULL;
+
+    if (ahci_read_sector(t->portno, t->fat_lba + chunk * FAT_TABLE_CHUNK_SECTORS,
+                         data, fat_chunk_sectors(t, chunk)) != 0) {
+        kfree(data);
+        return NULL;
+    }
+
+    c->data = data;
+    c->dirty = 0;
+    t->loaded++;
+    return data;
+}
+
+static inline uint32_t fat_entry_load(const fat_table_t* t, const uint8_t* p)
+{
+    if (t->entry_bytes == 2)
+        return *(const uint16_t*)p;
+    return *(const uint32_t*)p & 0x0FFFFFFF;
+}
+
+int fat_table_init(fat_table_t* t, int portno, uint32_t fat_lba, uint32_t fat_sectors,
+                   uint8_t fat_count, uint8_t entry_bytes, uint32_t clusters, uint32_t eoc)
+{
+    memset(t, 0, sizeof(*t));
+    t->lock = (task_mutex_t)TASK_MUTEX_INIT;
+    t->portno = portno;
+    t->fat_lba = fat_lba;
+    t->fat_sectors = fat_sectors;
+    t->fat_count = fat_count ? fat_count : 1;
+    t->entry_bytes = entry_bytes;
+    t->eoc = eoc;
+
+    // A FAT smaller than the data area it describes caps the cluster count.
+    uint32_t entries = fat_sectors * (FAT_TABLE_SECTOR_SIZE / entry_bytes);
+    if (entries < 2)
+        return -1;
+    t->clusters = clusters + 2 > entries ? entries - 2 : clusters;
+
+    t->nchunks = (fat_sectors + FAT_TABLE_CHUNK_SECTORS - 1) / FAT_TABLE_CHUNK_SECTORS;
+    t->chunks = kmalloc(t->nchunks * sizeof(fat_chunk_t));
+    uint32_t map_bytes = (fat_table_limit(t) + 31) / 32 * sizeof(uint32_t);
+    t->free_map = kmalloc(map_bytes);
+    if (!t->chunks || !t->free_map) {
+        fat_table_release(t);
+        return -1;
+    }
+    memset(t->chunks, 0, t->nchunks * sizeof(fat_chunk_t));
+    memset(t->free_map, 0, map_bytes);
+
+    uint32_t per_chunk = FAT_TABLE_CHUNK_BYTES / entry_bytes;
+    for (uint32_t chunk = 0; chunk < t->nchunks; chunk++) {
+        uint8_t* data = fat_chunk_get(t, chunk);
+        if (!data) {
+            fat_table_release(t);
+            return -1;
+        }
+
+        uint32_t first = chunk * per_chunk;
+        uint32_t end = first + fat_chunk_sectors(t, chunk) * (FAT_TABLE_SECTOR_SIZE / entry_bytes);
+        if (end > fat_table_limit(t))
+            end = fat_table_limit(t);
+
+        for (uint32_t cluster = first < 2 ? 2 : first; cluster < end; cluster++) {
+            if (fat_entry_load(t, data + (cluster - first) * entry_bytes) == 0) {
+                t->free_map[cluster / 32] |= 1U << (cluster % 32);
+                t->free_count++;
+            }
+        }
+    }
+
+    t->next_free = 2;
+    return 0;
+}
+
+void fat_table_release(fat_table_t* t)
+{
+    if (!t)
+        return;
+
+    if (t->chunks) {
+        fat_table_flush(t);
+        for (uint32_t i = 0; i < t->nchunks; i++) {
+            if (t->chunks[i].data)
+                kfree(t->chunks[i].data);
+        }
+        kfree(t->chunks);
+    }
+    if (t->free_map)
+        kfree(t->free_map);
+
+    t->chunks = NULL;
+    t->free_map = NULL;
+    t->nchunks = 0;
+    t->loaded = 0;
+}
+
+uint32_t fat_table_get(fat_table_t* t, uint32_t cluster)
+{
+    uint32_t offset = cluster * t->entry_bytes;
+    if (!t->chunks || offset / FAT_TABLE_SECTOR_SIZE >= t->fat_sectors)
+        return t->eoc;
+
+    multitasking_mutex_lock(&t->lock);
+    uint8_t* data = fat_chunk_get(t, offset / FAT_TABLE_CHUNK_BYTES);
+    uint32_t value = data ? fat_entry_load(t, data + offset % FAT_TABLE_CHUNK_BYTES) : t->eoc;
+    multitasking_mutex_unlock(&t->lock);
+    return value;
+}
+
+static int fat_table_put(fat_table_t* t, uint32_t cluster, uint32_t value)
+{
+    uint32_t offset = cluster * t->entry_bytes;
+    if (!t->chunks || offset / FAT_TABLE_SECTOR_SIZE >= t->fat_sectors)
+        return -1;
+
+    uint32_t chunk = offset / FAT_TABLE_CHUNK_BYTES;
+    uint8_t* data = fat_chunk_get(t, chunk);
+    if (!data)
+        return -1;
+
+    uint8_t* p = data + offset % FAT_TABLE_CHUNK_BYTES;
+    uint32_t old = fat_entry_load(t, p);
+    if (t->entry_bytes == 2) {
+        value &= 0xFFFF;
+        *(uint16_t*)p = (uint16_t)value;
+    } else {
+        // The top four bits are reserved and kept as they are.
+        value &= 0x0FFFFFFF;
+        *(uint32_t*)p = value | (*(uint32_t*)p & 0xF0000000);
+    }
+    t->chunks[chunk].dirty |= 1ULL << ((offset % FAT_TABLE_CHUNK_BYTES) / FAT_TABLE_SECTOR_SIZE);
+
+    if (cluster >= 2 && cluster < fat_table_limit(t) && (old == 0) != (value == 0)) {
+        if (value == 0) {
+            t->free_map[cluster / 32] |= 1U << (cluster % 32);
+            t->free_count++;
+        } else {
+            t->free_map[cluster / 32] &= ~(1U << (cluster % 32));
+            t->free_count--;
+        }
+    }
+    return 0;
+}
+
+int fat_table_set(fat_table_t* t, uint32_t cluster, uint32_t value)
+{
+    multitasking_mutex_lock(&t->lock);
+    int rc = fat_table_put(t, cluster, value);
+    multitasking_mutex_unlock(&t->lock);
+    return rc;
+}
+
+uint32_t fat_table_find_run(fat_table_t* t, uint32_t from, uint32_t want)
+{
+    uint32_t limit = fat_table_limit(t);
+    uint32_t first_free = 0;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+
+    if (!t->free_map || t->free_count == 0)
+        return 0;
+    if (from < 2 || from >= limit)
+        from = 2;
+    if (want == 0)
+        want = 1;
+
+    multitasking_mutex_lock(&t->lock);
+    uint32_t cluster = from;
+    for (uint32_t seen = 0; seen < t->clusters; ) {
+        // Runs do not wrap around the end of the volume.
+        if (cluster >= limit) {
+            cluster = 2;
+            run_len = 0;
+        }
+
+        if (cluster % 32 == 0 && t->free_map[cluster / 32] == 0) {
+            cluster += 32;
+            seen += 32;
+            run_len = 0;
+            continue;
+        }
+
+        if (fat_table_is_free(t, cluster)) {
+            if (!first_free)
+                first_free = cluster;
+            if (run_len++ == 0)
+                run_start = cluster;
+            if (run_len >= want) {
+                first_free = run_start;
+                break;
+            }
+        } else {
+            run_len = 0;
+        }
+        cluster++;
+        seen++;
+    }
+    multitasking_mutex_unlock(&t->lock);
+
+    return first_free;
+}
+
+uint32_t fat_table_alloc(fat_table_t* t, uint32_t prev, uint32_t count, uint32_t* got)
+{
+    uint32_t limit = fat_table_limit(t);
+    *got = 0;
+    if (count == 0)
+        count = 1;
+
+    multitasking_mutex_lock(&t->lock);
+
+    // Right behind the previous cluster keeps the file in one piece.
+    uint32_t from = t->next_free;
+    if (prev >= 2 && prev + 1 < limit)
+        from = prev + 1;
+
+    uint32_t first = fat_table_find_run(t, from, count);
+    if (!first) {
+        multitasking_mutex_unlock(&t->lock);
+        return 0;
+    }
+
+    uint32_t n = 0;
+    while (n < count && first + n < limit && fat_table_is_free(t, first + n))
+        n++;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t value = i + 1 < n ? first + i + 1 : t->eoc;
+        if (fat_table_put(t, first + i, value) != 0) {
+            // Give back what was taken; nothing points at it yet.
+            while (i--)
+                fat_table_put(t, first + i, 0);
+            multitasking_mutex_unlock(&t->lock);
+            return 0;
+        }
+    }
+    if (prev >= 2)
+        fat_table_put(t, prev, first);
+
+    t->next_free = first + n < limit ? first + n : 2;
+    multitasking_mutex_unlock(&t->lock);
+
+    *got = n;
+    return first;
+}
+
+int fat_table_flush(fat_table_t* t)
+{
+    if (!t->chunks)
+        return 0;
+
+    int rc = 0;
+    multitasking_mutex_lock(&t->lock);
+    for (uint32_t i = 0; i < t->nchunks; i++) {
+        if (t->chunks[i].data && t->chunks[i].dirty && fat_chunk_flush(t, i) != 0)
+            rc = -1;
+    }
+    multitasking_mutex_unlock(&t->lock);
+    return rc;
+}
+
+static bool fat_extent_push(fat_extent_map_t* m, uint32_t index, uint32_t cluster)
+{
+    if (m->n == m->cap) {
+        uint32_t cap = m->cap ? m->cap * 2 : 8;
+        fat_extent_t* ext = kmalloc(cap * sizeof(fat_extent_t));
+        if (!ext)
+            return false;
+        if (m->ext) {
+            memcpy(ext, m->ext, m->n * sizeof(fat_extent_t));
+            kfree(m->ext);
+        }
+        m->ext = ext;
+        m->cap = cap;
+    }
+
+    m->ext[m->n].index = index;
+    m->ext[m->n].cluster = cluster;
+    m->ext[m->n].count = 1;
+    m->n++;
+    return true;
+}
+
+uint32_t fat_extent_map(fat_table_t* t, fat_extent_map_t* m, uint32_t first,
+                        uint32_t index, uint32_t* run)
+{
+    if (m->n == 0) {
+        if (first < 2 || first >= fat_table_limit(t) || !fat_extent_push(m, 0, first))
+            return 0;
+    }
+
+    // Walk on from the end of what is mapped; a longer chain than the
+    // volume has clusters is a loop.
+    fat_extent_t* last = &m->ext[m->n - 1];
+    while (index >= last->index + last->count) {
+        uint32_t tail = last->cluster + last->count - 1;
+        uint32_t next = fat_table_get(t, tail);
+        if (next < 2 || next >= fat_table_limit(t) || last->index + last->count >= t->clusters)
+            return 0;
+
+        if (next == tail + 1) {
+            last->count++;
+        } else {
+            if (!fat_extent_push(m, last->index + last->count, next))
+                return 0;
+            last = &m->ext[m->n - 1];
+        }
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = m->n - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (m->ext[mid].index <= index)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    fat_extent_t* e = &m->ext[lo];
+    if (run)
+        *run = e->count - (index - e->index);
+    return e->cluster + (index - e->index);
+}
+
+uint32_t fat_extent_count(const fat_extent_map_t* m, uint32_t* last)
+{
+    if (m->n == 0)
+        return 0;
+
+    const fat_extent_t* e = &m->ext[m->n - 1];
+    if (last)
+        *last = e->cluster + e->count - 1;
+    return e->index + e->count;
+}
+
+void fat_extent_reset(fat_extent_map_t* m)
+{
+    if (m->ext)
+        kfree(m->ext);
+    m->ext = NULL;
+    m->n = 0;
+    m->cap = 0;
+}
@@ -277,6 +277,26 @@ int iso9660_read(iso9660_file_t* f, uint8_t* out, uint32_t size)
     return (int)done;
 }
 
+/* Queues [offset, offset + bytes) of the file into the block cache, no wait */
+int iso9660_readahead(iso9660_file_t* f, uint32_t offset, uint32_t bytes)
+{
+    if (!f || !f->fs || bytes == 0)
+        return -1;
+
+    if (offset >= f->entry.size)
+        return 0;
+    if (bytes > f->entry.size - offset)
+        bytes = f->entry.size - offset;
+
+    /* A file is one extent, so the whole range is one request */
+    uint32_t lbs = f->fs->logical_block_size;
+    uint32_t first = offset / lbs;
+    uint32_t blocks = (offset + bytes - 1) / lbs - first + 1;
+    uint32_t lba = f->fs->partition_lba + (f->entry.extent_lba + first) * (lbs / SECTOR_SIZE);
+
+    return ahci_prefetch_sectors(f->fs->portno, lba, blocks * (lbs / SECTOR_SIZE));
+}
+
 void iso9660_close(iso9660_file_t* f)
 {
     if (f)
@@ -15,9 +15,12 @@
 #include <heap.h>
 #include <memory.h>
 #include <pci.h>
+#include <paging.h>
 #include <strings.h>
+#include <ahci.h>
+#include <disk/bio.h>
 
-#define PROCFS_MAX_FILES 32
+#define PROCFS_MAX_FILES 64
 
 static procfs_entry_t* proc_files[PROCFS_MAX_FILES];
 static int proc_file_count = 0;
@@ -63,15 +66,36 @@ static int proc_heap_read(
 ) {
     (void)priv;
 
-    char tmp[128];
+    char tmp[1024];
     int len = snprintf(tmp, sizeof(tmp),
-        "HeapTotal: %u bytes\nHeapUsed: %u bytes\nHeapFree: %u bytes\nAllocCount: %d",
+        "HeapTotal: %u bytes\nHeapUsed: %u bytes\nHeapFree: %u bytes\nAllocCount: %d\n"
+        "\nClass  Slabs  InUse  Cached  Total  Allocs  Frees\n",
         (heap_end - heap_begin),
         (memory_used),
-        (heap_end - last_alloc),
+        mm_free_memory(),
         alloc_count
     );
 
+    for (int i = 0; i < HEAP_SIZE_CLASSES && len < (int)sizeof(tmp); i++) {
+        heap_class_stats_t st;
+        if (!heap_get_class_stats(i, &st))
+            continue;
+
+        len += snprintf(tmp + len, sizeof(tmp) - len,
+            "%5u  %5u  %5u  %6u  %5u  %6u  %5u\n",
+            st.object_size,
+            (uint32_t)st.slabs,
+            (uint32_t)st.objects_in_use,
+            (uint32_t)st.objects_cached,
+            (uint32_t)st.objects_total,
+            (uint32_t)st.total_allocs,
+            (uint32_t)st.total_frees
+        );
+    }
+
+    if (len >= (int)sizeof(tmp))
+        len = sizeof(tmp) - 1;
+
     if (file->pos >= (uint32_t)len)
         return 0;
 
@@ -95,12 +119,15 @@ extern struct memory_context* limine_memory_ctx;
 static int proc_meminfo_read(vfs_file_t* file, uint8_t* buf, uint32_t size, void* priv) {
     (void)priv;
 
-    char tmp[512];
+    char tmp[1024];
     int len = 0;
+    pmm_stats_t pmm;
+    pmm_get_stats(&pmm);
 
     // Convert bytes to KB
     uint64_t kb_total       = limine_memory_ctx->total / 1024;
-    uint64_t kb_free        = limine_memory_ctx->usable / 1024;
+    uint64_t kb_usable      = limine_memory_ctx->usable / 1024;
+    uint64_t kb_free        = (pmm.free_frames * PAGE_SIZE) / 1024;
     uint64_t kb_reserved    = limine_memory_ctx->reserved / 1024;
     uint64_t kb_acpi_reclaim= limine_memory_ctx->acpi_reclaimable / 1024;
     uint64_t kb_acpi_nvs    = limine_memory_ctx->acpi_nvs / 1024;
@@ -114,6 +141,7 @@ static int proc_meminfo_read(vfs_file_t* file, uint8_t* buf, uint32_t size, void
     len += snprintf(tmp + len, sizeof(tmp) - len,
         "MemTotal:       %u kB\n"
         "MemFree:        %u kB\n"
+        "MemUsable:      %u kB\n"
         "MemReserved:    %u kB\n"
         "ACPI Reclaim:   %u kB\n"
         "ACPI NVS:       %u kB\n"
@@ -122,10 +150,31 @@ static int proc_meminfo_read(vfs_file_t* file, uint8_t* buf, uint32_t size, void
         "KernelModules:  %u kB\n"
         "Framebuffer:    %u kB\n"
         "Unknown:        %u kB\n",
-        kb_total, kb_free, kb_reserved, kb_acpi_reclaim,
+        kb_total, kb_free, kb_usable, kb_reserved, kb_acpi_reclaim,
         kb_acpi_nvs, kb_bad, kb_boot, kb_kernel, kb_fb, kb_unknown
     );
 
+    len += snprintf(tmp + len, sizeof(tmp) - len,
+        "FramesTotal:    %u\n"
+        "FramesFree:     %u\n"
+        "FramesUsed:     %u\n",
+        (uint32_t)pmm.total_frames,
+        (uint32_t)pmm.free_frames,
+        (uint32_t)pmm.used_frames
+    );
+
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        len += snprintf(tmp + len, sizeof(tmp) - len,
+            "Zone %s: %u/%u frames free\n",
+            pmm.zones[z].name,
+            (uint32_t)pmm.zones[z].free_frames,
+            (uint32_t)pmm.zones[z].total_frames
+        );
+    }
+
+    if (len >= (int)sizeof(tmp))
+        len = sizeof(tmp) - 1;
+
     // Handle file offset for multiple reads
     if (file->pos >= (uint32_t)len) return 0;
 
@@ -137,6 +186,202 @@ static int proc_meminfo_read(vfs_file_t* file, uint8_t* buf, uint32_t size, void
     return rem;
 }
 
+static int proc_bcache_read(
+    vfs_file_t* file,
+    uint8_t* buf,
+    uint32_t size,
+    void* priv
+) {
+    (void)priv;
+
+    block_cache_stats_t st;
+    block_get_cache_stats(&st);
+
+    uint64_t lookups = st.hits + st.misses;
+    uint32_t hit_pct = lookups ? (uint32_t)(st.hits * 100 / lookups) : 0;
+
+    char tmp[512];
+    int len = snprintf(tmp, sizeof(tmp),
+        "Buffers: %u\nMaxBuffers: %u\nBufferSize: %u bytes\nDirty: %u\n"
+        "Hits: %u\nMisses: %u\nHitRate: %u%%\nBypassed: %u\nWritebacks: %u sectors\nEvictions: %u\n"
+        "Prefetched: %u sectors\n",
+        st.buffers,
+        st.max_buffers,
+        st.buffer_bytes,
+        st.dirty,
+        (uint32_t)st.hits,
+        (uint32_t)st.misses,
+        hit_pct,
+        (uint32_t)st.bypassed,
+        (uint32_t)st.writebacks,
+        (uint32_t)st.evictions,
+        (uint32_t)st.prefetched
+    );
+
+    if (file->pos >= (uint32_t)len)
+        return 0;
+
+    uint32_t rem = len - file->pos;
+    if (rem > size) rem = size;
+
+    memcpy(buf, tmp + file->pos, rem);
+    file->pos += rem;
+    return rem;
+}
+
+static procfs_entry_t proc_bcache = {
+    .name  = "bcache",
+    .read  = proc_bcache_read,
+    .write = NULL,
+    .priv  = NULL
+};
+
+static int proc_diskstats_read(
+    vfs_file_t* file,
+    uint8_t* buf,
+    uint32_t size,
+    void* priv
+) {
+    (void)priv;
+
+    uint32_t cap = 512U * (uint32_t)(block_device_count + 1);
+    char* tmp = kmalloc(cap);
+    if (!tmp)
+        return -1;
+
+    int len = 0;
+    for (int i = 0; i < block_device_count; i++) {
+        bio_stats_t st;
+        if (!bio_get_stats(i, &st))
+            continue;
+
+        uint64_t sectors = st.read_sectors + st.write_sectors;
+        uint64_t busy_us = st.busy_ns / 1000;
+        uint32_t kib_per_sec = busy_us ? (uint32_t)(sectors / 2 * 1000000 / busy_us) : 0;
+        uint32_t read_us = st.reads ? (uint32_t)(st.read_ns / st.reads / 1000) : 0;
+        uint32_t write_us = st.writes ? (uint32_t)(st.write_ns / st.writes / 1000) : 0;
+
+        len += snprintf(tmp + len, cap - len,
+            "[%s]\nScheduler: %s\n"
+            "Reads: %u\nReadSectors: %u\nReadLatency: %u us\n"
+            "Writes: %u\nWriteSectors: %u\nWriteLatency: %u us\n"
+            "MaxLatency: %u us\nRequests: %u\nMerges: %u\nErrors: %u\n"
+            "Queued: %u\nInFlight: %u\nThroughput: %u KiB/s\n\n",
+            block_get_device_name(i),
+            st.scheduler,
+            (uint32_t)st.reads,
+            (uint32_t)st.read_sectors,
+            read_us,
+            (uint32_t)st.writes,
+            (uint32_t)st.write_sectors,
+            write_us,
+            (uint32_t)(st.max_ns / 1000),
+            (uint32_t)st.requests,
+            (uint32_t)st.merges,
+            (uint32_t)st.errors,
+            st.queued,
+            st.inflight,
+            kib_per_sec
+        );
+    }
+
+    uint32_t rem = 0;
+    if (file->pos < (uint32_t)len) {
+        rem = len - file->pos;
+        if (rem > size) rem = size;
+
+        memcpy(buf, tmp + file->pos, rem);
+        file->pos += rem;
+    }
+
+    kfree(tmp);
+    return rem;
+}
+
+static procfs_entry_t proc_diskstats = {
+    .name  = "diskstats",
+    .read  = proc_diskstats_read,
+    .write = NULL,
+    .priv  = NULL
+};
+
+/* One line per queued disk, the active scheduler in brackets. */
+static int proc_iosched_read(
+    vfs_file_t* file,
+    uint8_t* buf,
+    uint32_t size,
+    void* priv
+) {
+    (void)priv;
+
+    char tmp[1024];
+    int len = 0;
+    for (int i = 0; i < block_device_count && len < (int)sizeof(tmp) - 64; i++) {
+        bio_stats_t st;
+        if (!bio_get_stats(i, &st))
+            continue;
+
+        len += snprintf(tmp + len, sizeof(tmp) - len, "%s:", block_get_device_name(i));
+        for (int s = 0; bio_scheduler_name(s); s++) {
+            const char* name = bio_scheduler_name(s);
+            if (strcmp(name, st.scheduler) == 0)
+                len += snprintf(tmp + len, sizeof(tmp) - len, " [%s]", name);
+            else
+                len += snprintf(tmp + len, sizeof(tmp) - len, " %s", name);
+        }
+        len += snprintf(tmp + len, sizeof(tmp) - len, "\n");
+    }
+
+    if (file->pos >= (uint32_t)len)
+        return 0;
+
+    uint32_t rem = len - file->pos;
+    if (rem > size) rem = size;
+
+    memcpy(buf, tmp + file->pos, rem);
+    file->pos += rem;
+    return rem;
+}
+
+/* "<disk> <scheduler>" switches the scheduler of a disk. */
+static int proc_iosched_write(
+    vfs_file_t* file,
+    const uint8_t* buf,
+    uint32_t size,
+    void* priv
+) {
+    (void)file;
+    (void)priv;
+
+    char line[64];
+    uint32_t n = size < sizeof(line) - 1 ? size : sizeof(line) - 1;
+    memcpy(line, buf, n);
+    line[n] = '\0';
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == ' '))
+        line[--n] = '\0';
+
+    char* sched = line;
+    while (*sched && *sched != ' ')
+        sched++;
+    if (!*sched)
+        return -1;
+    *sched++ = '\0';
+
+    for (int i = 0; i < block_device_count; i++) {
+        const char* name = block_get_device_name(i);
+        if (name && strcmp(name, line) == 0)
+            return bio_set_scheduler(i, sched) == 0 ? (int)size : -1;
+    }
+    return -1;
+}
+
+static procfs_entry_t proc_iosched = {
+    .name  = "iosched",
+    .read  = proc_iosched_read,
+    .write = proc_iosched_write,
+    .priv  = NULL
+};
+
 extern ring_buffer_t klog_rb;
 
 uint32_t klog_read(uint32_t pos, void* buf, uint32_t len)
@@ -218,6 +463,9 @@ void procfs_init(void) {
     procfs_register(&proc_pci);
     procfs_register(&proc_pci_devices);
     procfs_register(&proc_kmsg);
+    procfs_register(&proc_bcache);
+    procfs_register(&proc_diskstats);
+    procfs_register(&proc_iosched);
 
     proc_pci_register();
 }
@@ -0,0 +1,165 @@
+/**
+ * @file mount_trie.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Mount point lookup by path component, for the deepest mount of a
+ * path and the mounts directly below a directory.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#include <filesystems/mount_trie.h>
+#include <heap.h>
+#include <memory.h>
+#include <strings.h>
+
+static mount_node_t mount_root = { "", NULL, NULL, NULL };
+
+/* Splits the next component off @p *path; 0 at the end */
+static size_t mount_next(const char** path, const char** name)
+{
+    const char* p = *path;
+    while (*p == '/')
+        p++;
+    *name = p;
+    while (*p && *p != '/')
+        p++;
+    *path = p;
+    return (size_t)(p - *name);
+}
+
+static mount_node_t* mount_child(mount_node_t* node, const char* name, size_t len)
+{
+    for (mount_node_t* c = node->child; c; c = c->sibling)
+        if (strncmp(c->name, name, len) == 0 && c->name[len] == '\0')
+            return c;
+    return NULL;
+}
+
+/* The node of @p path, NULL if no mount point goes through it */
+static mount_node_t* mount_walk(const char* path)
+{
+    if (!path || path[0] != '/')
+        return NULL;
+
+    mount_node_t* node = &mount_root;
+    const char* name;
+    size_t len;
+    while (node && (len = mount_next(&path, &name)) != 0)
+        node = mount_child(node, name, len);
+    return node;
+}
+
+int mount_trie_insert(mount_entry_t* m)
+{
+    if (!m || !m->mount_point || m->mount_point[0] != '/')
+        return -1;
+
+    mount_node_t* node = &mount_root;
+    const char* path = m->mount_point;
+    const char* name;
+    size_t len;
+
+    while ((len = mount_next(&path, &name)) != 0) {
+        mount_node_t* c = mount_child(node, name, len);
+        if (!c) {
+            c = kmalloc(sizeof(mount_node_t));
+            if (!c)
+                return -1;
+            c->name = kmalloc(len + 1);
+            if (!c->name) {
+                kfree(c);
+                return -1;
+            }
+            memcpy(c->name, name, len);
+            c->name[len] = '\0';
+            c->mnt = NULL;
+            c->child = NULL;
+            c->sibling = NULL;
+
+            // Appended, so children list in the order they were mounted.
+            mount_node_t** link = &node->child;
+            while (*link)
+                link = &(*link)->sibling;
+            *link = c;
+        }
+        node = c;
+    }
+
+    node->mnt = m;
+    return 0;
+}
+
+static void mount_free(mount_node_t* node)
+{
+    while (node) {
+        mount_node_t* next = node->sibling;
+        mount_free(node->child);
+        kfree(node->name);
+        kfree(node);
+        node = next;
+    }
+}
+
+void mount_trie_rebuild(void)
+{
+    mount_free(mount_root.child);
+    mount_root.child = NULL;
+    mount_root.mnt = NULL;
+
+    for (int i = 0; i < mounted_partition_count; i++)
+        mount_trie_insert(&mounted_partitions[i]);
+}
+
+mount_entry_t* mount_trie_resolve(const char* path, const char** rel)
+{
+    if (!path || path[0] != '/')
+        return NULL;
+
+    mount_node_t* node = &mount_root;
+    mount_entry_t* best = node->mnt;
+    const char* best_rel = path;
+    const char* name;
+    size_t len;
+
+    while ((len = mount_next(&path, &name)) != 0) {
+        node = mount_child(node, name, len);
+        if (!node)
+            break;
+        if (node->mnt) {
+            best = node->mnt;
+            best_rel = path;
+        }
+    }
+
+    if (best && rel) {
+        while (*best_rel == '/')
+            best_rel++;
+        *rel = best_rel;
+    }
+    return best;
+}
+
+mount_entry_t* mount_trie_find(const char* mount_point)
+{
+    mount_node_t* node = mount_walk(mount_point);
+    return node ? node->mnt : NULL;
+}
+
+int mount_trie_children(const char* path, mount_entry_t** out, int max)
+{
+    mount_node_t* node = mount_walk(path);
+    if (!node)
+        return 0;
+
+    int n = 0;
+    for (mount_node_t* c = node->child; c; c = c->sibling) {
+        if (!c->mnt)
+            continue;
+        if (out && n < max)
+            out[n] = c->mnt;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,282 @@
+/**
+ * @file page_cache.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Page cache: file pages by (filesystem, inode, index), kept resident
+ * and shared by every mapping of them. Writes through the VFS update them
+ * in place.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#include <filesystems/page_cache.h>
+#include <heap.h>
+#include <memory.h>
+#include <paging.h>
+#include <multitasking.h>
+
+/*
+ * Held across a fill, so two tasks faulting on the same page read it once.
+ * Fills go through the filesystem read path, which never comes back here.
+ */
+static task_mutex_t page_cache_lock = TASK_MUTEX_INIT;
+
+static page_cache_page_t* page_cache_hash[PAGE_CACHE_BUCKETS];
+static page_cache_page_t* page_cache_lru;     // least recently used
+static page_cache_page_t* page_cache_mru;
+static uint32_t page_cache_count;
+
+/* Identity of the file behind @p file; false if it has none to cache by */
+static bool page_cache_key(vfs_file_t* file, void** fs, uint64_t* ino)
+{
+    if (!file || !file->mnt)
+        return false;
+
+    // Same numbers as the dentry cache, so the VFS can invalidate by path.
+    switch (file->mnt->type) {
+        case FS_FAT16:
+            *ino = file->f.fat16.entry.first_cluster;
+            break;
+        case FS_FAT32:
+            *ino = ((uint32_t)file->f.fat32.entry.first_cluster_high << 16) |
+                   file->f.fat32.entry.first_cluster_low;
+            break;
+        case FS_ISO9660:
+            *ino = file->f.iso9660.entry.extent_lba;
+            break;
+        case FS_EXT2:
+            *ino = file->f.ext2.ino;
+            break;
+        default:
+            return false;
+    }
+
+    *fs = file->mnt->fs;
+    return *ino != 0;
+}
+
+static uint32_t page_cache_hash_key(void* fs, uint64_t ino, uint64_t index)
+{
+    uint64_t h = (uint64_t)fs ^ (ino * 0x9E3779B97F4A7C15ULL) ^ (index * 0xC2B2AE3D27D4EB4FULL);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void page_cache_lru_remove(page_cache_page_t* p)
+{
+    if (p->lru_prev) p->lru_prev->lru_next = p->lru_next;
+    else page_cache_lru = p->lru_next;
+    if (p->lru_next) p->lru_next->lru_prev = p->lru_prev;
+    else page_cache_mru = p->lru_prev;
+    p->lru_prev = p->lru_next = NULL;
+}
+
+static void page_cache_lru_push(page_cache_page_t* p)
+{
+    p->lru_prev = page_cache_mru;
+    p->lru_next = NULL;
+    if (page_cache_mru) page_cache_mru->lru_next = p;
+    else page_cache_lru = p;
+    page_cache_mru = p;
+}
+
+static page_cache_page_t* page_cache_find(void* fs, uint64_t ino, uint64_t index)
+{
+    uint32_t hash = page_cache_hash_key(fs, ino, index);
+    for (page_cache_page_t* p = page_cache_hash[hash % PAGE_CACHE_BUCKETS]; p; p = p->hash_next) {
+        if (p->fs == fs && p->ino == ino && p->index == index)
+            return p;
+    }
+    return NULL;
+}
+
+/* Unhooks @p p and drops the cache's reference; mappings keep the frame */
+static void page_cache_free(page_cache_page_t* p)
+{
+    uint32_t hash = page_cache_hash_key(p->fs, p->ino, p->index);
+    page_cache_page_t** link = &page_cache_hash[hash % PAGE_CACHE_BUCKETS];
+    while (*link != p)
+        link = &(*link)->hash_next;
+    *link = p->hash_next;
+
+    page_cache_lru_remove(p);
+    free_page(p->phys);
+    kfree(p);
+    page_cache_count--;
+}
+
+/*
+ * Evicts from the cold end down to PAGE_CACHE_MAX, sparing @p keep and any
+ * page that is still mapped: a new mapping or a write() must find the frame
+ * the existing mappers share, not a fresh copy.
+ */
+static void page_cache_shrink(page_cache_page_t* keep)
+{
+    page_cache_page_t* p = page_cache_lru;
+    while (p && page_cache_count > PAGE_CACHE_MAX) {
+        page_cache_page_t* next = p->lru_next;
+        if (p != keep && page_ref_count(p->phys) == 1)
+            page_cache_free(p);
+        p = next;
+    }
+}
+
+static uintptr_t page_cache_fill_frame(vfs_file_t* file, uint64_t index, page_cache_fill_t fill)
+{
+    uintptr_t phys = allocate_page();
+    if (!phys)
+        return 0;
+
+    if (fill(file, index * PAGE_SIZE, phys_to_virt(phys)) != 0) {
+        free_page(phys);
+        return 0;
+    }
+    return phys;
+}
+
+uintptr_t page_cache_get(vfs_file_t* file, uint64_t index, page_cache_fill_t fill)
+{
+    void* fs;
+    uint64_t ino;
+
+    if (!file || !fill)
+        return 0;
+    if (!page_cache_key(file, &fs, &ino))
+        return page_cache_fill_frame(file, index, fill);
+
+    multitasking_mutex_lock(&page_cache_lock);
+
+    page_cache_page_t* p = page_cache_find(fs, ino, index);
+    if (p) {
+        page_cache_lru_remove(p);
+        page_cache_lru_push(p);
+        page_get(p->phys);
+        multitasking_mutex_unlock(&page_cache_lock);
+        return p->phys;
+    }
+
+    uintptr_t phys = page_cache_fill_frame(file, index, fill);
+    if (!phys) {
+        multitasking_mutex_unlock(&page_cache_lock);
+        return 0;
+    }
+
+    p = kmalloc(sizeof(page_cache_page_t));
+    if (!p) {
+        // Out of memory: hand the page out without caching it.
+        multitasking_mutex_unlock(&page_cache_lock);
+        return phys;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->fs = fs;
+    p->ino = ino;
+    p->index = index;
+    p->phys = phys;
+
+    uint32_t hash = page_cache_hash_key(fs, ino, index);
+    p->hash_next = page_cache_hash[hash % PAGE_CACHE_BUCKETS];
+    page_cache_hash[hash % PAGE_CACHE_BUCKETS] = p;
+    page_cache_lru_push(p);
+    page_cache_count++;
+
+    // One reference stays with the cache, the caller gets another.
+    page_get(phys);
+
+    page_cache_shrink(p);
+
+    multitasking_mutex_unlock(&page_cache_lock);
+    return phys;
+}
+
+int page_cache_read(vfs_file_t* file, uint64_t offset, void* buf, uint32_t size, page_cache_fill_t fill)
+{
+    uint8_t* out = (uint8_t*)buf;
+
+    while (size) {
+        uint64_t in_page = offset & (PAGE_SIZE - 1);
+        uint32_t chunk = (uint32_t)(PAGE_SIZE - in_page);
+        if (chunk > size)
+            chunk = size;
+
+        uintptr_t phys = page_cache_get(file, offset / PAGE_SIZE, fill);
+        if (!phys)
+            return -1;
+
+        memcpy(out, (uint8_t*)phys_to_virt(phys) + in_page, chunk);
+        free_page(phys);
+
+        out += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+
+    return 0;
+}
+
+void page_cache_write(vfs_file_t* file, uint64_t offset, const void* buf, uint32_t size)
+{
+    void* fs;
+    uint64_t ino;
+    const uint8_t* in = (const uint8_t*)buf;
+
+    if (!page_cache_key(file, &fs, &ino))
+        return;
+
+    multitasking_mutex_lock(&page_cache_lock);
+    while (size) {
+        uint64_t in_page = offset & (PAGE_SIZE - 1);
+        uint32_t chunk = (uint32_t)(PAGE_SIZE - in_page);
+        if (chunk > size)
+            chunk = size;
+
+        // Write-back of a shared mapping hands us the cached page itself.
+        page_cache_page_t* p = page_cache_find(fs, ino, offset / PAGE_SIZE);
+        uint8_t* to = p ? (uint8_t*)phys_to_virt(p->phys) + in_page : NULL;
+        if (to && to != in)
+            memcpy(to, in, chunk);
+
+        in += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    multitasking_mutex_unlock(&page_cache_lock);
+}
+
+void page_cache_invalidate(void* fs, uint64_t ino)
+{
+    if (ino == 0)
+        return;
+
+    multitasking_mutex_lock(&page_cache_lock);
+    page_cache_page_t* p = page_cache_lru;
+    while (p) {
+        page_cache_page_t* next = p->lru_next;
+        if (p->fs == fs && p->ino == ino)
+            page_cache_free(p);
+        p = next;
+    }
+    multitasking_mutex_unlock(&page_cache_lock);
+}
+
+void page_cache_invalidate_file(vfs_file_t* file)
+{
+    void* fs;
+    uint64_t ino;
+
+    if (page_cache_key(file, &fs, &ino))
+        page_cache_invalidate(fs, ino);
+}
+
+void page_cache_drop_fs(void* fs)
+{
+    multitasking_mutex_lock(&page_cache_lock);
+    page_cache_page_t* p = page_cache_lru;
+    while (p) {
+        page_cache_page_t* next = p->lru_next;
+        if (p->fs == fs)
+            page_cache_free(p);
+        p = next;
+    }
+    multitasking_mutex_unlock(&page_cache_lock);
+}
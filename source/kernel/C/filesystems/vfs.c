@@ -18,26 +18,21 @@
 #include <filesystems/iso9660.h>
 #include <filesystems/layers/proc.h>
 #include <filesystems/layers/dev.h>
+#include <filesystems/mount_trie.h>
+#include <filesystems/page_cache.h>
 #include <heap.h>
 #include <strings.h>
 #include <memory.h>
+#include <multitasking.h>
 
 char vfs_cwd[256] = "/";
 uint16_t vfs_cwd_cluster = 0; 
 
-static int path_matches_mount(const char* path, const char* mount) {
-    if (!path || !mount) return 0;
-
-    /* Root mount matches everything absolute */
-    if (strcmp(mount, "/") == 0)
-        return path[0] == '/';
-
-    size_t mlen = strlen(mount);
-    if (strncmp(path, mount, mlen) != 0)
-        return 0;
-
-    return path[mlen] == '\0' || path[mlen] == '/';
-}
+/*
+ * Disk waits sleep and give up the kernel lock, so operations that change a
+ * filesystem are serialised here instead; lookups and reads run alongside.
+ */
+static task_mutex_t vfs_lock = TASK_MUTEX_INIT;
 
 int vfs_resolve_mount(const char* path, vfs_mount_res_t* out) {
     if (!path || !out) {
@@ -45,32 +40,14 @@ int vfs_resolve_mount(const char* path, vfs_mount_res_t* out) {
         return -1;
     }
 
-    mount_entry_t* best = NULL;
-    int best_len = -1;
-
-    for (int i = 0; i < mounted_partition_count; i++) {
-        mount_entry_t* m = &mounted_partitions[i];
-        int len = strlen(m->mount_point);
-
-        if (path_matches_mount(path, m->mount_point)) {
-            if (len > best_len) {
-                best = m;
-                best_len = len;
-            }
-        }
-    }
+    const char* rel = NULL;
+    mount_entry_t* best = mount_trie_resolve(path, &rel);
 
     if (!best) {
-        if(path)
-            eprintf("resolve_mount: no mount matches path: %s", path);
-        else
-            eprintf("resolve_mount: no mount matches the given path.");
+        eprintf("resolve_mount: no mount matches path: %s", path);
         return -2;
     }
 
-    const char* rel = path + best_len;
-    if (*rel == '/') rel++;
-
     out->mnt = best;
     out->rel_path = rel;
     return 0;
@@ -134,6 +111,188 @@ int vfs_normalize_path(const char* in, char* out, size_t out_sz) {
     return 0;
 }
 
+// Fills a dentry cache miss from the filesystem.
+static int vfs_lookup_fs(mount_entry_t* mnt, const char* rel, vfs_lookup_t* out)
+{
+    memset(out, 0, sizeof(*out));
+
+    switch (mnt->type) {
+        case FS_FAT16: {
+            fat16_dir_entry_t e;
+            if (fat16_find_path((fat16_fs_t*)mnt->fs, rel, &e) != 0)
+                return VFS_LOOKUP_NOENT;
+            out->is_dir = (e.attr & 0x10) != 0;
+            out->size = e.filesize;
+            out->ino = e.first_cluster;
+            return 0;
+        }
+
+        case FS_FAT32: {
+            fat32_dir_entry_t e;
+            if (fat32_find_path((fat32_fs_t*)mnt->fs, rel, &e) != FAT_OK)
+                return VFS_LOOKUP_NOENT;
+            out->is_dir = (e.attr & FAT_ATTR_DIRECTORY) != 0;
+            out->size = e.file_size;
+            out->ino = ((uint32_t)e.first_cluster_high << 16) | e.first_cluster_low;
+            return 0;
+        }
+
+        case FS_ISO9660: {
+            iso9660_dirent_t e;
+            if (iso9660_find_path((iso9660_fs_t*)mnt->fs, rel, &e) != 0)
+                return VFS_LOOKUP_NOENT;
+            out->is_dir = (e.flags & ISO9660_FLAG_DIR) != 0;
+            out->size = e.size;
+            out->ino = e.extent_lba;
+            return 0;
+        }
+
+        case FS_EXT2: {
+            uint32_t ino;
+            ext2_inode_t inode;
+            int rc = ext2_find_path((ext2_fs_t*)mnt->fs, rel, &ino, &inode);
+            if (rc == EXT2_ERR_NOT_FOUND || rc == EXT2_ERR_NOTDIR)
+                return VFS_LOOKUP_NOENT;
+            if (rc != EXT2_OK)
+                return -1;
+            out->is_dir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            out->size = inode.i_size;
+            out->ino = ino;
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+int vfs_lookup(const vfs_mount_res_t* res, vfs_lookup_t* out)
+{
+    if (!res || !res->mnt || !res->rel_path || !out)
+        return -1;
+    if (res->mnt->type == FS_PROC || res->mnt->type == FS_DEV)
+        return -1;
+
+    return vfs_dcache_lookup(res->mnt, res->rel_path, vfs_lookup_fs, out);
+}
+
+// After the VFS changed @p path, drops what the dentry cache knows about it.
+static void vfs_invalidate_path(const char* path)
+{
+    char norm[256];
+    vfs_mount_res_t res;
+
+    if (!path || vfs_normalize_path(path, norm, sizeof(norm)) != 0)
+        return;
+    if (vfs_resolve_mount(norm, &res) != 0)
+        return;
+    if (res.mnt->type == FS_PROC || res.mnt->type == FS_DEV)
+        return;
+
+    vfs_dcache_invalidate(res.mnt, res.rel_path);
+}
+
+// Before the VFS overwrites or removes @p path, drops its cached pages;
+// afterwards its inode number may already belong to another file.
+static void vfs_drop_pages(const char* path)
+{
+    char norm[256];
+    vfs_mount_res_t res;
+    vfs_lookup_t info;
+
+    if (!path || vfs_normalize_path(path, norm, sizeof(norm)) != 0)
+        return;
+    if (vfs_resolve_mount(norm, &res) != 0)
+        return;
+    if (res.mnt->type == FS_PROC || res.mnt->type == FS_DEV)
+        return;
+    if (vfs_lookup(&res, &info) != 0)
+        return;
+
+    // A whole tree may go, which is not worth walking.
+    if (info.is_dir)
+        page_cache_drop_fs(res.mnt->fs);
+    else
+        page_cache_invalidate(res.mnt->fs, info.ino);
+}
+
+/**
+ * @brief Queues the part of the read-ahead window that is not in flight yet,
+ * ahead of a read of @p size bytes at the file's position. The window is
+ * topped up once the reader is halfway into it, so requests stay large.
+ */
+static void vfs_readahead(vfs_file_t* file, uint32_t size)
+{
+    vfs_readahead_t* ra = &file->ra;
+    uint32_t pos, file_size;
+
+    switch (file->mnt->type) {
+        case FS_FAT16:
+            pos = file->f.fat16.pos;
+            file_size = file->f.fat16.entry.filesize;
+            break;
+        case FS_FAT32:
+            pos = file->f.fat32.pos;
+            file_size = file->f.fat32.entry.file_size;
+            break;
+        case FS_ISO9660:
+            pos = file->f.iso9660.pos;
+            file_size = file->f.iso9660.entry.size;
+            break;
+        case FS_EXT2:
+            pos = file->f.ext2.pos;
+            file_size = file->f.ext2.inode.i_size;
+            break;
+        default:
+            return;
+    }
+
+    if (pos >= file_size || size == 0)
+        return;
+    if (size > file_size - pos)
+        size = file_size - pos;
+
+    if (pos == ra->next_pos) {
+        ra->window = ra->window ? ra->window * 2 : VFS_RA_MIN_WINDOW;
+        if (ra->window > VFS_RA_MAX_WINDOW)
+            ra->window = VFS_RA_MAX_WINDOW;
+    } else {
+        ra->window = 0;
+        ra->ahead = 0;
+    }
+    ra->next_pos = pos + size;
+
+    if (ra->window == 0)
+        return;
+    if (ra->ahead < pos)
+        ra->ahead = pos;
+
+    uint32_t end = file_size;
+    if (file_size - ra->next_pos > ra->window)
+        end = ra->next_pos + ra->window;
+    if (ra->ahead >= end || end - ra->ahead <= ra->window / 2)
+        return;
+
+    uint32_t bytes = end - ra->ahead;
+    switch (file->mnt->type) {
+        case FS_FAT16:
+            fat16_readahead(&file->f.fat16, ra->ahead, bytes);
+            break;
+        case FS_FAT32:
+            fat32_readahead(&file->f.fat32, ra->ahead, bytes);
+            break;
+        case FS_ISO9660:
+            iso9660_readahead(&file->f.iso9660, ra->ahead, bytes);
+            break;
+        case FS_EXT2:
+            ext2_readahead(&file->f.ext2, ra->ahead, bytes);
+            break;
+        default:
+            break;
+    }
+    ra->ahead = end;
+}
+
 int vfs_read(vfs_file_t* file, uint8_t* buf, uint32_t size)
 {
     if (!file || !buf)
@@ -145,6 +304,8 @@ int vfs_read(vfs_file_t* file, uint8_t* buf, uint32_t size)
         return -2;
     }
 
+    vfs_readahead(file, size);
+
     switch(file->mnt->type){
         case FS_PROC:
             return procfs_read(file, buf, size);
@@ -167,7 +328,7 @@ int vfs_read(vfs_file_t* file, uint8_t* buf, uint32_t size)
 }
 
 
-int vfs_write(vfs_file_t* file, const uint8_t* buf, uint32_t size)
+static int vfs_write_locked(vfs_file_t* file, const uint8_t* buf, uint32_t size)
 {
     if (!file || !buf)
         return -1;
@@ -200,8 +361,98 @@ int vfs_write(vfs_file_t* file, const uint8_t* buf, uint32_t size)
     return -3;
 }
 
+// Device and proc files have no on-disk state to protect.
+/* Position of a disk file, NULL for files without one */
+static uint32_t* vfs_pos_ptr(vfs_file_t* file)
+{
+    switch (file->mnt->type) {
+        case FS_FAT16:
+            return &file->f.fat16.pos;
+        case FS_FAT32:
+            return &file->f.fat32.pos;
+        case FS_ISO9660:
+            return &file->f.iso9660.pos;
+        case FS_EXT2:
+            return &file->f.ext2.pos;
+        default:
+            return NULL;
+    }
+}
+
+static bool vfs_file_on_disk(const vfs_file_t* file)
+{
+    return file && file->mnt && file->mnt->type != FS_DEV && file->mnt->type != FS_PROC;
+}
+
+int vfs_write(vfs_file_t* file, const uint8_t* buf, uint32_t size)
+{
+    if (!vfs_file_on_disk(file))
+        return vfs_write_locked(file, buf, size);
+
+    multitasking_mutex_lock(&vfs_lock);
+    uint32_t* pos = vfs_pos_ptr(file);
+    uint64_t offset = pos ? *pos : 0;
+    int rc = vfs_write_locked(file, buf, size);
+    // The size cached for its path may be stale now. Cached pages take the
+    // new bytes, so write() and shared mappings keep seeing the same page.
+    if (rc > 0 && file->dhash)
+        vfs_dcache_drop_hash(file->mnt->fs, file->dhash);
+    if (rc > 0 && pos)
+        page_cache_write(file, offset, buf, (uint32_t)rc);
+    else if (rc > 0)
+        page_cache_invalidate_file(file);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
+
+uint64_t vfs_file_size(vfs_file_t* file)
+{
+    if (!file || !file->mnt)
+        return 0;
+
+    switch (file->mnt->type) {
+        case FS_FAT16:
+            return file->f.fat16.entry.filesize;
+        case FS_FAT32:
+            return file->f.fat32.entry.file_size;
+        case FS_ISO9660:
+            return file->f.iso9660.entry.size;
+        case FS_EXT2:
+            return ((uint64_t)file->f.ext2.inode.i_size_high << 32) | file->f.ext2.inode.i_size;
+        default:
+            return 0;
+    }
+}
+
+int vfs_pread(vfs_file_t* file, uint64_t offset, uint8_t* buf, uint32_t size)
+{
+    if (!file || !file->mnt || offset > UINT32_MAX)
+        return -1;
 
-void vfs_close(vfs_file_t* file) {
+    uint32_t* pos = vfs_pos_ptr(file);
+    if (!pos)
+        return -1;
+
+    // FAT32 reads find the cluster for the new position themselves.
+    *pos = (uint32_t)offset;
+    return vfs_read(file, buf, size);
+}
+
+int vfs_pwrite(vfs_file_t* file, uint64_t offset, const uint8_t* buf, uint32_t size)
+{
+    if (!file || !file->mnt || offset > UINT32_MAX)
+        return -1;
+
+    uint32_t* pos = vfs_pos_ptr(file);
+    if (!pos)
+        return -1;
+
+    *pos = (uint32_t)offset;
+    return vfs_write(file, buf, size);
+}
+
+static void vfs_close_locked(vfs_file_t* file) {
     if (!file || !file->mnt) {
         eprintf("close: invalid file pointer");
         return;
@@ -227,6 +478,18 @@ void vfs_close(vfs_file_t* file) {
     }
 }
 
+void vfs_close(vfs_file_t* file)
+{
+    if (!vfs_file_on_disk(file)) {
+        vfs_close_locked(file);
+        return;
+    }
+
+    multitasking_mutex_lock(&vfs_lock);
+    vfs_close_locked(file);
+    multitasking_mutex_unlock(&vfs_lock);
+}
+
 int vfs_path_is_dir(const char* path)
 {
     if (!path || !*path) {
@@ -250,48 +513,14 @@ int vfs_path_is_dir(const char* path)
     if (*res.rel_path == '\0')
         return 1;
 
-    switch (res.mnt->type) {
-        case FS_FAT16: {
-            fat16_fs_t* fs = (fat16_fs_t*)res.mnt->fs;
-            fat16_dir_entry_t e;
-            if (fat16_find_path(fs, res.rel_path, &e) != 0)
-                return 0;
-            return (e.attr & 0x10) ? 1 : 0;
-        }
-
-        case FS_FAT32: {
-            fat32_fs_t* fs = (fat32_fs_t*)res.mnt->fs;
-            fat32_dir_entry_t e;
-            if (fat32_find_path(fs, res.rel_path, &e) != FAT_OK)
-                return 0;
-            return (e.attr & 0x10) ? 1 : 0;
-        }
-
-        case FS_ISO9660: {
-            iso9660_fs_t* fs = (iso9660_fs_t*)res.mnt->fs;
-            iso9660_dirent_t e;
-            if (iso9660_find_path(fs, res.rel_path, &e) != 0)
-                return 0;
-            return (e.flags & ISO9660_FLAG_DIR) ? 1 : 0;
-        }
-
-        case FS_EXT2: {
-            ext2_fs_t* fs = (ext2_fs_t*)res.mnt->fs;
-            uint32_t ino;
-            ext2_inode_t inode;
-            if (ext2_find_path(fs, res.rel_path, &ino, &inode) != EXT2_OK)
-                return 0;
-            return ((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) ? 1 : 0;
-        }
-
-        case FS_PROC:
-        case FS_DEV:
-            /* Layered filesystems: treat root as existing, else unsupported */
-            return 0;
+    /* Layered filesystems: treat root as existing, else unsupported */
+    if (res.mnt->type == FS_PROC || res.mnt->type == FS_DEV)
+        return 0;
 
-        default:
-            return 0;
-    }
+    vfs_lookup_t info;
+    if (vfs_lookup(&res, &info) != 0)
+        return 0;
+    return info.is_dir ? 1 : 0;
 }
 
 int vfs_ls(const char* path)
@@ -310,16 +539,14 @@ int vfs_ls(const char* path)
         return -1;
 
     bool entries = false;
-    
-    // for (int i = 1; i < mounted_partition_count; i++) { // i = 1; to ignore the root mount
-    //     mount_entry_t* m = &mounted_partitions[i];
 
-    //     if (vfs_is_direct_child_mount(norm, m)) {
-    //         const char* name = vfs_basename(m->mount_point);
-    //         printfnoln(yellow_color "%s/ " reset_color, name);
-    //         entries = true;
-    //     }
-    // }
+    /* Mounts directly below this directory */
+    mount_entry_t* children[MAX_PARTITIONS];
+    int nchildren = mount_trie_children(norm, children, MAX_PARTITIONS);
+    for (int i = 0; i < nchildren && i < MAX_PARTITIONS; i++) {
+        printfnoln(yellow_color "%s/ " reset_color, vfs_basename(children[i]->mount_point));
+        entries = true;
+    }
 
     if (res.mnt->type == FS_PROC) {
         procfs_ls(res.rel_path);
@@ -423,7 +650,7 @@ int vfs_ls(const char* path)
     return 0;
 }
 
-int vfs_open(const char* path, int flags, vfs_file_t* out)
+static int vfs_open_locked(const char* path, int flags, vfs_file_t* out)
 {
     if (!path || !out) {
         eprintf("open: invalid parameters");
@@ -463,6 +690,13 @@ int vfs_open(const char* path, int flags, vfs_file_t* out)
         return 0;
     }
 
+    /* A name the dentry cache knows is missing fails without the disk */
+    if (!(flags & VFS_CREATE) && *res.rel_path) {
+        vfs_lookup_t info;
+        if (vfs_lookup(&res, &info) == VFS_LOOKUP_NOENT)
+            return -6;
+    }
+
     if (res.mnt->type == FS_FAT16) {
         fat16_fs_t* fs = (fat16_fs_t*)res.mnt->fs;
         int ret;
@@ -609,7 +843,29 @@ int vfs_open(const char* path, int flags, vfs_file_t* out)
     return -3;
 }
 
-int vfs_mkdir(const char* path) {
+int vfs_open(const char* path, int flags, vfs_file_t* out)
+{
+    // Only opens that may create or truncate change the filesystem.
+    bool mutates = (flags & (VFS_CREATE | VFS_TRUNC)) != 0;
+    if (mutates)
+        multitasking_mutex_lock(&vfs_lock);
+    if (flags & VFS_TRUNC)
+        vfs_drop_pages(path);
+    int rc = vfs_open_locked(path, flags, out);
+    if (mutates)
+        vfs_invalidate_path(path);
+    if (rc == 0 && vfs_file_on_disk(out)) {
+        char norm[256];
+        vfs_mount_res_t res;
+        if (vfs_normalize_path(path, norm, sizeof(norm)) == 0 && vfs_resolve_mount(norm, &res) == 0)
+            out->dhash = vfs_dcache_hash(res.mnt, res.rel_path);
+    }
+    if (mutates)
+        multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
+static int vfs_mkdir_locked(const char* path) {
     if (!path){
         eprintf("mkdir: path is null or undefined");
         return -1;
@@ -642,7 +898,16 @@ int vfs_mkdir(const char* path) {
     return -2;
 }
 
-int vfs_rm_recursive(const char* path)
+int vfs_mkdir(const char* path)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    int rc = vfs_mkdir_locked(path);
+    vfs_invalidate_path(path);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
+static int vfs_rm_recursive_locked(const char* path)
 {
     char norm[256];
     if (vfs_normalize_path(path, norm, sizeof(norm)) != 0)
@@ -711,6 +976,16 @@ int vfs_rm_recursive(const char* path)
     return 0;
 }
 
+int vfs_rm_recursive(const char* path)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    vfs_drop_pages(path);
+    int rc = vfs_rm_recursive_locked(path);
+    vfs_invalidate_path(path);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
 int vfs_cd(const char* path)
 {
     if (!path || !*path) {
@@ -829,7 +1104,7 @@ int vfs_cd(const char* path)
 
 
 
-int vfs_create_path(const char* path, uint8_t attr) {
+static int vfs_create_path_locked(const char* path, uint8_t attr) {
     if (!path || !*path) {
         eprintf("create_path: path is null or undefined");
         return -1;
@@ -855,7 +1130,16 @@ int vfs_create_path(const char* path, uint8_t attr) {
     return -2;
 }
 
-int vfs_unlink(const char* path)
+int vfs_create_path(const char* path, uint8_t attr)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    int rc = vfs_create_path_locked(path, attr);
+    vfs_invalidate_path(path);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
+static int vfs_unlink_locked(const char* path)
 {
     if (!path || !*path) {
         eprintf("unlink:: path is null or undefined");
@@ -924,7 +1208,17 @@ int vfs_unlink(const char* path)
     return fat16_unlink_path(fs, parent_cluster, name);
 }
 
-int vfs_mv(const char* src, const char* dst)
+int vfs_unlink(const char* path)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    vfs_drop_pages(path);
+    int rc = vfs_unlink_locked(path);
+    vfs_invalidate_path(path);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
+static int vfs_mv_locked(const char* src, const char* dst)
 {
     char src_norm[256], dst_norm[256];
     if (vfs_normalize_path(src, src_norm, sizeof(src_norm)) != 0)
@@ -1010,6 +1304,17 @@ int vfs_mv(const char* src, const char* dst)
     return fat16_mv(fs, src_parent, src_name, dst_parent, dst_name);
 }
 
+int vfs_mv(const char* src, const char* dst)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    vfs_drop_pages(dst);
+    int rc = vfs_mv_locked(src, dst);
+    vfs_invalidate_path(src);
+    vfs_invalidate_path(dst);
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
+
 const char* vfs_getcwd(void) {
     return vfs_cwd;
 }
@@ -1043,7 +1348,7 @@ const char* vfs_basename(const char* path) {
     return last;
 }
 
-int vfs_sync(void)
+static int vfs_sync_locked(void)
 {
     int ret = 0;
 
@@ -1057,7 +1362,7 @@ int vfs_sync(void)
             break;
 
         case FS_FAT32:
-            ret |= fat32_sync((fat32_fs_t*)mnt->fs);
+            ret |= fat32_fs_sync((fat32_fs_t*)mnt->fs);
             break;
 
         case FS_EXT2:
@@ -1071,6 +1376,17 @@ int vfs_sync(void)
         }
     }
 
+    // The filesystems above only queue their writes in the block cache.
+    ret |= block_sync_all();
+
     debug_printf("sync has been called!");
     return ret;
-}
\ No newline at end of file
+}
+
+int vfs_sync(void)
+{
+    multitasking_mutex_lock(&vfs_lock);
+    int rc = vfs_sync_locked();
+    multitasking_mutex_unlock(&vfs_lock);
+    return rc;
+}
@@ -12,7 +12,7 @@
 #include <gdt.h>
 #include <tss.h>
 
-struct gdt_entry gdt[7];
+struct gdt_entry gdt[GDT_ENTRIES];
 struct gdt_ptr gdtp;
 
 static void gdt_set_entry(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
@@ -53,6 +53,14 @@ void setup_gdt(void) {
     gdtp.limit = (uint16_t)(sizeof(gdt) - 1U);
     gdtp.base  = (uint64_t)&gdt;
 
+    gdt_load();
+
+    done("GDT Successfully initialized!", __FILE__);
+
+    tss_load();
+}
+
+void gdt_load(void) {
     /* Load GDT, reload data segments, then reload CS with lretq. */
     asm volatile (
         "cli\n"
@@ -70,8 +78,4 @@ void setup_gdt(void) {
         : "m"(gdtp)
         : "rax", "memory"
     );
-
-    done("GDT Successfully initialized!", __FILE__);
-
-    tss_load();
 }
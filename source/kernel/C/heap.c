@@ -4,66 +4,506 @@
 #include <graphics.h>
 #include <debugger.h>
 #include <heap.h>
+#include <smp.h>
+#include <spinlock.h>
+
+/*
+ * The heap is split in two arenas that grow towards each other:
+ *
+ *   heap_begin -> [ large blocks ... last_alloc ) ... [ slab_floor ... slabs ] <- heap_end
+ *
+ * Requests up to 2 KiB are served from per size-class slabs with an O(1)
+ * free list. Anything larger is a block in the large arena carrying a
+ * header and a footer (boundary tags), so that freed blocks merge with
+ * their free neighbours and oversized ones are split.
+ *
+ * Slab objects are cached per CPU in magazines (Bonwick & Adams): every CPU
+ * owns a loaded and a previous magazine per class and only touches them
+ * with interrupts off. Full and empty magazines are exchanged through a
+ * per-class depot. Slabs, large blocks and counters sit behind heap_lock.
+ */
 
 typedef struct alloc_t {
     uint64_t size;
-    uint8_t status; // 0 = free, 1 = allocated
-} __attribute__((packed)) alloc_t;
+    uint32_t status; // 0 = free, 1 = allocated
+    uint32_t magic;
+} alloc_t;
+
+/* Mirror of the header, placed right after the payload. */
+typedef struct {
+    uint64_t size;
+    uint32_t status;
+    uint32_t magic;
+} alloc_footer_t;
 
 typedef struct {
     uint64_t magic;
     uintptr_t raw;
 } aligned_alloc_header_t;
 
+/* Links stored in the payload of a free large block. */
+typedef struct heap_free_node {
+    struct heap_free_node* prev;
+    struct heap_free_node* next;
+} heap_free_node_t;
+
+#define SLAB_MAP_WORDS 16 // one bit per object of the smallest class in a slab
+
+/* Lives at the start of every SLAB_SIZE aligned slab. */
+typedef struct slab {
+    uint32_t magic;
+    uint16_t class_index;
+    uint16_t in_use;
+    uint16_t capacity;
+    void* free_objects;
+    struct slab* prev;
+    struct slab* next;
+    uint64_t used[SLAB_MAP_WORDS]; // objects out with kmalloc() callers, to catch double frees
+} slab_t;
+
+typedef struct {
+    slab_t* partial;  // slabs with at least one free object
+    slab_t* full;     // slabs with no free object
+    uint64_t slabs;
+    uint64_t objects_in_use;
+    uint64_t total_allocs;
+    uint64_t total_frees;
+} slab_cache_t;
+
+#define MAGAZINE_ROUNDS 30
+
+typedef struct magazine {
+    struct magazine* next;
+    uint64_t rounds;
+    void* objects[MAGAZINE_ROUNDS];
+} magazine_t;
+
+typedef struct {
+    magazine_t* loaded;
+    magazine_t* previous;
+} cpu_magazines_t;
+
+typedef struct {
+    spinlock_t lock;
+    magazine_t* full;
+    magazine_t* empty;
+    uint64_t full_count;
+    uint64_t empty_count;
+} magazine_depot_t;
+
 uint64_t heap_begin = 0;
 uint64_t heap_end   = 0;
 uint64_t last_alloc = 0;
 uint64_t alloc_count = 0;
 uint64_t memory_used = 0;
 
+static uint64_t slab_floor = 0;
+static slab_t* empty_slabs = NULL;
+static heap_free_node_t* large_free_list = NULL;
+static uint64_t large_free_bytes = 0;
+static uint64_t empty_slab_count = 0;
+
 #define ALIGN_UP(x, a) (((x) + ((a)-1)) & ~((a)-1))
+#define ALIGN_DOWN(x, a) ((x) & ~((a)-1))
 #define ALIGNED_ALLOC_MAGIC 0x46574B414C49474EULL /* "FWKALIGN" */
+#define HEAP_ALLOC_MAGIC    0x4B4C4F43U            /* "KLOC" */
+#define HEAP_SLAB_MAGIC     0x42414C53U            /* "SLAB" */
+
+#define HEAP_MIN_ALIGN      16
+#define SLAB_SIZE           (16 KiB)
+#define SLAB_HEADER_SIZE    ALIGN_UP(sizeof(slab_t), 64)
+
+#define BLOCK_OVERHEAD      (sizeof(alloc_t) + sizeof(alloc_footer_t))
+#define BLOCK_MIN_SPLIT     64 // smallest payload worth splitting off
+
+static const uint32_t heap_class_sizes[HEAP_SIZE_CLASSES] = {
+    16, 32, 64, 128, 256, 512, 1024, 2048
+};
 
-static alloc_t* heap_alloc_from_user_ptr(void* ptr)
+static slab_cache_t slab_caches[HEAP_SIZE_CLASSES];
+static cpu_magazines_t cpu_magazines[SMP_MAX_CPUS][HEAP_SIZE_CLASSES];
+static magazine_depot_t magazine_depots[HEAP_SIZE_CLASSES];
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+static inline int heap_class_for(size_t size)
 {
-    if (!ptr || heap_begin == 0 || heap_end <= heap_begin)
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        if (size <= heap_class_sizes[i])
+            return i;
+    }
+    return -1;
+}
+
+static inline bool heap_in_slab_arena(uintptr_t addr)
+{
+    return addr >= slab_floor && addr < heap_end;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    slab->prev = slab->next = NULL;
+}
+
+static void slab_list_push(slab_t** head, slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static slab_t* slab_create(int class_index)
+{
+    slab_t* slab = empty_slabs;
+
+    if (slab) {
+        slab_list_remove(&empty_slabs, slab);
+        empty_slab_count--;
+    } else {
+        if (slab_floor < SLAB_SIZE || slab_floor - SLAB_SIZE < last_alloc)
+            return NULL;
+
+        slab_floor -= SLAB_SIZE;
+        slab = (slab_t*)slab_floor;
+    }
+
+    uint32_t obj_size = heap_class_sizes[class_index];
+
+    slab->magic = HEAP_SLAB_MAGIC;
+    slab->class_index = (uint16_t)class_index;
+    slab->in_use = 0;
+    slab->capacity = (uint16_t)((SLAB_SIZE - SLAB_HEADER_SIZE) / obj_size);
+    slab->free_objects = NULL;
+    memset(slab->used, 0, sizeof(slab->used));
+
+    // Thread the free list so the lowest object is handed out first.
+    uint8_t* base = (uint8_t*)slab + SLAB_HEADER_SIZE;
+    for (int i = slab->capacity - 1; i >= 0; i--) {
+        void** obj = (void**)(base + (size_t)i * obj_size);
+        *obj = slab->free_objects;
+        slab->free_objects = obj;
+    }
+
+    slab_caches[class_index].slabs++;
+    return slab;
+}
+
+static inline uint32_t slab_index(slab_t* slab, uintptr_t ptr)
+{
+    return (uint32_t)((ptr - ((uintptr_t)slab + SLAB_HEADER_SIZE)) / heap_class_sizes[slab->class_index]);
+}
+
+static void* slab_alloc(int class_index)
+{
+    slab_cache_t* cache = &slab_caches[class_index];
+    slab_t* slab = cache->partial;
+
+    if (!slab) {
+        slab = slab_create(class_index);
+        if (!slab)
+            return NULL;
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void** obj = (void**)slab->free_objects;
+    slab->free_objects = *obj;
+    slab->in_use++;
+
+    if (!slab->free_objects) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->objects_in_use++;
+    return obj;
+}
+
+static slab_t* slab_from_ptr(uintptr_t ptr)
+{
+    slab_t* slab = (slab_t*)ALIGN_DOWN(ptr, SLAB_SIZE);
+
+    if (slab->magic != HEAP_SLAB_MAGIC || slab->class_index >= HEAP_SIZE_CLASSES)
+        return NULL;
+
+    uintptr_t first = (uintptr_t)slab + SLAB_HEADER_SIZE;
+    uint32_t obj_size = heap_class_sizes[slab->class_index];
+    if (ptr < first || (ptr - first) % obj_size != 0 ||
+        (ptr - first) / obj_size >= slab->capacity)
+        return NULL;
+
+    return slab;
+}
+
+/*
+ * Marks @p ptr as handed out (@p live) or given back. Magazines hold given
+ * back objects, so this is done outside of them, lock free.
+ *
+ * @return false if it already was.
+ */
+static bool slab_mark(slab_t* slab, uintptr_t ptr, bool live)
+{
+    uint32_t index = slab_index(slab, ptr);
+    uint64_t bit = 1ULL << (index % 64);
+    uint64_t old = live ? __atomic_fetch_or(&slab->used[index / 64], bit, __ATOMIC_ACQ_REL)
+                        : __atomic_fetch_and(&slab->used[index / 64], ~bit, __ATOMIC_ACQ_REL);
+    return ((old & bit) != 0) != live;
+}
+
+static void slab_free(slab_t* slab, void* ptr)
+{
+    slab_cache_t* cache = &slab_caches[slab->class_index];
+    bool was_full = slab->free_objects == NULL;
+
+    *(void**)ptr = slab->free_objects;
+    slab->free_objects = ptr;
+    slab->in_use--;
+
+    cache->objects_in_use--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(was_full ? &cache->full : &cache->partial, slab);
+        slab->magic = 0;
+        cache->slabs--;
+        slab_list_push(&empty_slabs, slab);
+        empty_slab_count++;
+    } else if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+}
+
+static inline void* block_payload(alloc_t* a)
+{
+    return (uint8_t*)a + sizeof(alloc_t);
+}
+
+static inline alloc_t* block_from_payload(void* payload)
+{
+    return (alloc_t*)((uint8_t*)payload - sizeof(alloc_t));
+}
+
+static inline alloc_footer_t* block_footer(alloc_t* a)
+{
+    return (alloc_footer_t*)((uint8_t*)block_payload(a) + a->size);
+}
+
+/* Stamps the header and footer of a block with its current size/status. */
+static void block_write_tags(alloc_t* a, uint64_t size, uint32_t status)
+{
+    a->size = size;
+    a->status = status;
+    a->magic = HEAP_ALLOC_MAGIC;
+
+    alloc_footer_t* f = block_footer(a);
+    f->size = size;
+    f->status = status;
+    f->magic = HEAP_ALLOC_MAGIC;
+}
+
+static alloc_t* block_next(alloc_t* a)
+{
+    uintptr_t next = (uintptr_t)block_footer(a) + sizeof(alloc_footer_t);
+    if (next >= last_alloc)
+        return NULL;
+    return (alloc_t*)next;
+}
+
+static alloc_t* block_prev(alloc_t* a)
+{
+    if ((uintptr_t)a < heap_begin + BLOCK_OVERHEAD)
+        return NULL;
+
+    alloc_footer_t* f = (alloc_footer_t*)a - 1;
+    if (f->magic != HEAP_ALLOC_MAGIC)
         return NULL;
 
+    return (alloc_t*)((uint8_t*)f - f->size - sizeof(alloc_t));
+}
+
+static void large_free_list_remove(alloc_t* a)
+{
+    heap_free_node_t* node = (heap_free_node_t*)block_payload(a);
+
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        large_free_list = node->next;
+
+    if (node->next)
+        node->next->prev = node->prev;
+
+    large_free_bytes -= a->size;
+}
+
+static void large_free_list_push(alloc_t* a)
+{
+    heap_free_node_t* node = (heap_free_node_t*)block_payload(a);
+
+    node->prev = NULL;
+    node->next = large_free_list;
+    if (large_free_list)
+        large_free_list->prev = node;
+    large_free_list = node;
+
+    large_free_bytes += a->size;
+}
+
+/*
+ * Merges a free block with its free neighbours and gives it back, either to
+ * the free list or, when it is the last block, to the unreserved gap.
+ */
+static void large_release(alloc_t* a)
+{
+    alloc_t* next = block_next(a);
+    if (next && next->status == 0) {
+        large_free_list_remove(next);
+        block_write_tags(a, a->size + BLOCK_OVERHEAD + next->size, 0);
+    }
+
+    alloc_t* prev = block_prev(a);
+    if (prev && prev->status == 0) {
+        large_free_list_remove(prev);
+        block_write_tags(prev, prev->size + BLOCK_OVERHEAD + a->size, 0);
+        a = prev;
+    }
+
+    if ((uintptr_t)block_footer(a) + sizeof(alloc_footer_t) == last_alloc) {
+        last_alloc = (uintptr_t)a;
+        return;
+    }
+
+    large_free_list_push(a);
+}
+
+/* Shrinks an allocated block to size, returning the tail as a free block. */
+static void large_split(alloc_t* a, uint64_t size)
+{
+    if (a->size < size + BLOCK_OVERHEAD + BLOCK_MIN_SPLIT)
+        return;
+
+    uint64_t rest = a->size - size - BLOCK_OVERHEAD;
+    block_write_tags(a, size, a->status);
+
+    alloc_t* tail = (alloc_t*)((uint8_t*)block_footer(a) + sizeof(alloc_footer_t));
+    block_write_tags(tail, rest, 0);
+    large_release(tail);
+}
+
+static void* large_alloc(size_t size)
+{
+    // First fit over the free blocks only, never over live ones.
+    for (heap_free_node_t* node = large_free_list; node; node = node->next) {
+        alloc_t* a = block_from_payload(node);
+        if (a->size >= size) {
+            large_free_list_remove(a);
+            block_write_tags(a, a->size, 1);
+            large_split(a, size);
+            return node;
+        }
+    }
+
+    if (size > UINT64_MAX - last_alloc - BLOCK_OVERHEAD ||
+        last_alloc + BLOCK_OVERHEAD + size > slab_floor) {
+        return NULL;
+    }
+
+    alloc_t* new_alloc = (alloc_t*)last_alloc;
+    block_write_tags(new_alloc, size, 1);
+
+    last_alloc += BLOCK_OVERHEAD + size;
+    return block_payload(new_alloc);
+}
+
+/* Tries to grow an allocated block to size without moving it. */
+static bool large_grow(alloc_t* a, uint64_t size)
+{
+    uintptr_t end = (uintptr_t)block_footer(a) + sizeof(alloc_footer_t);
+
+    if (end == last_alloc) {
+        if (size - a->size > slab_floor - last_alloc)
+            return false;
+
+        block_write_tags(a, size, 1);
+        last_alloc = (uintptr_t)block_footer(a) + sizeof(alloc_footer_t);
+        return true;
+    }
+
+    alloc_t* next = block_next(a);
+    if (!next || next->status != 0 || a->size + BLOCK_OVERHEAD + next->size < size)
+        return false;
+
+    large_free_list_remove(next);
+    block_write_tags(a, a->size + BLOCK_OVERHEAD + next->size, 1);
+    large_split(a, size);
+    return true;
+}
+
+static alloc_t* large_from_ptr(uintptr_t user)
+{
+    if (user < heap_begin + sizeof(alloc_t) || user > last_alloc)
+        return NULL;
+
+    alloc_t* a = block_from_payload((void*)user);
+    if (a->magic != HEAP_ALLOC_MAGIC || block_footer(a)->magic != HEAP_ALLOC_MAGIC)
+        return NULL;
+
+    return a;
+}
+
+/* Undo kmalloc_aligned so callers always see the pointer kmalloc returned. */
+static uintptr_t heap_raw_from_user_ptr(void* ptr)
+{
+    if (!ptr || heap_begin == 0 || heap_end <= heap_begin)
+        return 0;
+
     uintptr_t user = (uintptr_t)ptr;
     if (user < heap_begin + sizeof(alloc_t) || user > heap_end)
-        return NULL;
+        return 0;
 
     if (user >= heap_begin + sizeof(aligned_alloc_header_t)) {
         aligned_alloc_header_t* aligned_hdr =
             (aligned_alloc_header_t*)(user - sizeof(aligned_alloc_header_t));
 
-        if ((uintptr_t)aligned_hdr >= heap_begin &&
-            (uintptr_t)aligned_hdr <= heap_end - sizeof(*aligned_hdr) &&
-            aligned_hdr->magic == ALIGNED_ALLOC_MAGIC &&
-            aligned_hdr->raw >= heap_begin + sizeof(alloc_t) &&
-            aligned_hdr->raw <= heap_end) {
-            alloc_t* raw_alloc = (alloc_t*)(aligned_hdr->raw - sizeof(alloc_t));
-            if ((uintptr_t)raw_alloc >= heap_begin &&
-                (uintptr_t)raw_alloc <= heap_end - sizeof(*raw_alloc)) {
-                return raw_alloc;
-            }
+        if (aligned_hdr->magic == ALIGNED_ALLOC_MAGIC &&
+            aligned_hdr->raw >= heap_begin &&
+            aligned_hdr->raw < user) {
+            return aligned_hdr->raw;
         }
     }
 
-    return (alloc_t*)(user - sizeof(alloc_t));
+    return user;
 }
 
 void mm_init(uintptr_t kernel_end, uint64 heap_size)
 {
     info("Initializing heap", __FILE__);
 
-    heap_begin = ALIGN_UP(kernel_end, 8);
+    heap_begin = ALIGN_UP(kernel_end, HEAP_MIN_ALIGN);
     if (heap_size <= 0 || (uint64_t)heap_size > UINT64_MAX - heap_begin) {
         meltdown_screen("Invalid heap size!", __FILE__, __LINE__, 0, getCR2(), 0);
         hcf();
     }
     heap_end   = heap_begin + (uint64_t)heap_size;
     last_alloc = heap_begin;
+    slab_floor = ALIGN_DOWN(heap_end, SLAB_SIZE);
+    heap_end   = slab_floor;
+
+    empty_slabs = NULL;
+    empty_slab_count = 0;
+    large_free_list = NULL;
+    large_free_bytes = 0;
+    memset(slab_caches, 0, sizeof(slab_caches));
+    memset(cpu_magazines, 0, sizeof(cpu_magazines));
+    memset(magazine_depots, 0, sizeof(magazine_depots));
 
     memset((void*)heap_begin, 0, (size_t)(heap_end - heap_begin));
 
@@ -73,6 +513,109 @@ void mm_init(uintptr_t kernel_end, uint64 heap_size)
     done("Heap initialized", __FILE__);
 }
 
+static magazine_t* magazine_new(void)
+{
+    static int magazine_class = -1;
+    if (magazine_class < 0)
+        magazine_class = heap_class_for(sizeof(magazine_t));
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    magazine_t* mag = slab_alloc(magazine_class);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (mag) {
+        mag->next = NULL;
+        mag->rounds = 0;
+    }
+    return mag;
+}
+
+static magazine_t* depot_take(magazine_depot_t* depot, bool full)
+{
+    spin_lock(&depot->lock);
+
+    magazine_t** head = full ? &depot->full : &depot->empty;
+    magazine_t* mag = *head;
+    if (mag) {
+        *head = mag->next;
+        if (full) depot->full_count--; else depot->empty_count--;
+    }
+
+    spin_unlock(&depot->lock);
+    return mag;
+}
+
+static void depot_put(magazine_depot_t* depot, magazine_t* mag)
+{
+    spin_lock(&depot->lock);
+
+    bool full = mag->rounds != 0;
+    magazine_t** head = full ? &depot->full : &depot->empty;
+    mag->next = *head;
+    *head = mag;
+    if (full) depot->full_count++; else depot->empty_count++;
+
+    spin_unlock(&depot->lock);
+}
+
+/* Must run with interrupts off, the magazines belong to this CPU only. */
+static void* magazine_pop(int class_index)
+{
+    cpu_magazines_t* cm = &cpu_magazines[smp_current_cpu()][class_index];
+
+    if (cm->loaded && cm->loaded->rounds)
+        return cm->loaded->objects[--cm->loaded->rounds];
+
+    if (cm->previous && cm->previous->rounds) {
+        magazine_t* tmp = cm->loaded;
+        cm->loaded = cm->previous;
+        cm->previous = tmp;
+        return cm->loaded->objects[--cm->loaded->rounds];
+    }
+
+    magazine_t* full = depot_take(&magazine_depots[class_index], true);
+    if (!full)
+        return NULL;
+
+    if (cm->previous)
+        depot_put(&magazine_depots[class_index], cm->previous);
+    cm->previous = cm->loaded;
+    cm->loaded = full;
+    return cm->loaded->objects[--cm->loaded->rounds];
+}
+
+/* Must run with interrupts off, the magazines belong to this CPU only. */
+static bool magazine_push(int class_index, void* obj)
+{
+    cpu_magazines_t* cm = &cpu_magazines[smp_current_cpu()][class_index];
+
+    if (cm->loaded && cm->loaded->rounds < MAGAZINE_ROUNDS) {
+        cm->loaded->objects[cm->loaded->rounds++] = obj;
+        return true;
+    }
+
+    if (cm->previous && cm->previous->rounds == 0) {
+        magazine_t* tmp = cm->loaded;
+        cm->loaded = cm->previous;
+        cm->previous = tmp;
+        cm->loaded->objects[cm->loaded->rounds++] = obj;
+        return true;
+    }
+
+    magazine_t* empty = depot_take(&magazine_depots[class_index], false);
+    if (!empty)
+        empty = magazine_new();
+    if (!empty)
+        return false;
+
+    if (cm->previous)
+        depot_put(&magazine_depots[class_index], cm->previous);
+    cm->previous = cm->loaded;
+    cm->loaded = empty;
+    cm->loaded->objects[cm->loaded->rounds++] = obj;
+    return true;
+}
+
 void* kmalloc(size_t size)
 {
     if (size == 0) {
@@ -80,52 +623,48 @@ void* kmalloc(size_t size)
         return NULL;
     }
 
-    size = ALIGN_UP(size, 8);
+    void* ptr = NULL;
+    size_t usable = 0;
+    int class_index = heap_class_for(size);
+    uint64_t flags;
 
-    uint8_t* mem = (uint8_t*)heap_begin;
+    if (class_index >= 0) {
+        flags = irq_save();
+        ptr = magazine_pop(class_index);
+        irq_restore(flags);
 
-    // Search for free block
-    while ((uintptr_t)mem < last_alloc) {
-        alloc_t* a = (alloc_t*)mem;
-
-        if (a->size == 0)
-            break;
-
-        if (!a->status && a->size >= size) {
-            a->status = 1;
-            memory_used += a->size + sizeof(alloc_t);
-            memset(mem + sizeof(alloc_t), 0, size);
-            return mem + sizeof(alloc_t);
+        if (!ptr) {
+            flags = spin_lock_irqsave(&heap_lock);
+            ptr = slab_alloc(class_index);
+            spin_unlock_irqrestore(&heap_lock, flags);
         }
 
-        mem += sizeof(alloc_t) + a->size;
-        mem = (uint8_t*)ALIGN_UP((uintptr_t)mem, 8);
+        if (ptr)
+            slab_mark((slab_t*)ALIGN_DOWN((uintptr_t)ptr, SLAB_SIZE), (uintptr_t)ptr, true);
+
+        usable = heap_class_sizes[class_index];
+        size = usable; // also wipes the free list link
+    } else if (size <= UINT64_MAX - HEAP_MIN_ALIGN) {
+        flags = spin_lock_irqsave(&heap_lock);
+        ptr = large_alloc(ALIGN_UP(size, HEAP_MIN_ALIGN));
+        if (ptr)
+            usable = block_from_payload(ptr)->size;
+        spin_unlock_irqrestore(&heap_lock, flags);
     }
 
-    // Align new block start
-    last_alloc = ALIGN_UP(last_alloc, 8);
-
-    if (size > UINT64_MAX - last_alloc - sizeof(alloc_t) ||
-        last_alloc + sizeof(alloc_t) + size > heap_end) {
+    if (!ptr) {
         meltdown_screen("Heap out of memory!", __FILE__, __LINE__, 0, getCR2(), 0);
         hcf();
     }
 
-    alloc_t* new_alloc = (alloc_t*)last_alloc;
-    new_alloc->size = size;
-    new_alloc->status = 1;
-
-    uint8_t* user_ptr = (uint8_t*)new_alloc + sizeof(alloc_t);
-    memset(user_ptr, 0, size);
-
-    last_alloc += sizeof(alloc_t) + size;
-    last_alloc = ALIGN_UP(last_alloc, 8);
+    memset(ptr, 0, size);
 
-    memory_used += size + sizeof(alloc_t);
+    __atomic_fetch_add(&memory_used, usable, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    if (class_index >= 0)
+        __atomic_fetch_add(&slab_caches[class_index].total_allocs, 1, __ATOMIC_RELAXED);
 
-    alloc_count++;
-
-    return user_ptr;
+    return ptr;
 }
 
 void kfree(void* ptr)
@@ -135,20 +674,66 @@ void kfree(void* ptr)
         return;
     }
 
-    alloc_t* a = heap_alloc_from_user_ptr(ptr);
-    if (!a || (uintptr_t)a < heap_begin || (uintptr_t)a > heap_end - sizeof(*a)) {
+    uintptr_t raw = heap_raw_from_user_ptr(ptr);
+    if (!raw) {
+        warn("kfree: Pointer is outside heap.", __FILE__);
+        return;
+    }
+
+    uint64_t flags;
+
+    if (heap_in_slab_arena(raw)) {
+        slab_t* slab = slab_from_ptr(raw);
+        if (!slab) {
+            warn("kfree: Pointer is not a slab object.", __FILE__);
+            return;
+        }
+
+        // Before the magazine, which would hand it out twice.
+        if (!slab_mark(slab, raw, false)) {
+            warn("kfree: Double free detected.", __FILE__);
+            return;
+        }
+
+        int class_index = slab->class_index;
+
+        flags = irq_save();
+        bool cached = magazine_push(class_index, (void*)raw);
+        irq_restore(flags);
+
+        if (!cached) {
+            flags = spin_lock_irqsave(&heap_lock);
+            slab_free(slab, (void*)raw);
+            spin_unlock_irqrestore(&heap_lock, flags);
+        }
+
+        __atomic_fetch_sub(&memory_used, heap_class_sizes[class_index], __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&slab_caches[class_index].total_frees, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    flags = spin_lock_irqsave(&heap_lock);
+
+    alloc_t* a = large_from_ptr(raw);
+    if (!a) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         warn("kfree: Pointer is outside heap.", __FILE__);
         return;
     }
 
     if (a->status == 0) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         warn("kfree: Double free detected.", __FILE__);
         return;
     }
 
-    a->status = 0;
-    memory_used -= a->size + sizeof(alloc_t);
-    alloc_count--;
+    __atomic_fetch_sub(&memory_used, a->size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&alloc_count, 1, __ATOMIC_RELAXED);
+    block_write_tags(a, a->size, 0);
+    large_release(a);
+
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void* krealloc(void* ptr, size_t size)
@@ -159,19 +744,47 @@ void* krealloc(void* ptr, size_t size)
         return NULL;
     }
 
-    size = ALIGN_UP(size, 8);
+    uintptr_t raw = heap_raw_from_user_ptr(ptr);
+    size_t usable = 0;
+
+    if (raw && heap_in_slab_arena(raw)) {
+        slab_t* slab = slab_from_ptr(raw);
+        if (slab)
+            usable = heap_class_sizes[slab->class_index];
+    } else if (raw) {
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
 
-    alloc_t* old = heap_alloc_from_user_ptr(ptr);
-    if (!old || old->status == 0) {
+        alloc_t* a = large_from_ptr(raw);
+        if (a && a->status) {
+            usable = a->size;
+
+            uint64_t wanted = ALIGN_UP((uint64_t)size, HEAP_MIN_ALIGN);
+            if (raw == (uintptr_t)ptr && wanted > usable && large_grow(a, wanted)) {
+                uint64_t grown = a->size;
+                spin_unlock_irqrestore(&heap_lock, flags);
+
+                __atomic_fetch_add(&memory_used, grown - usable, __ATOMIC_RELAXED);
+                memset((uint8_t*)ptr + usable, 0, grown - usable);
+                return ptr;
+            }
+        }
+
+        spin_unlock_irqrestore(&heap_lock, flags);
+    }
+
+    if (usable == 0) {
         warn("krealloc: Invalid pointer", __FILE__);
         return NULL;
     }
-    if (old->size >= size) return ptr;
+
+    // Aligned allocations only own the bytes after their header.
+    usable -= (uintptr_t)ptr - raw;
+    if (usable >= size) return ptr;
 
     void* new_ptr = kmalloc(size);
     if (!new_ptr) return NULL;
 
-    memcpy(new_ptr, ptr, old->size);
+    memcpy(new_ptr, ptr, usable);
     kfree(ptr);
     return new_ptr;
 }
@@ -203,12 +816,51 @@ void* kmalloc_aligned(size_t size, size_t align)
     return (void*)aligned;
 }
 
+bool heap_get_class_stats(int class_index, heap_class_stats_t* out)
+{
+    if (!out || class_index < 0 || class_index >= HEAP_SIZE_CLASSES)
+        return false;
+
+    slab_cache_t* cache = &slab_caches[class_index];
+    uint32_t per_slab = (uint32_t)((SLAB_SIZE - SLAB_HEADER_SIZE) / heap_class_sizes[class_index]);
+
+    // Racy snapshot, good enough for reporting.
+    uint64_t cached = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_magazines_t* cm = &cpu_magazines[cpu][class_index];
+        if (cm->loaded)   cached += cm->loaded->rounds;
+        if (cm->previous) cached += cm->previous->rounds;
+    }
+
+    magazine_depot_t* depot = &magazine_depots[class_index];
+    uint64_t flags = irq_save();
+    spin_lock(&depot->lock);
+    for (magazine_t* mag = depot->full; mag; mag = mag->next)
+        cached += mag->rounds;
+    spin_unlock(&depot->lock);
+    irq_restore(flags);
+
+    out->object_size    = heap_class_sizes[class_index];
+    out->slabs          = cache->slabs;
+    out->objects_cached = cached;
+    out->objects_in_use = cache->objects_in_use > cached ? cache->objects_in_use - cached : 0;
+    out->objects_total  = cache->slabs * per_slab;
+    out->total_allocs   = cache->total_allocs;
+    out->total_frees    = cache->total_frees;
+    return true;
+}
+
+uint64_t mm_free_memory(void)
+{
+    return (slab_floor - last_alloc) + large_free_bytes + empty_slab_count * SLAB_SIZE;
+}
+
 void mm_print_out(void)
 {
     printf("%sMemory used :%s %u KiB", yellow_color, reset_color, memory_used/(1 KiB));
-    printf("%sMemory free :%s %u KiB", yellow_color, reset_color, (heap_end - last_alloc)/(1 KiB));
+    printf("%sMemory free :%s %u KiB", yellow_color, reset_color, mm_free_memory()/(1 KiB));
     printf("%sHeap size   :%s %u KiB", yellow_color, reset_color, (heap_end - heap_begin)/(1 KiB));
     debug_printf("%sMemory used :%s %u KiB\n", yellow_color, reset_color, memory_used/(1 KiB));
-    debug_printf("%sMemory free :%s %u KiB\n", yellow_color, reset_color, (heap_end - last_alloc)/(1 KiB));
+    debug_printf("%sMemory free :%s %u KiB\n", yellow_color, reset_color, mm_free_memory()/(1 KiB));
     debug_printf("%sHeap size   :%s %u KiB\n", yellow_color, reset_color, (heap_end - heap_begin)/(1 KiB));
 }
@@ -75,7 +75,15 @@ void init_syscall(void)
     wrmsr64(IA32_STAR, star);
 
     wrmsr64(IA32_LSTAR, (uint64_t)syscall_entry);
-    wrmsr64(IA32_FMASK, 0);
+    // Enter with IF (and DF) clear: syscall_entry is still on the user stack
+    // until it loads this CPU's kernel stack, and only then turns interrupts
+    // back on.
+    wrmsr64(IA32_FMASK, 0x600);
+}
+
+void idt_load(void)
+{
+    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
 }
 
 void initIdt(void)
@@ -108,7 +116,7 @@ void initIdt(void)
     outb(0xa1, 0xef); // 0xff for keyboard only and for mouse + keyboard 0xef
 
     idt_ptr.offset = (uintptr_t)&idt_entries[0];
-    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+    idt_load();
     set_interrupts();
     init_syscall();
 
@@ -18,6 +18,7 @@
 #include <meltdown.h>
 #include <userland.h>
 #include <cc-asm.h>
+#include <multitasking.h>
 
 irq_handler interrupt_handlers[256];
 
@@ -37,7 +38,32 @@ static void log_page_fault_details(InterruptFrame* frame) {
             (int)((err >> 4) & 0x1));
 }
 
+/*
+ * Demand paging: a page the program owns but has not touched yet is filled
+ * in, or a copy-on-write page copied, and the faulting instruction retried.
+ * That may read the executable from disk, so interrupts come back on if
+ * the faulting code had them. The kernel only gets that for accesses it
+ * made on the program's behalf; any other kernel fault is fatal.
+ */
+static bool handle_demand_page_fault(InterruptFrame* frame) {
+    if ((frame->cs & 0x3) != 0x3 && !userland_user_access())
+        return false;
+
+    uint64_t addr = getCR2();
+
+    if (frame->rflags & 0x200)
+        asm volatile("sti");
+    multitasking_lock_kernel();
+    bool handled = userland_handle_page_fault(addr, frame->err_code);
+    multitasking_unlock_kernel();
+    asm volatile("cli");
+    return handled;
+}
+
 void exceptionHandler(InterruptFrame* frame) {
+    if (frame && frame->int_no == 14 && handle_demand_page_fault(frame))
+        return;
+
     enable_logging = false; // disables logger as fast as it can to get the last instance of panic.
     log_page_fault_details(frame);
 
@@ -86,6 +112,23 @@ void registerInterruptHandler(uint8_t interrupt, irq_handler handler)
     interrupt_handlers[interrupt] = handler;
 }
 
+uint8_t allocateInterruptVector(irq_handler handler)
+{
+    for (uint32_t v = IRQ_DYNAMIC_FIRST; v <= IRQ_DYNAMIC_LAST; v++) {
+        if (v == IRQ_SYSCALL || interrupt_handlers[v] != NULL)
+            continue;
+        interrupt_handlers[v] = handler;
+        return (uint8_t)v;
+    }
+    return 0;
+}
+
+void freeInterruptVector(uint8_t irq)
+{
+    if (irq >= IRQ_DYNAMIC_FIRST && irq <= IRQ_DYNAMIC_LAST && irq != IRQ_SYSCALL)
+        interrupt_handlers[irq] = NULL;
+}
+
 void irqHandler(InterruptFrame* frame)
 {
     irq_handler handler = (irq_handler)interrupt_handlers[frame->int_no];
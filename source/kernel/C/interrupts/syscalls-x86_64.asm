@@ -1,44 +1,39 @@
 global syscall_entry
+global syscall_resume
 extern syscall_handler
-extern kernel_stack_top
-extern userland_should_return_kernel
-extern userland_resume_rsp
-extern userland_resume_rip
-extern userland_resume_rbx
-extern userland_resume_rbp
-extern userland_resume_r12
-extern userland_resume_r13
-extern userland_resume_r14
-extern userland_resume_r15
-
-section .bss
-align 8
-saved_user_rsp: resq 1
-saved_user_rbx: resq 1
 
 section .text
 
 syscall_entry:
+    ; KERNEL_GS_BASE points at this CPU's cpu_syscall_area (see tss.h).
+    ; IA32_FMASK clears IF, so nothing can interrupt us while RSP still
+    ; points at the user stack and GS is swapped. GS is swapped back before
+    ; interrupts come on: a syscall that sleeps must not carry the kernel GS
+    ; into whatever task runs next on this CPU.
     swapgs
+    mov [gs:8], rsp     ; user RSP
 
-    ; Preserve userland RBX and RSP across SYSCALL.
-    ; NOTE: single-slot scratch is fine for current single-core/single-threaded userspace,
-    ; but this should eventually be per-CPU/per-thread storage.
-    mov [rel saved_user_rbx], rbx
-    mov [rel saved_user_rsp], rsp
-
-    ; Switch to kernel stack
-    mov rsp, [rel kernel_stack_top]
+    ; Switch to the kernel stack of the running task
+    mov rsp, [gs:0]
 
     ; Build FULL iret frame manually
     push 0x23        ; SS (user data)
-    mov rbx, [rel saved_user_rsp]
-    push rbx         ; RSP (user stack)
+    push qword [gs:8] ; RSP (user stack)
+    swapgs
     push r11         ; RFLAGS
     push 0x1B        ; CS (user code)
     push rcx         ; RIP
 
-    ; Save registers
+    ; Save registers. RBX goes on the task's stack as well: a syscall can
+    ; sleep and another task's syscall would overwrite any shared slot.
+    ; The callee-saved ones are kept too, so fork() can hand the whole
+    ; user context to the child.
+    push r15
+    push r14
+    push r13
+    push r12
+    push rbp
+    push rbx
     push rax
     push rdi
     push rsi
@@ -47,10 +42,13 @@ syscall_entry:
     push r8
     push r9
 
-    ; Call C handler
+    ; Call C handler (18 pushes keep RSP aligned for the SysV ABI)
     mov rdi, rsp
+    sti
     call syscall_handler
+    cli
 
+syscall_exit:
     ; Restore registers
     pop r9
     pop r8
@@ -59,27 +57,21 @@ syscall_entry:
     pop rsi
     pop rdi
     pop rax
-
-    ; Restore userland RBX prior to iretq.
-    mov rbx, [rel saved_user_rbx]
-
-    cmp byte [rel userland_should_return_kernel], 0
-    je .return_to_user
-
-    mov rbx, [rel userland_resume_rbx]
-    mov rbp, [rel userland_resume_rbp]
-    mov r12, [rel userland_resume_r12]
-    mov r13, [rel userland_resume_r13]
-    mov r14, [rel userland_resume_r14]
-    mov r15, [rel userland_resume_r15]
-    mov rsp, [rel userland_resume_rsp]
-    mov rax, [rel userland_resume_rip]
-    jmp rax
-
-.return_to_user:
+    pop rbx
+    pop rbp
+    pop r12
+    pop r13
+    pop r14
+    pop r15
 
     ; Return to user
-    swapgs
     iretq
 
+syscall_resume:
+    ; Leaves for ring 3 with the syscall frame at RDI, which must be on the
+    ; running task's kernel stack: how a forked child returns from fork().
+    cli
+    mov rsp, rdi
+    jmp syscall_exit
+
 section .note.GNU-stack noalloc noexec nowrite progbits
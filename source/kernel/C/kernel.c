@@ -17,6 +17,9 @@
 #include <tty.h>
 #include <executables/elf.h>
 #include <multitasking.h>
+#include <smp.h>
+#include <timer.h>
+#include <filesystems/vfs.h>
 
 int terminal_rows = 0;
 int terminal_columns = 0;
@@ -78,9 +81,10 @@ static void ap_entry(struct limine_smp_info *info) {
     printf("Hart ID: 0x%x", info->hartid);
 #endif
 
+    smp_ap_online(info);
     __atomic_fetch_add(&ctr, 1, __ATOMIC_SEQ_CST);
 
-    while (1);
+    smp_ap_loop();
 }
 
 #define MOUSE_COLOR_DEFAULT 0xffffffff
@@ -143,6 +147,7 @@ void main(void) {
     framebuffer = framebuffer_request.response->framebuffers[0];
     memmap = memory_map_request.response;
     paging_set_hhdm_offset(hhdm_request.response->offset);
+    paging_enable_pcid();
 
     ft_ctx = flanterm_fb_simple_init(
         framebuffer->address, framebuffer->width, framebuffer->height, framebuffer->pitch
@@ -171,7 +176,11 @@ void main(void) {
      */
     mm_init(0x1000000, 64 MiB);
 
-    // Optional method of initializing heap, TODO make an VMM & PMM
+    // The heap is identity mapped physical memory, keep the PMM out of it.
+    pmm_reserve_range(0x1000000, 64 MiB);
+    pmm_init();
+
+    // Optional method of initializing heap, TODO make an VMM
     // void* heap_page = allocate_pages(64 MiB / PAGE_SIZE);
     // mm_init(heap_page, 64 MiB);
 
@@ -205,6 +214,9 @@ void main(void) {
     printf("Read back page1: 0x%x", *test1);
     printf("Read back page2: 0x%x", *test2);
 
+    free_page(page1);
+    free_page(page2);
+
     probe_pci();
     
     printf(public_key);
@@ -220,6 +232,7 @@ void main(void) {
     }
 
     printf("Total CPU(s): %d", smp_request.response->cpu_count);
+    smp_init(smp_request.response);
     for(uint64_t i=0;i<smp_request.response->cpu_count;i++){
         printf("Processor  ID [%d] : 0x%X", (int)(i+1U), smp_request.response->cpus[i]->processor_id);
         printf("Local APIC ID [%d] : 0x%X", (int)(i+1U), smp_request.response->cpus[i]->lapic_id);
@@ -239,11 +252,13 @@ void main(void) {
 
     init_rtc();
     display_time();
+    timer_init();
     
     enable_fpu();
 
     check_sse();
     load_complete_sse();
+    memory_probe_features();
 
     rtl8139_init(RTL8139);
 
@@ -253,6 +268,7 @@ void main(void) {
     
     mm_print_out();
     multitasking_init();
+    smp_start_scheduler();
     multitasking_start_cursor_blink_task();
     create_user_str("root", "prad");
     
@@ -272,10 +288,12 @@ void main(void) {
 
 void shutdown(void){
     info("shutdown has been called", __FILE__);
+    vfs_sync();
     acpi_shutdown_hack(hhdm_request.response->offset, acpi_find_sdt);
 }
 
 void reboot(void){
     info("reboot has been called", __FILE__);
+    vfs_sync();
     acpi_reboot(hhdm_request.response->offset);
 }
@@ -0,0 +1,145 @@
+/**
+ * @file lapic.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Local APIC: enable, EOI, IPIs and the per-CPU timer.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+
+#include <lapic.h>
+#include <graphics.h>
+#include <isr.h>
+#include <paging.h>
+#include <cc-asm.h>
+#include <multitasking.h>
+#include <spinlock.h>
+
+#define IA32_APIC_BASE_MSR     0x1B
+#define APIC_BASE_X2APIC       (1ULL << 10)
+#define APIC_BASE_ENABLE       (1ULL << 11)
+#define APIC_BASE_ADDR_MASK    0xFFFFFF000ULL
+#define X2APIC_MSR_BASE        0x800
+
+#define LAPIC_REG_ID           0x020
+#define LAPIC_REG_TPR          0x080
+#define LAPIC_REG_EOI          0x0B0
+#define LAPIC_REG_SVR          0x0F0
+#define LAPIC_REG_ICR_LOW      0x300
+#define LAPIC_REG_ICR_HIGH     0x310
+#define LAPIC_REG_LVT_TIMER    0x320
+#define LAPIC_REG_TIMER_INIT   0x380
+#define LAPIC_REG_TIMER_CUR    0x390
+#define LAPIC_REG_TIMER_DIV    0x3E0
+
+#define LAPIC_SVR_ENABLE       (1U << 8)
+#define LAPIC_LVT_MASKED       (1U << 16)
+#define LAPIC_TIMER_DEADLINE   (2U << 17)
+#define LAPIC_TIMER_DIV_16     0x3
+#define LAPIC_ICR_PENDING      (1U << 12)
+#define LAPIC_ICR_ASSERT       (1U << 14)
+
+#define IA32_TSC_DEADLINE_MSR  0x6E0
+
+// Every CPU is left in the same mode by the firmware, so this is shared.
+static volatile uint32_t* lapic_mmio = NULL;
+static bool lapic_x2apic = false;
+
+static uint32_t lapic_read(uint32_t reg) {
+    if (lapic_x2apic)
+        return (uint32_t)rdmsr64(X2APIC_MSR_BASE + (reg >> 4));
+    return lapic_mmio[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    if (lapic_x2apic) {
+        wrmsr64(X2APIC_MSR_BASE + (reg >> 4), value);
+        return;
+    }
+    lapic_mmio[reg / 4] = value;
+}
+
+/*
+ * Timer events and reschedule IPIs are handled alike: both only ask the
+ * scheduler to look at its queues and timers again.
+ */
+static void lapic_timer_interrupt(InterruptFrame* frame) {
+    lapic_eoi();
+
+    // Acknowledged first: this may switch to another task before returning.
+    multitasking_on_timer_tick(frame && (frame->cs & 0x3) == 0x3);
+}
+
+void lapic_init(void) {
+    uint64_t base = rdmsr64(IA32_APIC_BASE_MSR);
+    if (!(base & APIC_BASE_ENABLE)) {
+        base |= APIC_BASE_ENABLE;
+        wrmsr64(IA32_APIC_BASE_MSR, base);
+    }
+
+    lapic_x2apic = (base & APIC_BASE_X2APIC) != 0;
+    if (!lapic_x2apic)
+        lapic_mmio = (volatile uint32_t*)phys_to_virt(base & APIC_BASE_ADDR_MASK);
+
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    registerInterruptHandler(LAPIC_TIMER_VECTOR, lapic_timer_interrupt);
+    registerInterruptHandler(LAPIC_RESCHED_VECTOR, lapic_timer_interrupt);
+}
+
+uint32_t lapic_id(void) {
+    uint32_t id = lapic_read(LAPIC_REG_ID);
+    return lapic_x2apic ? id : (id >> 24);
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    uint64_t flags = irq_save();
+
+    if (lapic_x2apic) {
+        wrmsr64(X2APIC_MSR_BASE + (LAPIC_REG_ICR_LOW >> 4), ((uint64_t)apic_id << 32) | LAPIC_ICR_ASSERT | vector);
+    } else {
+        while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+            asm volatile("pause");
+        lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+        lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_ASSERT | vector);
+    }
+
+    irq_restore(flags);
+}
+
+void lapic_timer_count_start(void) {
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFFU);
+}
+
+uint32_t lapic_timer_count_elapsed(void) {
+    return 0xFFFFFFFFU - lapic_read(LAPIC_REG_TIMER_CUR);
+}
+
+void lapic_timer_oneshot(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INIT, count ? count : 1);
+}
+
+void lapic_timer_tsc_deadline(uint64_t tsc) {
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_DEADLINE);
+    // The mode switch must be visible before the deadline is written.
+    asm volatile("mfence" ::: "memory");
+    wrmsr64(IA32_TSC_DEADLINE_MSR, tsc ? tsc : 1);
+}
+
+void lapic_timer_stop(void) {
+    // Leaving TSC-deadline mode through the LVT also disarms the deadline.
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
@@ -10,6 +10,7 @@
  */
 #include <memory.h>
 #include <graphics.h>
+#include <cpuid2.h>
 
 /*
  * GCC and Clang reserve the right to generate calls to the following
@@ -17,26 +18,290 @@
  * Implement them as the C specification mandates.
  * DO NOT remove or rename these functions, or stuff will eventually break!
  * They CAN be moved to a different .c file.
+ *
+ * They are in use long before memory_probe_features() runs, so the default
+ * (all flags clear) must be the plain word-wide path that needs no CPU support.
  */
 
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
+
+#define MEM_WORD_PATTERN 0x0101010101010101ULL
+
+static bool mem_erms = no;
+static bool mem_fsrm = no;
+static memory_stream_t mem_stream = MEMORY_STREAM_NONE;
+
+/*
+ * XSAVE area for the AVX streaming loops: the 512-byte legacy region, the
+ * 64-byte header XRSTOR checks, then the YMM upper halves at the offset
+ * CPUID leaf 0xD gives. mem_xsave_size is 0 if that does not fit.
+ */
+#define MEM_XSAVE_AREA_MAX  1024
+#define MEM_XSAVE_HEADER    512
+#define MEM_XSAVE_HEADER_SZ 64
+
+static uint32_t mem_xsave_size = 0;
+
+#define CR0_EM      (1ULL << 2)
+#define CR0_TS      (1ULL << 3)
+#define CR4_OSFXSR  (1ULL << 9)
+#define CR4_OSXSAVE (1ULL << 18)
+
+/**
+ * @brief The SIMD registers may only be touched when *this* CPU has them
+ * enabled; APs bring their own CR0/CR4, so this is checked per call rather
+ * than once at boot. Only reached for copies past MEMORY_STREAM_THRESHOLD.
+ */
+static memory_stream_t mem_stream_usable(void) {
+    if (mem_stream == MEMORY_STREAM_NONE)
+        return MEMORY_STREAM_NONE;
+
+    uint64_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    if ((cr0 & (CR0_EM | CR0_TS)) || !(cr4 & CR4_OSFXSR))
+        return MEMORY_STREAM_NONE;
+    if (mem_stream == MEMORY_STREAM_AVX && (!(cr4 & CR4_OSXSAVE) || !mem_xsave_size))
+        return MEMORY_STREAM_SSE2;
+    return mem_stream;
+}
+
+static inline void mem_copy_words(uint8_t* d, const uint8_t* s, size_t n) {
+    while (n >= 8) {
+        *(mem_word_t*)d = *(const mem_word_t*)s;
+        d += 8; s += 8; n -= 8;
+    }
+    while (n--)
+        *d++ = *s++;
+}
+
+static inline void mem_fill_words(uint8_t* d, uint64_t pattern, size_t n) {
+    while (n >= 8) {
+        *(mem_word_t*)d = pattern;
+        d += 8; n -= 8;
+    }
+    while (n--)
+        *d++ = (uint8_t)pattern;
+}
+
+/**
+ * @brief Forward copy without the streaming path. Safe for overlap when dest < src.
+ */
+static inline void mem_copy_forward(uint8_t* d, const uint8_t* s, size_t n) {
+    if (mem_erms && (mem_fsrm || n >= MEMORY_REP_THRESHOLD)) {
+        asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) :: "memory");
+        return;
+    }
+
+    if (n >= MEMORY_REP_THRESHOLD) {
+        size_t words = n / 8;
+        asm volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) :: "memory");
+        n &= 7;
+    }
+    mem_copy_words(d, s, n);
+}
+
+/**
+ * @brief Large copy with non-temporal stores, so a multi-megabyte copy does
+ * not flush the whole cache. The SIMD state is saved and restored around the
+ * loop in the same asm block; the kernel is built with -mno-sse, so nothing
+ * else is allowed to assume the registers survive.
+ */
+static bool mem_stream_copy(uint8_t* d, const uint8_t* s, size_t n) {
+    memory_stream_t kind = mem_stream_usable();
+    if (kind == MEMORY_STREAM_NONE)
+        return no;
+
+    size_t align = (kind == MEMORY_STREAM_AVX) ? 32 : 16;
+    size_t head = (align - ((uintptr_t)d & (align - 1))) & (align - 1);
+    mem_copy_words(d, s, head);
+    d += head; s += head; n -= head;
+
+    size_t blocks = n / 64;
+    uint8_t area[MEM_XSAVE_AREA_MAX] __attribute__((aligned(64)));
+
+    if (kind == MEMORY_STREAM_AVX) {
+        // XSAVE leaves most of the header alone and XRSTOR faults on junk there.
+        mem_fill_words(area + MEM_XSAVE_HEADER, 0, MEM_XSAVE_HEADER_SZ);
+        asm volatile(
+            "xsave64 (%[area])\n\t"
+            "1:\n\t"
+            "vmovdqu 0(%[s]), %%ymm0\n\t"
+            "vmovdqu 32(%[s]), %%ymm1\n\t"
+            "vmovntdq %%ymm0, 0(%[d])\n\t"
+            "vmovntdq %%ymm1, 32(%[d])\n\t"
+            "add $64, %[s]\n\t"
+            "add $64, %[d]\n\t"
+            "dec %[cnt]\n\t"
+            "jnz 1b\n\t"
+            "sfence\n\t"
+            "xrstor64 (%[area])"
+            : [s]"+r"(s), [d]"+r"(d), [cnt]"+r"(blocks)
+            : [area]"r"(area), "a"(0x7), "d"(0)
+            : "memory", "cc");
+    } else {
+        asm volatile(
+            "fxsave64 (%[area])\n\t"
+            "1:\n\t"
+            "movdqu 0(%[s]), %%xmm0\n\t"
+            "movdqu 16(%[s]), %%xmm1\n\t"
+            "movdqu 32(%[s]), %%xmm2\n\t"
+            "movdqu 48(%[s]), %%xmm3\n\t"
+            "movntdq %%xmm0, 0(%[d])\n\t"
+            "movntdq %%xmm1, 16(%[d])\n\t"
+            "movntdq %%xmm2, 32(%[d])\n\t"
+            "movntdq %%xmm3, 48(%[d])\n\t"
+            "add $64, %[s]\n\t"
+            "add $64, %[d]\n\t"
+            "dec %[cnt]\n\t"
+            "jnz 1b\n\t"
+            "sfence\n\t"
+            "fxrstor64 (%[area])"
+            : [s]"+r"(s), [d]"+r"(d), [cnt]"+r"(blocks)
+            : [area]"r"(area)
+            : "memory", "cc");
+    }
+
+    mem_copy_words(d, s, n & 63);
+    return yes;
+}
+
+static bool mem_stream_fill(uint8_t* d, uint64_t pattern, size_t n) {
+    memory_stream_t kind = mem_stream_usable();
+    if (kind == MEMORY_STREAM_NONE)
+        return no;
+
+    size_t align = (kind == MEMORY_STREAM_AVX) ? 32 : 16;
+    size_t head = (align - ((uintptr_t)d & (align - 1))) & (align - 1);
+    mem_fill_words(d, pattern, head);
+    d += head; n -= head;
+
+    size_t blocks = n / 64;
+    uint8_t area[MEM_XSAVE_AREA_MAX] __attribute__((aligned(64)));
+
+    if (kind == MEMORY_STREAM_AVX) {
+        // XSAVE leaves most of the header alone and XRSTOR faults on junk there.
+        mem_fill_words(area + MEM_XSAVE_HEADER, 0, MEM_XSAVE_HEADER_SZ);
+        asm volatile(
+            "xsave64 (%[area])\n\t"
+            "vmovq %[pat], %%xmm0\n\t"
+            "vpunpcklqdq %%xmm0, %%xmm0, %%xmm0\n\t"
+            "vinsertf128 $1, %%xmm0, %%ymm0, %%ymm0\n\t"
+            "1:\n\t"
+            "vmovntdq %%ymm0, 0(%[d])\n\t"
+            "vmovntdq %%ymm0, 32(%[d])\n\t"
+            "add $64, %[d]\n\t"
+            "dec %[cnt]\n\t"
+            "jnz 1b\n\t"
+            "sfence\n\t"
+            "xrstor64 (%[area])"
+            : [d]"+r"(d), [cnt]"+r"(blocks)
+            : [area]"r"(area), [pat]"r"(pattern), "a"(0x7), "d"(0)
+            : "memory", "cc");
+    } else {
+        asm volatile(
+            "fxsave64 (%[area])\n\t"
+            "movq %[pat], %%xmm0\n\t"
+            "punpcklqdq %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movntdq %%xmm0, 0(%[d])\n\t"
+            "movntdq %%xmm0, 16(%[d])\n\t"
+            "movntdq %%xmm0, 32(%[d])\n\t"
+            "movntdq %%xmm0, 48(%[d])\n\t"
+            "add $64, %[d]\n\t"
+            "dec %[cnt]\n\t"
+            "jnz 1b\n\t"
+            "sfence\n\t"
+            "fxrstor64 (%[area])"
+            : [d]"+r"(d), [cnt]"+r"(blocks)
+            : [area]"r"(area), [pat]"r"(pattern)
+            : "memory", "cc");
+    }
+
+    mem_fill_words(d, pattern, n & 63);
+    return yes;
+}
+
+/* Bytes XSAVE with x87, SSE and AVX (RFBM 0x7) writes, 0 if over our area */
+static uint32_t mem_probe_xsave_size(void) {
+    if (!cpu_has_avx())
+        return 0;
+
+    uint32 eax, ebx, ecx, edx;
+    cpuid_count(0xD, 2, &eax, &ebx, &ecx, &edx);   // AVX state: size, offset
+    uint32_t size = ebx + eax;
+    if (eax == 0 || ebx < MEM_XSAVE_HEADER + MEM_XSAVE_HEADER_SZ || size > MEM_XSAVE_AREA_MAX)
+        return 0;
+    return size;
+}
+
+void memory_probe_features(void) {
+    mem_erms = cpu_has_erms();
+    mem_fsrm = mem_erms && cpu_has_fsrm();
+    mem_xsave_size = mem_probe_xsave_size();
+
+    if (mem_xsave_size)
+        mem_stream = MEMORY_STREAM_AVX;
+    else if (cpu_has_sse2())
+        mem_stream = MEMORY_STREAM_SSE2;
+    else
+        mem_stream = MEMORY_STREAM_NONE;
+
+    printf("memcpy: %s, streaming: %s", mem_erms ? (mem_fsrm ? "rep movsb (ERMS+FSRM)" : "rep movsb (ERMS)") : "rep movsq",
+           memory_stream_name(mem_stream));
+}
+
+memory_stream_t memory_stream_kind(void) {
+    return mem_stream;
+}
+
+void memory_set_stream_kind(memory_stream_t kind) {
+    if (kind == MEMORY_STREAM_AVX && (!cpu_has_avx() || !mem_xsave_size))
+        kind = MEMORY_STREAM_SSE2;
+    if (kind == MEMORY_STREAM_SSE2 && !cpu_has_sse2())
+        kind = MEMORY_STREAM_NONE;
+    mem_stream = kind;
+}
+
+cstring memory_stream_name(memory_stream_t kind) {
+    switch (kind) {
+        case MEMORY_STREAM_SSE2: return "SSE2 movntdq";
+        case MEMORY_STREAM_AVX:  return "AVX vmovntdq";
+        default:                 return "off";
+    }
+}
+
 void *memcpy(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
- 
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
-    }
- 
+
+    if (n >= MEMORY_STREAM_THRESHOLD && mem_stream_copy(pdest, psrc, n))
+        return dest;
+
+    mem_copy_forward(pdest, psrc, n);
     return dest;
 }
 
 void *memset(void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
- 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+    uint64_t pattern = (uint64_t)(uint8_t)c * MEM_WORD_PATTERN;
+
+    if (n >= MEMORY_STREAM_THRESHOLD && mem_stream_fill(p, pattern, n))
+        return s;
+
+    if (mem_erms && (mem_fsrm || n >= MEMORY_REP_THRESHOLD)) {
+        asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+        return s;
     }
- 
+
+    if (n >= MEMORY_REP_THRESHOLD) {
+        size_t words = n / 8;
+        asm volatile("rep stosq" : "+D"(p), "+c"(words) : "a"(pattern) : "memory");
+        n &= 7;
+    }
+    mem_fill_words(p, pattern, n);
+
     return s;
 }
 
@@ -48,14 +313,20 @@ void *memmove(void *dest, const void *src, size_t n) {
         return dest;
     }
 
-    if (pdest < psrc) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+    if (pdest < psrc || pdest >= psrc + n) {
+        mem_copy_forward(pdest, psrc, n);
+        return dest;
+    }
+
+    // Overlapping with dest above src: walk down from the end. Each word is
+    // loaded before it is stored, so an overlap shorter than a word is fine.
+    while (n >= 8) {
+        n -= 8;
+        *(mem_word_t*)(pdest + n) = *(const mem_word_t*)(psrc + n);
+    }
+    while (n > 0) {
+        n--;
+        pdest[n] = psrc[n];
     }
  
     return dest;
@@ -64,6 +335,11 @@ void *memmove(void *dest, const void *src, size_t n) {
 int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
+
+    // Skip equal words, then let the byte loop find the first difference.
+    while (n >= 8 && *(const mem_word_t*)p1 == *(const mem_word_t*)p2) {
+        p1 += 8; p2 += 8; n -= 8;
+    }
  
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
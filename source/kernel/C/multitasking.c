@@ -4,42 +4,179 @@
 #include <heap.h>
 #include <memory.h>
 #include <strings.h>
+#include <paging.h>
 #include <userland.h>
+#include <tss.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <lapic.h>
+#include <timer.h>
+#include <cc-asm.h>
 #include <flanterm/flanterm.h>
 
+/*
+ * Every task owns a kernel stack and a saved register context. Switching is
+ * done by sched_switch_context(), which only has to save the callee-saved
+ * registers: everything else is already on the stack of whoever called it
+ * (schedule() itself, or the interrupt stub when the timer preempts ring 3).
+ *
+ * Each CPU has its own run queue: one FIFO per priority with a bitmap of
+ * non-empty levels, a hashed timer wheel of sleeping tasks, and a lock. A switch
+ * is made with the local queue lock held and the task switched to drops it
+ * (finish_switch()), so a task that was just put back on a queue cannot be
+ * stolen before its registers are saved. New tasks go to the least loaded
+ * CPU and an idle CPU steals from the one with the most ready tasks.
+ *
+ * There is no periodic tick. After every scheduling decision a CPU programs
+ * one one-shot timer event for the earlier of its next sleeper and, if
+ * anything else is ready, the end of the running task's time slice. An idle
+ * CPU with no sleepers arms nothing and halts until another CPU kicks it
+ * with a reschedule IPI.
+ *
+ * The kernel itself is not preemptible: a task running kernel code keeps the
+ * CPU until it sleeps, yields or returns to ring 3. Only the interrupted ring 3
+ * context is switched out on a timer tick. Kernel code is also not yet safe
+ * to run on two CPUs at once, so it runs under one kernel lock that a task
+ * gives up whenever it sleeps or returns to ring 3.
+ */
+
+#define TIMER_WHEEL_SLOTS  256
+#define TIMER_WHEEL_SHIFT  20       // 2^20 ns, about a millisecond per slot
+
 typedef struct task {
     uint32_t pid;
     task_type_t type;
     task_state_t state;
     int exit_code;
-    uint64_t created_at_tick;
-    uint64_t runtime_ticks;
+    uint64_t created_ns;
+    uint64_t exited_ns;
+    uint64_t runtime_ns;
+    uint64_t run_start_ns;      // when it last got the CPU
     char name[64];
 
+    uint64_t rsp;               // saved by sched_switch_context
+    uint8_t* kstack;            // NULL for the boot and AP idle tasks, which keep their stacks
+    uint64_t kstack_top;
+    uint64_t cr3;
+    uint32_t tlb_cpu;           // CPU whose TLB may hold its PCID's entries, UINT32_MAX if none
+    uint64_t fs_base;
+    uint8_t* fpu_state;         // fxsave area, 16-byte aligned
+    bool fpu_valid;
+    bool waited;
+
+    uint8_t priority;
+    uint64_t wake_ns;
+    uint16_t wheel_slot;
+    const void* wait_obj;       // completion a BLOCKED task waits for, if any
+    task_completion_t exit_event; // signalled by every task exit while exit_watch is set
+    bool exit_watch;
+    uint32_t period_ms;         // kernel tasks: delay between kernel_fn calls
+    void (*entry)(struct task* task);
+
+    uint32_t cpu;               // run queue the task is on or last ran from
+    volatile bool on_cpu;       // registers not saved yet, stack still in use
+    bool kill_pending;          // exit_task() hit it, it exits the next time it runs
+    int kill_code;
+    uint32_t lock_depth;        // kernel lock nesting
+    uint32_t mutexes_held;      // task_mutex_t locks, which make it unsafe to kill in place
+
     kernel_task_fn_t kernel_fn;
     void* kernel_ctx;
 
     user_task_spec_t user_spec;
+    char* user_strings;         // backing store for user_spec.path/argv
+    userland_state_t user;
+    syscall_frame_t fork_frame; // forked child: where it returns to ring 3
 
-    struct task* next;
+    struct task* next;          // all spawned tasks, for listing and pid lookup
+    struct task* qnext;         // run queue or timer wheel slot
+    struct task* qprev;
 } task_t;
 
+typedef struct cpu_rq {
+    spinlock_t lock;
+    task_t* current;
+    task_t* idle;
+    task_t* prev;               // switched away from, released by finish_switch()
+
+    task_t* head[TASK_PRIORITIES];
+    task_t* tail[TASK_PRIORITIES];
+    uint32_t bitmap;
+    volatile uint32_t nr_ready; // read without the lock to pick steal victims
+
+    task_t* wheel[TIMER_WHEEL_SLOTS];               // sleepers hashed by wake time
+    uint64_t wheel_bits[TIMER_WHEEL_SLOTS / 64];    // non-empty slots
+    uint64_t wheel_clock;       // absolute slot expired last
+    uint32_t nr_sleeping;
+
+    uint64_t slice_end_ns;      // running task's slice ends here
+    uint64_t armed_ns;          // programmed timer event, TIMER_NEVER if none
+
+    bool need_resched;
+    volatile bool kicked;       // set by multitasking_kick_cpu(), keeps idle from halting
+    volatile bool online;
+} cpu_rq_t;
+
 extern struct flanterm_context* ft_ctx;
 
+extern void sched_switch_context(uint64_t* save_rsp, uint64_t next_rsp);
+extern void sched_task_start(void);
+
+#define ZOMBIE_KEEP_NS (10 * TIMER_NS_PER_SEC)  // exit status stays around for a late waiter
+
+static spinlock_t g_tasks_lock = SPINLOCK_INIT;     // g_task_head list and pids
 static task_t* g_task_head = NULL;
 static task_t* g_task_tail = NULL;
 static uint32_t g_next_pid = 1;
-static uint32_t g_current_pid = 0;
-static uint64_t g_last_tick = 0;
 
-static uint64_t irq_save_disable(void) {
-    uint64_t flags = 0;
-    asm volatile("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
-    return flags;
+static spinlock_t g_kernel_lock = SPINLOCK_INIT;
+static cpu_rq_t g_rqs[SMP_MAX_CPUS];
+static bool g_started = false;
+
+static task_t g_boot_task;
+static uint8_t g_boot_fpu[512] __attribute__((aligned(16)));
+
+/*
+ * Callee-saved registers go on the old stack, RSP is swapped, and the new
+ * task's registers come off its stack. A fresh task "returns" into
+ * sched_task_start with its task_t in RBX.
+ */
+__asm__(
+    ".text\n"
+    ".global sched_switch_context\n"
+    "sched_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".global sched_task_start\n"
+    "sched_task_start:\n"
+    "    movq %rbx, %rdi\n"
+    "    call task_bootstrap\n"
+    "    ud2\n"
+);
+
+static inline cpu_rq_t* this_rq(void) {
+    return &g_rqs[smp_current_cpu()];
+}
+
+static inline uint32_t rq_index(const cpu_rq_t* rq) {
+    return (uint32_t)(rq - g_rqs);
 }
 
-static void irq_restore(uint64_t flags) {
-    asm volatile("pushq %0; popfq" :: "r"(flags) : "memory", "cc");
+static inline task_t* current_task(void) {
+    return this_rq()->current;
 }
 
 static task_t* find_task_locked(uint32_t pid) {
@@ -69,99 +206,855 @@ static void fill_info(const task_t* task, task_info_t* info) {
     info->type = task->type;
     info->state = task->state;
     info->exit_code = task->exit_code;
-    info->runtime_ticks = task->runtime_ticks;
+    info->runtime_ms = task->runtime_ns / TIMER_NS_PER_MS;
+    info->cpu = task->cpu;
     info->name = task->name;
 }
 
+static void rq_push_locked(cpu_rq_t* rq, task_t* task) {
+    uint8_t prio = task->priority;
+
+    task->qnext = NULL;
+    task->qprev = rq->tail[prio];
+    if (rq->tail[prio])
+        rq->tail[prio]->qnext = task;
+    else
+        rq->head[prio] = task;
+    rq->tail[prio] = task;
+    rq->bitmap |= 1U << prio;
+    rq->nr_ready++;
+}
+
+static void rq_remove_locked(cpu_rq_t* rq, task_t* task) {
+    uint8_t prio = task->priority;
+
+    if (task->qprev)
+        task->qprev->qnext = task->qnext;
+    else
+        rq->head[prio] = task->qnext;
+
+    if (task->qnext)
+        task->qnext->qprev = task->qprev;
+    else
+        rq->tail[prio] = task->qprev;
+
+    if (!rq->head[prio])
+        rq->bitmap &= ~(1U << prio);
+    task->qnext = task->qprev = NULL;
+    rq->nr_ready--;
+}
+
+static task_t* rq_pop_locked(cpu_rq_t* rq) {
+    if (rq->bitmap == 0)
+        return NULL;
+
+    task_t* task = rq->head[__builtin_ctz(rq->bitmap)];
+    rq_remove_locked(rq, task);
+    return task;
+}
+
+static void wheel_insert_locked(cpu_rq_t* rq, task_t* task) {
+    uint32_t slot = (uint32_t)(task->wake_ns >> TIMER_WHEEL_SHIFT) & (TIMER_WHEEL_SLOTS - 1);
+
+    task->wheel_slot = (uint16_t)slot;
+    task->qprev = NULL;
+    task->qnext = rq->wheel[slot];
+    if (rq->wheel[slot])
+        rq->wheel[slot]->qprev = task;
+    rq->wheel[slot] = task;
+    rq->wheel_bits[slot / 64] |= 1ULL << (slot % 64);
+    rq->nr_sleeping++;
+}
+
+static void wheel_remove_locked(cpu_rq_t* rq, task_t* task) {
+    uint32_t slot = task->wheel_slot;
+
+    if (task->qprev)
+        task->qprev->qnext = task->qnext;
+    else
+        rq->wheel[slot] = task->qnext;
+
+    if (task->qnext)
+        task->qnext->qprev = task->qprev;
+    if (!rq->wheel[slot])
+        rq->wheel_bits[slot / 64] &= ~(1ULL << (slot % 64));
+    task->qnext = task->qprev = NULL;
+    rq->nr_sleeping--;
+}
+
+static inline bool wheel_slot_used(const cpu_rq_t* rq, uint32_t slot) {
+    return (rq->wheel_bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+/**
+ * @brief Makes every sleeper of @p rq that is due by @p now ready. Only the
+ * slots passed since the last call are looked at; a slot also holds tasks
+ * due whole wheel turns later, which stay put.
+ *
+ * @return Number of tasks woken.
+ */
+static uint32_t wheel_expire_locked(cpu_rq_t* rq, uint64_t now) {
+    uint64_t now_slot = now >> TIMER_WHEEL_SHIFT;
+    uint64_t first = rq->wheel_clock;
+    if (now_slot - first >= TIMER_WHEEL_SLOTS)
+        first = now_slot - (TIMER_WHEEL_SLOTS - 1);
+    rq->wheel_clock = now_slot;
+
+    uint32_t woken = 0;
+    for (uint64_t abs = first; abs <= now_slot && rq->nr_sleeping; abs++) {
+        uint32_t slot = (uint32_t)abs & (TIMER_WHEEL_SLOTS - 1);
+        if (!wheel_slot_used(rq, slot))
+            continue;
+
+        task_t* cur = rq->wheel[slot];
+        while (cur != NULL) {
+            task_t* next = cur->qnext;
+            if (cur->wake_ns <= now) {
+                wheel_remove_locked(rq, cur);
+                cur->state = TASK_STATE_READY;
+                rq_push_locked(rq, cur);
+                if (rq->current == rq->idle || cur->priority < rq->current->priority)
+                    rq->need_resched = true;
+                woken++;
+            }
+            cur = next;
+        }
+    }
+
+    return woken;
+}
+
+/**
+ * @brief Earliest wake time on @p rq, TIMER_NEVER if nobody sleeps. Slots
+ * are walked from the wheel clock on; one that starts after the best time
+ * found so far cannot hold anything earlier.
+ */
+static uint64_t wheel_next_locked(const cpu_rq_t* rq) {
+    uint64_t best = TIMER_NEVER;
+    if (rq->nr_sleeping == 0)
+        return best;
+
+    for (uint32_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        uint64_t abs = rq->wheel_clock + i;
+        if ((abs << TIMER_WHEEL_SHIFT) >= best)
+            break;
+
+        uint32_t slot = (uint32_t)abs & (TIMER_WHEEL_SLOTS - 1);
+        if (!wheel_slot_used(rq, slot))
+            continue;
+
+        for (const task_t* task = rq->wheel[slot]; task != NULL; task = task->qnext) {
+            if (task->wake_ns < best)
+                best = task->wake_ns;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Programs this CPU's timer for the next thing @p rq has to act on:
+ * a sleeper waking up or, with other tasks waiting, the end of the time
+ * slice of @p running. Must be called on the CPU that owns @p rq.
+ */
+static void rearm_locked(cpu_rq_t* rq, const task_t* running) {
+    uint64_t next = wheel_next_locked(rq);
+    if (running != rq->idle && rq->bitmap && rq->slice_end_ns < next)
+        next = rq->slice_end_ns;
+
+    if (next != rq->armed_ns) {
+        rq->armed_ns = next;
+        timer_arm(next);
+    }
+}
+
+/**
+ * @brief Locks the run queue @p task is on. Stealing can move a task between
+ * looking up its CPU and taking the lock, hence the retry.
+ */
+static cpu_rq_t* lock_task_rq(task_t* task) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&task->cpu, __ATOMIC_ACQUIRE);
+        cpu_rq_t* rq = &g_rqs[cpu];
+
+        spin_lock(&rq->lock);
+        if (task->cpu == cpu)
+            return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+/**
+ * @brief Gives up the kernel lock entirely, for a task about to sleep.
+ *
+ * @return Nesting depth to hand back to kernel_lock_retake().
+ */
+static uint32_t kernel_lock_drop(task_t* self) {
+    uint32_t depth = self->lock_depth;
+    if (depth) {
+        self->lock_depth = 0;
+        spin_unlock(&g_kernel_lock);
+    }
+    return depth;
+}
+
+static void kernel_lock_retake(task_t* self, uint32_t depth) {
+    if (depth) {
+        spin_lock(&g_kernel_lock);
+        self->lock_depth = depth;
+    }
+}
+
+static void fpu_save(task_t* task) {
+    asm volatile("fxsave64 (%0)" :: "r"(task->fpu_state) : "memory");
+    task->fpu_valid = true;
+}
+
+static void fpu_restore(task_t* task) {
+    if (task->fpu_valid) {
+        asm volatile("fxrstor64 (%0)" :: "r"(task->fpu_state) : "memory");
+        return;
+    }
+
+    // First run: start from a clean x87/SSE state.
+    uint32_t mxcsr = 0x1F80;
+    asm volatile("fninit; ldmxcsr %0" :: "m"(mxcsr));
+}
+
+/**
+ * @brief Second half of a switch, run by the task switched to: the previous
+ * task's registers are saved now, so it may run elsewhere or be reaped.
+ */
+static void finish_switch(void) {
+    cpu_rq_t* rq = this_rq();
+    task_t* prev = rq->prev;
+
+    rq->prev = NULL;
+    if (prev)
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    spin_unlock(&rq->lock);
+}
+
+static void switch_to_locked(cpu_rq_t* rq, task_t* prev, task_t* next) {
+    uint32_t cpu = rq_index(rq);
+
+    fpu_save(prev);
+    if (prev->type == TASK_TYPE_USERLAND)
+        prev->fs_base = rdmsr64(IA32_FS_BASE_MSR);
+
+    rq->current = next;
+    rq->prev = prev;
+    next->cpu = cpu;
+    next->on_cpu = true;
+
+    if (next->kstack_top)
+        tss_set_kernel_stack(cpu, next->kstack_top);
+
+    // An address space only changes while its task runs, so the entries
+    // this CPU has for it are still good unless it ran elsewhere since.
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (next->cr3 && next->cr3 != cr3)
+        paging_switch_address_space(next->cr3, next->tlb_cpu == cpu);
+    next->tlb_cpu = cpu;
+
+    if (next->type == TASK_TYPE_USERLAND)
+        wrmsr64(IA32_FS_BASE_MSR, next->fs_base);
+    fpu_restore(next);
+
+    sched_switch_context(&prev->rsp, next->rsp);
+
+    // Back in prev, possibly much later and on another CPU.
+    finish_switch();
+}
+
+/**
+ * @brief Picks the next task of @p rq and switches to it. Interrupts must be
+ * off and rq->lock held; it is released on return.
+ * A RUNNING caller is put back on the ready queue; a BLOCKED or EXITED one
+ * is expected to already be where it belongs.
+ */
+static void schedule_locked(cpu_rq_t* rq) {
+    task_t* prev = rq->current;
+    uint64_t now = timer_now_ns();
+
+    rq->need_resched = false;
+    if (prev->state == TASK_STATE_RUNNING && prev != rq->idle) {
+        prev->state = TASK_STATE_READY;
+        rq_push_locked(rq, prev);
+    }
+
+    task_t* next = rq_pop_locked(rq);
+    if (!next)
+        next = rq->idle;
+
+    next->state = TASK_STATE_RUNNING;
+    rq->slice_end_ns = now + TASK_TIMESLICE_NS;
+    rearm_locked(rq, next);
+
+    if (next == prev) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    if (prev != rq->idle)
+        prev->runtime_ns += now - prev->run_start_ns;
+    next->run_start_ns = now;
+
+    switch_to_locked(rq, prev, next);
+}
+
+/**
+ * @brief Moves one ready task from the busiest other CPU onto @p rq.
+ * The victim lock is only tried, so two CPUs stealing from each other
+ * cannot deadlock.
+ */
+static bool steal_locked(cpu_rq_t* rq) {
+    cpu_rq_t* victim = NULL;
+    uint32_t most = 0;
+
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_rq_t* other = &g_rqs[cpu];
+        if (other == rq || !other->online)
+            continue;
+
+        uint32_t ready = __atomic_load_n(&other->nr_ready, __ATOMIC_RELAXED);
+        if (ready > most) {
+            most = ready;
+            victim = other;
+        }
+    }
+
+    if (!victim || !spin_trylock(&victim->lock))
+        return false;
+
+    task_t* task = rq_pop_locked(victim);
+    if (task)
+        __atomic_store_n(&task->cpu, rq_index(rq), __ATOMIC_RELEASE);
+    spin_unlock(&victim->lock);
+
+    if (!task)
+        return false;
+
+    rq_push_locked(rq, task);
+    return true;
+}
+
+/**
+ * @brief Least loaded CPU for a new task, counting its running task.
+ */
+static cpu_rq_t* pick_rq(void) {
+    cpu_rq_t* best = &g_rqs[0];
+    uint32_t best_load = ~0U;
+
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_rq_t* rq = &g_rqs[cpu];
+        if (!rq->online)
+            continue;
+
+        uint32_t load = __atomic_load_n(&rq->nr_ready, __ATOMIC_RELAXED) + (rq->current != rq->idle ? 1 : 0);
+        if (load < best_load) {
+            best_load = load;
+            best = rq;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief Wakes one idle CPU so it can steal the surplus of @p busy.
+ */
+static void kick_idle_cpu(const cpu_rq_t* busy) {
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_rq_t* rq = &g_rqs[cpu];
+        if (rq == busy || !rq->online)
+            continue;
+
+        if (rq->current == rq->idle && __atomic_load_n(&rq->nr_ready, __ATOMIC_RELAXED) == 0) {
+            multitasking_kick_cpu(cpu);
+            return;
+        }
+    }
+}
+
+static void idle_main(task_t* self) {
+    (void)self;
+
+    for (;;) {
+        asm volatile("cli" ::: "memory");
+        cpu_rq_t* rq = this_rq();
+        __atomic_store_n(&rq->kicked, false, __ATOMIC_RELAXED);
+
+        spin_lock(&rq->lock);
+        if (rq->bitmap == 0)
+            steal_locked(rq);
+        if (rq->bitmap) {
+            schedule_locked(rq);
+            continue;
+        }
+        spin_unlock(&rq->lock);
+
+        asm volatile("sti" ::: "memory");
+        if (smp_run_posted_work())
+            continue;
+
+        // Checked with interrupts off: a wakeup or kick that lands between
+        // the check and the hlt is taken right after it ("sti; hlt").
+        asm volatile("cli" ::: "memory");
+        if (!__atomic_load_n(&rq->kicked, __ATOMIC_ACQUIRE) && rq->bitmap == 0)
+            asm volatile("sti; hlt" ::: "memory");
+    }
+}
+
+static void kernel_task_main(task_t* self) {
+    multitasking_lock_kernel();
+
+    for (;;) {
+        int exit_code = 0;
+        if (self->kernel_fn(self->pid, timer_now_ns() / TIMER_NS_PER_MS, self->kernel_ctx, &exit_code))
+            multitasking_exit_current(exit_code);
+        if (self->kill_pending)
+            multitasking_exit_current(self->kill_code);
+
+        if (self->period_ms)
+            multitasking_sleep_ms(self->period_ms);
+        else
+            multitasking_yield();
+    }
+}
+
+static void userland_task_main(task_t* self) {
+    // Loading the image is kernel work; userland_exec() lets go of the lock
+    // right before it drops to ring 3.
+    multitasking_lock_kernel();
+    if (self->kill_pending)
+        multitasking_exit_current(self->kill_code);
+
+    // Only comes back if the image could not be loaded.
+    userland_exec(self->user_spec.path, self->user_spec.argc, self->user_spec.argv, NULL);
+    eprintf("%s: failed to load ELF", self->user_spec.path);
+    multitasking_exit_current(127);
+}
+
+static void userland_fork_main(task_t* self) {
+    // Back out of the fork() the parent made, from our own kernel stack.
+    syscall_frame_t frame = self->fork_frame;
+    syscall_resume(&frame);
+}
+
+__attribute__((used, noreturn)) static void task_bootstrap(task_t* self) {
+    finish_switch();
+    asm volatile("sti");
+    self->entry(self);
+    multitasking_exit_current(0);
+}
+
+/**
+ * @brief Allocates a task with its own kernel stack, set up so the first
+ * switch to it lands in sched_task_start.
+ */
+static task_t* task_create(const char* name, task_type_t type, uint8_t priority, void (*entry)(task_t*)) {
+    task_t* task = (task_t*)kmalloc(sizeof(task_t));
+    if (!task)
+        return NULL;
+
+    memset(task, 0, sizeof(*task));
+    task->kstack = (uint8_t*)kmalloc_aligned(TASK_KSTACK_SIZE, 16);
+    task->fpu_state = (uint8_t*)kmalloc_aligned(512, 16);
+    if (!task->kstack || !task->fpu_state) {
+        if (task->kstack)
+            kfree(task->kstack);
+        if (task->fpu_state)
+            kfree(task->fpu_state);
+        kfree(task);
+        return NULL;
+    }
+
+    task->type = type;
+    task->state = TASK_STATE_READY;
+    task->priority = priority;
+    task->entry = entry;
+    task->cr3 = paging_kernel_cr3();
+    task->tlb_cpu = UINT32_MAX;
+    task->kstack_top = (uint64_t)task->kstack + TASK_KSTACK_SIZE;
+    if (name)
+        snprintf(task->name, sizeof(task->name), "%s", name);
+
+    // [top-16] padding, [top-24] return into sched_task_start, then the six
+    // registers sched_switch_context pops (r15 lowest, rbx = task).
+    uint64_t* sp = (uint64_t*)(task->kstack_top - 16);
+    *--sp = (uint64_t)sched_task_start;
+    *--sp = 0;                  // rbp
+    *--sp = (uint64_t)task;     // rbx
+    *--sp = 0;                  // r12
+    *--sp = 0;                  // r13
+    *--sp = 0;                  // r14
+    *--sp = 0;                  // r15
+    task->rsp = (uint64_t)sp;
+
+    return task;
+}
+
+static void task_release_resources(task_t* task) {
+    if (task->kstack) {
+        kfree(task->kstack);
+        task->kstack = NULL;
+    }
+    if (task->fpu_state) {
+        kfree(task->fpu_state);
+        task->fpu_state = NULL;
+    }
+    if (task->type == TASK_TYPE_USERLAND) {
+        userland_state_release(&task->user);
+        userland_state_close_files(&task->user);
+    }
+    if (task->type == TASK_TYPE_USERLAND && task->cr3) {
+        paging_destroy_address_space(task->cr3);
+        task->cr3 = 0;
+    }
+    if (task->user_strings) {
+        kfree(task->user_strings);
+        task->user_strings = NULL;
+    }
+}
+
+static uint32_t task_start(task_t* task) {
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
+    task->pid = g_next_pid++;
+    task->created_ns = timer_now_ns();
+    if (task->name[0] == '\0')
+        snprintf(task->name, sizeof(task->name), "task-%u", task->pid);
+    push_task_locked(task);
+    spin_unlock(&g_tasks_lock);
+
+    cpu_rq_t* rq = pick_rq();
+    bool local = rq == this_rq();
+    spin_lock(&rq->lock);
+    task->cpu = rq_index(rq);
+    rq_push_locked(rq, task);
+    if (local)
+        rearm_locked(rq, rq->current);  // the running task's slice now counts
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+
+    if (!local)
+        multitasking_kick_cpu(task->cpu);
+    return task->pid;
+}
+
 void multitasking_init(void) {
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = irq_save();
     g_task_head = NULL;
     g_task_tail = NULL;
     g_next_pid = 1;
-    g_current_pid = 0;
-    g_last_tick = 0;
+    memset(g_rqs, 0, sizeof(g_rqs));
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        g_rqs[cpu].armed_ns = TIMER_NEVER;
+
+    // The code running right now (kernel main, later the shell) becomes
+    // pid 0, keeps the stack it booted on and holds the kernel lock.
+    memset(&g_boot_task, 0, sizeof(g_boot_task));
+    g_boot_task.type = TASK_TYPE_KERNEL;
+    g_boot_task.state = TASK_STATE_RUNNING;
+    g_boot_task.priority = TASK_PRIO_KERNEL;
+    g_boot_task.run_start_ns = timer_now_ns();
+    g_boot_task.fpu_state = g_boot_fpu;
+    g_boot_task.on_cpu = true;
+    g_boot_task.lock_depth = 1;
+    asm volatile("mov %%cr3, %0" : "=r"(g_boot_task.cr3));
+    snprintf(g_boot_task.name, sizeof(g_boot_task.name), "kernel");
+    spin_lock(&g_kernel_lock);
+    g_rqs[0].current = &g_boot_task;
+    g_rqs[0].slice_end_ns = g_boot_task.run_start_ns + TASK_TIMESLICE_NS;
+    g_rqs[0].wheel_clock = g_boot_task.run_start_ns >> TIMER_WHEEL_SHIFT;
     irq_restore(flags);
+
+    g_rqs[0].idle = task_create("idle", TASK_TYPE_KERNEL, TASK_PRIORITIES - 1, idle_main);
+    if (!g_rqs[0].idle) {
+        error("Could not allocate the idle task", __FILE__);
+        return;
+    }
+
+    g_rqs[0].online = true;
+    g_started = true;
+    done("Preemptive scheduler is running", __FILE__);
+}
+
+void multitasking_ap_enter(uint32_t cpu) {
+    cpu_rq_t* rq = &g_rqs[cpu];
+
+    // Like the boot task, the AP's idle task keeps the stack it came up on.
+    task_t* idle = (task_t*)kmalloc(sizeof(task_t));
+    uint8_t* fpu = (uint8_t*)kmalloc_aligned(512, 16);
+    if (!idle || !fpu) {
+        error("Could not allocate an AP idle task", __FILE__);
+        hcf2();
+    }
+
+    memset(idle, 0, sizeof(*idle));
+    idle->type = TASK_TYPE_KERNEL;
+    idle->state = TASK_STATE_RUNNING;
+    idle->priority = TASK_PRIORITIES - 1;
+    idle->fpu_state = fpu;
+    idle->cr3 = paging_kernel_cr3();
+    idle->cpu = cpu;
+    idle->on_cpu = true;
+    snprintf(idle->name, sizeof(idle->name), "idle/%u", cpu);
+
+    rq->idle = idle;
+    rq->current = idle;
+    rq->wheel_clock = timer_now_ns() >> TIMER_WHEEL_SHIFT;
+    __atomic_store_n(&rq->online, true, __ATOMIC_RELEASE);
+
+    idle_main(idle);
+    __builtin_unreachable();
+}
+
+void multitasking_lock_kernel(void) {
+    task_t* self = current_task();
+    if (!self)
+        return;
+
+    if (self->lock_depth++ == 0)
+        spin_lock(&g_kernel_lock);
+}
+
+void multitasking_unlock_kernel(void) {
+    task_t* self = current_task();
+    if (!self || self->lock_depth == 0)
+        return;
+
+    if (--self->lock_depth == 0)
+        spin_unlock(&g_kernel_lock);
 }
 
 uint32_t multitasking_current_pid(void) {
-    uint64_t flags = irq_save_disable();
-    uint32_t pid = g_current_pid;
+    uint64_t flags = irq_save();
+    task_t* self = current_task();
+    uint32_t pid = self ? self->pid : 0;
     irq_restore(flags);
     return pid;
 }
 
-uint32_t multitasking_spawn_kernel(const char* name, kernel_task_fn_t fn, void* ctx) {
-    if (!fn)
+bool multitasking_new_address_space(void) {
+    task_t* self = current_task();
+    if (!self || self->type != TASK_TYPE_USERLAND || !self->cr3)
+        return false;
+
+    uint64_t old = self->cr3;
+    uint64_t fresh = paging_create_address_space();
+    if (!fresh)
+        return false;
+
+    uint64_t flags = irq_save();
+    self->cr3 = fresh;
+    self->tlb_cpu = self->cpu;
+    paging_switch_address_space(fresh, false);
+    irq_restore(flags);
+
+    paging_destroy_address_space(old);
+    return true;
+}
+
+userland_state_t* multitasking_current_userland(void) {
+    task_t* task = current_task();
+    if (!task || task->type != TASK_TYPE_USERLAND)
+        return NULL;
+    return &task->user;
+}
+
+uint32_t multitasking_spawn_kernel(const char* name, kernel_task_fn_t fn, void* ctx, uint32_t period_ms) {
+    if (!fn || !g_started)
         return 0;
 
-    task_t* task = (task_t*)kmalloc(sizeof(task_t));
+    task_t* task = task_create(name, TASK_TYPE_KERNEL, TASK_PRIO_KERNEL, kernel_task_main);
     if (!task)
         return 0;
 
-    memset(task, 0, sizeof(*task));
-
-    uint64_t flags = irq_save_disable();
-    task->pid = g_next_pid++;
-    task->type = TASK_TYPE_KERNEL;
-    task->state = TASK_STATE_READY;
-    task->exit_code = 0;
-    task->created_at_tick = g_last_tick;
     task->kernel_fn = fn;
     task->kernel_ctx = ctx;
-    if (name)
-        snprintf(task->name, sizeof(task->name), "%s", name);
-    else
-        snprintf(task->name, sizeof(task->name), "kernel-task-%u", task->pid);
+    task->period_ms = period_ms;
+    return task_start(task);
+}
 
-    push_task_locked(task);
-    irq_restore(flags);
+uint32_t multitasking_spawn_userland(const char* name, const user_task_spec_t* spec) {
+    if (!spec || !spec->path || !g_started)
+        return 0;
 
-    return task->pid;
+    task_t* task = task_create(name ? name : spec->path, TASK_TYPE_USERLAND, TASK_PRIO_USER, userland_task_main);
+    if (!task)
+        return 0;
+
+    // The caller's strings may not outlive it, keep our own copies.
+    int argc = spec->argc < 0 ? 0 : (spec->argc > 31 ? 31 : spec->argc);
+    size_t total = strlen(spec->path) + 1;
+    for (int i = 0; i < argc; ++i)
+        total += strlen(spec->argv[i] ? spec->argv[i] : "") + 1;
+
+    task->user_strings = (char*)kmalloc(total);
+    task->cr3 = paging_create_address_space();
+    if (!task->user_strings || !task->cr3 || userland_state_init(&task->user) != 0) {
+        task_release_resources(task);
+        kfree(task);
+        return 0;
+    }
+
+    char* out = task->user_strings;
+    size_t len = strlen(spec->path) + 1;
+    memcpy(out, spec->path, len);
+    task->user_spec.path = out;
+    out += len;
+
+    for (int i = 0; i < argc; ++i) {
+        const char* arg = spec->argv[i] ? spec->argv[i] : "";
+        len = strlen(arg) + 1;
+        memcpy(out, arg, len);
+        task->user_spec.argv[i] = out;
+        out += len;
+    }
+    task->user_spec.argv[argc] = NULL;
+    task->user_spec.argc = argc;
+
+    return task_start(task);
 }
 
-uint32_t multitasking_spawn_userland(const char* name, const user_task_spec_t* spec) {
-    if (!spec || !spec->path)
+uint32_t multitasking_fork_userland(const syscall_frame_t* frame) {
+    task_t* self = current_task();
+    if (!frame || !self || self->type != TASK_TYPE_USERLAND || !self->cr3 || !g_started)
         return 0;
 
-    task_t* task = (task_t*)kmalloc(sizeof(task_t));
+    task_t* task = task_create(self->name, TASK_TYPE_USERLAND, TASK_PRIO_USER, userland_fork_main);
     if (!task)
         return 0;
 
-    memset(task, 0, sizeof(*task));
+    if (userland_state_fork(&task->user, &self->user) != 0) {
+        task_release_resources(task);
+        kfree(task);
+        return 0;
+    }
+    task->cr3 = paging_clone_address_space(self->cr3);
+    if (!task->cr3) {
+        task_release_resources(task);
+        kfree(task);
+        return 0;
+    }
 
-    uint64_t flags = irq_save_disable();
-    task->pid = g_next_pid++;
-    task->type = TASK_TYPE_USERLAND;
-    task->state = TASK_STATE_READY;
-    task->exit_code = 0;
-    task->created_at_tick = g_last_tick;
-    if (name)
-        snprintf(task->name, sizeof(task->name), "%s", name);
-    else
-        snprintf(task->name, sizeof(task->name), "%s", spec->path);
+    task->fork_frame = *frame;
+    task->fork_frame.rax = 0;
+    task->fs_base = rdmsr64(IA32_FS_BASE_MSR);
+    fpu_save(task);
 
-    task->user_spec.path = spec->path;
-    task->user_spec.argc = spec->argc;
-    for (int i = 0; i < spec->argc && i < 32; ++i)
-        task->user_spec.argv[i] = spec->argv[i];
+    return task_start(task);
+}
 
-    push_task_locked(task);
-    irq_restore(flags);
+/*
+ * Wakes every task waiting for an exit. Called with g_tasks_lock held, once
+ * the exited task is marked so, which is where waiters look.
+ */
+static void notify_exit_locked(void) {
+    for (task_t* task = g_task_head; task != NULL; task = task->next) {
+        if (task->exit_watch)
+            multitasking_completion_signal(&task->exit_event);
+    }
+}
 
-    return task->pid;
+void multitasking_exit_watch(bool on) {
+    task_t* self = current_task();
+    if (!self)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
+    if (on && !self->exit_watch)
+        multitasking_completion_init(&self->exit_event);
+    self->exit_watch = on;
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
+}
+
+void multitasking_exit_wait(void) {
+    task_t* self = current_task();
+    if (!self || !self->exit_watch)
+        return;
+
+    // Before the scheduler runs nothing else can exit; do not spin on it.
+    if (!multitasking_completion_wait(&self->exit_event, TIMER_NEVER))
+        multitasking_sleep_ms(10);
+    multitasking_exit_watch(false);
+}
+
+void multitasking_exit_current(int exit_code) {
+    asm volatile("cli");
+
+    cpu_rq_t* rq = this_rq();
+    task_t* self = rq->current;
+    if (!self || self == &g_boot_task || self == rq->idle) {
+        error("The boot and idle tasks cannot exit", __FILE__);
+        hcf2();
+    }
+
+    kernel_lock_drop(self);
+
+    // Still on this CPU with interrupts off, so nothing reaps us yet; the
+    // waiters are woken before the run queue is locked for the switch.
+    spin_lock(&g_tasks_lock);
+    self->exit_code = exit_code;
+    self->exited_ns = timer_now_ns();
+    self->state = TASK_STATE_EXITED;
+    notify_exit_locked();
+    spin_unlock(&g_tasks_lock);
+
+    spin_lock(&rq->lock);
+
+    // Never comes back; switching away also drops our CR3, and on_cpu is
+    // cleared once the next task runs, so the reaper can then free the
+    // address space and this stack.
+    schedule_locked(rq);
+    __builtin_unreachable();
+}
+
+/*
+ * Ends the calling task for a kill. A program goes through userland_exit(),
+ * as if it had called exit(); that may write to disk, so it runs like a
+ * syscall.
+ */
+static void __attribute__((noreturn)) exit_killed(task_t* self, int exit_code) {
+    if (self->type == TASK_TYPE_USERLAND) {
+        asm volatile("sti");
+        multitasking_lock_kernel();
+        userland_exit(exit_code);
+    }
+    multitasking_exit_current(exit_code);
 }
 
 bool multitasking_exit_task(uint32_t pid, int exit_code) {
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
     task_t* task = find_task_locked(pid);
     if (!task) {
-        irq_restore(flags);
+        spin_unlock_irqrestore(&g_tasks_lock, flags);
         return false;
     }
 
-    task->state = TASK_STATE_EXITED;
-    task->exit_code = exit_code;
-    irq_restore(flags);
+    if (task == current_task()) {
+        spin_unlock_irqrestore(&g_tasks_lock, flags);
+        exit_killed(task, exit_code);
+    }
+
+    // Never torn down in place: the task exits itself the next time it
+    // runs, so a program still writes back its shared mappings and closes
+    // its files. A task waiting on a device or sleeping is let finish that
+    // first, so buffers and locks are not left behind.
+    int kick_cpu = -1;
+    if (task->state != TASK_STATE_EXITED) {
+        cpu_rq_t* rq = lock_task_rq(task);
+        task->kill_pending = true;
+        task->kill_code = exit_code;
+        kick_cpu = (int)rq_index(rq);
+        spin_unlock(&rq->lock);
+    }
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
+
+    if (kick_cpu >= 0)
+        multitasking_kick_cpu((uint32_t)kick_cpu);
 
     return true;
 }
@@ -170,25 +1063,55 @@ bool multitasking_get_task(uint32_t pid, task_info_t* out_info) {
     if (!out_info)
         return false;
 
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
     task_t* task = find_task_locked(pid);
     if (!task) {
-        irq_restore(flags);
+        spin_unlock_irqrestore(&g_tasks_lock, flags);
         return false;
     }
 
     fill_info(task, out_info);
-    irq_restore(flags);
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
     return true;
 }
 
+bool multitasking_wait_task(uint32_t pid, int* exit_code, bool* load_failed) {
+    for (;;) {
+        multitasking_exit_watch(true);
+
+        uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
+        task_t* task = find_task_locked(pid);
+        if (!task) {
+            spin_unlock_irqrestore(&g_tasks_lock, flags);
+            multitasking_exit_watch(false);
+            return false;
+        }
+
+        if (task->state == TASK_STATE_EXITED) {
+            if (exit_code)
+                *exit_code = task->exit_code;
+            // userland_exec() gives up with 127 before the image ever runs.
+            if (load_failed)
+                *load_failed = task->type == TASK_TYPE_USERLAND && !task->user.entered &&
+                               task->exit_code == 127;
+            task->waited = true;
+            spin_unlock_irqrestore(&g_tasks_lock, flags);
+            multitasking_exit_watch(false);
+            return true;
+        }
+        spin_unlock_irqrestore(&g_tasks_lock, flags);
+
+        multitasking_exit_wait();
+    }
+}
+
 uint32_t multitasking_count_tasks(void) {
     uint32_t count = 0;
 
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
     for (task_t* task = g_task_head; task != NULL; task = task->next)
         count++;
-    irq_restore(flags);
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
 
     return count;
 }
@@ -196,12 +1119,12 @@ uint32_t multitasking_count_tasks(void) {
 uint32_t multitasking_count_running(void) {
     uint32_t count = 0;
 
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
     for (task_t* task = g_task_head; task != NULL; task = task->next) {
         if (task->state != TASK_STATE_EXITED)
             count++;
     }
-    irq_restore(flags);
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
 
     return count;
 }
@@ -210,35 +1133,47 @@ bool multitasking_for_each_task(task_iter_cb_t cb, void* ctx) {
     if (!cb)
         return false;
 
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
     task_t* current = g_task_head;
 
     while (current != NULL) {
         task_info_t info;
         fill_info(current, &info);
 
-        irq_restore(flags);
+        spin_unlock_irqrestore(&g_tasks_lock, flags);
         bool keep = cb(&info, ctx);
         if (!keep)
             return true;
 
-        flags = irq_save_disable();
+        flags = spin_lock_irqsave(&g_tasks_lock);
         current = current->next;
     }
 
-    irq_restore(flags);
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
     return true;
 }
 
 static void sweep_exited_tasks(void) {
-    uint64_t flags = irq_save_disable();
+    uint64_t flags = spin_lock_irqsave(&g_tasks_lock);
 
     task_t* prev = NULL;
     task_t* cur = g_task_head;
 
     while (cur != NULL) {
-        if (cur->state == TASK_STATE_EXITED) {
+        if (cur->state == TASK_STATE_EXITED && !__atomic_load_n(&cur->on_cpu, __ATOMIC_ACQUIRE)) {
             task_t* dead = cur;
+
+            spin_unlock_irqrestore(&g_tasks_lock, flags);
+            task_release_resources(dead);
+            flags = spin_lock_irqsave(&g_tasks_lock);
+
+            // Keep the exit status for a while so wait4() can still find it.
+            if (!dead->waited && timer_now_ns() - dead->exited_ns < ZOMBIE_KEEP_NS) {
+                prev = cur;
+                cur = cur->next;
+                continue;
+            }
+
             cur = cur->next;
 
             if (prev)
@@ -249,9 +1184,9 @@ static void sweep_exited_tasks(void) {
             if (dead == g_task_tail)
                 g_task_tail = prev;
 
-            irq_restore(flags);
+            spin_unlock_irqrestore(&g_tasks_lock, flags);
             kfree(dead);
-            flags = irq_save_disable();
+            flags = spin_lock_irqsave(&g_tasks_lock);
             continue;
         }
 
@@ -259,23 +1194,23 @@ static void sweep_exited_tasks(void) {
         cur = cur->next;
     }
 
-    irq_restore(flags);
+    spin_unlock_irqrestore(&g_tasks_lock, flags);
 }
 
-static bool cursor_blink_task(uint32_t pid, uint64_t now_ticks, void* ctx, int* exit_code) {
+static bool cursor_blink_task(uint32_t pid, uint64_t now_ms, void* ctx, int* exit_code) {
     (void)pid;
     (void)exit_code;
 
     if (!ft_ctx)
         return false;
 
-    uint64_t* next_toggle_tick = (uint64_t*)ctx;
-    if (!next_toggle_tick)
+    uint64_t* next_toggle_ms = (uint64_t*)ctx;
+    if (!next_toggle_ms)
         return false;
 
-    while (now_ticks >= *next_toggle_tick) {
+    while (now_ms >= *next_toggle_ms) {
         ft_ctx->cursor_enabled = !ft_ctx->cursor_enabled;
-        *next_toggle_tick += 50;
+        *next_toggle_ms += 500;
     }
     return false;
 }
@@ -286,70 +1221,259 @@ void multitasking_start_cursor_blink_task(void) {
         return;
 
     *blink_ctx = 0;
-    if (multitasking_spawn_kernel("cursor-blink", cursor_blink_task, blink_ctx) == 0)
+    if (multitasking_spawn_kernel("cursor-blink", cursor_blink_task, blink_ctx, 500) == 0)
         kfree(blink_ctx);
 }
 
-void multitasking_on_pit_tick(uint64_t now_ticks) {
-    uint64_t flags = irq_save_disable();
-    g_last_tick = now_ticks;
+void multitasking_yield(void) {
+    if (!g_started)
+        return;
 
-    for (task_t* task = g_task_head; task != NULL; task = task->next) {
-        if (task->type != TASK_TYPE_KERNEL || task->state == TASK_STATE_EXITED)
-            continue;
+    task_t* self = current_task();
+    uint32_t depth = kernel_lock_drop(self);
 
-        task->state = TASK_STATE_RUNNING;
-        g_current_pid = task->pid;
-        kernel_task_fn_t fn = task->kernel_fn;
-        void* kctx = task->kernel_ctx;
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+    irq_restore(flags);
 
-        irq_restore(flags);
+    kernel_lock_retake(self, depth);
+}
 
-        int exit_code = 0;
-        bool should_exit = fn(task->pid, now_ticks, kctx, &exit_code);
+void multitasking_sleep_ns(uint64_t ns) {
+    if (ns == 0)
+        return;
 
-        flags = irq_save_disable();
+    task_t* self = current_task();
+    if (!g_started || !self || self == this_rq()->idle) {
+        uint64_t target = timer_now_ns() + ns;
+        while (timer_now_ns() < target)
+            asm volatile("pause");
+        return;
+    }
 
-        task->runtime_ticks++;
-        if (should_exit) {
-            task->state = TASK_STATE_EXITED;
-            task->exit_code = exit_code;
-        } else {
-            task->state = TASK_STATE_READY;
-        }
+    uint32_t depth = kernel_lock_drop(self);
+
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    self->wake_ns = timer_now_ns() + ns;
+    self->state = TASK_STATE_BLOCKED;
+    wheel_insert_locked(rq, self);
+    schedule_locked(rq);
+    irq_restore(flags);
+
+    // Interrupts are back on, so a CPU waiting here still takes its events.
+    kernel_lock_retake(self, depth);
+}
+
+/**
+ * @brief Makes @p task ready again if it is still blocked on @p wait_obj,
+ * ahead of its timeout. Safe in interrupt handlers.
+ */
+static void wake_task(task_t* task, const void* wait_obj) {
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = lock_task_rq(task);
+    uint32_t cpu = rq_index(rq);
+    bool kick = false;
+
+    if (task->state == TASK_STATE_BLOCKED && task->wait_obj == wait_obj) {
+        wheel_remove_locked(rq, task);
+        task->state = TASK_STATE_READY;
+        rq_push_locked(rq, task);
+
+        // Whoever waited on I/O is next, rather than at the end of a slice.
+        rq->need_resched = true;
+        if (rq == this_rq())
+            rearm_locked(rq, rq->current);
+        else
+            kick = true;
     }
 
-    g_current_pid = 0;
+    spin_unlock(&rq->lock);
     irq_restore(flags);
+
+    if (kick)
+        multitasking_kick_cpu(cpu);
 }
 
-void multitasking_pump(void) {
-    task_t* run_task = NULL;
+bool multitasking_completion_wait(task_completion_t* c, uint64_t timeout_ns) {
+    if (__atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+        return true;
 
-    uint64_t flags = irq_save_disable();
-    for (task_t* task = g_task_head; task != NULL; task = task->next) {
-        if (task->type == TASK_TYPE_USERLAND && task->state == TASK_STATE_READY) {
-            task->state = TASK_STATE_RUNNING;
-            g_current_pid = task->pid;
-            run_task = task;
-            break;
-        }
+    task_t* self = current_task();
+    if (!g_started || !self || self == this_rq()->idle)
+        return false;
+
+    uint32_t depth = kernel_lock_drop(self);
+
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = this_rq();
+    spin_lock(&rq->lock);
+
+    // Publish ourselves, then look again: a signal either sees the waiter
+    // or has set done before this load.
+    self->wait_obj = c;
+    __atomic_store_n(&c->waiter, self, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->done, __ATOMIC_SEQ_CST)) {
+        spin_unlock(&rq->lock);
+    } else {
+        uint64_t now = timer_now_ns();
+        self->wake_ns = timeout_ns >= TIMER_NEVER - now ? TIMER_NEVER : now + timeout_ns;
+        self->state = TASK_STATE_BLOCKED;
+        wheel_insert_locked(rq, self);
+        schedule_locked(rq);
     }
     irq_restore(flags);
 
-    if (run_task) {
-        int rc = userland_exec(run_task->user_spec.path,
-                               run_task->user_spec.argc,
-                               run_task->user_spec.argv,
-                               NULL);
+    // Timed out: withdraw, so a late signal does not look for us.
+    self->wait_obj = NULL;
+    void* expected = self;
+    __atomic_compare_exchange_n(&c->waiter, &expected, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    kernel_lock_retake(self, depth);
+    return __atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+}
+
+void multitasking_completion_signal(task_completion_t* c) {
+    __atomic_store_n(&c->done, true, __ATOMIC_SEQ_CST);
+
+    task_t* waiter = __atomic_exchange_n((task_t**)&c->waiter, NULL, __ATOMIC_SEQ_CST);
+    if (waiter)
+        wake_task(waiter, c);
+}
+
+/**
+ * @brief Identity a task_mutex_t is held by: the running task, or the boot
+ * context before the scheduler exists.
+ */
+static task_t* mutex_owner_self(void) {
+    task_t* self = g_started ? current_task() : NULL;
+    return self ? self : &g_boot_task;
+}
 
-        flags = irq_save_disable();
-        run_task->runtime_ticks += (g_last_tick - run_task->created_at_tick);
-        run_task->state = TASK_STATE_EXITED;
-        run_task->exit_code = rc;
-        g_current_pid = 0;
-        irq_restore(flags);
+void multitasking_mutex_lock(task_mutex_t* m) {
+    task_t* self = mutex_owner_self();
+
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&m->lock);
+        if (m->owner == NULL || m->owner == self) {
+            if (m->depth++ == 0)
+                self->mutexes_held++;
+            m->owner = self;
+            spin_unlock_irqrestore(&m->lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&m->lock, flags);
+
+        // The holder may be asleep on a disk; let it, and others, run.
+        multitasking_yield();
+    }
+}
+
+void multitasking_mutex_unlock(task_mutex_t* m) {
+    uint64_t flags = spin_lock_irqsave(&m->lock);
+    if (m->depth && --m->depth == 0) {
+        ((task_t*)m->owner)->mutexes_held--;
+        m->owner = NULL;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+}
+
+void multitasking_kick_cpu(uint32_t cpu) {
+    if (cpu >= SMP_MAX_CPUS || !g_rqs[cpu].online)
+        return;
+
+    __atomic_store_n(&g_rqs[cpu].kicked, true, __ATOMIC_RELEASE);
+    if (cpu != smp_current_cpu())
+        lapic_send_ipi(smp_cpu_lapic_id(cpu), LAPIC_RESCHED_VECTOR);
+}
+
+void multitasking_on_timer_tick(bool from_user) {
+    // Runs from the timer interrupt, so interrupts are already off.
+    cpu_rq_t* rq = this_rq();
+    if (!g_started || !rq->current)
+        return;
+
+    spin_lock(&rq->lock);
+    task_t* self = rq->current;
+    uint64_t now = timer_now_ns();
+
+    // One-shot: whatever was programmed has fired (or is about to).
+    rq->armed_ns = TIMER_NEVER;
+
+    if (wheel_expire_locked(rq, now) && self != rq->idle && rq->nr_ready > 0)
+        kick_idle_cpu(rq);
+
+    if (self != rq->idle && rq->bitmap && now >= rq->slice_end_ns) {
+        rq->need_resched = true;
+        // The kernel is not preemptible; look again a slice later in case
+        // the task does not pass a preemption point before then.
+        if (!from_user)
+            rq->slice_end_ns = now + TASK_TIMESLICE_NS;
+    }
+
+    if (from_user && self->kill_pending) {
+        spin_unlock(&rq->lock);
+        exit_killed(self, self->kill_code);
+    }
+
+    if (rq->need_resched && from_user) {
+        schedule_locked(rq);
+        // Killed while it was switched out.
+        if (self->kill_pending)
+            exit_killed(self, self->kill_code);
+        return;
+    }
+
+    rearm_locked(rq, self);
+    spin_unlock(&rq->lock);
+}
+
+void multitasking_on_device_irq(bool from_user) {
+    // In the kernel, the woken task waits for the next preemption point.
+    cpu_rq_t* rq = this_rq();
+    if (!g_started || !from_user || !rq->current)
+        return;
+
+    spin_lock(&rq->lock);
+    task_t* self = rq->current;
+
+    if (self->kill_pending) {
+        spin_unlock(&rq->lock);
+        exit_killed(self, self->kill_code);
+    }
+
+    if (rq->need_resched) {
+        schedule_locked(rq);
+        if (self->kill_pending)
+            exit_killed(self, self->kill_code);
+        return;
     }
 
+    spin_unlock(&rq->lock);
+}
+
+void multitasking_preempt_point(void) {
+    if (!g_started)
+        return;
+
+    uint64_t flags = irq_save();
+    cpu_rq_t* rq = this_rq();
+    task_t* self = rq->current;
+    bool resched = rq->need_resched;
+    irq_restore(flags);
+
+    if (self && self->kill_pending && self != &g_boot_task)
+        exit_killed(self, self->kill_code);
+    if (resched) {
+        multitasking_yield();
+        if (self && self->kill_pending && self != &g_boot_task)
+            exit_killed(self, self->kill_code);
+    }
+}
+
+void multitasking_pump(void) {
     sweep_exited_tasks();
 }
@@ -1,6 +1,7 @@
 /**
  * @file nvme.c
- * @brief Minimal polled NVMe support for FrostWing block devices.
+ * @brief NVMe support for FrostWing block devices: one I/O queue pair per
+ * CPU, multi-block commands with PRP lists, MSI-X completion interrupts.
  */
 
 #include <nvme.h>
@@ -13,6 +14,13 @@
 #include <memory.h>
 #include <paging.h>
 #include <cc-asm.h>
+#include <spinlock.h>
+#include <multitasking.h>
+#include <lapic.h>
+#include <timer.h>
+#include <smp.h>
+#include <cpuid2.h>
+#include <isr.h>
 
 #define NVME_CC_EN            (1U << 0)
 #define NVME_CC_CSS_NVM       (0U << 4)
@@ -21,6 +29,9 @@
 #define NVME_CC_IOSQES_SHIFT  16
 #define NVME_CC_IOCQES_SHIFT  20
 #define NVME_CSTS_RDY         (1U << 0)
+#define NVME_CSTS_CFS         (1U << 1)
+#define NVME_CQ_PC            (1U << 0)
+#define NVME_CQ_IEN           (1U << 1)
 #define NVME_ADMIN_OP_CREATE_IO_SQ 0x01
 #define NVME_ADMIN_OP_CREATE_IO_CQ 0x05
 #define NVME_ADMIN_OP_IDENTIFY     0x06
@@ -29,6 +40,14 @@
 #define NVME_NVM_OP_READ           0x02
 #define NVME_FEAT_NUM_QUEUES       0x07
 
+#define NVME_WAIT_SLICE_NS    (10 * TIMER_NS_PER_MS)   // look again in case an interrupt got lost
+#define NVME_RAW_BATCH        8
+
+typedef struct {
+    nvme_request_t* req;
+    int status;
+} nvme_done_t;
+
 nvme_controller_t nvme_controllers[NVME_MAX_CONTROLLERS];
 nvme_namespace_t nvme_namespaces[NVME_MAX_NAMESPACES];
 int nvme_namespace_count = 0;
@@ -57,7 +76,16 @@ static int nvme_wait_ready(nvme_controller_t* ctrl, int ready, int timeout_ms)
 }
 
 
-static int nvme_submit_and_wait(nvme_controller_t* ctrl, nvme_queue_t* q, nvme_command_t* cmd)
+static inline uint64_t nvme_phys(const void* ptr)
+{
+    return virtual_to_physical((uint64_t)(uintptr_t)ptr);
+}
+
+/*
+ * Admin commands only run while probing, one at a time, so they are
+ * polled and use the submission slot as their command ID.
+ */
+static int nvme_submit_and_wait(nvme_controller_t* ctrl, nvme_queue_t* q, nvme_command_t* cmd, uint32_t* result)
 {
     uint16_t cid = q->sq_tail;
     cmd->cid = cid;
@@ -67,13 +95,16 @@ static int nvme_submit_and_wait(nvme_controller_t* ctrl, nvme_queue_t* q, nvme_c
     *nvme_sq_doorbell(ctrl, q->qid) = q->sq_tail;
 
     for (int spin = 0; spin < 1000000; spin++) {
-        nvme_completion_t* cpl = &q->cq[q->cq_head];
-        if ((cpl->status & 1) != q->phase)
+        volatile nvme_completion_t* cpl = &q->cq[q->cq_head];
+        if ((cpl->status & 1) != q->phase) {
+            __asm__ __volatile__("pause");
             continue;
+        }
 
         uint16_t status = cpl->status >> 1;
-        if (cpl->cid != cid || status != 0)
-            return -1;
+        uint16_t done_cid = cpl->cid;
+        if (result)
+            *result = cpl->dw0;
 
         q->cq_head++;
         if (q->cq_head == q->depth) {
@@ -82,7 +113,7 @@ static int nvme_submit_and_wait(nvme_controller_t* ctrl, nvme_queue_t* q, nvme_c
         }
 
         *nvme_cq_doorbell(ctrl, q->qid) = q->cq_head;
-        return 0;
+        return (done_cid != cid || status != 0) ? -1 : 0;
     }
 
     return -1;
@@ -94,47 +125,139 @@ static int nvme_identify(nvme_controller_t* ctrl, uint32_t nsid, uint32_t cns, v
     memset(&cmd, 0, sizeof(cmd));
     cmd.opcode = NVME_ADMIN_OP_IDENTIFY;
     cmd.nsid = nsid;
-    cmd.prp1 = (uint64_t)(uintptr_t)buffer;
+    cmd.prp1 = nvme_phys(buffer);
     cmd.cdw10 = cns;
 
-    return nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd);
+    return nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd, NULL);
 }
 
-static int nvme_create_io_queues(nvme_controller_t* ctrl)
+static void nvme_interrupt(InterruptFrame* frame);
+
+/* The controller and I/O queue behind each vector we were given */
+static struct {
+    uint8_t controller;
+    uint8_t queue;
+} nvme_vectors[256];
+
+static int nvme_create_io_queue(nvme_controller_t* ctrl, nvme_queue_t* q, uint16_t max_entries)
 {
     nvme_command_t cmd;
-    memset(&cmd, 0, sizeof(cmd));
 
-    // Set Features: Number of Queues
-    cmd.opcode = NVME_ADMIN_OP_SET_FEATURES;
-    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
-    cmd.cdw11 = 0; // 1 IO queue
-    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd) != 0)
-        return -2;
+    q->depth = NVME_IO_QUEUE_DEPTH;
+    if (q->depth > max_entries)
+        q->depth = max_entries;
+
+    q->sq = kmalloc_aligned(sizeof(nvme_command_t) * q->depth, 4096);
+    q->cq = kmalloc_aligned(sizeof(nvme_completion_t) * q->depth, 4096);
+    if (!q->sq || !q->cq)
+        return -1;
+
+    memset(q->sq, 0, sizeof(nvme_command_t) * q->depth);
+    memset(q->cq, 0, sizeof(nvme_completion_t) * q->depth);
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
 
-    // Create IO Completion Queue
+    // The CQ raises MSI-X table entry qid; entry 0 belongs to the admin CQ.
     memset(&cmd, 0, sizeof(cmd));
     cmd.opcode = NVME_ADMIN_OP_CREATE_IO_CQ;
-    cmd.prp1 = (uint64_t)(uintptr_t)ctrl->ioq.cq;
-    cmd.cdw10 = (((uint32_t)ctrl->ioq.depth - 1U) << 16) | (uint32_t)ctrl->ioq.qid;
-    cmd.cdw11 = 0x1; // phase = 1
-    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd) != 0)
-        return -3;
+    cmd.prp1 = nvme_phys(q->cq);
+    cmd.cdw10 = (((uint32_t)q->depth - 1U) << 16) | (uint32_t)q->qid;
+    cmd.cdw11 = NVME_CQ_PC;
+    if (q->vector)
+        cmd.cdw11 |= NVME_CQ_IEN | ((uint32_t)q->qid << 16);
+    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd, NULL) != 0)
+        return -2;
 
-    // Create IO Submission Queue
     memset(&cmd, 0, sizeof(cmd));
     cmd.opcode = NVME_ADMIN_OP_CREATE_IO_SQ;
-    cmd.prp1 = (uint64_t)(uintptr_t)ctrl->ioq.sq;
-    cmd.cdw10 = (((uint32_t)ctrl->ioq.depth - 1U) << 16) | (uint32_t)ctrl->ioq.qid;
-    cmd.cdw11 = ((uint32_t)ctrl->ioq.qid << 16) | 0x1U; // CQID + PC=1
-    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd) != 0)
-        return -4;
+    cmd.prp1 = nvme_phys(q->sq);
+    cmd.cdw10 = (((uint32_t)q->depth - 1U) << 16) | (uint32_t)q->qid;
+    cmd.cdw11 = ((uint32_t)q->qid << 16) | NVME_CQ_PC; // CQID + PC=1
+    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd, NULL) != 0)
+        return -3;
 
     return 0;
 }
 
+/**
+ * @brief Creates one I/O queue pair per CPU, as many as the controller
+ * grants, each completing through its own MSI-X vector when it has MSI-X.
+ */
+static int nvme_create_io_queues(nvme_controller_t* ctrl, uint8_t bus, uint8_t slot, uint8_t function, uint16_t max_entries)
+{
+    nvme_command_t cmd;
+    uint32_t granted = 0;
+    // Probing runs before the APs are started, so ask for the most we use.
+    uint32_t want = NVME_MAX_IO_QUEUES;
+
+    // Set Features: Number of Queues, zero based
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_OP_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((want - 1U) << 16) | (want - 1U);
+    if (nvme_submit_and_wait(ctrl, &ctrl->adminq, &cmd, &granted) != 0)
+        return -2;
+
+    uint32_t nsq = (granted & 0xFFFF) + 1U;
+    uint32_t ncq = (granted >> 16) + 1U;
+    if (want > nsq)
+        want = nsq;
+    if (want > ncq)
+        want = ncq;
+
+    // Probing runs before the LAPIC driver is up; CPUID has the boot CPU's ID.
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    ctrl->msix = true;
+    for (uint32_t i = 0; i < want; i++) {
+        nvme_queue_t* q = &ctrl->ioq[i];
+
+        q->qid = (uint16_t)(i + 1);
+        q->vector = 0;
+        if (ctrl->msix) {
+            uint8_t vector = allocateInterruptVector(nvme_interrupt);
+            if (!vector) {
+                if (i == 0) {
+                    warn("[NVMe] No free interrupt vector", __FILE__);
+                    return -5;
+                }
+                break;
+            }
+
+            nvme_vectors[vector].controller = (uint8_t)ctrl->controller_id;
+            nvme_vectors[vector].queue = (uint8_t)i;
+            if (pci_enable_msix(bus, slot, function, q->qid, vector, ebx >> 24)) {
+                q->vector = vector;
+            } else {
+                freeInterruptVector(vector);
+                if (i == 0)
+                    ctrl->msix = false;
+                else
+                    break;  // a short MSI-X table: no polled queues next to interrupt driven ones
+            }
+        }
+
+        int rc = nvme_create_io_queue(ctrl, q, max_entries);
+        if (rc != 0) {
+            if (i == 0)
+                return rc - 2;
+            break;
+        }
+
+        ctrl->nr_ioq = (uint16_t)(i + 1);
+    }
 
-static int nvme_init_controller(nvme_controller_t* ctrl)
+    if (ctrl->msix)
+        printf("[NVMe] %u I/O queues, completions through MSI-X", ctrl->nr_ioq);
+    else
+        printf("[NVMe] %u I/O queues, completions by polling", ctrl->nr_ioq);
+    return 0;
+}
+
+
+static int nvme_init_controller(nvme_controller_t* ctrl, uint8_t bus, uint8_t slot, uint8_t function)
 {
     uint16_t max_entries = (uint16_t)((ctrl->regs->cap & 0xFFFF) + 1);
     uint8_t dstrd = (ctrl->regs->cap >> 32) & 0xF;
@@ -173,8 +296,8 @@ static int nvme_init_controller(nvme_controller_t* ctrl)
     ctrl->adminq.phase = 1;
 
     ctrl->regs->aqa = (((uint32_t)ctrl->adminq.depth - 1U) << 16) | ((uint32_t)ctrl->adminq.depth - 1U);
-    ctrl->regs->asq = (uint64_t)(uintptr_t)ctrl->adminq.sq;
-    ctrl->regs->acq = (uint64_t)(uintptr_t)ctrl->adminq.cq;
+    ctrl->regs->asq = nvme_phys(ctrl->adminq.sq);
+    ctrl->regs->acq = nvme_phys(ctrl->adminq.cq);
 
     ctrl->regs->cc =
         NVME_CC_EN |
@@ -189,71 +312,8 @@ static int nvme_init_controller(nvme_controller_t* ctrl)
         return -3;
     }
 
-    ctrl->ioq.qid = 1;
-    ctrl->ioq.depth = NVME_IO_QUEUE_DEPTH;
-    if (ctrl->ioq.depth > max_entries)
-        ctrl->ioq.depth = max_entries;
-
-    ctrl->ioq.sq = kmalloc_aligned(sizeof(nvme_command_t) * ctrl->ioq.depth, 4096);
-    ctrl->ioq.cq = kmalloc_aligned(sizeof(nvme_completion_t) * ctrl->ioq.depth, 4096);
-    ctrl->bounce_buffer = kmalloc_aligned(4096, 4096);
-    if (!ctrl->ioq.sq || !ctrl->ioq.cq || !ctrl->bounce_buffer)
-        return -4;
-
-    memset(ctrl->ioq.sq, 0, sizeof(nvme_command_t) * ctrl->ioq.depth);
-    memset(ctrl->ioq.cq, 0, sizeof(nvme_completion_t) * ctrl->ioq.depth);
-    ctrl->ioq.sq_tail = 0;
-    ctrl->ioq.cq_head = 0;
-    ctrl->ioq.phase = 1;
-
-    return nvme_create_io_queues(ctrl);
-}
-
-static int nvme_buffer_needs_bounce(void* buffer, uint32_t lba_size)
-{
-    uintptr_t start = (uintptr_t)buffer;
-    uintptr_t end = start + lba_size;
-
-    if (start < heap_begin || start >= heap_end)
-        return 1;
-
-    return ((start & 0xFFF) + lba_size) > 4096 || end > heap_end;
-}
-
-static int nvme_read_write_one(nvme_namespace_t* ns, uint64_t lba, void* buffer, int is_write)
-{
-    nvme_controller_t* ctrl = &nvme_controllers[ns->controller_index];
-    nvme_command_t cmd;
-    uint8_t* io_buffer = (uint8_t*)buffer;
-    int use_bounce = nvme_buffer_needs_bounce(buffer, ns->lba_size);
-
-    if (use_bounce) {
-        /*
-         * Filesystem probing commonly reads into stack buffers, while early
-         * partition probing often uses aligned heap buffers. Bounce only when
-         * the caller buffer is not DMA-safe for the controller.
-         */
-        if (!ctrl->bounce_buffer)
-            return -1;
-
-        io_buffer = (uint8_t*)ctrl->bounce_buffer;
-        if (is_write)
-            memcpy(io_buffer, buffer, ns->lba_size);
-    }
-
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.opcode = is_write ? NVME_NVM_OP_WRITE : NVME_NVM_OP_READ;
-    cmd.nsid = ns->nsid;
-    cmd.prp1 = fast_virt_to_phys(io_buffer);
-    cmd.cdw10 = (uint32_t)lba;
-    cmd.cdw11 = (uint32_t)(lba >> 32);
-    cmd.cdw12 = 0;
-
-    int rc = nvme_submit_and_wait(ctrl, &ctrl->ioq, &cmd);
-    if (rc == 0 && use_bounce && !is_write)
-        memcpy(buffer, io_buffer, ns->lba_size);
-
-    return rc;
+    ctrl->max_sectors = NVME_REQ_MAX_SECTORS;
+    return nvme_create_io_queues(ctrl, bus, slot, function, max_entries);
 }
 
 static void nvme_probe_namespaces(int controller_index)
@@ -269,6 +329,11 @@ static void nvme_probe_namespaces(int controller_index)
         return;
     }
 
+    // MDTS is a power of two in units of the 4 KiB minimum page size.
+    uint8_t mdts = identify_buf[77];
+    if (mdts != 0 && mdts < 9)
+        ctrl->max_sectors = (4096U << mdts) / SECTOR_SIZE;
+
     ctrl->nn = ((uint32_t*)identify_buf)[129];
     if (ctrl->nn == 0)
         ctrl->nn = 1;
@@ -347,7 +412,7 @@ void probe_nvme(uint8_t bus, uint8_t slot, uint8_t function)
         ctrl->regs = (nvme_regs_t*)(uintptr_t)bar;
         ctrl->controller_id = (uint32_t)i;
 
-        if (nvme_init_controller(ctrl) != 0) {
+        if (nvme_init_controller(ctrl, bus, slot, function) != 0) {
             printf("[NVMe] init failure: CAP=0x%X:%X CC=0x%X CSTS=0x%X",
                 (uint32_t)(ctrl->regs->cap >> 32),
                 (uint32_t)(ctrl->regs->cap & 0xFFFFFFFFU),
@@ -365,38 +430,400 @@ void probe_nvme(uint8_t bus, uint8_t slot, uint8_t function)
     }
 }
 
-int nvme_read_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count)
+/**
+ * @brief Fills in the PRP entries of @p req for @p bytes of @p buffer: one
+ * per page, the third onward in a list page. Every page is looked up on
+ * its own, so the buffer need not be physically contiguous.
+ *
+ * @return 0 if mapped; -1 if a page is unmapped or the start is not dword
+ * aligned, -10 if out of memory.
+ */
+static int nvme_map_prp(nvme_request_t* req, const void* buffer, uint32_t bytes)
 {
-    if (namespace_index < 0 || namespace_index >= nvme_namespace_count || !buffer)
+    uint64_t va = (uint64_t)(uintptr_t)buffer;
+    uint64_t pa = virtual_to_physical(va);
+
+    req->prp_list = NULL;
+    req->prp2 = 0;
+    if (pa == 0 || (pa & 3))
+        return -1;
+    req->prp1 = pa;
+
+    uint32_t first = (uint32_t)(PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+    if (bytes <= first)
+        return 0;
+
+    uint64_t next = va + first;
+    uint32_t pages = (bytes - first + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 1) {
+        req->prp2 = virtual_to_physical(next);
+        return req->prp2 ? 0 : -1;
+    }
+
+    uint64_t* list = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    if (!list)
+        return -10;
+
+    for (uint32_t i = 0; i < pages; i++) {
+        list[i] = virtual_to_physical(next + (uint64_t)i * PAGE_SIZE);
+        if (list[i] == 0) {
+            kfree(list);
+            return -1;
+        }
+    }
+
+    req->prp_list = list;
+    req->prp2 = nvme_phys(list);
+    return 0;
+}
+
+static uint32_t nvme_dma_extent(nvme_controller_t* ctrl, const void* buffer, uint32_t count)
+{
+    uint64_t va = (uint64_t)(uintptr_t)buffer;
+    uint64_t pa = virtual_to_physical(va);
+
+    if (count > ctrl->max_sectors)
+        count = ctrl->max_sectors;
+    if (pa == 0 || (pa & 3))
+        return 0;
+
+    uint64_t bytes = (uint64_t)count * SECTOR_SIZE;
+    uint64_t covered = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+    while (covered < bytes && virtual_to_physical(va + covered) != 0)
+        covered += PAGE_SIZE;
+
+    return (uint32_t)((covered < bytes ? covered : bytes) / SECTOR_SIZE);
+}
+
+static void nvme_issue_locked(nvme_queue_t* q, uint16_t cid, nvme_request_t* req)
+{
+    nvme_command_t* cmd = &q->sq[q->sq_tail];
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->opcode = req->write ? NVME_NVM_OP_WRITE : NVME_NVM_OP_READ;
+    cmd->cid = cid;
+    cmd->nsid = req->nsid;
+    cmd->prp1 = req->prp1;
+    cmd->prp2 = req->prp2;
+    cmd->cdw10 = (uint32_t)req->lba;
+    cmd->cdw11 = (uint32_t)(req->lba >> 32);
+    cmd->cdw12 = req->count - 1U;   // zero based
+
+    q->cid_req[cid] = req;
+    q->cid_busy |= 1ULL << cid;
+    q->sq_tail = (uint16_t)((q->sq_tail + 1U) % q->depth);
+}
+
+/**
+ * @brief Moves waiting requests into free command IDs and rings the
+ * doorbell once for all of them. One SQ entry is always left empty, so a
+ * full queue has depth - 1 commands in flight.
+ */
+static void nvme_start_locked(nvme_controller_t* ctrl, nvme_queue_t* q)
+{
+    uint64_t usable = (1ULL << (q->depth - 1U)) - 1U;
+    bool issued = false;
+
+    while (q->pending_head) {
+        uint64_t free = ~q->cid_busy & usable;
+        if (!free)
+            break;
+
+        nvme_request_t* req = q->pending_head;
+        q->pending_head = req->next;
+        if (!q->pending_head)
+            q->pending_tail = NULL;
+        req->next = NULL;
+
+        nvme_issue_locked(q, (uint16_t)__builtin_ctzll(free), req);
+        issued = true;
+    }
+
+    if (issued)
+        *nvme_sq_doorbell(ctrl, q->qid) = q->sq_tail;
+}
+
+static void nvme_reap_locked(nvme_controller_t* ctrl, nvme_queue_t* q, nvme_done_t* done, uint32_t* ndone)
+{
+    bool reaped = false;
+
+    for (;;) {
+        volatile nvme_completion_t* cpl = &q->cq[q->cq_head];
+        if ((cpl->status & 1) != q->phase)
+            break;
+
+        uint16_t cid = cpl->cid;
+        uint16_t status = cpl->status >> 1;
+
+        q->cq_head++;
+        if (q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        reaped = true;
+
+        if (cid >= q->depth || !(q->cid_busy & (1ULL << cid)))
+            continue;
+
+        done[*ndone].req = q->cid_req[cid];
+        done[*ndone].status = status ? -2 : 0;
+        (*ndone)++;
+        q->cid_req[cid] = NULL;
+        q->cid_busy &= ~(1ULL << cid);
+    }
+
+    if (reaped)
+        *nvme_cq_doorbell(ctrl, q->qid) = q->cq_head;
+}
+
+/**
+ * @brief Hands a finished request back. Waiters copy read data themselves,
+ * in their own address space; callbacks get it copied here.
+ */
+static void nvme_finish(nvme_request_t* req, int status)
+{
+    if (req->prp_list) {
+        kfree(req->prp_list);
+        req->prp_list = NULL;
+    }
+
+    if (req->complete) {
+        if (req->dma) {
+            if (status == 0 && !req->write)
+                memcpy(req->buffer, req->dma, req->count * SECTOR_SIZE);
+            kfree(req->dma);
+            req->dma = NULL;
+        }
+        req->status = status;
+        req->complete(req);
+        return;
+    }
+
+    // The waiter may drop the request once it sees the status, so that
+    // is written last.
+    multitasking_completion_signal(&req->done);
+    __atomic_store_n(&req->status, status, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Reaps and restarts an I/O queue. Runs from its interrupt and from
+ * waiters. A controller in fatal state fails everything queued on it.
+ */
+static void nvme_queue_service(nvme_controller_t* ctrl, nvme_queue_t* q)
+{
+    nvme_done_t done[NVME_IO_QUEUE_DEPTH];
+    uint32_t ndone = 0;
+    nvme_request_t* failed = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+
+    if (ctrl->regs->csts & NVME_CSTS_CFS) {
+        for (uint64_t busy = q->cid_busy; busy; busy &= busy - 1) {
+            uint32_t cid = (uint32_t)__builtin_ctzll(busy);
+            done[ndone].req = q->cid_req[cid];
+            done[ndone].status = -2;
+            ndone++;
+            q->cid_req[cid] = NULL;
+        }
+        q->cid_busy = 0;
+        failed = q->pending_head;
+        q->pending_head = q->pending_tail = NULL;
+    } else {
+        nvme_reap_locked(ctrl, q, done, &ndone);
+        nvme_start_locked(ctrl, q);
+    }
+
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    for (uint32_t i = 0; i < ndone; i++)
+        nvme_finish(done[i].req, done[i].status);
+    while (failed) {
+        nvme_request_t* next = failed->next;
+        nvme_finish(failed, -2);
+        failed = next;
+    }
+}
+
+static void nvme_interrupt(InterruptFrame* frame)
+{
+    nvme_controller_t* ctrl = &nvme_controllers[nvme_vectors[frame->int_no & 0xFF].controller];
+    uint32_t qi = nvme_vectors[frame->int_no & 0xFF].queue;
+
+    if (qi < ctrl->nr_ioq)
+        nvme_queue_service(ctrl, &ctrl->ioq[qi]);
+
+    lapic_eoi();
+    multitasking_on_device_irq((frame->cs & 0x3) == 0x3);
+}
+
+int nvme_submit(int namespace_index, nvme_request_t* req)
+{
+    if (namespace_index < 0 || namespace_index >= nvme_namespace_count || !req || !req->buffer)
         return -1;
 
     nvme_namespace_t* ns = &nvme_namespaces[namespace_index];
-    if (!ns->present)
+    nvme_controller_t* ctrl = &nvme_controllers[ns->controller_index];
+    if (!ns->present || ctrl->nr_ioq == 0 || req->count == 0 || req->count > ctrl->max_sectors)
         return -1;
+    if (ctrl->regs->csts & NVME_CSTS_CFS)
+        return -2;
 
-    uint8_t* ptr = (uint8_t*)buffer;
-    for (uint32_t i = 0; i < count; i++) {
-        if (nvme_read_write_one(ns, lba + i, ptr + i * ns->lba_size, 0) != 0)
-            return -2;
+    uint32_t bytes = req->count * SECTOR_SIZE;
+
+    req->dma = NULL;
+    int rc = nvme_map_prp(req, req->buffer, bytes);
+    if (rc == -1) {
+        if (req->count > NVME_BOUNCE_MAX_SECTORS)
+            return -1;
+
+        req->dma = kmalloc_aligned(bytes, 4096);
+        if (!req->dma)
+            return -10;
+        rc = nvme_map_prp(req, req->dma, bytes);
+        if (rc != 0) {
+            kfree(req->dma);
+            req->dma = NULL;
+            return -10;
+        }
+        if (req->write)
+            memcpy(req->dma, req->buffer, bytes);
+    } else if (rc != 0) {
+        return rc;
     }
 
+    req->nsid = ns->nsid;
+    req->queue = (uint16_t)(smp_current_cpu() % ctrl->nr_ioq);
+    req->status = NVME_REQ_PENDING;
+    req->next = NULL;
+    multitasking_completion_init(&req->done);
+
+    nvme_queue_t* q = &ctrl->ioq[req->queue];
+    uint64_t flags = spin_lock_irqsave(&q->lock);
+    if (q->pending_tail)
+        q->pending_tail->next = req;
+    else
+        q->pending_head = req;
+    q->pending_tail = req;
+    nvme_start_locked(ctrl, q);
+    spin_unlock_irqrestore(&q->lock, flags);
+
     return 0;
 }
 
-int nvme_write_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count)
+int nvme_wait(int namespace_index, nvme_request_t* req)
+{
+    nvme_controller_t* ctrl = &nvme_controllers[nvme_namespaces[namespace_index].controller_index];
+    nvme_queue_t* q = &ctrl->ioq[req->queue];
+
+    for (;;) {
+        int status = __atomic_load_n(&req->status, __ATOMIC_ACQUIRE);
+        if (status != NVME_REQ_PENDING) {
+            if (req->dma) {
+                if (status == 0 && !req->write)
+                    memcpy(req->buffer, req->dma, req->count * SECTOR_SIZE);
+                kfree(req->dma);
+                req->dma = NULL;
+            }
+            return status;
+        }
+
+        nvme_queue_service(ctrl, q);
+        if (__atomic_load_n(&req->status, __ATOMIC_ACQUIRE) != NVME_REQ_PENDING)
+            continue;
+
+        // Sleeps until the interrupt, or polls while there is none yet.
+        if (!q->vector || !multitasking_completion_wait(&req->done, NVME_WAIT_SLICE_NS))
+            __asm__ __volatile__("pause");
+    }
+}
+
+void nvme_poll(int namespace_index)
+{
+    if (namespace_index < 0 || namespace_index >= nvme_namespace_count)
+        return;
+
+    nvme_controller_t* ctrl = &nvme_controllers[nvme_namespaces[namespace_index].controller_index];
+    for (uint16_t i = 0; i < ctrl->nr_ioq; i++)
+        nvme_queue_service(ctrl, &ctrl->ioq[i]);
+}
+
+bool nvme_interrupts_enabled(int namespace_index)
+{
+    if (namespace_index < 0 || namespace_index >= nvme_namespace_count)
+        return false;
+    return nvme_controllers[nvme_namespaces[namespace_index].controller_index].msix;
+}
+
+uint32_t nvme_dma_sectors(int namespace_index, const void* buffer, uint32_t count)
+{
+    if (namespace_index < 0 || namespace_index >= nvme_namespace_count)
+        return 0;
+    return nvme_dma_extent(&nvme_controllers[nvme_namespaces[namespace_index].controller_index], buffer, count);
+}
+
+/**
+ * @brief Splits a transfer into requests that are all queued before the
+ * first is waited for, so the controller works on them together. Each
+ * takes as much of the caller's buffer as one command can map, so only
+ * memory that is not mapped page by page is copied.
+ */
+static int nvme_transfer(int namespace_index, uint64_t lba, void* buffer, uint32_t count, bool write)
 {
     if (namespace_index < 0 || namespace_index >= nvme_namespace_count || !buffer)
         return -1;
 
     nvme_namespace_t* ns = &nvme_namespaces[namespace_index];
+    nvme_controller_t* ctrl = &nvme_controllers[ns->controller_index];
     if (!ns->present)
         return -1;
 
-    uint8_t* ptr = (uint8_t*)buffer;
-    for (uint32_t i = 0; i < count; i++) {
-        if (nvme_read_write_one(ns, lba + i, ptr + i * ns->lba_size, 1) != 0)
-            return -2;
+    nvme_request_t reqs[NVME_RAW_BATCH];
+    uint8_t* p = buffer;
+    int rc = 0;
+
+    while (count > 0 && rc == 0) {
+        uint32_t n = 0;
+
+        while (n < NVME_RAW_BATCH && count > 0) {
+            uint32_t chunk = nvme_dma_extent(ctrl, p, count);
+            if (chunk == 0)
+                chunk = count < NVME_BOUNCE_MAX_SECTORS ? count : NVME_BOUNCE_MAX_SECTORS;
+            if (chunk > ctrl->max_sectors)
+                chunk = ctrl->max_sectors;
+            nvme_request_t* req = &reqs[n];
+
+            memset(req, 0, sizeof(*req));
+            req->lba = lba;
+            req->count = chunk;
+            req->buffer = p;
+            req->write = write;
+
+            rc = nvme_submit(namespace_index, req);
+            if (rc != 0)
+                break;
+
+            n++;
+            lba += chunk;
+            p += chunk * SECTOR_SIZE;
+            count -= chunk;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            int status = nvme_wait(namespace_index, &reqs[i]);
+            if (status != 0 && rc == 0)
+                rc = status;
+        }
     }
 
-    return 0;
+    return rc;
+}
+
+int nvme_read_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count)
+{
+    return nvme_transfer(namespace_index, lba, buffer, count, false);
+}
+
+int nvme_write_sector(int namespace_index, uint64_t lba, void* buffer, uint32_t count)
+{
+    return nvme_transfer(namespace_index, lba, buffer, count, true);
 }
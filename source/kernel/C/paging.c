@@ -9,55 +9,476 @@
  * 
  */
 #include <paging.h>
+#include <memory.h>
+#include <graphics.h>
+#include <cc-asm.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <cpuid2.h>
 
 uint64_t memory_start;
 uint64_t memory_end;
 size_t   amount_of_pages;
 uint8*    page_bitmap;
+static uint16_t* page_refs; // holders of each frame beyond the first
 
 extern uint8_t user_code_start[];
 extern uint8_t user_code_end[];
 
 struct limine_memmap_response *memmap;
-static uintptr_t bump_ptr = 0;
 static uint64_t hhdm_offset = 0;
+static uint64_t kernel_cr3 = 0;
+
+/*
+ * Physical frames are tracked in page_bitmap, one bit per 4 KiB frame
+ * (1 = used), covering every USABLE entry of the Limine memory map.
+ * Frames outside USABLE entries and reserved ranges always stay set.
+ *
+ * Single frames go through a small per-CPU stack first, so the common
+ * allocate_page()/free_page() pair never touches pmm_lock. The stack's own
+ * lock is only ever contended by pmm_drain_pcp(). Parked frames stay set
+ * in the bitmap and carry PMM_FRAME_CACHED in page_refs.
+ *
+ * A frame mapped in more than one place (the page cache, copy-on-write)
+ * has its extra holders counted in page_refs; free_page() drops one of
+ * them and only the last one really frees the frame.
+ */
+#define PMM_MAX_RESERVED 8
+#define PMM_DMA_LIMIT    (16 MiB)
+#define PMM_DMA32_LIMIT  (4 GiB)
+#define PMM_PCP_HIGH     32 // frames a CPU may hoard
+#define PMM_PCP_BATCH    16 // frames moved per refill/drain
+#define PMM_FRAME_CACHED 0xFFFF // page_refs of a frame parked in a per-CPU stack
+
+typedef struct {
+    spinlock_t lock;
+    uint32_t count;
+    uintptr_t frames[PMM_PCP_HIGH];
+} pmm_pcp_t;
+
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+} pmm_range_t;
+
+/*
+ * Every user address space gets a PCID in the low bits of its CR3, so
+ * switching to it keeps the TLB entries of the others. The kernel tables
+ * keep PCID 0 and are flushed on every load, as without PCIDs.
+ */
+#define CR4_PCIDE        (1ULL << 17)
+#define CR3_PCID_MASK    0xFFFULL
+#define CR3_NOFLUSH      (1ULL << 63)
+#define PCID_COUNT       4096
+
+static bool pcid_enabled = false;
+static uint64_t pcid_used[PCID_COUNT / 64] = { 1 }; // PCID 0 is the kernel's
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+
+static pmm_range_t pmm_reserved[PMM_MAX_RESERVED];
+static int pmm_reserved_count = 0;
+static bool pmm_ready = false;
+static uint64_t pmm_next_hint = 0;
+static uint64_t pmm_zone_total[PMM_ZONE_COUNT];
+static uint64_t pmm_zone_free[PMM_ZONE_COUNT];
+static pmm_pcp_t pmm_pcp[SMP_MAX_CPUS];
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+static const char* const pmm_zone_names[PMM_ZONE_COUNT] = {
+    "DMA", "DMA32", "Normal"
+};
 
 void paging_set_hhdm_offset(uint64_t offset) {
     hhdm_offset = offset;
+    // Still on the bootloader's tables here, which become the kernel's.
+    asm volatile("mov %%cr3, %0" : "=r"(kernel_cr3));
 }
 
 static inline uint64_t *phys_to_virt_ptr(uint64_t phys_addr) {
     return (uint64_t *)(phys_addr + hhdm_offset);
 }
 
-uintptr_t allocate_page(void) {
+static inline int pmm_zone_of(uint64_t frame) {
+    uint64_t addr = frame * PAGE_SIZE;
+    if (addr < PMM_DMA_LIMIT)   return PMM_ZONE_DMA;
+    if (addr < PMM_DMA32_LIMIT) return PMM_ZONE_DMA32;
+    return PMM_ZONE_NORMAL;
+}
+
+static inline bool pmm_frame_used(uint64_t frame) {
+    return (page_bitmap[frame >> 3] >> (frame & 7)) & 1;
+}
+
+static inline void pmm_mark_used(uint64_t frame) {
+    if (pmm_frame_used(frame))
+        return;
+    page_bitmap[frame >> 3] |= (uint8)(1U << (frame & 7));
+    pmm_zone_free[pmm_zone_of(frame)]--;
+}
+
+static inline void pmm_mark_free(uint64_t frame) {
+    if (!pmm_frame_used(frame))
+        return;
+    page_bitmap[frame >> 3] &= (uint8)~(1U << (frame & 7));
+    pmm_zone_free[pmm_zone_of(frame)]++;
+}
+
+static bool pmm_is_reserved(uint64_t addr) {
+    for (int i = 0; i < pmm_reserved_count; i++) {
+        if (addr >= pmm_reserved[i].base && addr < pmm_reserved[i].end)
+            return true;
+    }
+    return false;
+}
+
+/* A frame may be handed out only if it is fully inside a USABLE entry. */
+static bool pmm_frame_managed(uint64_t frame) {
+    uint64_t addr = frame * PAGE_SIZE;
+
+    if (frame >= amount_of_pages || pmm_is_reserved(addr))
+        return false;
+
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE)
+            continue;
+        if (addr >= e->base && addr + PAGE_SIZE <= e->base + e->length)
+            return true;
+    }
+    return false;
+}
+
+void pmm_reserve_range(uint64_t base, uint64_t length) {
+    if (length == 0 || pmm_reserved_count >= PMM_MAX_RESERVED) {
+        warn("pmm: Cannot reserve more physical ranges", __FILE__);
+        return;
+    }
+
+    uint64_t start = base & ~(PAGE_SIZE - 1);
+    uint64_t end = (base + length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    pmm_reserved[pmm_reserved_count++] = (pmm_range_t){ start, end };
+
+    if (pmm_ready) {
+        for (uint64_t f = start / PAGE_SIZE; f < end / PAGE_SIZE && f < amount_of_pages; f++)
+            pmm_mark_used(f);
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_init(void) {
     if(!memmap){
         error("Limine failed to give the memory map", __FILE__);
         hcf2();
     }
 
-    if (!bump_ptr) {
-        for (uint64_t i = 0; i < memmap->entry_count; i++) {
-            struct limine_memmap_entry *e = memmap->entries[i];
-            if (e->type != LIMINE_MEMMAP_USABLE) continue;
-            bump_ptr = (e->base + PAGE_SIZE - 1) & ~0xFFFULL;
-            break;
+    // The first MiB holds BIOS/real-mode structures and frame 0 doubles as "no page".
+    pmm_reserve_range(0, 1 MiB);
+
+    memory_start = UINT64_MAX;
+    memory_end = 0;
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE)
+            continue;
+        if (e->base < memory_start)
+            memory_start = e->base;
+        if (e->base + e->length > memory_end)
+            memory_end = e->base + e->length;
+    }
+
+    amount_of_pages = memory_end / PAGE_SIZE;
+    uint64_t bitmap_bytes = (amount_of_pages + 7) / 8;
+    uint64_t refs_bytes = amount_of_pages * sizeof(uint16_t);
+    uint64_t bitmap_size = (bitmap_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t refs_size = (refs_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    // Carve the bitmap and the reference counts out of the first usable
+    // region that is big enough for both.
+    uint64_t bitmap_phys = 0;
+    for (uint64_t i = 0; i < memmap->entry_count && !bitmap_phys; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        uint64_t base = (e->base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        uint64_t end = (e->base + e->length) & ~(PAGE_SIZE - 1);
+        for (; base + bitmap_size + refs_size <= end; base += PAGE_SIZE) {
+            if (!pmm_is_reserved(base) && !pmm_is_reserved(base + bitmap_size + refs_size - 1)) {
+                bitmap_phys = base;
+                break;
+            }
         }
     }
 
-    uintptr_t page = bump_ptr;
-    bump_ptr += PAGE_SIZE;
-    return page;
+    if (!bitmap_phys) {
+        error("pmm: No room for the page frame bitmap", __FILE__);
+        hcf2();
+    }
+
+    page_bitmap = (uint8*)phys_to_virt_ptr(bitmap_phys);
+    memset(page_bitmap, 0xFF, bitmap_size);
+    page_refs = (uint16_t*)phys_to_virt_ptr(bitmap_phys + bitmap_size);
+    memset(page_refs, 0, refs_size);
+    memset(pmm_zone_total, 0, sizeof(pmm_zone_total));
+    memset(pmm_zone_free, 0, sizeof(pmm_zone_free));
+
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry *e = memmap->entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE)
+            continue;
+
+        uint64_t first = (e->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t last = (e->base + e->length) / PAGE_SIZE;
+        for (uint64_t f = first; f < last; f++) {
+            if (pmm_is_reserved(f * PAGE_SIZE))
+                continue;
+            pmm_zone_total[pmm_zone_of(f)]++;
+            pmm_mark_free(f);
+        }
+    }
+
+    pmm_ready = true;
+    pmm_reserve_range(bitmap_phys, bitmap_size + refs_size);
+    pmm_next_hint = 0;
+
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+    printf("pmm: %u frames managed, %u free, bitmap at 0x%X",
+           stats.total_frames, stats.free_frames, bitmap_phys);
 }
 
-uintptr_t allocate_pages(size_t count) {
-    uintptr_t base = allocate_page();
-    for (size_t i = 1; i < count; i++) {
-        allocate_page(); // advance bump_ptr
+/* Callers get 0 and decide for themselves whether they can go on. */
+static uintptr_t pmm_out_of_memory(size_t count) {
+    error("pmm: Out of physical memory!", __FILE__);
+    printf("pmm: failed to allocate %u contiguous page(s)", count);
+    return 0;
+}
+
+/* Takes one frame out of the bitmap, caller holds pmm_lock. */
+static uintptr_t pmm_take_frame(void) {
+    uint64_t words = amount_of_pages / 64;
+    uint64_t* map = (uint64_t*)page_bitmap;
+
+    // Next-fit, one 64-frame word at a time.
+    for (uint64_t n = 0; n < words; n++) {
+        uint64_t w = (pmm_next_hint + n) % words;
+        if (map[w] == UINT64_MAX)
+            continue;
+
+        uint64_t frame = w * 64 + (uint64_t)__builtin_ctzll(~map[w]);
+        pmm_mark_used(frame);
+        pmm_next_hint = w;
+        return frame * PAGE_SIZE;
+    }
+
+    for (uint64_t frame = words * 64; frame < amount_of_pages; frame++) {
+        if (!pmm_frame_used(frame)) {
+            pmm_mark_used(frame);
+            return frame * PAGE_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+uintptr_t allocate_page(void) {
+    if (!pmm_ready)
+        pmm_init();
+
+    uint64_t flags = irq_save();
+    pmm_pcp_t* pcp = &pmm_pcp[smp_current_cpu()];
+    spin_lock(&pcp->lock);
+
+    if (pcp->count == 0) {
+        spin_lock(&pmm_lock);
+        while (pcp->count < PMM_PCP_BATCH) {
+            uintptr_t frame = pmm_take_frame();
+            if (!frame)
+                break;
+            page_refs[frame / PAGE_SIZE] = PMM_FRAME_CACHED;
+            pcp->frames[pcp->count++] = frame;
+        }
+        spin_unlock(&pmm_lock);
+    }
+
+    uintptr_t page = pcp->count ? pcp->frames[--pcp->count] : 0;
+    if (page)
+        __atomic_store_n(&page_refs[page / PAGE_SIZE], 0, __ATOMIC_RELEASE);
+
+    spin_unlock(&pcp->lock);
+    irq_restore(flags);
+
+    return page ? page : pmm_out_of_memory(1);
+}
+
+/* Hands @p pcp's frames, or all but @p keep of them, back to the bitmap. */
+static void pmm_pcp_drain_locked(pmm_pcp_t* pcp, uint32_t keep) {
+    spin_lock(&pmm_lock);
+    while (pcp->count > keep) {
+        uint64_t frame = pcp->frames[--pcp->count] / PAGE_SIZE;
+        __atomic_store_n(&page_refs[frame], 0, __ATOMIC_RELEASE);
+        pmm_mark_free(frame);
+    }
+    spin_unlock(&pmm_lock);
+}
+
+/* Empties every CPU's stack, so a contiguous run can use what they hoard. */
+static void pmm_drain_pcp(void) {
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        pmm_pcp_t* pcp = &pmm_pcp[cpu];
+        if (__atomic_load_n(&pcp->count, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        uint64_t flags = spin_lock_irqsave(&pcp->lock);
+        pmm_pcp_drain_locked(pcp, 0);
+        spin_unlock_irqrestore(&pcp->lock, flags);
+    }
+}
+
+/* First fit search for count free frames that all lie below limit. */
+static uintptr_t pmm_find_contiguous(size_t count, uint64_t limit) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t max_frame = limit / PAGE_SIZE;
+    if (max_frame > amount_of_pages)
+        max_frame = amount_of_pages;
+
+    uint64_t run = 0;
+    for (uint64_t frame = 0; frame < max_frame; frame++) {
+        if (pmm_frame_used(frame)) {
+            run = 0;
+            // Skip whole used words quickly.
+            if ((frame & 63) == 0 && ((uint64_t*)page_bitmap)[frame / 64] == UINT64_MAX && frame + 64 <= max_frame)
+                frame += 63;
+            continue;
+        }
+
+        if (++run == count) {
+            uint64_t first = frame + 1 - count;
+            for (uint64_t f = first; f <= frame; f++)
+                pmm_mark_used(f);
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return first * PAGE_SIZE;
+        }
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return 0;
+}
+
+static uintptr_t pmm_alloc_contiguous(size_t count, uint64_t limit) {
+    if (!pmm_ready)
+        pmm_init();
+
+    uintptr_t base = pmm_find_contiguous(count, limit);
+    if (!base) {
+        pmm_drain_pcp();
+        base = pmm_find_contiguous(count, limit);
     }
     return base;
 }
 
+uintptr_t allocate_pages(size_t count) {
+    if (count == 0)
+        return 0;
+    if (count == 1)
+        return allocate_page();
+
+    uintptr_t base = pmm_alloc_contiguous(count, UINT64_MAX);
+    return base ? base : pmm_out_of_memory(count);
+}
+
+uintptr_t allocate_dma_pages(size_t count) {
+    if (count == 0)
+        return 0;
+
+    uintptr_t base = pmm_alloc_contiguous(count, PMM_DMA32_LIMIT);
+    return base ? base : pmm_out_of_memory(count);
+}
+
+void free_page(uintptr_t phys) {
+    if (!pmm_ready || (phys & (PAGE_SIZE - 1)) != 0)
+        return;
+
+    uint64_t frame = phys / PAGE_SIZE;
+    if (!pmm_frame_managed(frame)) {
+        warn("pmm: Tried to free an unmanaged frame", __FILE__);
+        return;
+    }
+
+    // Still held elsewhere: drop one holder, only the last one frees, and
+    // claims the frame for the per-CPU stack in the same step.
+    uint16_t refs = __atomic_load_n(&page_refs[frame], __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (!pmm_frame_used(frame) || refs == PMM_FRAME_CACHED) {
+            warn("pmm: Double free of a physical frame", __FILE__);
+            return;
+        }
+        uint16_t next = refs ? refs - 1 : PMM_FRAME_CACHED;
+        if (__atomic_compare_exchange_n(&page_refs[frame], &refs, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (refs)
+        return;
+
+    uint64_t flags = irq_save();
+    pmm_pcp_t* pcp = &pmm_pcp[smp_current_cpu()];
+    spin_lock(&pcp->lock);
+
+    if (pcp->count == PMM_PCP_HIGH)
+        pmm_pcp_drain_locked(pcp, PMM_PCP_HIGH - PMM_PCP_BATCH);
+
+    pcp->frames[pcp->count++] = phys;
+    spin_unlock(&pcp->lock);
+    irq_restore(flags);
+}
+
+void page_get(uintptr_t phys) {
+    uint64_t frame = phys / PAGE_SIZE;
+    if (!pmm_ready || frame >= amount_of_pages)
+        return;
+
+    __atomic_add_fetch(&page_refs[frame], 1, __ATOMIC_ACQ_REL);
+}
+
+uint32_t page_ref_count(uintptr_t phys) {
+    uint64_t frame = phys / PAGE_SIZE;
+    if (!pmm_ready || frame >= amount_of_pages)
+        return 0;
+
+    return (uint32_t)__atomic_load_n(&page_refs[frame], __ATOMIC_ACQUIRE) + 1;
+}
+
+void free_pages(uintptr_t phys, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        free_page(phys + i * PAGE_SIZE);
+}
+
+void pmm_get_stats(pmm_stats_t* out) {
+    if (!out)
+        return;
+
+    memset(out, 0, sizeof(*out));
+    for (int z = 0; z < PMM_ZONE_COUNT; z++) {
+        out->zones[z].name = pmm_zone_names[z];
+        out->zones[z].total_frames = pmm_zone_total[z];
+        out->zones[z].free_frames = pmm_zone_free[z];
+        out->total_frames += pmm_zone_total[z];
+        out->free_frames += pmm_zone_free[z];
+    }
+
+    // Frames parked in per-CPU stacks are free, the bitmap just doesn't know yet.
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+        out->cached_frames += pmm_pcp[cpu].count;
+    out->free_frames += out->cached_frames;
+
+    out->used_frames = out->total_frames - out->free_frames;
+}
+
 static inline uint64_t get_kernel_pml4(void) {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
@@ -73,20 +494,47 @@ uint64_t virtual_to_physical(uint64_t virt) {
     uint64_t offset   = virt & 0xFFF;
 
     if (!(pml4[pml4_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pdpt = phys_to_virt_ptr(pml4[pml4_idx] & ~0xFFFULL);
+    uint64_t *pdpt = phys_to_virt_ptr(pml4[pml4_idx] & PAGE_ADDR_MASK);
 
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pd = phys_to_virt_ptr(pdpt[pdpt_idx] & ~0xFFFULL);
+    if (pdpt[pdpt_idx] & PAGE_HUGE)
+        return (pdpt[pdpt_idx] & PAGE_ADDR_MASK & ~0x3FFFFFFFULL) | (virt & 0x3FFFFFFFULL);
+    uint64_t *pd = phys_to_virt_ptr(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
 
     if (!(pd[pd_idx] & PAGE_PRESENT)) return 0;
-    uint64_t *pt = phys_to_virt_ptr(pd[pd_idx] & ~0xFFFULL);
+    if (pd[pd_idx] & PAGE_HUGE)
+        return (pd[pd_idx] & PAGE_ADDR_MASK & ~0x1FFFFFULL) | (virt & 0x1FFFFFULL);
+    uint64_t *pt = phys_to_virt_ptr(pd[pd_idx] & PAGE_ADDR_MASK);
 
     if (!(pt[pt_idx] & PAGE_PRESENT)) return 0;
 
-    uint64_t phys = (pt[pt_idx] & ~0xFFF) | offset;
+    uint64_t phys = (pt[pt_idx] & PAGE_ADDR_MASK) | offset;
     return phys;
 }
 
+uint64_t user_page_entry(uint64_t virt) {
+    uint64_t *pml4 = phys_to_virt_ptr(get_kernel_pml4() & ~0xFFFULL);
+    uint64_t pml4_idx = (virt >> 39) & 0x1FF;
+    uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
+    uint64_t pd_idx   = (virt >> 21) & 0x1FF;
+    uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+
+    if (!(pml4[pml4_idx] & PAGE_PRESENT)) return 0;
+    uint64_t *pdpt = phys_to_virt_ptr(pml4[pml4_idx] & PAGE_ADDR_MASK);
+
+    if (!(pdpt[pdpt_idx] & PAGE_PRESENT) || (pdpt[pdpt_idx] & PAGE_HUGE)) return 0;
+    uint64_t *pd = phys_to_virt_ptr(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
+
+    if (!(pd[pd_idx] & PAGE_PRESENT) || (pd[pd_idx] & PAGE_HUGE)) return 0;
+    uint64_t *pt = phys_to_virt_ptr(pd[pd_idx] & PAGE_ADDR_MASK);
+
+    return pt[pt_idx];
+}
+
+void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + hhdm_offset);
+}
+
 uint64_t fast_virt_to_phys(void* v) {
     return (uint64_t)v - hhdm_offset;
 }
@@ -95,7 +543,7 @@ uint64_t virt_to_phys(void* v) {
     return fast_virt_to_phys(v);
 }
 
-void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
+bool map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     // Traverse or create PML4 -> PDPT -> PD -> PT
     uint64_t *pml4 = phys_to_virt_ptr(get_kernel_pml4() & ~0xFFFULL); // kernel PML4
     uint64_t *pdpt, *pd, *pt;
@@ -109,6 +557,8 @@ void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     // Create PDPT if missing
     if (!(pml4[pml4_idx] & PAGE_PRESENT)) {
         pdpt_phys = allocate_page();
+        if (!pdpt_phys)
+            return false;
         pdpt = phys_to_virt_ptr(pdpt_phys);
         memset(pdpt, 0, 0x1000);
         pml4[pml4_idx] = pdpt_phys | PAGE_PRESENT | PAGE_RW | PAGE_USER;
@@ -121,6 +571,8 @@ void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     // Create PD if missing
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT)) {
         pd_phys = allocate_page();
+        if (!pd_phys)
+            return false;
         pd = phys_to_virt_ptr(pd_phys);
         memset(pd, 0, 0x1000);
         pdpt[pdpt_idx] = pd_phys | PAGE_PRESENT | PAGE_RW | PAGE_USER;
@@ -133,6 +585,8 @@ void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
     // Create PT if missing
     if (!(pd[pd_idx] & PAGE_PRESENT)) {
         pt_phys = allocate_page();
+        if (!pt_phys)
+            return false;
         pt = phys_to_virt_ptr(pt_phys);
         memset(pt, 0, 0x1000);
         pd[pd_idx] = pt_phys | PAGE_PRESENT | PAGE_RW | PAGE_USER;
@@ -142,10 +596,23 @@ void map_user_page(uint64_t virt, uint64_t phys, uint64_t flags) {
         pt = phys_to_virt_ptr(pt_phys);
     }
 
+    // Replacing a live mapping would otherwise leak its frame.
+    if ((pt[pt_idx] & PAGE_PRESENT) && (pt[pt_idx] & PAGE_ADDR_MASK) != phys)
+        free_page(pt[pt_idx] & PAGE_ADDR_MASK);
+
     pt[pt_idx] = phys | flags;
 
     // Flush TLB
     asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+    return true;
+}
+
+static bool page_table_empty(const uint64_t* table) {
+    for (int i = 0; i < 512; i++) {
+        if (table[i] & PAGE_PRESENT)
+            return false;
+    }
+    return true;
 }
 
 void unmap_user_page(uint64_t virt) {
@@ -157,19 +624,243 @@ void unmap_user_page(uint64_t virt) {
 
     if (!(pml4[pml4_idx] & PAGE_PRESENT))
         return;
-    uint64_t *pdpt = phys_to_virt_ptr(pml4[pml4_idx] & ~0xFFFULL);
+    uint64_t *pdpt = phys_to_virt_ptr(pml4[pml4_idx] & PAGE_ADDR_MASK);
 
     if (!(pdpt[pdpt_idx] & PAGE_PRESENT))
         return;
-    uint64_t *pd = phys_to_virt_ptr(pdpt[pdpt_idx] & ~0xFFFULL);
+    uint64_t *pd = phys_to_virt_ptr(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
 
     if (!(pd[pd_idx] & PAGE_PRESENT))
         return;
-    uint64_t *pt = phys_to_virt_ptr(pd[pd_idx] & ~0xFFFULL);
+    uint64_t *pt = phys_to_virt_ptr(pd[pd_idx] & PAGE_ADDR_MASK);
 
     if (!(pt[pt_idx] & PAGE_PRESENT))
         return;
 
+    free_page(pt[pt_idx] & PAGE_ADDR_MASK);
     pt[pt_idx] = 0;
     asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+
+    // Give back the user page-table pages that became empty.
+    if (!(pd[pd_idx] & PAGE_USER) || !page_table_empty(pt))
+        return;
+    free_page(pd[pd_idx] & PAGE_ADDR_MASK);
+    pd[pd_idx] = 0;
+
+    if (!(pdpt[pdpt_idx] & PAGE_USER) || !page_table_empty(pd))
+        return;
+    free_page(pdpt[pdpt_idx] & PAGE_ADDR_MASK);
+    pdpt[pdpt_idx] = 0;
+
+    if (pml4_idx >= 256 || !(pml4[pml4_idx] & PAGE_USER) || !page_table_empty(pdpt))
+        return;
+    free_page(pml4[pml4_idx] & PAGE_ADDR_MASK);
+    pml4[pml4_idx] = 0;
+}
+
+void paging_enable_pcid(void) {
+    // The BSP decides once; the APs run the same CPU model.
+    static bool checked = false;
+    if (!checked) {
+        pcid_enabled = cpu_has_pcid();
+        checked = true;
+    }
+    if (!pcid_enabled)
+        return;
+
+    // Setting CR4.PCIDE faults unless the current PCID is 0.
+    uint64_t cr3, cr4;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (cr3 & CR3_PCID_MASK) {
+        pcid_enabled = false;
+        return;
+    }
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+}
+
+static uint64_t paging_alloc_pcid(void) {
+    if (!pcid_enabled)
+        return 0;
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (uint64_t w = 0; w < PCID_COUNT / 64; w++) {
+        if (pcid_used[w] == UINT64_MAX)
+            continue;
+        uint64_t bit = (uint64_t)__builtin_ctzll(~pcid_used[w]);
+        pcid_used[w] |= 1ULL << bit;
+        spin_unlock_irqrestore(&pcid_lock, flags);
+        return w * 64 + bit;
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+
+    // All taken: share PCID 0, which is flushed on every switch.
+    return 0;
+}
+
+static void paging_free_pcid(uint64_t pcid) {
+    if (pcid == 0 || pcid >= PCID_COUNT)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_used[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+void paging_switch_address_space(uint64_t cr3, bool tlb_current) {
+    if (pcid_enabled && tlb_current && (cr3 & CR3_PCID_MASK))
+        cr3 |= CR3_NOFLUSH;
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+uint64_t paging_kernel_cr3(void) {
+    return kernel_cr3;
+}
+
+uint64_t paging_create_address_space(void) {
+    uint64_t pml4_phys = allocate_page();
+    if (!pml4_phys)
+        return 0;
+
+    uint64_t* pml4 = phys_to_virt_ptr(pml4_phys);
+    const uint64_t* kernel_pml4 = phys_to_virt_ptr(kernel_cr3 & PAGE_ADDR_MASK);
+
+    // Share every kernel top-level entry; user slots start out empty.
+    for (int i = 0; i < 512; i++)
+        pml4[i] = (kernel_pml4[i] & PAGE_USER) ? 0 : kernel_pml4[i];
+
+    return pml4_phys | paging_alloc_pcid();
+}
+
+#define PAGE_HUGE_PAT  (1ULL << 12) /* PAT in a PS entry; bit 7 in a PT entry */
+
+/*
+ * Replaces the huge page @p entry of a level @p level table (2 or 3) with a
+ * table one level down that maps the same frames with the same flags.
+ */
+static int paging_split_huge(uint64_t* entry, int level) {
+    uint64_t table_phys = allocate_page();
+    if (!table_phys)
+        return -1;
+
+    uint64_t span = level == 3 ? (1ULL << 30) : (1ULL << 21);
+    uint64_t base = *entry & PAGE_ADDR_MASK & ~(span - 1);
+    uint64_t flags = *entry & ~PAGE_ADDR_MASK;
+    if (level == 2) {
+        flags &= ~(uint64_t)PAGE_HUGE;
+        if (*entry & PAGE_HUGE_PAT)
+            flags |= 0x80;
+    } else {
+        flags |= *entry & PAGE_HUGE_PAT;
+    }
+
+    uint64_t* table = phys_to_virt_ptr(table_phys);
+    for (int i = 0; i < 512; i++)
+        table[i] = (base + (uint64_t)i * (span / 512)) | flags;
+
+    // The leaves carry the permissions.
+    *entry = table_phys | PAGE_PRESENT | PAGE_RW | PAGE_USER;
+    return 0;
+}
+
+/*
+ * Copies the user entries of one table level into @p dst. Pages are not
+ * copied but shared: writable ones turn read-only and copy-on-write in both
+ * tables, and every page gets one more holder. Huge pages are split in the
+ * source first, since copy-on-write works on 4 KiB pages only.
+ *
+ * Returns -1 if a table could not be allocated; what was copied so far is
+ * linked into @p dst, for paging_destroy_address_space() to undo.
+ */
+static int paging_clone_table(uint64_t* dst, uint64_t* src, int level) {
+    // Only the lower half of a PML4 is the program's.
+    int count = level == 4 ? 256 : 512;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t entry = src[i];
+        if (!(entry & PAGE_PRESENT) || !(entry & PAGE_USER))
+            continue;
+
+        if (level > 1 && level < 4 && (entry & PAGE_HUGE)) {
+            if (paging_split_huge(&src[i], level) != 0)
+                return -1;
+            entry = src[i];
+        }
+
+        if (level == 1) {
+            if ((entry & (PAGE_RW | PAGE_COW)) && !(entry & PAGE_SHARED)) {
+                entry = (entry & ~(uint64_t)PAGE_RW) | PAGE_COW;
+                src[i] = entry;
+            }
+            page_get(entry & PAGE_ADDR_MASK);
+            dst[i] = entry;
+            continue;
+        }
+
+        uint64_t table_phys = allocate_page();
+        if (!table_phys)
+            return -1;
+
+        memset(phys_to_virt_ptr(table_phys), 0, PAGE_SIZE);
+        dst[i] = table_phys | (entry & ~PAGE_ADDR_MASK);
+        if (paging_clone_table(phys_to_virt_ptr(table_phys), phys_to_virt_ptr(entry & PAGE_ADDR_MASK), level - 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+uint64_t paging_clone_address_space(uint64_t cr3) {
+    uint64_t clone = paging_create_address_space();
+    if (!clone)
+        return 0;
+
+    int rc = paging_clone_table(phys_to_virt_ptr(clone & PAGE_ADDR_MASK), phys_to_virt_ptr(cr3 & PAGE_ADDR_MASK), 4);
+
+    // The source may still have its writable entries cached.
+    uint64_t active = get_kernel_pml4();
+    if ((active & PAGE_ADDR_MASK) == (cr3 & PAGE_ADDR_MASK))
+        asm volatile("mov %0, %%cr3" :: "r"(active) : "memory");
+
+    // Pages already shared get their holder back; the source keeps them
+    // copy-on-write and just regains write access on the next fault.
+    if (rc != 0) {
+        paging_destroy_address_space(clone);
+        return 0;
+    }
+    return clone;
+}
+
+static void paging_free_table(uint64_t table_phys, int level) {
+    uint64_t* table = phys_to_virt_ptr(table_phys);
+
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = table[i];
+        if (!(entry & PAGE_PRESENT) || !(entry & PAGE_USER))
+            continue;
+
+        if (level == 1 || (entry & PAGE_HUGE))
+            free_page(entry & PAGE_ADDR_MASK);
+        else
+            paging_free_table(entry & PAGE_ADDR_MASK, level - 1);
+        table[i] = 0;
+    }
+
+    free_page(table_phys);
+}
+
+void paging_destroy_address_space(uint64_t cr3) {
+    uint64_t pml4_phys = cr3 & PAGE_ADDR_MASK;
+    if (pml4_phys == 0 || pml4_phys == (kernel_cr3 & PAGE_ADDR_MASK))
+        return;
+
+    uint64_t* pml4 = phys_to_virt_ptr(pml4_phys);
+    for (int i = 0; i < 256; i++) {
+        if ((pml4[i] & PAGE_PRESENT) && (pml4[i] & PAGE_USER))
+            paging_free_table(pml4[i] & PAGE_ADDR_MASK, 3);
+        pml4[i] = 0;
+    }
+
+    free_page(pml4_phys);
+    paging_free_pcid(cr3 & CR3_PCID_MASK);
 }
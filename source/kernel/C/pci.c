@@ -50,6 +50,103 @@ void pci_config_write_dword(uint8 bus, uint8 slot, uint8 func, uint8 offset, uin
     outl(PCI_CONFIG_DATA, value);
 }
 
+#define PCI_COMMAND_MASTER        (1U << 2)
+#define PCI_COMMAND_INTX_DISABLE  (1U << 10)
+#define PCI_STATUS_CAP_LIST       (1U << 4)
+#define PCI_CAP_POINTER           0x34
+
+#define PCI_MSI_ENABLE            (1U << 16)
+#define PCI_MSI_MULTIPLE_ENABLE   (7U << 20)
+#define PCI_MSI_64BIT             (1U << 23)
+#define PCI_MSI_ADDRESS_BASE      0xFEE00000U
+
+#define PCI_COMMAND_MEMORY        (1U << 1)
+#define PCI_MSIX_ENABLE           (1U << 31)
+#define PCI_MSIX_FUNCTION_MASK    (1U << 30)
+#define PCI_MSIX_BIR_MASK         0x7U
+#define PCI_MSIX_ENTRY_MASKED     (1U << 0)
+#define PCI_BAR_TYPE_64           (2U << 1)
+
+uint8 pci_find_capability(uint8 bus, uint8 slot, uint8 func, uint8 cap_id) {
+    uint32 status = pci_config_read_dword(bus, slot, func, 0x04) >> 16;
+    if (!(status & PCI_STATUS_CAP_LIST))
+        return 0;
+
+    uint8 ptr = (uint8)(pci_config_read_dword(bus, slot, func, PCI_CAP_POINTER) & 0xFC);
+
+    // A broken list could loop; config space only has room for 48 entries.
+    for (int guard = 0; ptr && guard < 48; guard++) {
+        uint32 header = pci_config_read_dword(bus, slot, func, ptr);
+        if ((header & 0xFF) == cap_id)
+            return ptr;
+        ptr = (uint8)((header >> 8) & 0xFC);
+    }
+
+    return 0;
+}
+
+bool pci_enable_msi(uint8 bus, uint8 slot, uint8 func, uint8 vector, uint32_t apic_id) {
+    uint8 cap = pci_find_capability(bus, slot, func, PCI_CAP_ID_MSI);
+    if (!cap)
+        return false;
+
+    uint32 control = pci_config_read_dword(bus, slot, func, cap);
+
+    // Physical destination, fixed delivery, edge triggered.
+    pci_config_write_dword(bus, slot, func, (uint8)(cap + 4), PCI_MSI_ADDRESS_BASE | ((apic_id & 0xFF) << 12));
+    if (control & PCI_MSI_64BIT) {
+        pci_config_write_dword(bus, slot, func, (uint8)(cap + 8), 0);
+        pci_config_write_dword(bus, slot, func, (uint8)(cap + 12), vector);
+    } else {
+        pci_config_write_dword(bus, slot, func, (uint8)(cap + 8), vector);
+    }
+
+    // One message only.
+    control = (control & ~PCI_MSI_MULTIPLE_ENABLE) | PCI_MSI_ENABLE;
+    pci_config_write_dword(bus, slot, func, cap, control);
+
+    // The upper half is the status register, whose bits clear on a write of 1.
+    uint32 command = pci_config_read_dword(bus, slot, func, 0x04) & 0xFFFF;
+    pci_config_write_dword(bus, slot, func, 0x04, command | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+    return true;
+}
+
+bool pci_enable_msix(uint8 bus, uint8 slot, uint8 func, uint16 entry, uint8 vector, uint32_t apic_id) {
+    uint8 cap = pci_find_capability(bus, slot, func, PCI_CAP_ID_MSIX);
+    if (!cap)
+        return false;
+
+    uint32 control = pci_config_read_dword(bus, slot, func, cap);
+    if (entry > ((control >> 16) & 0x7FF))
+        return false;
+
+    // The table lives in one of the function's memory BARs.
+    uint32 table = pci_config_read_dword(bus, slot, func, (uint8)(cap + 4));
+    uint8 bar_offset = (uint8)(0x10 + (table & PCI_MSIX_BIR_MASK) * 4);
+    uint32 bar_low = pci_config_read_dword(bus, slot, func, bar_offset);
+    uint64_t bar = bar_low & ~0xFULL;
+    if (bar_low & PCI_BAR_TYPE_64)
+        bar |= (uint64_t)pci_config_read_dword(bus, slot, func, (uint8)(bar_offset + 4)) << 32;
+    if (bar == 0)
+        return false;
+
+    uint32 command = pci_config_read_dword(bus, slot, func, 0x04) & 0xFFFF;
+    pci_config_write_dword(bus, slot, func, 0x04, command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_INTX_DISABLE);
+
+    volatile uint32* msix = (volatile uint32*)(uintptr_t)(bar + (table & ~PCI_MSIX_BIR_MASK) + entry * 16U);
+
+    // Physical destination, fixed delivery, edge triggered; masked while rewritten.
+    msix[3] |= PCI_MSIX_ENTRY_MASKED;
+    msix[0] = PCI_MSI_ADDRESS_BASE | ((apic_id & 0xFF) << 12);
+    msix[1] = 0;
+    msix[2] = vector;
+    msix[3] &= ~PCI_MSIX_ENTRY_MASKED;
+
+    control = (control | PCI_MSIX_ENABLE) & ~PCI_MSIX_FUNCTION_MASK;
+    pci_config_write_dword(bus, slot, func, cap, control);
+    return true;
+}
+
 /**
  * @brief Gets the AHCI bar address
  * 
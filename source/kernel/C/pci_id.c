@@ -258,6 +258,7 @@ void probe_ahci(uint8_t bus, uint8_t slot, uint8_t function)
     if (abar && abar != (void*)0xFFFFFFFF) {
         done("Found AHCI BAR!", __FILE__);
         detect_ahci_devices(abar);
+        ahci_enable_interrupts(bus, slot, function);
     } else {
         warn("Failed to find AHCI BAR!", __FILE__);
     }
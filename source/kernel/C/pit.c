@@ -16,9 +16,11 @@ volatile uint64_t pit_ticks = 0;
 #define pit_freq 100 // Hz
 
 void process_pit(InterruptFrame* frame) {
-    (void)frame;
     pit_ticks++;
     outb(0x20, 0x20);  // Notify the PIC that we've handled the interrupt
+
+    // Acknowledged first: this may switch to another task before returning.
+    multitasking_on_timer_tick(frame && (frame->cs & 0x3) == 0x3);
 }
 
 void init_pit(void) {
@@ -30,9 +32,5 @@ void init_pit(void) {
 }
 
 void pit_sleep(uint32_t milliseconds) {
-    uint64_t target_ticks = pit_ticks + (uint64_t)(milliseconds / (1000U / pit_freq));
-
-    while (pit_ticks < target_ticks) {
-        asm volatile("hlt");
-    }
+    multitasking_sleep_ms(milliseconds);
 }
\ No newline at end of file
@@ -15,6 +15,8 @@
 #include <graphics.h>
 #include <tty.h>
 #include <keyboard.h>
+#include <multitasking.h>
+#include <strings.h>
 
 extern char* global_envp[];
 
@@ -28,28 +30,40 @@ int cmd_exec(int argc, char** argv)
 
     const char* path = argv[1];
 
-    const char* user_argv[34];
-    int user_argc = 0;
+    // A trailing "&" leaves the program running in the background.
+    bool background = false;
+    if (argc > 2 && strcmp(argv[argc - 1], "&") == 0) {
+        background = true;
+        argc--;
+    }
 
-    // argv[0] should be the program name (basename)
-    const char* basename = vfs_basename(path);
-    // user_argv[user_argc++] = basename;
+    user_task_spec_t spec = {0};
+    spec.path = path;
 
     // copy actual arguments AFTER the program path
-    for (int i = 2; i < argc && user_argc < 33; ++i)
-        user_argv[user_argc++] = argv[i];
+    for (int i = 2; i < argc && spec.argc < 31; ++i)
+        spec.argv[spec.argc++] = argv[i];
 
-    user_argv[user_argc] = NULL;
+    spec.argv[spec.argc] = NULL;
 
     tty_flush_input();
     keyboard_flush_buffer();
 
-    if (userland_exec(path, user_argc, user_argv, NULL) != 0) {
-        keyboard_flush_buffer();
-        eprintf("exec: failed to load ELF");
+    uint32_t pid = multitasking_spawn_userland(vfs_basename(path), &spec);
+    if (pid == 0) {
+        eprintf("exec: could not create a task for %s", path);
         return -1;
     }
 
+    if (background) {
+        printf("[%u] %s", pid, path);
+        return 0;
+    }
+
+    bool load_failed = false;
+    multitasking_wait_task(pid, NULL, &load_failed);
+
+    tty_flush_input();
     keyboard_flush_buffer();
-    return 0;
+    return load_failed ? -1 : 0;
 }
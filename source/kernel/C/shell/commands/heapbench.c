@@ -0,0 +1,139 @@
+/**
+ * @file heapbench.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Allocator stress test running on every online CPU at once.
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) Pradosh 2026
+ * 
+ */
+
+#include <commands/commands.h>
+#include <heap.h>
+#include <memory.h>
+#include <paging.h>
+#include <smp.h>
+#include <cc-asm.h>
+#include <strings.h>
+#include <timer.h>
+
+#define HEAPBENCH_SLOTS 64
+#define HEAPBENCH_DEFAULT_ITERATIONS 200000
+
+typedef struct {
+    uint32_t cpu;
+    uint64_t iterations;
+    volatile bool* go;
+    uint64_t ops;
+    uint64_t cycles;
+} heapbench_job_t;
+
+static const uint32_t heapbench_sizes[] = { 16, 24, 48, 64, 96, 200, 512, 1500, 2048 };
+
+static void heapbench_worker(void* arg) {
+    heapbench_job_t* job = (heapbench_job_t*)arg;
+    void* slots[HEAPBENCH_SLOTS] = {0};
+    uint32_t seed = 0x9E3779B9u * (job->cpu + 1);
+    uint64_t ops = 0;
+
+    while (!__atomic_load_n(job->go, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+
+    uint64_t start = rdtsc64();
+
+    for (uint64_t i = 0; i < job->iterations; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        uint32_t idx = seed % HEAPBENCH_SLOTS;
+        if (slots[idx]) {
+            kfree(slots[idx]);
+            slots[idx] = NULL;
+        } else {
+            uint32_t size = heapbench_sizes[(seed >> 8) % (sizeof(heapbench_sizes) / sizeof(heapbench_sizes[0]))];
+            slots[idx] = kmalloc(size);
+        }
+        ops++;
+
+        if ((i & 7) == 0) {
+            free_page(allocate_page());
+            ops += 2;
+        }
+    }
+
+    for (int i = 0; i < HEAPBENCH_SLOTS; i++) {
+        if (slots[i]) {
+            kfree(slots[i]);
+            ops++;
+        }
+    }
+
+    job->cycles = rdtsc64() - start;
+    job->ops = ops;
+}
+
+int cmd_heapbench(int argc, char** argv) {
+    uint64_t iterations = HEAPBENCH_DEFAULT_ITERATIONS;
+    if (argc > 1) {
+        long v = strtol(argv[1], NULL, 10);
+        if (v <= 0) {
+            eprintf("usage: heapbench [iterations]");
+            return 1;
+        }
+        iterations = (uint64_t)v;
+    }
+
+    static heapbench_job_t jobs[SMP_MAX_CPUS];
+    volatile bool go = false;
+    uint32_t cpus = smp_cpu_count();
+    uint32_t started = 0;
+
+    memset(jobs, 0, sizeof(jobs));
+
+    for (uint32_t cpu = 1; cpu < cpus; cpu++) {
+        jobs[cpu] = (heapbench_job_t){ cpu, iterations, &go, 0, 0 };
+        if (smp_run_on(cpu, heapbench_worker, &jobs[cpu]))
+            started++;
+    }
+
+    printf("heapbench: %u iterations on %u CPU(s)", (uint32_t)iterations, started + 1);
+
+    uint64_t ns0 = timer_now_ns();
+    uint64_t tsc0 = rdtsc64();
+
+    jobs[0] = (heapbench_job_t){ 0, iterations, &go, 0, 0 };
+    __atomic_store_n(&go, true, __ATOMIC_RELEASE);
+    heapbench_worker(&jobs[0]);
+
+    for (uint32_t cpu = 1; cpu < cpus; cpu++)
+        smp_wait(cpu);
+
+    uint64_t ns = timer_now_ns() - ns0;
+    uint64_t tsc = rdtsc64() - tsc0;
+
+    uint64_t tsc_hz = timer_tsc_hz();
+    if (tsc_hz == 0) {
+        if (ns < TIMER_NS_PER_MS) {
+            eprintf("heapbench: run too short to calibrate, raise the iteration count");
+            return 1;
+        }
+        // No calibrated TSC; the run itself gives the frequency.
+        tsc_hz = tsc * TIMER_NS_PER_MS / (ns / 1000);
+    }
+    uint64_t total = 0;
+
+    printf("CPU        OPS     OPS/SEC");
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        if (jobs[cpu].cycles == 0)
+            continue;
+
+        uint64_t rate = (jobs[cpu].ops * tsc_hz) / jobs[cpu].cycles;
+        total += rate;
+        printf("%3u  %9u  %10u", cpu, (uint32_t)jobs[cpu].ops, (uint32_t)rate);
+    }
+    printf("total ops/sec: %u (elapsed %u ms)", (uint32_t)total, (uint32_t)(ns / TIMER_NS_PER_MS));
+
+    return 0;
+}
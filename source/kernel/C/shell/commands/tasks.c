@@ -6,6 +6,7 @@ static const char* state_name(task_state_t state) {
         case TASK_STATE_READY:   return "ready";
         case TASK_STATE_RUNNING: return "running";
         case TASK_STATE_EXITED:  return "exited";
+        case TASK_STATE_BLOCKED: return "blocked";
         default: return "?";
     }
 }
@@ -24,12 +25,13 @@ typedef struct {
 
 static bool print_task_row(const task_info_t* info, void* ctx_ptr) {
     list_ctx_t* ctx = (list_ctx_t*)ctx_ptr;
-    printf("%2u  %8s %10s    exit=%02d runtime_ticks=%02u  %s",
+    printf("%2u  %8s %10s    cpu=%u exit=%02d runtime=%ums  %s",
            info->pid,
            type_name(info->type),
            state_name(info->state),
+           info->cpu,
            info->exit_code,
-           (uint32_t)info->runtime_ticks,
+           (uint32_t)info->runtime_ms,
            info->name ? info->name : "(unnamed)");
     ctx->rows++;
     return true;
@@ -420,7 +420,9 @@ static command_t commands[] = {
     { "mv", cmd_mv },
     { "umount", cmd_umount },
     { "exec", cmd_exec },
-    { "tasks", cmd_tasks }
+    { "tasks", cmd_tasks },
+    { "heapbench", cmd_heapbench },
+    { "membench", cmd_membench }
     // { "fwfetch", cmd_fwfetch },
     // { "help", cmd_help },
 };
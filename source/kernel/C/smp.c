@@ -0,0 +1,242 @@
+/**
+ * @file smp.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Application processor bookkeeping and per-CPU indexing.
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) Pradosh 2026
+ * 
+ */
+#include <smp.h>
+#include <cpuid2.h>
+#include <cc-asm.h>
+#include <gdt.h>
+#include <tss.h>
+#include <idt.h>
+#include <lapic.h>
+#include <multitasking.h>
+#include <timer.h>
+#include <paging.h>
+
+#define IA32_TSC_AUX_MSR 0xC0000103
+
+#define CR0_MP          (1ULL << 1)
+#define CR0_EM          (1ULL << 2)
+#define CR0_TS          (1ULL << 3)
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+typedef struct {
+    uint32_t lapic_id;
+    volatile bool online;
+    volatile bool busy;
+    smp_work_fn_t volatile work;
+    void* volatile work_arg;
+    volatile bool scheduling;
+} smp_cpu_t;
+
+static smp_cpu_t smp_cpus[SMP_MAX_CPUS];
+static uint32_t smp_count = 1;
+static bool smp_ready = false;
+static bool smp_has_rdtscp = false;
+
+// Set once the BSP scheduler runs; the APs then leave smp_ap_loop().
+static volatile bool smp_sched_release = false;
+static uint64_t smp_bsp_cr4 = 0;
+static uint64_t smp_bsp_xcr0 = 0;
+
+static uint32_t smp_index_for_lapic(uint32_t lapic_id) {
+    for (uint32_t i = 0; i < smp_count; i++) {
+        if (smp_cpus[i].lapic_id == lapic_id)
+            return i;
+    }
+    return 0;
+}
+
+/* Every CPU keeps its own index in TSC_AUX, which RDTSCP reads without a VM exit. */
+static void smp_publish_index(uint32_t index) {
+    if (smp_has_rdtscp)
+        wrmsr64(IA32_TSC_AUX_MSR, index);
+}
+
+void smp_init(struct limine_smp_response* response) {
+    uint32 eax, ebx, ecx, edx;
+    cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    smp_has_rdtscp = (edx >> 27) & 1;
+
+    smp_count = 1;
+    smp_cpus[0].lapic_id = response ? response->bsp_lapic_id : 0;
+    smp_cpus[0].online = true;
+
+    for (uint64_t i = 0; response && i < response->cpu_count; i++) {
+        uint32_t lapic_id = response->cpus[i]->lapic_id;
+        if (lapic_id == response->bsp_lapic_id)
+            continue;
+
+        if (smp_count >= SMP_MAX_CPUS) {
+            warn("smp: More CPUs than SMP_MAX_CPUS, ignoring the rest", __FILE__);
+            break;
+        }
+
+        smp_cpus[smp_count].lapic_id = lapic_id;
+        smp_cpus[smp_count].online = false;
+        smp_count++;
+    }
+
+    smp_publish_index(0);
+    smp_ready = true;
+}
+
+void smp_ap_online(struct limine_smp_info* info) {
+    uint32_t index = smp_index_for_lapic(info->lapic_id);
+
+    smp_publish_index(index);
+    __atomic_store_n(&smp_cpus[index].online, true, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The APs were started before enable_fpu() and load_complete_sse() ran on
+ * the BSP, and Limine hands them its own GDT and no IDT. Copy the BSP's
+ * setup over before the first task switch does an fxsave.
+ */
+static void smp_ap_enable_fpu(void) {
+    uint64_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP;
+    asm volatile("mov %0, %%cr0" :: "r"(cr0));
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= smp_bsp_cr4 & (CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_OSXSAVE);
+    asm volatile("mov %0, %%cr4" :: "r"(cr4));
+
+    if (cr4 & CR4_OSXSAVE)
+        asm volatile("xsetbv" :: "c"(0), "a"((uint32_t)smp_bsp_xcr0), "d"((uint32_t)(smp_bsp_xcr0 >> 32)));
+
+    uint16_t cw = 0x37F;
+    uint32_t mxcsr = 0x1F80;
+    asm volatile("fninit; fldcw %0; ldmxcsr %1" :: "m"(cw), "m"(mxcsr));
+}
+
+__attribute__((noreturn)) static void smp_ap_enter_scheduler(uint32_t index) {
+    gdt_load();
+    tss_load_cpu(index);
+    idt_load();
+    init_syscall();
+    smp_ap_enable_fpu();
+    paging_enable_pcid();
+
+    lapic_init();
+
+    __atomic_store_n(&smp_cpus[index].scheduling, true, __ATOMIC_RELEASE);
+    multitasking_ap_enter(index);
+}
+
+bool smp_run_posted_work(void) {
+    smp_cpu_t* self = &smp_cpus[smp_current_cpu()];
+
+    smp_work_fn_t fn = __atomic_load_n(&self->work, __ATOMIC_ACQUIRE);
+    if (!fn)
+        return false;
+
+    fn(self->work_arg);
+
+    __atomic_store_n(&self->work, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->busy, false, __ATOMIC_RELEASE);
+    return true;
+}
+
+void smp_ap_loop(void) {
+    uint32_t index = smp_current_cpu();
+
+    while (1) {
+        if (__atomic_load_n(&smp_sched_release, __ATOMIC_ACQUIRE))
+            smp_ap_enter_scheduler(index);
+
+        if (!smp_run_posted_work())
+            asm volatile("pause");
+    }
+}
+
+bool smp_start_scheduler(void) {
+    // The APs need their own timer events; the PIT only interrupts the BSP.
+    if (smp_count == 1 || timer_event_kind() == TIMER_EVENT_PIT)
+        return false;
+
+    asm volatile("mov %%cr4, %0" : "=r"(smp_bsp_cr4));
+    if (smp_bsp_cr4 & CR4_OSXSAVE) {
+        uint32_t lo, hi;
+        asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        smp_bsp_xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+
+    __atomic_store_n(&smp_sched_release, true, __ATOMIC_RELEASE);
+
+    // Give every AP a second to come up; one that does not just stays out.
+    uint32_t joined = 1;
+    uint64_t deadline = timer_now_ns() + TIMER_NS_PER_SEC;
+    for (uint32_t i = 1; i < smp_count; i++) {
+        if (!smp_cpu_online(i))
+            continue;
+        while (!__atomic_load_n(&smp_cpus[i].scheduling, __ATOMIC_ACQUIRE) && timer_now_ns() < deadline)
+            asm volatile("pause");
+        if (smp_cpus[i].scheduling)
+            joined++;
+    }
+
+    printf("smp: scheduler running on %u of %u CPU(s)", joined, smp_count);
+    return joined > 1;
+}
+
+uint32_t smp_cpu_lapic_id(uint32_t cpu) {
+    return cpu < smp_count ? smp_cpus[cpu].lapic_id : 0;
+}
+
+uint32_t smp_cpu_count(void) {
+    return smp_count;
+}
+
+uint32_t smp_current_cpu(void) {
+    if (!smp_ready || smp_count == 1)
+        return 0;
+
+    if (smp_has_rdtscp) {
+        uint32_t lo, hi, aux;
+        asm volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+        return aux < SMP_MAX_CPUS ? aux : 0;
+    }
+
+    uint32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return smp_index_for_lapic(ebx >> 24);
+}
+
+bool smp_cpu_online(uint32_t cpu) {
+    return cpu < smp_count && __atomic_load_n(&smp_cpus[cpu].online, __ATOMIC_ACQUIRE);
+}
+
+bool smp_run_on(uint32_t cpu, smp_work_fn_t fn, void* arg) {
+    if (cpu == 0 || !fn || !smp_cpu_online(cpu))
+        return false;
+
+    smp_cpu_t* target = &smp_cpus[cpu];
+    smp_wait(cpu);
+
+    target->work_arg = arg;
+    __atomic_store_n(&target->busy, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&target->work, fn, __ATOMIC_RELEASE);
+
+    // A scheduling AP may be halted in its idle task with no timer armed.
+    if (__atomic_load_n(&target->scheduling, __ATOMIC_ACQUIRE))
+        multitasking_kick_cpu(cpu);
+    return true;
+}
+
+void smp_wait(uint32_t cpu) {
+    if (cpu >= smp_count)
+        return;
+
+    while (__atomic_load_n(&smp_cpus[cpu].busy, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+}
@@ -15,6 +15,9 @@
 #include <memory.h>
 #include <flanterm/flanterm.h>
 #include <filesystems/vfs.h>
+#include <heap.h>
+#include <userland.h>
+#include <multitasking.h>
 
 extern struct flanterm_context* ft_ctx;
 
@@ -38,11 +41,24 @@ typedef struct {
     fd_object_t* object;
 } fd_entry_t;
 
+/* Descriptors of one process; a forked child gets a copy that shares the open files. */
+struct fd_table {
+    fd_entry_t entries[STREAM_MAX_FDS];
+};
+
 static stream_impl_t streams[3];
-static fd_entry_t fd_table[STREAM_MAX_FDS];
+static fd_table_t kernel_fds;      // the shell's, and any program that has none of its own
 static fd_object_t fd_objects[STREAM_MAX_FDS];
 static bool fd_initialized = false;
 
+static fd_entry_t* fd_entries(void)
+{
+    userland_state_t* state = multitasking_current_userland();
+    if (state && state->fds)
+        return state->fds->entries;
+    return kernel_fds.entries;
+}
+
 static fd_object_t* fd_object_alloc(vfs_file_t* file, bool owns_file, int flags)
 {
     for (int i = 0; i < STREAM_MAX_FDS; ++i) {
@@ -87,8 +103,9 @@ static void fd_object_release(fd_object_t* object)
 
 static int fd_alloc_slot(void)
 {
+    fd_entry_t* table = fd_entries();
     for (int fd = 3; fd < STREAM_MAX_FDS; ++fd) {
-        if (!fd_table[fd].used)
+        if (!table[fd].used)
             return fd;
     }
 
@@ -97,14 +114,15 @@ static int fd_alloc_slot(void)
 
 static void fd_assign_slot(int fd, fd_object_t* object)
 {
+    fd_entry_t* table = fd_entries();
     if (fd < 0 || fd >= STREAM_MAX_FDS)
         return;
 
-    if (fd_table[fd].used)
-        fd_object_release(fd_table[fd].object);
+    if (table[fd].used)
+        fd_object_release(table[fd].object);
 
-    fd_table[fd].used = true;
-    fd_table[fd].object = object;
+    table[fd].used = true;
+    table[fd].object = object;
     fd_object_retain(object);
 }
 
@@ -161,7 +179,7 @@ void fd_table_init(void)
         return;
 
     memset(streams, 0, sizeof(streams));
-    memset(fd_table, 0, sizeof(fd_table));
+    memset(&kernel_fds, 0, sizeof(kernel_fds));
     memset(fd_objects, 0, sizeof(fd_objects));
 
     for (int i = STDIN; i <= STDERR; ++i) {
@@ -173,31 +191,60 @@ void fd_table_init(void)
         if (!object)
             return;
 
-        fd_table[i].used = true;
-        fd_table[i].object = object;
+        kernel_fds.entries[i].used = true;
+        kernel_fds.entries[i].object = object;
     }
 
     fd_initialized = true;
 }
 
+fd_table_t* fd_table_fork(void)
+{
+    fd_table_t* table = kmalloc(sizeof(fd_table_t));
+    if (!table)
+        return NULL;
+
+    memcpy(table->entries, fd_entries(), sizeof(table->entries));
+    for (int fd = 0; fd < STREAM_MAX_FDS; ++fd) {
+        if (table->entries[fd].used)
+            fd_object_retain(table->entries[fd].object);
+    }
+    return table;
+}
+
+void fd_table_release(fd_table_t* table)
+{
+    if (!table)
+        return;
+
+    for (int fd = 0; fd < STREAM_MAX_FDS; ++fd) {
+        if (table->entries[fd].used)
+            fd_object_release(table->entries[fd].object);
+    }
+    kfree(table);
+}
+
 bool fd_valid(int fd)
 {
-    return fd >= 0 && fd < STREAM_MAX_FDS && fd_table[fd].used;
+    fd_entry_t* table = fd_entries();
+    return fd >= 0 && fd < STREAM_MAX_FDS && table[fd].used;
 }
 
 vfs_file_t* fd_get_file(int fd)
 {
+    fd_entry_t* table = fd_entries();
     if (!fd_valid(fd))
         return NULL;
 
-    if (!fd_table[fd].object)
+    if (!table[fd].object)
         return NULL;
 
-    return fd_table[fd].object->file;
+    return table[fd].object->file;
 }
 
 int fd_open(const char* path, int flags)
 {
+    fd_entry_t* table = fd_entries();
     int fd = fd_alloc_slot();
     if (fd < 0)
         return -1;
@@ -216,40 +263,43 @@ int fd_open(const char* path, int flags)
         return -2;
     }
 
-    fd_table[fd].used = true;
-    fd_table[fd].object = object;
+    table[fd].used = true;
+    table[fd].object = object;
     return fd;
 }
 
 int fd_close(int fd)
 {
+    fd_entry_t* table = fd_entries();
     if (!fd_valid(fd))
         return -1;
 
-    fd_object_release(fd_table[fd].object);
-    fd_table[fd].used = false;
-    fd_table[fd].object = NULL;
+    fd_object_release(table[fd].object);
+    table[fd].used = false;
+    table[fd].object = NULL;
 
     return 0;
 }
 
 int fd_dup2(int oldfd, int newfd)
 {
+    fd_entry_t* table = fd_entries();
     if (!fd_valid(oldfd) || newfd < 0 || newfd >= STREAM_MAX_FDS)
         return -1;
 
     if (oldfd == newfd)
         return newfd;
 
-    if (fd_table[newfd].used)
+    if (table[newfd].used)
         fd_close(newfd);
 
-    fd_assign_slot(newfd, fd_table[oldfd].object);
+    fd_assign_slot(newfd, table[oldfd].object);
     return newfd;
 }
 
 int fd_dup(int oldfd)
 {
+    fd_entry_t* table = fd_entries();
     if (!fd_valid(oldfd))
         return -1;
 
@@ -257,27 +307,29 @@ int fd_dup(int oldfd)
     if (newfd < 0)
         return -1;
 
-    fd_assign_slot(newfd, fd_table[oldfd].object);
+    fd_assign_slot(newfd, table[oldfd].object);
     return newfd;
 }
 
 int fd_flags(int fd)
 {
-    if (!fd_valid(fd) || !fd_table[fd].object)
+    fd_entry_t* table = fd_entries();
+    if (!fd_valid(fd) || !table[fd].object)
         return 0;
 
-    return fd_table[fd].object->flags;
+    return table[fd].object->flags;
 }
 
 const char* fd_get_path(int fd)
 {
-    if (!fd_valid(fd) || !fd_table[fd].object)
+    fd_entry_t* table = fd_entries();
+    if (!fd_valid(fd) || !table[fd].object)
         return NULL;
 
-    if (fd_table[fd].object->path[0] == '\0')
+    if (table[fd].object->path[0] == '\0')
         return NULL;
 
-    return fd_table[fd].object->path;
+    return table[fd].object->path;
 }
 
 uint32_t fd_file_size(int fd)
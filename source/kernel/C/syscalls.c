@@ -17,6 +17,7 @@
 #include <memory.h>
 #include <stream.h>
 #include <userland.h>
+#include <paging.h>
 
 // Entire filesystems present in the OS.
 #include <filesystems/vfs.h>
@@ -26,6 +27,7 @@
 #include <filesystems/fat32.h>
 #include <filesystems/iso9660.h>
 #include <filesystems/ext2.h>
+#include <filesystems/mount_trie.h>
 
 #include <executables/elf.h>
 #include <ahci.h>
@@ -33,6 +35,7 @@
 #include <heap.h>
 #include <tty.h>
 #include <multitasking.h>
+#include <timer.h>
 #include <cc-asm.h>
 
 // sys headers
@@ -59,14 +62,6 @@ typedef struct {
 } vfs_stat_info_t;
 
 static char current_exec_path[256] = "/";
-static uint64_t current_fs_base = 0;
-static uint32_t current_umask = 022;
-static uint64_t* clear_child_tid = NULL;
-static char current_exec_argv_storage[32][128];
-static const char* current_exec_argv[32];
-static int current_exec_argc = 0;
-static uint32_t fork_children[64];
-static int fork_child_count = 0;
 
 #pragma pack(push, 1)
 typedef struct {
@@ -236,30 +231,12 @@ static bool fill_vfs_stat_for_path_at(int dirfd, const char* path, vfs_stat_info
         return true;
     }
 
-    if (res.mnt->type == FS_FAT16) {
-        fat16_fs_t* fs = (fat16_fs_t*)res.mnt->fs;
-        fat16_dir_entry_t entry = {0};
-        if (fat16_find_path(fs, res.rel_path, &entry) != 0)
-            return false;
-        info->is_dir = (entry.attr & 0x10) != 0;
-        info->size = entry.filesize;
-    } else if (res.mnt->type == FS_FAT32) {
-        fat32_fs_t* fs = (fat32_fs_t*)res.mnt->fs;
-        fat32_dir_entry_t entry = {0};
-        if (fat32_find_path(fs, res.rel_path, &entry) != FAT_OK)
-            return false;
-        info->is_dir = (entry.attr & FAT_ATTR_DIRECTORY) != 0;
-        info->size = entry.file_size;
-    } else if (res.mnt->type == FS_ISO9660) {
-        iso9660_fs_t* fs = (iso9660_fs_t*)res.mnt->fs;
-        iso9660_dirent_t entry = {0};
-        if (iso9660_find_path(fs, res.rel_path, &entry) != 0)
-            return false;
-        info->is_dir = (entry.flags & ISO9660_FLAG_DIR) != 0;
-        info->size = entry.size;
-    } else {
+    // FAT, ISO 9660 and ext2 go through the VFS dentry cache.
+    vfs_lookup_t found;
+    if (vfs_lookup(&res, &found) != 0)
         return false;
-    }
+    info->is_dir = found.is_dir;
+    info->size = found.size;
 
     info->mode = (info->is_dir ? LINUX_S_IFDIR | 0755 : LINUX_S_IFREG | 0644);
     return true;
@@ -319,41 +296,29 @@ static uint64 copy_readlink_result(const char* target, char* buf, uint64_t bufsi
     return (uint64)len;
 }
 
-static void record_exec_context(const char* target, char* const* argv) {
+static void record_exec_context(const char* target) {
     if (target)
         snprintf(current_exec_path, sizeof(current_exec_path), "%s", target);
-
-    current_exec_argc = 0;
-    memset(current_exec_argv_storage, 0, sizeof(current_exec_argv_storage));
-    memset(current_exec_argv, 0, sizeof(current_exec_argv));
-
-    if (!argv)
-        return;
-
-    for (int i = 0; i < 31 && argv[i]; ++i) {
-        snprintf(current_exec_argv_storage[i], sizeof(current_exec_argv_storage[i]), "%s", argv[i]);
-        current_exec_argv[i] = current_exec_argv_storage[i];
-        current_exec_argc++;
-    }
-    current_exec_argv[current_exec_argc] = NULL;
 }
 
 static bool track_fork_child(uint32_t pid) {
-    for (int i = 0; i < fork_child_count; ++i) {
-        if (fork_children[i] == pid)
+    userland_state_t* self = userland_state();
+    for (uint32_t i = 0; i < self->child_count; ++i) {
+        if (self->children[i] == pid)
             return true;
     }
-    if (fork_child_count >= (int)(sizeof(fork_children) / sizeof(fork_children[0])))
+    if (self->child_count >= USER_CHILDREN_MAX)
         return false;
-    fork_children[fork_child_count++] = pid;
+    self->children[self->child_count++] = pid;
     return true;
 }
 
-static void untrack_child_at(int idx) {
-    if (idx < 0 || idx >= fork_child_count)
+static void untrack_child_at(uint32_t idx) {
+    userland_state_t* self = userland_state();
+    if (idx >= self->child_count)
         return;
-    fork_child_count--;
-    fork_children[idx] = fork_children[fork_child_count];
+    self->child_count--;
+    self->children[idx] = self->children[self->child_count];
 }
 
 static int emit_dirent(char* buf, uint64_t buflen, uint64_t* used, uint64_t ino, uint8_t type, const char* name, uint64_t next_off) {
@@ -421,12 +386,14 @@ static int sys_getdents64(uint64_t fd, char* buf, uint64_t buflen) {
 
     if (file->flags & VFS_FILE_ROOT_DIR) {
         uint64_t idx = 0;
+        mount_entry_t* children[MAX_PARTITIONS];
+        int nchildren = mount_trie_children("/", children, MAX_PARTITIONS);
 
-        for (int i = 1; i < mounted_partition_count; i++) {
+        for (int i = 0; i < nchildren && i < MAX_PARTITIONS; i++) {
             if (idx++ < entry_index)
                 continue;
 
-            mount_entry_t* m = &mounted_partitions[i];
+            mount_entry_t* m = children[i];
             const char* name = vfs_basename(m->mount_point);
 
             if (!emit_dirent(
@@ -579,10 +546,7 @@ static int sys_getdents64(uint64_t fd, char* buf, uint64_t buflen) {
                     *pos = (uint32_t)idx;
                 }
             }
-            uint32_t fat_sector = fs->fat_start_lba + (cluster * 4 / FAT32_SECTOR_SIZE);
-            uint32_t ent_offset = (cluster * 4) % FAT32_SECTOR_SIZE;
-            ahci_read_sector(fs->portno, fat_sector, sector, 1);
-            cluster = (*(uint32_t*)(sector + ent_offset)) & 0x0FFFFFFF;
+            cluster = fat32_read_fat(fs, cluster);
         }
         return (int)used;
     }
@@ -737,6 +701,8 @@ static uint64 sys_read(uint64_t fd, char* buf, uint64_t count) {
     if (fd == 0)
         return tty_read(buf, count);
 
+    // Drivers copy into the buffer with their locks held, page it in first.
+    userland_prefault((uint64_t)buf, count, true);
     int rd = vfs_read(file, (uint8_t*)buf, (uint32_t)count);
     if (rd < 0)
         return -LINUX_EBADF;
@@ -762,6 +728,7 @@ static uint64 sys_write(uint64_t fd, const char* buf, uint64_t count) {
         return (uint64)count;
     }
 
+    userland_prefault((uint64_t)buf, count, false);
     int wr = vfs_write(file, (const uint8_t*)buf, (uint32_t)count);
     if (wr < 0)
         return -LINUX_EBADF;
@@ -970,21 +937,25 @@ static uint64 sys_clock_gettime(uint64_t clockid, linux_timespec_t* tp) {
     if (clockid != LINUX_CLOCK_REALTIME && clockid != LINUX_CLOCK_MONOTONIC)
         return -LINUX_EINVAL;
 
-    uint8 sec = 0, min = 0, hour = 0, day = 0, month = 0;
-    uint16 year = 0;
-    update_system_time(&sec, &min, &hour, &day, &month, &year);
-
-    tp->tv_sec = (hour * 3600) + (min * 60) + sec;
-    tp->tv_nsec = 0;
+    uint64_t ns = clockid == LINUX_CLOCK_MONOTONIC ? timer_now_ns() : timer_realtime_ns();
+    tp->tv_sec = (long)(ns / TIMER_NS_PER_SEC);
+    tp->tv_nsec = (long)(ns % TIMER_NS_PER_SEC);
     return 0;
 }
 
 static uint64 sys_nanosleep(const linux_timespec_t* req, linux_timespec_t* rem) {
-    (void)rem;
     if (!req)
         return -LINUX_EINVAL;
-    if (req->tv_sec > 0)
-        sleep((int)req->tv_sec);
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || (uint64_t)req->tv_nsec >= TIMER_NS_PER_SEC)
+        return -LINUX_EINVAL;
+
+    multitasking_sleep_ns((uint64_t)req->tv_sec * TIMER_NS_PER_SEC + (uint64_t)req->tv_nsec);
+
+    // Nothing interrupts a sleep, so there is never time left over.
+    if (rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
     return 0;
 }
 
@@ -1057,9 +1028,48 @@ int sys_kill(int pid, int sig)
  * Only anonymous mappings are currently supported. The function enforces
  * Linux argument validation and returns Linux errno values on failure.
  */
-static uint64 sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t off) {
-    (void)addr;
+/*
+ * Opens our own handle on the file behind @p fd for a mapping, which
+ * outlives the descriptor. Only disk files go through the page cache.
+ */
+static int64_t open_mapped_file(uint64_t fd, bool write, user_file_t** out) {
+    vfs_file_t* src = fd_get_file((int)fd);
+    const char* path = fd_get_path((int)fd);
+    if (!src || !src->mnt || !path)
+        return -LINUX_EBADF;
+
+    switch (src->mnt->type) {
+        case FS_FAT16:
+        case FS_FAT32:
+        case FS_ISO9660:
+        case FS_EXT2:
+            break;
+        default:
+            return -LINUX_ENODEV;
+    }
+
+    int fd_mode = fd_flags((int)fd);
+    if (!(fd_mode & VFS_RDONLY) || (write && !(fd_mode & VFS_WRONLY)))
+        return -LINUX_EACCES;
 
+    vfs_file_t* file = kmalloc(sizeof(vfs_file_t));
+    if (!file)
+        return -LINUX_ENOMEM;
+    if (vfs_open(path, write ? VFS_RDWR : VFS_RDONLY, file) != 0) {
+        kfree(file);
+        return -LINUX_EACCES;
+    }
+
+    *out = user_file_create(file);
+    if (!*out) {
+        vfs_close(file);
+        kfree(file);
+        return -LINUX_ENOMEM;
+    }
+    return 0;
+}
+
+static uint64 sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, uint64_t fd, uint64_t off) {
     if (length == 0)
         return -LINUX_EINVAL;
 
@@ -1072,13 +1082,31 @@ static uint64 sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t f
     if ((flags & (LINUX_MAP_PRIVATE | LINUX_MAP_SHARED)) == 0)
         return -LINUX_EINVAL;
 
-    if ((flags & LINUX_MAP_ANONYMOUS) == 0)
-        return -LINUX_ENOSYS;
+    bool fixed = (flags & LINUX_MAP_FIXED) != 0;
+    if (fixed && (addr & 0xFFFULL) != 0)
+        return -LINUX_EINVAL;
 
-    if ((int64_t)fd != -1)
+    // mprotect() is a no-op, so everything but shared file pages stays
+    // writable; private file pages are copied on the first write.
+    bool shared = (flags & LINUX_MAP_SHARED) != 0;
+    uint64_t page_flags = USER_DATA_FLAGS;
+    if (prot & LINUX_PROT_EXEC)
+        page_flags &= ~PAGE_NX;
+
+    user_file_t* file = NULL;
+    if ((flags & LINUX_MAP_ANONYMOUS) == 0) {
+        bool write = shared && (prot & LINUX_PROT_WRITE);
+        int64_t rc = open_mapped_file(fd, write, &file);
+        if (rc != 0)
+            return (uint64)rc;
+        if (shared && !write)
+            page_flags &= ~(uint64_t)PAGE_RW;
+    } else if ((int64_t)fd != -1) {
         return -LINUX_EBADF;
+    }
 
-    uint64_t mapped = userland_mmap_anon(length);
+    uint64_t mapped = userland_mmap(addr, length, page_flags, shared, fixed, file, off);
+    user_file_put(file);    // the mapping holds its own reference
     if (mapped == 0)
         return -LINUX_ENOMEM;
 
@@ -1134,13 +1162,16 @@ static uint64 sys_munmap(uint64_t addr, uint64_t length) {
     if (!in_heap && !in_mmap)
         return -LINUX_EINVAL;
 
+    // The heap only shrinks through brk().
+    if (in_mmap && userland_munmap(addr, length) != 0)
+        return -LINUX_ENOMEM;
+
     return 0;
 }
 
 static uint64 sys_arch_prctl(uint64_t code, uint64_t addr) {
     switch (code) {
         case LINUX_ARCH_SET_FS:
-            current_fs_base = addr;
             wrmsr64(IA32_FS_BASE_MSR, addr);
             return 0;
         case LINUX_ARCH_GET_FS:
@@ -1166,8 +1197,9 @@ static uint64 sys_prlimit64(uint64_t pid, uint64_t resource, const linux_rlimit6
 }
 
 static uint64 sys_umask(uint64_t mask) {
-    uint32_t previous = current_umask;
-    current_umask = (uint32_t)(mask & 0777U);
+    userland_state_t* self = userland_state();
+    uint32_t previous = self->umask;
+    self->umask = (uint32_t)(mask & 0777U);
     return (uint64)previous;
 }
 
@@ -1182,8 +1214,8 @@ static uint64 sys_tgkill(uint64_t tgid, uint64_t tid, uint64_t sig) {
 }
 
 static uint64 sys_set_tid_address(uint64_t* tidptr) {
-    clear_child_tid = tidptr;
-    return 1;
+    userland_state()->clear_child_tid = tidptr;
+    return multitasking_current_pid() ? multitasking_current_pid() : 1;
 }
 
 static uint64 sys_set_robust_list(const void* head, uint64_t len) {
@@ -1212,7 +1244,7 @@ static uint64 sys_execve(const char* target, char* const* argv, char* const* env
     if (!target)
         return -LINUX_EINVAL;
 
-    record_exec_context(target, argv);
+    record_exec_context(target);
 
     char** copied_argv = NULL;
     char** copied_envp = NULL;
@@ -1236,19 +1268,14 @@ static uint64 sys_execve(const char* target, char* const* argv, char* const* env
     return rc >= 0 ? rc : -LINUX_ENOEXEC;
 }
 
-static uint64 sys_fork(void) {
-    if (current_exec_path[0] == '\0')
+static uint64 sys_fork(const syscall_frame_t* frame) {
+    // The child needs every user register, which only syscall_entry saves.
+    if (!frame || !multitasking_current_userland())
         return -LINUX_ENOSYS;
 
-    user_task_spec_t spec = {0};
-    spec.path = current_exec_path;
-    spec.argc = current_exec_argc;
-    for (int i = 0; i < current_exec_argc && i < 32; ++i)
-        spec.argv[i] = current_exec_argv[i];
-
-    uint32_t child = multitasking_spawn_userland(current_exec_path, &spec);
+    uint32_t child = multitasking_fork_userland(frame);
     if (child == 0)
-        return -LINUX_EAGAIN;
+        return -LINUX_ENOMEM;
 
     if (!track_fork_child(child))
         return -LINUX_EAGAIN;
@@ -1264,9 +1291,13 @@ static uint64 sys_wait4(int64_t pid, int* status, int options, void* rusage) {
         return -LINUX_EINVAL;
 
     while (1) {
+        // Armed before looking, so a child exiting meanwhile still wakes us.
+        multitasking_exit_watch(true);
+
+        userland_state_t* self = userland_state();
         int found_any = 0;
-        for (int i = 0; i < fork_child_count; ++i) {
-            uint32_t child = fork_children[i];
+        for (uint32_t i = 0; i < self->child_count; ++i) {
+            uint32_t child = self->children[i];
             if (pid > 0 && child != (uint32_t)pid)
                 continue;
 
@@ -1281,18 +1312,19 @@ static uint64 sys_wait4(int64_t pid, int* status, int options, void* rusage) {
             if (info.state != TASK_STATE_EXITED)
                 continue;
 
+            multitasking_exit_watch(false);
             if (status)
                 *status = (info.exit_code & 0xFF) << 8;
             untrack_child_at(i);
             return (uint64)child;
         }
 
-        if (!found_any)
-            return -LINUX_ECHILD;
-        if (options & LINUX_WNOHANG)
-            return 0;
+        if (!found_any || (options & LINUX_WNOHANG)) {
+            multitasking_exit_watch(false);
+            return found_any ? 0 : -LINUX_ECHILD;
+        }
 
-        sleep(1);
+        multitasking_exit_wait();
     }
 }
 
@@ -1351,6 +1383,8 @@ struct passwd* getpwuid(int uid) {
 // THIS IS FOR INTERRUPT 0X80
 void int80_handler(InterruptFrame* frame)
 {
+    multitasking_lock_kernel();
+    userland_set_user_access(true);
     uint64_t ret = syscall_dispatch(
         frame->rax,
         frame->rdi,
@@ -1360,6 +1394,8 @@ void int80_handler(InterruptFrame* frame)
         frame->r8,
         frame->r9
     );
+    userland_set_user_access(false);
+    multitasking_unlock_kernel();
 
     frame->rax = ret;
 }
@@ -1367,24 +1403,34 @@ void int80_handler(InterruptFrame* frame)
 // THIS IS FOR SYSCALL INSTRUCTION
 void syscall_handler(syscall_frame_t* f)
 {
+    multitasking_lock_kernel();
+    userland_set_user_access(true);
+
     if (f && (f->rax == LINUX_SYS_EXIT || f->rax == LINUX_SYS_EXIT_GROUP)) {
-        if (clear_child_tid)
-            *clear_child_tid = 0;
-        if (userland_prepare_exit(f, f->rdi))
-            return;
+        if (userland_state()->clear_child_tid)
+            *userland_state()->clear_child_tid = 0;
+        if (userland_is_running())
+            userland_exit((int)f->rdi);
     }
 
-    uint64_t ret = syscall_dispatch(
-        f->rax,
-        f->rdi,
-        f->rsi,
-        f->rdx,
-        f->r10,   // ⚠️ DIFFERENT HERE
-        f->r8,
-        f->r9
-    );
+    uint64_t ret;
+    if (f->rax == LINUX_SYS_FORK || f->rax == LINUX_SYS_CLONE)
+        ret = sys_fork(f);
+    else
+        ret = syscall_dispatch(
+            f->rax,
+            f->rdi,
+            f->rsi,
+            f->rdx,
+            f->r10,   // ⚠️ DIFFERENT HERE
+            f->r8,
+            f->r9
+        );
+    userland_set_user_access(false);
+    multitasking_unlock_kernel();
 
     f->rax = ret;
+    multitasking_preempt_point();
 }
 
 uint64_t syscall_dispatch (
@@ -1475,7 +1521,7 @@ uint64_t syscall_dispatch (
             return sys_connect(arg1, (const void*)arg2, arg3);
 
         case LINUX_SYS_CLONE:
-            return sys_fork();
+            return sys_fork(NULL);
 
         case LINUX_SYS_EXECVE:
             return sys_execve((const char*)arg1, (char* const*)arg2, (char* const*)arg3);
@@ -1494,7 +1540,7 @@ uint64_t syscall_dispatch (
             return sys_chdir((const char*)arg1);
 
         case LINUX_SYS_FORK:
-            return sys_fork();
+            return sys_fork(NULL);
 
         case LINUX_SYS_UNAME:
             return sys_uname((linux_utsname_t*)arg1);
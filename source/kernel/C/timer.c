@@ -0,0 +1,253 @@
+/**
+ * @file timer.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Clock and timer events: TSC time keeping, LAPIC one-shot or
+ * TSC-deadline events, calibrated against the HPET or the PIT.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+
+#include <timer.h>
+#include <acpi.h>
+#include <lapic.h>
+#include <cpuid2.h>
+#include <cc-asm.h>
+#include <paging.h>
+#include <graphics.h>
+#include <rtc.h>
+#include <hal.h>
+
+#define HPET_REG_GCAP_ID        0x000
+#define HPET_REG_GEN_CONF       0x010
+#define HPET_REG_COUNTER        0x0F0
+#define HPET_GEN_CONF_ENABLE    (1ULL << 0)
+#define HPET_MAX_PERIOD_FS      100000000ULL    // the spec caps it at 100 ns
+
+#define FS_PER_NS               1000000ULL
+#define PIT_TICK_NS             (10 * TIMER_NS_PER_MS)
+
+#define CALIBRATE_NS            (50 * TIMER_NS_PER_MS)
+#define CALIBRATE_PIT_TICKS     5
+
+// One-shot counts are clamped so a late or far deadline still behaves.
+#define ONESHOT_MIN_NS          (2 * TIMER_NS_PER_US)
+#define ONESHOT_MAX_NS          TIMER_NS_PER_SEC
+
+extern volatile uint64_t pit_ticks;
+
+struct hpet_table {
+    struct sdt header;
+    uint32_t block_id;
+    uint8_t address_space;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t reserved;
+    uint64_t address;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t page_protection;
+} __attribute__((packed));
+
+static volatile uint64_t* hpet_mmio = NULL;
+static uint64_t hpet_period_fs = 0;
+
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_ns_mult = 0;     // ns per TSC tick, 32.32 fixed point
+static uint64_t lapic_hz = 0;        // LAPIC timer counts per second, divide by 16
+static uint64_t boot_epoch_ns = 0;   // realtime at timer_now_ns() == 0
+static timer_event_t event_kind = TIMER_EVENT_PIT;
+
+static uint64_t hpet_read(uint32_t reg) {
+    return hpet_mmio[reg / 8];
+}
+
+static void hpet_write(uint32_t reg, uint64_t value) {
+    hpet_mmio[reg / 8] = value;
+}
+
+static bool hpet_init(void) {
+    struct hpet_table* table = (struct hpet_table*)acpi_find_sdt("HPET", 0);
+    if (!table || table->address_space != 0 || table->address == 0)
+        return false;
+
+    hpet_mmio = (volatile uint64_t*)phys_to_virt(table->address);
+
+    uint64_t period = hpet_read(HPET_REG_GCAP_ID) >> 32;
+    if (period == 0 || period > HPET_MAX_PERIOD_FS) {
+        hpet_mmio = NULL;
+        return false;
+    }
+
+    hpet_period_fs = period;
+    hpet_write(HPET_REG_GEN_CONF, hpet_read(HPET_REG_GEN_CONF) | HPET_GEN_CONF_ENABLE);
+    return true;
+}
+
+static uint64_t hpet_ticks_to_ns(uint64_t ticks) {
+    // Split so the multiplication cannot overflow on a long uptime.
+    return (ticks / FS_PER_NS) * hpet_period_fs + (ticks % FS_PER_NS) * hpet_period_fs / FS_PER_NS;
+}
+
+static uint64_t ns_to_tsc(uint64_t ns) {
+    return (ns / TIMER_NS_PER_SEC) * tsc_hz + (ns % TIMER_NS_PER_SEC) * tsc_hz / TIMER_NS_PER_SEC;
+}
+
+/*
+ * Runs the TSC and the LAPIC timer side by side with a reference clock for
+ * about 50 ms. Returns the reference time that passed, 0 on failure.
+ */
+static uint64_t calibrate(uint64_t* dtsc, uint32_t* dlapic) {
+    uint64_t tsc0, ref_ns;
+
+    if (hpet_mmio) {
+        uint64_t wait = CALIBRATE_NS * FS_PER_NS / hpet_period_fs;
+        uint64_t start = hpet_read(HPET_REG_COUNTER);
+
+        lapic_timer_count_start();
+        tsc0 = rdtsc64();
+        uint64_t now;
+        while ((now = hpet_read(HPET_REG_COUNTER)) - start < wait)
+            asm volatile("pause");
+        *dtsc = rdtsc64() - tsc0;
+        *dlapic = lapic_timer_count_elapsed();
+
+        ref_ns = hpet_ticks_to_ns(now - start);
+    } else {
+        // Start on a tick edge so the window is whole ticks long.
+        uint64_t tick = pit_ticks;
+        while (pit_ticks == tick)
+            asm volatile("pause");
+        tick = pit_ticks;
+
+        lapic_timer_count_start();
+        tsc0 = rdtsc64();
+        while (pit_ticks - tick < CALIBRATE_PIT_TICKS)
+            asm volatile("pause");
+        *dtsc = rdtsc64() - tsc0;
+        *dlapic = lapic_timer_count_elapsed();
+
+        ref_ns = CALIBRATE_PIT_TICKS * PIT_TICK_NS;
+    }
+
+    lapic_timer_stop();
+    return ref_ns;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date.
+static int64_t days_from_civil(int64_t y, uint32_t m, uint32_t d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = (uint32_t)(y - era * 400);
+    uint32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+static void read_boot_epoch(void) {
+    uint8 sec, min, hour, day, month;
+    uint16 year;
+    update_system_time(&sec, &min, &hour, &day, &month, &year);
+
+    // The century register is unreliable; the year register holds two digits.
+    int64_t days = days_from_civil(2000 + year, month, day);
+    uint64_t secs = (uint64_t)days * 86400 + hour * 3600U + min * 60U + sec;
+    boot_epoch_ns = secs * TIMER_NS_PER_SEC - timer_now_ns();
+}
+
+void timer_init(void) {
+    info("Calibrating the TSC and the LAPIC timer", __FILE__);
+
+    lapic_init();
+    bool have_hpet = hpet_init();
+
+    uint64_t dtsc = 0;
+    uint32_t dlapic = 0;
+    uint64_t ref_ns = calibrate(&dtsc, &dlapic);
+
+    if (ref_ns != 0 && dtsc != 0) {
+        tsc_hz = dtsc * TIMER_NS_PER_SEC / ref_ns;
+        tsc_ns_mult = (TIMER_NS_PER_SEC << 32) / tsc_hz;
+    }
+    if (ref_ns != 0 && dlapic != 0)
+        lapic_hz = (uint64_t)dlapic * TIMER_NS_PER_SEC / ref_ns;
+
+    read_boot_epoch();
+
+    if (tsc_hz && cpu_has_tsc_deadline())
+        event_kind = TIMER_EVENT_TSC_DEADLINE;
+    else if (lapic_hz)
+        event_kind = TIMER_EVENT_LAPIC_ONESHOT;
+
+    if (event_kind == TIMER_EVENT_PIT) {
+        warn("timer: LAPIC timer calibration failed, staying on the 100 Hz PIT", __FILE__);
+        return;
+    }
+
+    // Every CPU now arms its own one-shot events; mask IRQ0 on the PIC.
+    outb(0x21, (uint8)(inb(0x21) | 0x01U));
+
+    printf("timer: reference %s, TSC %u MHz%s, LAPIC timer %u kHz, events via %s",
+           have_hpet ? "HPET" : "PIT",
+           (uint32_t)(tsc_hz / 1000000),
+           cpu_has_invariant_tsc() ? " (invariant)" : "",
+           (uint32_t)(lapic_hz / 1000),
+           timer_event_name());
+    done("Timer subsystem ready", __FILE__);
+}
+
+uint64_t timer_now_ns(void) {
+    if (tsc_ns_mult)
+        return (uint64_t)(((unsigned __int128)rdtsc64() * tsc_ns_mult) >> 32);
+    if (hpet_mmio)
+        return hpet_ticks_to_ns(hpet_read(HPET_REG_COUNTER));
+    return pit_ticks * PIT_TICK_NS;
+}
+
+uint64_t timer_realtime_ns(void) {
+    return boot_epoch_ns + timer_now_ns();
+}
+
+uint64_t timer_tsc_hz(void) {
+    return tsc_hz;
+}
+
+timer_event_t timer_event_kind(void) {
+    return event_kind;
+}
+
+const char* timer_event_name(void) {
+    switch (event_kind) {
+        case TIMER_EVENT_TSC_DEADLINE:   return "TSC-deadline";
+        case TIMER_EVENT_LAPIC_ONESHOT:  return "LAPIC one-shot";
+        default:                         return "PIT (100 Hz)";
+    }
+}
+
+void timer_arm(uint64_t deadline_ns) {
+    if (event_kind == TIMER_EVENT_PIT)
+        return;
+
+    if (deadline_ns == TIMER_NEVER) {
+        lapic_timer_stop();
+        return;
+    }
+
+    if (event_kind == TIMER_EVENT_TSC_DEADLINE) {
+        // A deadline already in the past fires right away.
+        lapic_timer_tsc_deadline(ns_to_tsc(deadline_ns));
+        return;
+    }
+
+    uint64_t now = timer_now_ns();
+    uint64_t delta = deadline_ns > now ? deadline_ns - now : 0;
+    if (delta < ONESHOT_MIN_NS)
+        delta = ONESHOT_MIN_NS;
+    if (delta > ONESHOT_MAX_NS)
+        delta = ONESHOT_MAX_NS;
+
+    uint64_t count = delta * lapic_hz / TIMER_NS_PER_SEC;
+    lapic_timer_oneshot(count > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (uint32_t)count);
+}
@@ -12,25 +12,21 @@
 #include <gdt.h>
 #include <memory.h>
 
-// Global TSS and kernel stack
-__attribute__((aligned(16)))
-struct tss_entry tss;
+#include <cc-asm.h>
 
+// One TSS and syscall area per CPU, plus the boot kernel stack
 __attribute__((aligned(16)))
-uint8_t kernel_stack[0x4000]; // 16 KB kernel stack
+struct tss_entry cpu_tss[SMP_MAX_CPUS];
 
-uint64_t kernel_stack_top = (uint64_t)&kernel_stack[0x4000];
-
-// Initialize TSS
-void kernel_tss_init(void) {
-    memset(&tss, 0, sizeof(tss));
+cpu_syscall_area_t cpu_syscall_area[SMP_MAX_CPUS];
 
-    tss.rsp0 = (uint64_t)(kernel_stack + sizeof(kernel_stack));
-    tss.iomap_base = sizeof(struct tss_entry);
+__attribute__((aligned(16)))
+uint8_t kernel_stack[0x4000]; // 16 KB kernel stack
 
-    struct tss_descriptor *desc = (struct tss_descriptor *)&gdt[5];
+static void tss_set_descriptor(uint32_t cpu) {
+    struct tss_descriptor *desc = (struct tss_descriptor *)&gdt[GDT_TSS_INDEX + 2 * cpu];
 
-    uint64_t base  = (uint64_t)&tss;
+    uint64_t base  = (uint64_t)&cpu_tss[cpu];
     uint32_t limit = (uint32_t)(sizeof(struct tss_entry) - 1U);
 
     desc->limit_low  = (uint16_t)(limit & 0xFFFFU);
@@ -41,12 +37,30 @@ void kernel_tss_init(void) {
     desc->base_high  = (uint8_t)((base >> 24) & 0xFFU);
     desc->base_upper = (uint32_t)(base >> 32);
     desc->reserved   = 0;
+}
+
+// Initialize TSS
+void kernel_tss_init(void) {
+    memset(cpu_tss, 0, sizeof(cpu_tss));
+    memset(cpu_syscall_area, 0, sizeof(cpu_syscall_area));
+
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cpu_tss[cpu].iomap_base = sizeof(struct tss_entry);
+        tss_set_descriptor(cpu);
+    }
+
+    tss_set_kernel_stack(0, (uint64_t)(kernel_stack + sizeof(kernel_stack)));
 
     done("TSS is ready, yet to be deployed", __FILE__);
 }
 
+void tss_load_cpu(uint32_t cpu) {
+    asm volatile("ltr %0" :: "r"(GDT_TSS_SELECTOR(cpu)));
+    wrmsr64(IA32_KERNEL_GS_BASE_MSR, (uint64_t)&cpu_syscall_area[cpu]);
+}
+
 // Load TSS using ltr instruction
 void tss_load(void) {
-    asm volatile("ltr %0" :: "r"((uint16)0x28));
+    tss_load_cpu(0);
     done("Done loading TSS", __FILE__);
 }
@@ -99,23 +99,17 @@ uint8_t getmodifiers(void)
     return modifiers;
 }
 
-extern volatile uint64_t pit_ticks;
 uint8_t getc(void)
 {
     uint8_t sc;
-    static uint64_t last_tick = 0;
 
     for (;;) {
         if (rb_pop(&kb_rb, &sc) == 0) {
             return (uint8_t)handle_char_from_scancode(sc);
         }
 
-        if (pit_ticks != last_tick) {
-            last_tick = pit_ticks;
-            multitasking_on_pit_tick(last_tick);
-        }
-
-        asm volatile("hlt");
+        // Let other tasks run for a while instead of spinning here.
+        multitasking_sleep_ms(10);
     }
 }
 
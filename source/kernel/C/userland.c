@@ -5,73 +5,29 @@
 #include <userland.h>
 #include <executables/elf.h>
 #include <filesystems/vfs.h>
+#include <filesystems/page_cache.h>
 #include <heap.h>
 #include <tss.h>
 #include <tty.h>
 #include <debugger.h>
 #include <cc-asm.h>
+#include <multitasking.h>
+#include <stream.h>
 
-static uint64_t user_heap_break = USER_HEAP_VADDR;
-static uint64_t user_heap_mapped_end = USER_HEAP_VADDR;
-
-static uint64_t user_mmap_cursor = USER_MMAP_VADDR;
-static uint64_t user_mmap_end = USER_MMAP_VADDR;
-static volatile bool userland_running = false;
-static uint64_t userland_saved_kernel_stack_top = 0;
-static uint64_t userland_saved_tss_rsp0 = 0;
-__attribute__((aligned(16)))
-static uint8_t userland_syscall_stack[0x4000];
-volatile bool userland_should_return_kernel = false;
-volatile uint64_t userland_resume_rip = 0;
-volatile uint64_t userland_resume_rsp = 0;
-volatile uint64_t userland_resume_rbx = 0;
-volatile uint64_t userland_resume_rbp = 0;
-volatile uint64_t userland_resume_r12 = 0;
-volatile uint64_t userland_resume_r13 = 0;
-volatile uint64_t userland_resume_r14 = 0;
-volatile uint64_t userland_resume_r15 = 0;
-volatile uint64_t userland_resume_ret_rip = 0;
-volatile uint64_t userland_resume_ret_rsp = 0;
-static volatile int userland_last_exit_code = 0;
+#define PAGE_FAULT_PRESENT  0x1
+#define PAGE_FAULT_WRITE    0x2
+#define PAGE_FAULT_USER     0x4
+#define PAGE_FAULT_FETCH    0x10
+
+static userland_state_t boot_user_state = { .umask = 022 };
 static inline void wrmsr64_local(uint32_t msr, uint64_t value);
 static void userland_unmap_all(void);
+static bool userland_fault_vma(vma_t* vma, uint64_t page, uint64_t err_code);
 void userland_heap_init(void);
 
-__attribute__((noinline, noreturn)) static void userland_finish_exit(void) {
-    uint64_t return_rip = userland_resume_ret_rip;
-    uint64_t return_rsp = userland_resume_ret_rsp;
-
-    userland_running = false;
-    userland_should_return_kernel = false;
-    userland_resume_rip = 0;
-    userland_resume_rsp = 0;
-    userland_resume_rbx = 0;
-    userland_resume_rbp = 0;
-    userland_resume_r12 = 0;
-    userland_resume_r13 = 0;
-    userland_resume_r14 = 0;
-    userland_resume_r15 = 0;
-    userland_resume_ret_rip = 0;
-    userland_resume_ret_rsp = 0;
-    kernel_stack_top = userland_saved_kernel_stack_top;
-    tss.rsp0 = userland_saved_tss_rsp0;
-    userland_saved_kernel_stack_top = 0;
-    userland_saved_tss_rsp0 = 0;
-    wrmsr64_local(IA32_FS_BASE_MSR, 0);
-    userland_unmap_all();
-    userland_heap_init();
-    tty_flush_input();
-    printf(blue_color "\n[process exited with code %d]" reset_color, userland_last_exit_code);
-    asm volatile("sti");
-    
-    asm volatile(
-        "xor %%rax, %%rax\n"
-        "mov %0, %%rsp\n"
-        "jmp *%1\n"
-        :
-        : "r"(return_rsp), "r"(return_rip)
-        : "memory", "rax");
-    __builtin_unreachable();
+userland_state_t* userland_state(void) {
+    userland_state_t* state = multitasking_current_userland();
+    return state ? state : &boot_user_state;
 }
 
 static void debug_dump_initial_stack(uint64_t stack_top) {
@@ -268,7 +224,11 @@ static int init_user_tls(const elf_image_info_t* image_info) {
 
     for (uint64_t vaddr = USER_TLS_VADDR; vaddr < tls_end; vaddr += PAGE_SIZE) {
         uint64_t phys = allocate_page();
-        map_user_page(vaddr, phys, USER_DATA_FLAGS);
+        if (!phys || !map_user_page(vaddr, phys, USER_DATA_FLAGS)) {
+            free_page(phys);
+            eprintf("userland: out of memory for the TLS block");
+            return -1;
+        }
     }
 
     memset((void*)USER_TLS_VADDR, 0, tls_end - USER_TLS_VADDR);
@@ -304,23 +264,31 @@ static int init_user_tls(const elf_image_info_t* image_info) {
     return 0;
 }
 
-static void map_user_stack(void) {
+static int map_user_stack(void) {
     uint64_t stack_top = USER_STACK_TOP;
 
     for (uint64_t off = 0; off < USER_STACK_SIZE; off += PAGE_SIZE) {
         uint64_t phys = allocate_page();
         uint64_t vaddr = stack_top - off - PAGE_SIZE;
-        map_user_page(vaddr, phys, USER_DATA_FLAGS);
+        if (!phys || !map_user_page(vaddr, phys, USER_DATA_FLAGS)) {
+            free_page(phys);
+            eprintf("userland: out of memory for the stack");
+            return -1;
+        }
     }
+    return 0;
 }
 
-static void map_user_range(uint64_t start, uint64_t end, uint64_t flags) {
+__attribute__((unused)) static void map_user_range(uint64_t start, uint64_t end, uint64_t flags) {
     uint64_t aligned_start = start & ~(PAGE_SIZE - 1);
     uint64_t aligned_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
     for (uint64_t vaddr = aligned_start; vaddr < aligned_end; vaddr += PAGE_SIZE) {
         uint64_t phys = allocate_page();
-        map_user_page(vaddr, phys, flags);
+        if (!phys || !map_user_page(vaddr, phys, flags)) {
+            free_page(phys);
+            return;
+        }
     }
 }
 
@@ -333,71 +301,496 @@ static void unmap_user_range(uint64_t start, uint64_t end) {
 }
 
 static void userland_unmap_all(void) {
+    userland_state_t* state = userland_state();
+
+    // ET_EXEC images sit at their link address, outside the code range.
+    for (uint32_t i = 0; i < state->region_count; ++i)
+        unmap_user_range(state->regions[i].start, state->regions[i].end);
+
     unmap_user_range(USER_CODE_VADDR, USER_HEAP_VADDR);
     unmap_user_range(USER_HEAP_VADDR, USER_HEAP_VADDR + USER_HEAP_SIZE);
-    unmap_user_range(USER_MMAP_VADDR, USER_MMAP_VADDR + USER_MMAP_SIZE);
+    for (vma_t* vma = vma_first(state->vmas, 0); vma; vma = vma_first(state->vmas, vma->end))
+        unmap_user_range(vma->start, vma->end);
     unmap_user_range(USER_TLS_VADDR, USER_TLS_VADDR + USER_TLS_REGION_SIZE);
     unmap_user_range(USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP);
 }
 
 void userland_heap_init(void) {
-    user_heap_break = USER_HEAP_VADDR;
-    user_heap_mapped_end = USER_HEAP_VADDR;
+    userland_state_t* state = userland_state();
 
-    user_mmap_cursor = USER_MMAP_VADDR;
-    user_mmap_end = USER_MMAP_VADDR + USER_MMAP_SIZE;
+    state->heap_break = USER_HEAP_VADDR;
+    state->heap_mapped_end = USER_HEAP_VADDR;
 }
 
 uint64_t userland_brk(uint64_t requested_break) {
+    userland_state_t* state = userland_state();
     uint64_t user_heap_end = USER_HEAP_VADDR + USER_HEAP_SIZE;
 
     if (requested_break == 0) {
-        return user_heap_break;
+        return state->heap_break;
     }
 
     if (requested_break < USER_HEAP_VADDR || requested_break > user_heap_end) {
-        return user_heap_break;
+        return state->heap_break;
     }
 
-    if (requested_break > user_heap_mapped_end) {
-        map_user_range(user_heap_mapped_end, requested_break, USER_DATA_FLAGS);
-        user_heap_mapped_end = (requested_break + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    // Pages below heap_mapped_end are handed out zeroed when first touched.
+    if (requested_break > state->heap_mapped_end)
+        state->heap_mapped_end = align_up_u64(requested_break, PAGE_SIZE);
+
+    state->heap_break = requested_break;
+    return state->heap_break;
+}
+
+int userland_map_lazy(uint64_t start, uint64_t end, uint64_t flags, uint64_t file_offset, uint64_t file_size) {
+    userland_state_t* state = userland_state();
+
+    if (state->region_count >= USER_REGIONS_MAX)
+        return -1;
+
+    user_region_t* region = &state->regions[state->region_count++];
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    region->file_end = start + file_size;
+    region->file_offset = file_offset;
+    return 0;
+}
+
+int userland_set_image(struct vfs_file* file) {
+    userland_state_t* state = userland_state();
+
+    if (state->image && state->image->file == file)
+        return 0;
+
+    user_file_put(state->image);
+    state->image = user_file_create(file);
+    return state->image ? 0 : -1;
+}
+
+void userland_state_release(userland_state_t* state) {
+    if (!state)
+        return;
+
+    user_file_put(state->image);
+    state->image = NULL;
+    state->region_count = 0;
+    vma_destroy(state->vmas);
+    state->vmas = NULL;
+}
+
+int userland_state_init(userland_state_t* state) {
+    memset(state, 0, sizeof(*state));
+    state->umask = 022;
+    state->fds = fd_table_fork();
+    return state->fds ? 0 : -1;
+}
+
+void userland_state_close_files(userland_state_t* state) {
+    if (!state)
+        return;
+
+    fd_table_release(state->fds);
+    state->fds = NULL;
+}
+
+int userland_state_fork(userland_state_t* child, const userland_state_t* parent) {
+    *child = *parent;
+    child->image = NULL;
+    child->user_access = false; // the child leaves fork() straight for ring 3
+    child->child_count = 0;
+    child->fds = fd_table_fork();
+    if (!child->fds) {
+        child->vmas = NULL;
+        child->region_count = 0;
+        return -1;
     }
+    if (vma_clone(parent->vmas, &child->vmas) != 0) {
+        child->region_count = 0;
+        return -1;
+    }
+
+    child->image = parent->image;
+    user_file_get(child->image);
+    return 0;
+}
+
+/*
+ * Writes the pages of a shared, writable file mapping in [start, end) that
+ * the program changed back to the file, straight from their frames.
+ */
+static void userland_write_back(vma_t* vma, uint64_t start, uint64_t end) {
+    if (!vma->shared || !vma->file || !(vma->flags & PAGE_RW))
+        return;
+
+    uint64_t size = vfs_file_size(vma->file->file);
+    if (end > vma->file_end)
+        end = vma->file_end;
+
+    for (uint64_t page = start; page < end; page += PAGE_SIZE) {
+        uint64_t entry = user_page_entry(page);
+        if (!(entry & PAGE_PRESENT) || !(entry & PAGE_DIRTY))
+            continue;
 
-    user_heap_break = requested_break;
-    return user_heap_break;
+        // Only what the file holds; a mapping never makes it grow.
+        uint64_t offset = vma->file_offset + (page - vma->start);
+        if (offset >= size)
+            break;
+        uint32_t bytes = size - offset < PAGE_SIZE ? (uint32_t)(size - offset) : (uint32_t)PAGE_SIZE;
+
+        if (vfs_pwrite(vma->file->file, offset, (const uint8_t*)phys_to_virt(entry & PAGE_ADDR_MASK), bytes) != (int)bytes)
+            eprintf("userland: failed to write back %x", page);
+    }
 }
 
-uint64_t userland_mmap_anon(uint64_t length) {
-    if (length == 0) {
+static void userland_write_back_all(userland_state_t* state) {
+    for (vma_t* vma = vma_first(state->vmas, 0); vma; vma = vma_first(state->vmas, vma->end))
+        userland_write_back(vma, vma->start, vma->end);
+}
+
+int userland_munmap(uint64_t addr, uint64_t length) {
+    userland_state_t* state = userland_state();
+    uint64_t end = align_up_u64(addr + length, PAGE_SIZE);
+
+    // Cut the mappings sticking out at either end, then drop whole ones.
+    vma_t* vma = vma_find(state->vmas, addr);
+    if (vma && vma->start < addr && vma_split(&state->vmas, vma, addr) != 0)
+        return -1;
+    vma = vma_find(state->vmas, end - 1);
+    if (vma && vma->end > end && vma_split(&state->vmas, vma, end) != 0)
+        return -1;
+
+    while ((vma = vma_first(state->vmas, addr)) != NULL && vma->start < end) {
+        userland_write_back(vma, vma->start, vma->end);
+        unmap_user_range(vma->start, vma->end);
+        vma_remove(&state->vmas, vma);
+    }
+    return 0;
+}
+
+uint64_t userland_mmap(uint64_t addr, uint64_t length, uint64_t flags, bool shared, bool fixed,
+                       user_file_t* file, uint64_t offset) {
+    userland_state_t* state = userland_state();
+    uint64_t lo = USER_MMAP_VADDR;
+    uint64_t hi = USER_MMAP_VADDR + USER_MMAP_SIZE;
+
+    if (length == 0 || length > USER_MMAP_SIZE)
+        return 0;
+    length = align_up_u64(length, PAGE_SIZE);
+
+    if (fixed) {
+        if (addr < lo || addr > hi - length || userland_munmap(addr, length) != 0)
+            return 0;
+    } else {
+        addr = vma_find_gap(state->vmas, lo, hi, length);
+        if (addr == 0)
+            return 0;
+    }
+
+    uint64_t file_end = addr;
+    if (file) {
+        uint64_t size = vfs_file_size(file->file);
+        if (size > offset)
+            file_end = size - offset < length ? addr + (size - offset) : addr + length;
+    }
+
+    vma_t* vma = vma_create(addr, addr + length, flags, shared, file, offset, file_end);
+    if (!vma)
         return 0;
+
+    vma_insert(&state->vmas, vma);
+
+    // Shared anonymous memory has no file for a forked child to meet its
+    // parent on, so its frames have to exist before any fork.
+    if (shared && !file) {
+        for (uint64_t page = addr; page < addr + length; page += PAGE_SIZE) {
+            if (!userland_fault_vma(vma, page, 0)) {
+                userland_munmap(addr, length);
+                return 0;
+            }
+        }
+    }
+    return addr;
+}
+
+/*
+ * Fills @p frame with what the image regions hold at @p page. A page can be
+ * shared by the end of one segment and the start of the next, so every
+ * region on it is copied and their permissions are combined.
+ *
+ * Returns how many regions cover the page, -1 if the file could not be read.
+ */
+static int userland_fill_image_page(userland_state_t* state, uint64_t page, uint8_t* frame, uint64_t* flags) {
+    bool writable = false;
+    bool executable = false;
+    int covered = 0;
+
+    for (uint32_t i = 0; i < state->region_count; ++i) {
+        user_region_t* region = &state->regions[i];
+        if (page + PAGE_SIZE <= region->start || page >= align_up_u64(region->end, PAGE_SIZE))
+            continue;
+
+        covered++;
+        if (region->flags & PAGE_RW)
+            writable = true;
+        if (!(region->flags & PAGE_NX))
+            executable = true;
+
+        uint64_t lo = region->start > page ? region->start : page;
+        uint64_t hi = region->file_end < page + PAGE_SIZE ? region->file_end : page + PAGE_SIZE;
+        if (lo >= hi)
+            continue;
+
+        if (!state->image ||
+            elf_read_image(state->image->file, region->file_offset + (lo - region->start), frame + (lo - page), (uint32_t)(hi - lo)) != 0)
+            return -1;
+    }
+
+    *flags = PAGE_PRESENT | PAGE_USER;
+    if (writable)
+        *flags |= PAGE_RW;
+    if (!executable)
+        *flags |= PAGE_NX;
+    return covered;
+}
+
+static bool userland_zero_fill_page(userland_state_t* state, uint64_t page) {
+    if (page >= USER_STACK_TOP - USER_STACK_SIZE && page < USER_STACK_TOP)
+        return true;
+    if (page >= USER_HEAP_VADDR && page < state->heap_mapped_end)
+        return true;
+    return false;
+}
+
+/*
+ * The region that alone covers @p page, with file bytes all over it that
+ * start on a page of the executable: then the page cache frame can be
+ * mapped as it is.
+ */
+static user_region_t* userland_cached_region(userland_state_t* state, uint64_t page) {
+    user_region_t* found = NULL;
+
+    for (uint32_t i = 0; i < state->region_count; ++i) {
+        user_region_t* region = &state->regions[i];
+        if (page + PAGE_SIZE <= region->start || page >= align_up_u64(region->end, PAGE_SIZE))
+            continue;
+        if (found)
+            return NULL;
+        found = region;
+    }
+
+    if (!found || !state->image || page < found->start || page + PAGE_SIZE > found->file_end)
+        return NULL;
+    if ((found->file_offset + (page - found->start)) & (PAGE_SIZE - 1))
+        return NULL;
+    return found;
+}
+
+/*
+ * Gives the program its own copy of a copy-on-write page. The last holder
+ * of the frame just gets it writable.
+ */
+static bool userland_break_cow(uint64_t page) {
+    uint64_t entry = user_page_entry(page);
+    if (!(entry & PAGE_PRESENT) || !(entry & PAGE_COW))
+        return false;
+
+    uintptr_t old = entry & PAGE_ADDR_MASK;
+    uint64_t flags = ((entry & ~PAGE_ADDR_MASK) & ~PAGE_COW) | PAGE_RW;
+
+    if (page_ref_count(old) == 1) {
+        map_user_page(page, old, flags);
+        return true;
     }
 
-    uint64_t aligned_len = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    if (user_mmap_cursor + aligned_len > user_mmap_end) {
+    uintptr_t phys = allocate_page();
+    if (!phys)
+        return false;
+
+    memcpy(phys_to_virt(phys), phys_to_virt(old), PAGE_SIZE);
+    map_user_page(page, phys, flags); // tables are there; drops our reference on the shared frame
+    return true;
+}
+
+static bool userland_access_allowed(uint64_t flags, uint64_t err_code) {
+    if (!(err_code & PAGE_FAULT_USER))
+        return true;
+    if ((err_code & PAGE_FAULT_WRITE) && !(flags & PAGE_RW))
+        return false;
+    if ((err_code & PAGE_FAULT_FETCH) && (flags & PAGE_NX))
+        return false;
+    return true;
+}
+
+/* The page cache fill for mapped files: the page at @p offset, zero-padded */
+static int userland_fill_file_page(vfs_file_t* file, uint64_t offset, void* page) {
+    uint64_t size = vfs_file_size(file);
+
+    memset(page, 0, PAGE_SIZE);
+    if (offset >= size)
         return 0;
+
+    uint32_t want = size - offset < PAGE_SIZE ? (uint32_t)(size - offset) : (uint32_t)PAGE_SIZE;
+    return vfs_pread(file, offset, (uint8_t*)page, want) == (int)want ? 0 : -1;
+}
+
+static bool userland_fault_vma(vma_t* vma, uint64_t page, uint64_t err_code) {
+    if (!userland_access_allowed(vma->flags, err_code))
+        return false;
+
+    uint64_t flags = vma->flags;
+    if (vma->shared)
+        flags |= PAGE_SHARED;
+
+    if (!vma->file) {
+        uint64_t phys = allocate_page();
+        if (!phys)
+            return false;
+        memset(phys_to_virt(phys), 0, PAGE_SIZE);
+        if (!map_user_page(page, phys, flags)) {
+            free_page(phys);
+            return false;
+        }
+        return true;
     }
 
-    uint64_t mapping_base = user_mmap_cursor;
-    map_user_range(mapping_base, mapping_base + aligned_len, USER_DATA_FLAGS);
-    user_mmap_cursor += aligned_len;
+    // Past the last page of the file there is nothing to map.
+    if (page >= align_up_u64(vma->file_end, PAGE_SIZE))
+        return false;
 
-    return mapping_base;
+    uint64_t index = (vma->file_offset + (page - vma->start)) / PAGE_SIZE;
+    uintptr_t phys = page_cache_get(vma->file->file, index, userland_fill_file_page);
+    if (!phys) {
+        eprintf("userland: failed to page in %x from a mapped file", page);
+        return false;
+    }
+
+    // Shared mappings write into the cached page itself; private ones
+    // share it until they write, like the image's data.
+    if (!vma->shared && (flags & PAGE_RW))
+        flags = (flags & ~(uint64_t)PAGE_RW) | PAGE_COW;
+    if (!map_user_page(page, phys, flags)) {
+        free_page(phys);
+        return false;
+    }
+
+    if ((err_code & PAGE_FAULT_WRITE) && (flags & PAGE_COW))
+        return userland_break_cow(page);
+    return true;
 }
 
-bool userland_prepare_exit(syscall_frame_t* frame, uint64_t exit_code) {
-    (void)frame;
+bool userland_handle_page_fault(uint64_t addr, uint64_t err_code) {
+    // Only the lower half is ours.
+    if ((addr >> 47) != 0)
+        return false;
+
+    userland_state_t* state = userland_state();
+    uint64_t page = addr & ~(PAGE_SIZE - 1);
+
+    // A present page only faults on a write if it is copy-on-write.
+    if (err_code & PAGE_FAULT_PRESENT)
+        return (err_code & PAGE_FAULT_WRITE) && userland_break_cow(page);
+
+    vma_t* vma = vma_find(state->vmas, page);
+    if (vma)
+        return userland_fault_vma(vma, page, err_code);
+
+    user_region_t* region = userland_cached_region(state, page);
+    if (region) {
+        if (!userland_access_allowed(region->flags, err_code))
+            return false;
+
+        uint64_t index = (region->file_offset + (page - region->start)) / PAGE_SIZE;
+        uintptr_t phys = elf_image_page(state->image->file, index);
+        if (!phys) {
+            eprintf("userland: failed to page in %x from the executable", page);
+            return false;
+        }
+
+        // Writable data shares the cached page until the program writes.
+        uint64_t flags = region->flags;
+        if (flags & PAGE_RW)
+            flags = (flags & ~(uint64_t)PAGE_RW) | PAGE_COW;
+        if (!map_user_page(page, phys, flags)) {
+            free_page(phys);
+            return false;
+        }
+
+        if ((err_code & PAGE_FAULT_WRITE) && (flags & PAGE_COW))
+            return userland_break_cow(page);
+        return true;
+    }
 
-    if (!userland_running || !userland_resume_rip || !userland_resume_rsp)
+    uint64_t phys = allocate_page();
+    if (!phys)
         return false;
 
-    userland_last_exit_code = (int)exit_code;
-    userland_should_return_kernel = true;
+    uint8_t* frame = (uint8_t*)phys_to_virt(phys);
+    memset(frame, 0, PAGE_SIZE);
+
+    uint64_t flags = 0;
+    int covered = userland_fill_image_page(state, page, frame, &flags);
+    if (covered < 0) {
+        eprintf("userland: failed to page in %x from the executable", page);
+        free_page(phys);
+        return false;
+    }
+
+    if (covered == 0) {
+        if (!userland_zero_fill_page(state, page)) {
+            free_page(phys);
+            return false;
+        }
+        flags = USER_DATA_FLAGS;
+    }
+
+    if (!userland_access_allowed(flags, err_code) || !map_user_page(page, phys, flags)) {
+        free_page(phys);
+        return false;
+    }
     return true;
 }
 
+void userland_set_user_access(bool open) {
+    userland_state()->user_access = open;
+}
+
+bool userland_user_access(void) {
+    return userland_state()->user_access;
+}
+
+void userland_prefault(uint64_t addr, uint64_t len, bool write) {
+    if (len == 0 || addr + len < addr)
+        return;
+
+    for (uint64_t page = addr & ~(PAGE_SIZE - 1); page < addr + len; page += PAGE_SIZE) {
+        uint64_t entry = user_page_entry(page);
+        if (entry & PAGE_PRESENT) {
+            // DMA would go straight into a shared frame.
+            if (write && (entry & PAGE_COW) && !userland_break_cow(page))
+                return;
+            continue;
+        }
+        if (!userland_handle_page_fault(page, write ? PAGE_FAULT_WRITE : 0))
+            return;
+    }
+}
+
+void userland_exit(int exit_code) {
+    wrmsr64_local(IA32_FS_BASE_MSR, 0);
+    userland_write_back_all(userland_state());
+    // A task's own page tables are freed whole when it is reaped.
+    if (!multitasking_current_userland())
+        userland_unmap_all();
+    userland_state_release(userland_state());
+    if (multitasking_current_userland())
+        userland_state_close_files(userland_state());
+    printf(blue_color "\n[process exited with code %d]" reset_color, exit_code);
+    multitasking_exit_current(exit_code);
+}
+
 bool userland_is_running(void) {
-    return userland_running;
+    return multitasking_current_userland() != NULL;
 }
 
 static int userland_exception_exit_code(uint64_t int_no) {
@@ -415,38 +808,20 @@ static int userland_exception_exit_code(uint64_t int_no) {
 }
 
 void userland_abort_from_exception(uint64_t int_no, uint64_t err_code, uint64_t fault_rip) {
-    if (!userland_running || !userland_resume_rip || !userland_resume_rsp)
+    if (!userland_is_running())
         hcf2();
 
-    userland_last_exit_code = userland_exception_exit_code(int_no);
+    int exit_code = userland_exception_exit_code(int_no);
     eprintf("[userland] fatal exception: int=%02u err=0x%02X rip=0x%X -> exit=%02d",
             int_no,
             err_code,
             fault_rip,
-            userland_last_exit_code);
+            exit_code);
 
-    asm volatile(
-        "cli\n"
-        "mov %0, %%rbx\n"
-        "mov %1, %%rbp\n"
-        "mov %2, %%r12\n"
-        "mov %3, %%r13\n"
-        "mov %4, %%r14\n"
-        "mov %5, %%r15\n"
-        "mov %6, %%rsp\n"
-        "jmp *%7\n"
-        :
-        : "r"(userland_resume_rbx),
-          "r"(userland_resume_rbp),
-          "r"(userland_resume_r12),
-          "r"(userland_resume_r13),
-          "r"(userland_resume_r14),
-          "r"(userland_resume_r15),
-          "r"(userland_resume_rsp),
-          "r"(userland_resume_rip)
-        : "memory");
-
-    __builtin_unreachable();
+    // Tearing the program down may write to disk: run it like a syscall.
+    asm volatile("sti");
+    multitasking_lock_kernel();
+    userland_exit(exit_code);
 }
 
 
@@ -456,7 +831,8 @@ void userland_abort_from_exception(uint64_t int_no, uint64_t err_code, uint64_t
 void enter_userland_at(uint64_t code_entry) {
     uint64_t stack_top = USER_STACK_TOP; // 8-bit alignment
 
-    map_user_stack();
+    if (map_user_stack() != 0)
+        return;
     userland_heap_init();
     if (init_user_tls(NULL) != 0)
         return;
@@ -491,24 +867,39 @@ void enter_userland_at(uint64_t code_entry) {
 
 int userland_exec(const char* path, int argc, const char* const* argv, const char* const* envp) {
     elf_image_info_t image_info = {0};
-    void* entry = elf_load_from_vfs_ex(path, &image_info);
-    if (!entry)
+    elf_image_t image;
+    char exec_path[256];
+
+    // execve() passes a pointer into the program that is about to go away.
+    snprintf(exec_path, sizeof(exec_path), "%s", path ? path : "");
+    if (elf_open_image(exec_path, &image) != 0)
         return -1;
 
-    map_user_stack();
+    // No way back from here: the old program is torn down before the new
+    // one is mapped, since its pages are only filled in when touched.
+    userland_write_back_all(userland_state());
+    if (!multitasking_new_address_space())
+        userland_unmap_all();
+    userland_state_release(userland_state());
     userland_heap_init();
-    if (init_user_tls(&image_info) != 0) {
+
+    // Relocations and the initial stack are written through demand faults.
+    userland_set_user_access(true);
+    void* entry = elf_map_image(&image, &image_info);
+    if (!entry || init_user_tls(&image_info) != 0) {
         if (image_info.tls_template)
             kfree(image_info.tls_template);
-        return -1;
+        eprintf("userland: failed to load %s", exec_path);
+        userland_exit(127);
     }
     if (image_info.tls_template)
         kfree(image_info.tls_template);
 
-    uint64_t stack_top = build_initial_user_stack(path, argc, argv, envp, &image_info);
+    // The stack is paged in as the arguments are pushed.
+    uint64_t stack_top = build_initial_user_stack(exec_path, argc, argv, envp, &image_info);
 
     debug_printf("userland: exec path=%s entry=%x phdr=%x phentsz=%u phnum=%u tls_mem=%u tls_file=%u stack=%x\n",
-                 path,
+                 exec_path,
                  entry,
                  image_info.phdr_addr,
                  image_info.phentsize,
@@ -518,27 +909,13 @@ int userland_exec(const char* path, int argc, const char* const* argv, const cha
                  stack_top);
     debug_dump_initial_stack(stack_top);
 
-    uint64_t kernel_rsp = 0;
-    asm volatile("mov %%rsp, %0" : "=r"(kernel_rsp));
-    asm volatile("mov %%rbx, %0" : "=r"(userland_resume_rbx));
-    asm volatile("mov %%rbp, %0" : "=r"(userland_resume_rbp));
-    asm volatile("mov %%r12, %0" : "=r"(userland_resume_r12));
-    asm volatile("mov %%r13, %0" : "=r"(userland_resume_r13));
-    asm volatile("mov %%r14, %0" : "=r"(userland_resume_r14));
-    asm volatile("mov %%r15, %0" : "=r"(userland_resume_r15));
-    void* frame = __builtin_frame_address(0);
-    userland_resume_ret_rip = (uint64_t)__builtin_return_address(0);
-    userland_resume_ret_rsp = (uint64_t)frame + 16;
-    userland_resume_rsp = kernel_rsp;
-    userland_resume_rip = (uint64_t)userland_finish_exit;
-    userland_should_return_kernel = false;
-    userland_last_exit_code = 0;
-    userland_running = true;
-    userland_saved_kernel_stack_top = kernel_stack_top;
-    userland_saved_tss_rsp0 = tss.rsp0;
-    kernel_stack_top = (uint64_t)&userland_syscall_stack[sizeof(userland_syscall_stack)];
-    tss.rsp0 = kernel_stack_top;
-
+    // The kernel side of this task (syscalls, interrupts from ring 3) runs on
+    // its own stack, which the scheduler already put into the TSS. Ring 3
+    // runs without the kernel lock; both callers (task start and execve)
+    // hold it exactly once.
+    userland_set_user_access(false);
+    userland_state()->entered = true;
+    multitasking_unlock_kernel();
     asm volatile (
         "cli\n"
         "mov %0, %%r11\n"
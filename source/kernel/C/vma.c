@@ -0,0 +1,226 @@
+/**
+ * @file vma.c
+ * @author Pradosh (pradoshgame@gmail.com)
+ * @brief Memory areas of a program in a treap ordered by start address, for
+ * the page fault handler, mmap placement and munmap.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) Pradosh 2026
+ *
+ */
+#include <vma.h>
+#include <heap.h>
+#include <memory.h>
+#include <filesystems/vfs.h>
+
+user_file_t* user_file_create(struct vfs_file* file)
+{
+    user_file_t* shared = kmalloc(sizeof(user_file_t));
+    if (!shared)
+        return NULL;
+
+    shared->file = file;
+    shared->refs = 1;
+    return shared;
+}
+
+void user_file_get(user_file_t* file)
+{
+    if (file)
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+void user_file_put(user_file_t* file)
+{
+    if (!file || __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    vfs_close(file->file);
+    kfree(file->file);
+    kfree(file);
+}
+
+/* Page numbers spread over the whole range, as treap priorities */
+static uint32_t vma_prio(uint64_t start)
+{
+    uint64_t h = (start >> 12) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+vma_t* vma_create(uint64_t start, uint64_t end, uint64_t flags, bool shared,
+                  user_file_t* file, uint64_t file_offset, uint64_t file_end)
+{
+    vma_t* vma = kmalloc(sizeof(vma_t));
+    if (!vma)
+        return NULL;
+
+    memset(vma, 0, sizeof(*vma));
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->shared = shared;
+    vma->file = file;
+    vma->file_offset = file_offset;
+    vma->file_end = file ? file_end : start;
+    vma->prio = vma_prio(start);
+    user_file_get(file);
+    return vma;
+}
+
+static void vma_free(vma_t* vma)
+{
+    user_file_put(vma->file);
+    kfree(vma);
+}
+
+/* Joins two treaps where everything in @p a lies below everything in @p b */
+static vma_t* vma_merge(vma_t* a, vma_t* b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (a->prio > b->prio) {
+        a->right = vma_merge(a->right, b);
+        return a;
+    }
+    b->left = vma_merge(a, b->left);
+    return b;
+}
+
+/* Splits @p t into the nodes starting below @p key and the rest */
+static void vma_cut(vma_t* t, uint64_t key, vma_t** lo, vma_t** hi)
+{
+    if (!t) {
+        *lo = *hi = NULL;
+        return;
+    }
+
+    if (t->start < key) {
+        vma_cut(t->right, key, &t->right, hi);
+        *lo = t;
+    } else {
+        vma_cut(t->left, key, lo, &t->left);
+        *hi = t;
+    }
+}
+
+void vma_insert(vma_t** root, vma_t* vma)
+{
+    vma_t *lo, *hi;
+
+    vma->left = vma->right = NULL;
+    vma_cut(*root, vma->start, &lo, &hi);
+    *root = vma_merge(vma_merge(lo, vma), hi);
+}
+
+void vma_remove(vma_t** root, vma_t* vma)
+{
+    vma_t *lo, *mid, *hi;
+
+    // Starts are unique, so the middle part is vma alone.
+    vma_cut(*root, vma->start, &lo, &mid);
+    vma_cut(mid, vma->start + 1, &mid, &hi);
+    *root = vma_merge(lo, hi);
+    vma_free(vma);
+}
+
+vma_t* vma_find(vma_t* root, uint64_t addr)
+{
+    while (root) {
+        if (addr < root->start)
+            root = root->left;
+        else if (addr >= root->end)
+            root = root->right;
+        else
+            return root;
+    }
+    return NULL;
+}
+
+vma_t* vma_first(vma_t* root, uint64_t addr)
+{
+    vma_t* found = NULL;
+
+    // Mappings do not overlap, so ends rise with starts.
+    while (root) {
+        if (root->end > addr) {
+            found = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return found;
+}
+
+int vma_split(vma_t** root, vma_t* vma, uint64_t at)
+{
+    if (at <= vma->start || at >= vma->end)
+        return 0;
+
+    uint64_t file_end = vma->file_end > at ? vma->file_end : at;
+    vma_t* upper = vma_create(at, vma->end, vma->flags, vma->shared, vma->file,
+                              vma->file_offset + (at - vma->start), file_end);
+    if (!upper)
+        return -1;
+
+    vma->end = at;
+    if (vma->file_end > at)
+        vma->file_end = at;
+    vma_insert(root, upper);
+    return 0;
+}
+
+uint64_t vma_find_gap(vma_t* root, uint64_t lo, uint64_t hi, uint64_t len)
+{
+    uint64_t start = lo;
+
+    for (vma_t* vma = vma_first(root, lo); vma && vma->start < hi; vma = vma_first(root, vma->end)) {
+        if (vma->start >= start && vma->start - start >= len)
+            return start;
+        if (vma->end > start)
+            start = vma->end;
+    }
+
+    if (start < hi && hi - start >= len)
+        return start;
+    return 0;
+}
+
+int vma_clone(const vma_t* root, vma_t** out)
+{
+    *out = NULL;
+    if (!root)
+        return 0;
+
+    vma_t* copy = kmalloc(sizeof(vma_t));
+    if (!copy)
+        return -1;
+
+    // Same keys and priorities, so the shape can be copied as it is.
+    *copy = *root;
+    copy->left = copy->right = NULL;
+    user_file_get(copy->file);
+
+    if (vma_clone(root->left, &copy->left) != 0 ||
+        vma_clone(root->right, &copy->right) != 0) {
+        vma_destroy(copy);
+        return -1;
+    }
+
+    *out = copy;
+    return 0;
+}
+
+void vma_destroy(vma_t* root)
+{
+    while (root) {
+        vma_t* right = root->right;
+        vma_destroy(root->left);
+        vma_free(root);
+        root = right;
+    }
+}